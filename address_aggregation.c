@@ -0,0 +1,192 @@
+/* The aggregation of the samples per location, before the symbolization:
+ * see "address_aggregation.h".
+ *
+ * As the symbol_aggregation, an open-addressing hash table with linear
+ * probing, whose capacity is a power of two, and which is grown (doubled)
+ * when it is half full. An empty slot has a NULL DSO: the samples of an
+ * unknown location are kept apart, in "unknown".
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "address_aggregation.h"
+
+
+#define INITIAL_ADDRESS_AGGREGATION_CAPACITY  4096
+
+struct address_aggregation {
+    struct address_aggregate * slots;      /* location.dso == NULL: empty */
+    size_t                     capacity;
+    size_t                     count;
+    struct address_aggregate   unknown;    /* the location is not known */
+
+    /* the array of address_aggregation_sorted() */
+    struct address_aggregate * sorted;
+    size_t                     sorted_capacity;
+};
+
+
+static inline uint64_t
+hash_location(const struct symbol_location * location)
+{
+    /* the finalizer of MurmurHash3, over the DSO and the offset */
+    uint64_t h = (uint64_t)(uintptr_t)location->dso * 0x9e3779b97f4a7c15ULL ^
+                 (uint64_t)location->offset;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+
+struct address_aggregation *
+address_aggregation_new(void)
+{
+    struct address_aggregation * aggregation = calloc(1, sizeof *aggregation);
+    if (!aggregation)
+        return NULL;
+
+    aggregation->slots = calloc(INITIAL_ADDRESS_AGGREGATION_CAPACITY,
+                                sizeof *aggregation->slots);
+    if (!aggregation->slots) {
+        free(aggregation);
+        return NULL;
+    }
+    aggregation->capacity = INITIAL_ADDRESS_AGGREGATION_CAPACITY;
+    return aggregation;
+}
+
+
+void
+address_aggregation_free(struct address_aggregation * aggregation)
+{
+    if (!aggregation)
+        return;
+    free(aggregation->slots);
+    free(aggregation->sorted);
+    free(aggregation);
+}
+
+
+static int
+grow_address_table(struct address_aggregation * aggregation)
+{
+    size_t new_capacity = 2 * aggregation->capacity;
+    struct address_aggregate * new_slots = calloc(new_capacity,
+                                                  sizeof *new_slots);
+    if (!new_slots)
+        return -1;
+
+    size_t i;
+    for (i = 0; i < aggregation->capacity; i++) {
+        const struct address_aggregate * entry = &aggregation->slots[i];
+        if (!entry->location.dso)
+            continue;
+        size_t slot = hash_location(&entry->location) & (new_capacity - 1);
+        while (new_slots[slot].location.dso)
+            slot = (slot + 1) & (new_capacity - 1);
+        new_slots[slot] = *entry;
+    }
+
+    free(aggregation->slots);
+    aggregation->slots = new_slots;
+    aggregation->capacity = new_capacity;
+    return 0;
+}
+
+
+int
+address_aggregation_add(struct address_aggregation * aggregation,
+                        const struct symbol_location * location,
+                        unsigned long long samples, unsigned long long period,
+                        double weight)
+{
+    struct address_aggregate * entry = &aggregation->unknown;
+    if (location->dso) {
+        if (2 * (aggregation->count + 1) > aggregation->capacity &&
+            grow_address_table(aggregation) != 0 &&
+            aggregation->count + 1 >= aggregation->capacity)
+            return -1;   /* completely full: can't grow it */
+
+        size_t mask = aggregation->capacity - 1;
+        size_t slot = hash_location(location) & mask;
+        while ((entry = &aggregation->slots[slot])->location.dso != NULL) {
+            if (entry->location.dso == location->dso &&
+                entry->location.offset == location->offset)
+                break;
+            slot = (slot + 1) & mask;
+        }
+        if (!entry->location.dso) {
+            entry->location = *location;
+            aggregation->count++;
+        }
+    } else if (entry->samples == 0) {
+        aggregation->count++;
+    }
+
+    entry->samples += samples;
+    entry->period += period;
+    entry->weight += weight;
+    return 0;
+}
+
+
+size_t
+address_aggregation_count(const struct address_aggregation * aggregation)
+{
+    return aggregation->count;
+}
+
+
+static int
+compare_addresses_by_weight(const void * a, const void * b)
+{
+    const struct address_aggregate * aa = a;
+    const struct address_aggregate * ab = b;
+    if (aa->weight != ab->weight)
+        return aa->weight > ab->weight ? -1 : 1;
+    return 0;
+}
+
+
+const struct address_aggregate *
+address_aggregation_sorted(struct address_aggregation * aggregation,
+                           size_t * out_n)
+{
+    *out_n = 0;
+    if (aggregation->sorted_capacity < aggregation->count) {
+        struct address_aggregate * sorted = realloc(aggregation->sorted,
+                                                    aggregation->count *
+                                                            sizeof *sorted);
+        if (!sorted)
+            return NULL;
+        aggregation->sorted = sorted;
+        aggregation->sorted_capacity = aggregation->count;
+    }
+
+    size_t n = 0, i;
+    for (i = 0; i < aggregation->capacity; i++)
+        if (aggregation->slots[i].location.dso)
+            aggregation->sorted[n++] = aggregation->slots[i];
+    if (aggregation->unknown.samples > 0)
+        aggregation->sorted[n++] = aggregation->unknown;
+
+    qsort(aggregation->sorted, n, sizeof *aggregation->sorted,
+          compare_addresses_by_weight);
+    *out_n = n;
+    return aggregation->sorted;
+}
+
+
+void
+address_aggregation_reset(struct address_aggregation * aggregation)
+{
+    memset(aggregation->slots, 0,
+           aggregation->capacity * sizeof *aggregation->slots);
+    memset(&aggregation->unknown, 0, sizeof aggregation->unknown);
+    aggregation->count = 0;
+}
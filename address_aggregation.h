@@ -0,0 +1,69 @@
+
+/* The aggregation of the samples of the native sampler per location (DSO,
+ * file offset) of their instruction addresses, for a flush window, before
+ * they are symbolized: the symbolization (loading the symbols of the DSOs,
+ * and searching them) is then done only for the hottest locations, the ones
+ * which can make it into the top-K symbols that are sent to New Relic, and
+ * not for the long tail of the locations with a few samples each.
+ *
+ * The table is an open-addressing hash table (with linear probing) keyed by
+ * the (DSO, offset) of the locations, as the symbol_aggregation is by the
+ * (symbol, DSO) strings.
+ */
+
+#ifndef ADDRESS_AGGREGATION_H_
+#define ADDRESS_AGGREGATION_H_
+
+#include <stddef.h>
+
+#include "symbol_resolver.h"
+
+
+/* The aggregate of one location */
+struct address_aggregate {
+    struct symbol_location location;
+    unsigned long long     samples;
+    unsigned long long     period;
+    double                 weight;
+};
+
+
+struct address_aggregation;
+
+
+struct address_aggregation *
+address_aggregation_new(void);
+
+
+void
+address_aggregation_free(struct address_aggregation * aggregation);
+
+
+/* Add "samples", "period" and "weight" to the aggregate of "location".
+ * Returns 0, or -1 if it couldn't allocate memory. */
+int
+address_aggregation_add(struct address_aggregation * aggregation,
+                        const struct symbol_location * location,
+                        unsigned long long samples, unsigned long long period,
+                        double weight);
+
+
+/* The number of distinct locations in the table */
+size_t
+address_aggregation_count(const struct address_aggregation * aggregation);
+
+
+/* All the aggregates, sorted by decreasing weight, in an array which is
+ * owned by the table and which is valid till the next call to it. Returns
+ * NULL if it couldn't allocate memory (then *out_n is 0). */
+const struct address_aggregate *
+address_aggregation_sorted(struct address_aggregation * aggregation,
+                           size_t * out_n);
+
+
+/* Empty the table at the end of a flush window */
+void
+address_aggregation_reset(struct address_aggregation * aggregation);
+
+
+#endif  /* ADDRESS_AGGREGATION_H_ */
@@ -0,0 +1,199 @@
+/* A bump allocator of chunks: see "arena.h".
+ *
+ * The chunks are in a list, in the order in which they were first used: an
+ * allocation bumps the offset in the current chunk, or moves to the next
+ * chunk of the list (which is rewound), or appends a new one. A reset only
+ * goes back to the first chunk, so that the chunks of the busiest window are
+ * reused by all the next ones.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+
+#define ARENA_ALIGNMENT  16   /* of max_align_t on x86-64 and AArch64 */
+
+struct arena_chunk {
+    struct arena_chunk * next;
+    size_t               used;
+    size_t               size;
+    unsigned char        data[];
+};
+
+
+static inline size_t
+arena_chunk_size(const struct arena * arena)
+{
+    return arena->chunk_size ? arena->chunk_size : ARENA_DEFAULT_CHUNK_SIZE;
+}
+
+
+/* the offset in "chunk" of the next block aligned on "alignment" */
+static inline size_t
+aligned_offset(const struct arena_chunk * chunk, size_t alignment)
+{
+    uintptr_t address = (uintptr_t)(chunk->data + chunk->used);
+    return chunk->used + ((alignment - address % alignment) % alignment);
+}
+
+
+static void
+count_used_bytes(struct arena * arena, size_t size)
+{
+    arena->used_bytes += size;
+    if (arena->used_bytes > arena->peak_bytes)
+        arena->peak_bytes = arena->used_bytes;
+}
+
+
+static void *
+alloc_large_block(struct arena * arena, size_t size)
+{
+    struct arena_chunk * block = malloc(sizeof *block + size +
+                                        ARENA_ALIGNMENT);
+    if (!block)
+        return NULL;
+    block->size = size;
+    block->used = 0;
+    block->next = arena->large;
+    arena->large = block;
+    count_used_bytes(arena, size);
+    return block->data + aligned_offset(block, ARENA_ALIGNMENT);
+}
+
+
+static void *
+alloc_aligned(struct arena * arena, size_t size, size_t alignment)
+{
+    size_t chunk_size = arena_chunk_size(arena);
+    if (size > chunk_size / 2)
+        return alloc_large_block(arena, size);
+
+    struct arena_chunk * chunk = arena->current;
+    size_t offset = chunk ? aligned_offset(chunk, alignment) : 0;
+    if (!chunk || offset + size > chunk->size) {
+        if (chunk && chunk->next) {
+            chunk = chunk->next;         /* a chunk of a previous window */
+        } else {
+            struct arena_chunk * new_chunk = malloc(sizeof *new_chunk +
+                                                    chunk_size);
+            if (!new_chunk)
+                return NULL;
+            new_chunk->size = chunk_size;
+            new_chunk->next = NULL;
+            if (chunk)
+                chunk->next = new_chunk;
+            else
+                arena->first = new_chunk;
+            chunk = new_chunk;
+        }
+        chunk->used = 0;
+        arena->current = chunk;
+        offset = aligned_offset(chunk, alignment);
+    }
+
+    void * block = chunk->data + offset;
+    count_used_bytes(arena, offset + size - chunk->used);
+    chunk->used = offset + size;
+    return block;
+}
+
+
+void
+arena_init(struct arena * arena, size_t chunk_size)
+{
+    memset(arena, 0, sizeof *arena);
+    arena->chunk_size = chunk_size;
+}
+
+
+void *
+arena_alloc(struct arena * arena, size_t size)
+{
+    return alloc_aligned(arena, size, ARENA_ALIGNMENT);
+}
+
+
+void *
+arena_calloc(struct arena * arena, size_t n, size_t size)
+{
+    if (size != 0 && n > SIZE_MAX / size)
+        return NULL;
+    void * block = alloc_aligned(arena, n * size, ARENA_ALIGNMENT);
+    if (block)
+        memset(block, 0, n * size);
+    return block;
+}
+
+
+char *
+arena_strndup(struct arena * arena, const char * str, size_t len)
+{
+    char * copy = alloc_aligned(arena, len + 1, 1);
+    if (!copy)
+        return NULL;
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+
+static void
+free_large_blocks(struct arena * arena)
+{
+    struct arena_chunk * block = arena->large;
+    while (block) {
+        struct arena_chunk * next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->large = NULL;
+}
+
+
+void
+arena_reset(struct arena * arena)
+{
+    free_large_blocks(arena);
+    arena->current = arena->first;
+    if (arena->current)
+        arena->current->used = 0;
+    arena->used_bytes = 0;
+}
+
+
+void
+arena_free(struct arena * arena)
+{
+    free_large_blocks(arena);
+    struct arena_chunk * chunk = arena->first;
+    while (chunk) {
+        struct arena_chunk * next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    arena->first = arena->current = NULL;
+    arena->used_bytes = 0;
+}
+
+
+void
+arena_get_stats(const struct arena * arena, struct arena_stats * out_stats)
+{
+    memset(out_stats, 0, sizeof *out_stats);
+    out_stats->used_bytes = arena->used_bytes;
+    out_stats->peak_bytes = arena->peak_bytes;
+
+    const struct arena_chunk * chunk;
+    for (chunk = arena->first; chunk; chunk = chunk->next) {
+        out_stats->reserved_bytes += chunk->size;
+        out_stats->chunks++;
+    }
+    for (chunk = arena->large; chunk; chunk = chunk->next) {
+        out_stats->reserved_bytes += chunk->size;
+        out_stats->large_blocks++;
+    }
+}
@@ -0,0 +1,90 @@
+/* A bump allocator ("arena") of chunks, for the data which all dies at the
+ * same time, so that it is allocated without a malloc() per object and
+ * released all together, in O(1):
+ *
+ *   - the state of a flush window (the temporary tables and top-K arrays of
+ *     its uploads), which is dropped by arena_reset() at the end of the
+ *     window: the chunks are kept, and reused by the next windows, so that a
+ *     wrapper which runs for months does no malloc()/free() per window, and
+ *     doesn't fragment its heap;
+ *
+ *   - the long-lived strings (eg., the symbols and the paths of the DSOs of
+ *     the symbol resolver, see "string_pool.h"), in an arena of their own
+ *     which is never reset, only freed at the end.
+ *
+ * An arena is zero-initialized (eg., "static struct arena a;") with chunks
+ * of ARENA_DEFAULT_CHUNK_SIZE, or set up by arena_init() with another size.
+ * The allocations larger than half a chunk get a block of their own, which
+ * is freed by arena_reset(). An arena is not thread-safe.
+ */
+
+#ifndef ARENA_H_
+#define ARENA_H_
+
+#include <stddef.h>
+
+
+#define ARENA_DEFAULT_CHUNK_SIZE  (256 * 1024)
+
+
+struct arena_chunk;
+
+struct arena {
+    struct arena_chunk * first;      /* the chunks, in the order of use */
+    struct arena_chunk * current;    /* the one being filled */
+    struct arena_chunk * large;      /* the blocks of their own */
+    size_t               chunk_size;  /* 0: ARENA_DEFAULT_CHUNK_SIZE */
+    size_t               used_bytes;  /* since the last reset */
+    size_t               peak_bytes;  /* the most that was used at once */
+};
+
+
+struct arena_stats {
+    size_t       used_bytes;         /* since the last reset */
+    size_t       reserved_bytes;     /* the chunks and the large blocks */
+    size_t       peak_bytes;
+    unsigned int chunks;
+    unsigned int large_blocks;
+};
+
+
+/* Set up an empty arena of chunks of "chunk_size" bytes (or of the default
+ * size, if 0) */
+void
+arena_init(struct arena * arena, size_t chunk_size);
+
+
+/* "size" bytes aligned for any type, which live till the next arena_reset()
+ * or arena_free(). Returns NULL if it couldn't allocate memory. */
+void *
+arena_alloc(struct arena * arena, size_t size);
+
+
+/* "n" zeroed objects of "size" bytes. Returns NULL if it couldn't allocate
+ * memory, or if n * size overflows. */
+void *
+arena_calloc(struct arena * arena, size_t n, size_t size);
+
+
+/* Copy the "len" chars of "str" into the arena (unaligned), adding a '\0'.
+ * Returns the copy, or NULL if it couldn't allocate memory. */
+char *
+arena_strndup(struct arena * arena, const char * str, size_t len);
+
+
+/* Release everything that was allocated from the arena, keeping its chunks
+ * for the next allocations: O(1), but for the large blocks, which are freed */
+void
+arena_reset(struct arena * arena);
+
+
+/* Release the arena and all its memory (it can be used again after that) */
+void
+arena_free(struct arena * arena);
+
+
+void
+arena_get_stats(const struct arena * arena, struct arena_stats * out_stats);
+
+
+#endif  /* ARENA_H_ */
@@ -0,0 +1,86 @@
+
+/* The counting of the allocations of a benchmark: see "bench_alloc.h".
+ *
+ * The linker resolves the calls to malloc() of the objects of the link to
+ * __wrap_malloc(), and __real_malloc() to the malloc() of the C library.
+ */
+
+#include <stddef.h>
+#include <sys/resource.h>
+
+#include "bench_alloc.h"
+
+
+void * __real_malloc(size_t size);
+void * __real_calloc(size_t n, size_t size);
+void * __real_realloc(void * ptr, size_t size);
+void   __real_free(void * ptr);
+
+void * __wrap_malloc(size_t size);
+void * __wrap_calloc(size_t n, size_t size);
+void * __wrap_realloc(void * ptr, size_t size);
+void   __wrap_free(void * ptr);
+
+
+static struct bench_alloc_counts counts;
+
+
+static inline void
+count_allocation(size_t size)
+{
+    __atomic_fetch_add(&counts.allocations, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&counts.bytes, size, __ATOMIC_RELAXED);
+}
+
+
+void *
+__wrap_malloc(size_t size)
+{
+    count_allocation(size);
+    return __real_malloc(size);
+}
+
+
+void *
+__wrap_calloc(size_t n, size_t size)
+{
+    count_allocation(n * size);
+    return __real_calloc(n, size);
+}
+
+
+void *
+__wrap_realloc(void * ptr, size_t size)
+{
+    count_allocation(size);
+    return __real_realloc(ptr, size);
+}
+
+
+void
+__wrap_free(void * ptr)
+{
+    if (ptr)
+        __atomic_fetch_add(&counts.frees, 1, __ATOMIC_RELAXED);
+    __real_free(ptr);
+}
+
+
+void
+bench_alloc_get_counts(struct bench_alloc_counts * out_counts)
+{
+    out_counts->allocations = __atomic_load_n(&counts.allocations,
+                                              __ATOMIC_RELAXED);
+    out_counts->frees = __atomic_load_n(&counts.frees, __ATOMIC_RELAXED);
+    out_counts->bytes = __atomic_load_n(&counts.bytes, __ATOMIC_RELAXED);
+}
+
+
+long
+bench_peak_rss_kb(void)
+{
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return -1;
+    return usage.ru_maxrss;
+}
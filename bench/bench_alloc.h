@@ -0,0 +1,33 @@
+
+/* The allocations and the peak RSS of a benchmark. The allocations are
+ * counted by wrapping malloc(), calloc(), realloc() and free() at link time
+ * (-Wl,--wrap=malloc,...: see "make bench"), so they are the ones of the
+ * code linked with bench_alloc.c, not the ones which the C library makes
+ * for itself (eg., inside getline() or fopen()).
+ */
+
+#ifndef BENCH_ALLOC_H_
+#define BENCH_ALLOC_H_
+
+#include <stddef.h>
+
+
+struct bench_alloc_counts {
+    unsigned long      allocations;   /* malloc(), calloc(), realloc() */
+    unsigned long      frees;
+    unsigned long long bytes;         /* the sum of the sizes asked for */
+};
+
+
+/* The counts since the start of the program (they are updated atomically,
+ * so the threads of the program can allocate meanwhile) */
+void
+bench_alloc_get_counts(struct bench_alloc_counts * out_counts);
+
+
+/* The peak resident set size of the process, in KB, from getrusage() */
+long
+bench_peak_rss_kb(void);
+
+
+#endif  /* BENCH_ALLOC_H_ */
@@ -0,0 +1,259 @@
+
+/* The overhead of the wrapper on a target: each workload of bench_workload
+ * is run alone, then under the wrapper built with the stub SDK in a few of
+ * its modes, and it tells, per run:
+ *
+ *   - the wall-clock time, and its slow-down against the run alone;
+ *   - the CPU time (user + system) of the whole tree of processes, and of
+ *     the wrapper itself;
+ *   - the peak RSS of the wrapper, and its allocations;
+ *   - the samples that the wrapper sent, per second of wall-clock time.
+ *
+ * The numbers of the wrapper come from the summary written by the stub SDK
+ * (see "newrelic_sdk_stub/newrelic_sdk_stub.c"). The runs of "perf record"
+ * are skipped if there is no "perf" in the PATH.
+ *
+ *     bench_overhead  <perf_record_newrelic-with-stub-SDK>  <bench_workload>
+ *                     [<repetitions>]
+ *
+ * Each run is repeated (3 times by default) and the fastest one is kept.
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+
+#define MAX_ARGS  16
+
+
+/* the workloads, and the modes of the wrapper they are run under */
+static const char * workloads[][4] = {
+    { "cpu", "1000", NULL },
+    { "threads", "64", "1000", NULL },
+};
+
+static const char * wrapper_modes[][4] = {
+    { NULL },                                   /* the workload alone */
+    { "--native", NULL },
+    { "--native", "-g", NULL },
+    { "--native", "--cpu-budget=1", NULL },
+    { "perf", NULL },                           /* perf record + report */
+};
+
+
+struct run_result {
+    double             wall_seconds;
+    double             cpu_seconds;          /* of all the processes */
+    double             wrapper_cpu_seconds;  /* of the wrapper alone */
+    long               wrapper_peak_rss_kb;
+    unsigned long      allocations;
+    unsigned long long samples;
+    int                has_summary;
+};
+
+
+static double
+elapsed_seconds(const struct timespec * start, const struct timespec * end)
+{
+    return (end->tv_sec - start->tv_sec) +
+           (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+
+static int
+perf_is_in_path(void)
+{
+    const char * path = getenv("PATH");
+    if (!path)
+        return 0;
+    char * dirs = strdup(path), * saveptr = NULL, * dir;
+    int found = 0;
+    for (dir = strtok_r(dirs, ":", &saveptr); dir && !found;
+         dir = strtok_r(NULL, ":", &saveptr)) {
+        char fname[4096];
+        snprintf(fname, sizeof fname, "%s/perf", dir);
+        found = access(fname, X_OK) == 0;
+    }
+    free(dirs);
+    return found;
+}
+
+
+/* Run argv[] with its output to /dev/null, and the summary of the stub SDK
+ * to "summary_fname". Returns 0, or -1 if it couldn't run or it failed. */
+static int
+run_once(char * argv[], const char * summary_fname,
+         struct run_result * out_result)
+{
+    memset(out_result, 0, sizeof *out_result);
+    unlink(summary_fname);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        if (null_fd >= 0) {
+            dup2(null_fd, STDOUT_FILENO);
+            dup2(null_fd, STDERR_FILENO);
+            close(null_fd);
+        }
+        setenv("NEWRELIC_STUB_SUMMARY", summary_fname, 1);
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) != pid) {
+        perror("wait4");
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "ERROR: '%s' failed (status %d)\n", argv[0], status);
+        return -1;
+    }
+
+    out_result->wall_seconds = elapsed_seconds(&start, &end);
+    /* the rusage of wait4() is the one of the child and of all its
+     * descendants which were waited for */
+    out_result->cpu_seconds = usage.ru_utime.tv_sec +
+                              usage.ru_utime.tv_usec / 1e6 +
+                              usage.ru_stime.tv_sec +
+                              usage.ru_stime.tv_usec / 1e6;
+
+    FILE * summary = fopen(summary_fname, "r");
+    if (summary) {
+        out_result->has_summary =
+            fscanf(summary, "transactions=%*u attributes=%*u metrics=%*u "
+                            "errors=%*u samples=%llu allocations=%lu "
+                            "allocated_bytes=%*u peak_rss_kb=%ld "
+                            "cpu_seconds=%lf", &out_result->samples,
+                   &out_result->allocations, &out_result->wrapper_peak_rss_kb,
+                   &out_result->wrapper_cpu_seconds) == 4;
+        fclose(summary);
+    }
+    return 0;
+}
+
+
+static void
+print_result(const char * mode, const struct run_result * result,
+             const struct run_result * alone)
+{
+    printf("  %-24s %8.3f s %+7.1f%% %8.3f s", mode, result->wall_seconds,
+           100.0 * (result->wall_seconds - alone->wall_seconds) /
+                   alone->wall_seconds,
+           result->cpu_seconds);
+    if (result->has_summary)
+        printf(" %8.3f s %8.1f MB %10lu %12.0f",
+               result->wrapper_cpu_seconds,
+               result->wrapper_peak_rss_kb / 1024.0, result->allocations,
+               result->samples / result->wall_seconds);
+    printf("\n");
+}
+
+
+int
+main(int argc, char * argv[])
+{
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s <perf_record_newrelic> <bench_workload> "
+                        "[<repetitions>]\n", argv[0]);
+        return 2;
+    }
+    const char * wrapper = argv[1];
+    const char * workload = argv[2];
+    int repetitions = argc > 3 ? atoi(argv[3]) : 3;
+    if (repetitions < 1)
+        repetitions = 1;
+    int with_perf = perf_is_in_path();
+
+    char summary_fname[] = "/tmp/bench_overhead_XXXXXX";
+    int summary_fd = mkstemp(summary_fname);
+    if (summary_fd < 0) {
+        perror("mkstemp");
+        return 1;
+    }
+    close(summary_fd);
+
+    int failed = 0;
+    size_t w, m;
+    for (w = 0; w < sizeof workloads / sizeof workloads[0]; w++) {
+        printf("workload: %s", workload);
+        size_t i;
+        for (i = 0; workloads[w][i]; i++)
+            printf(" %s", workloads[w][i]);
+        printf("\n  %-24s %10s %8s %10s %10s %11s %10s %12s\n", "mode",
+               "wall", "slowdown", "cpu (all)", "cpu (wrap)", "peak RSS",
+               "allocs", "samples/s");
+
+        struct run_result alone;
+        for (m = 0; m < sizeof wrapper_modes / sizeof wrapper_modes[0]; m++) {
+            int is_perf = wrapper_modes[m][0] &&
+                          strcmp(wrapper_modes[m][0], "perf") == 0;
+            if (is_perf && !with_perf) {
+                printf("  %-24s (skipped: no perf in the PATH)\n",
+                       "perf record");
+                continue;
+            }
+
+            char * run_argv[MAX_ARGS];
+            char mode_name[128] = "";
+            size_t n = 0;
+            if (wrapper_modes[m][0]) {
+                run_argv[n++] = (char *)wrapper;
+                run_argv[n++] = "bench-license-key";
+                for (i = 0; !is_perf && wrapper_modes[m][i]; i++) {
+                    run_argv[n++] = (char *)wrapper_modes[m][i];
+                    snprintf(mode_name + strlen(mode_name),
+                             sizeof mode_name - strlen(mode_name), "%s%s",
+                             i > 0 ? " " : "", wrapper_modes[m][i]);
+                }
+                if (is_perf)
+                    snprintf(mode_name, sizeof mode_name, "perf record");
+            } else {
+                snprintf(mode_name, sizeof mode_name, "alone");
+            }
+            run_argv[n++] = (char *)workload;
+            for (i = 0; workloads[w][i]; i++)
+                run_argv[n++] = (char *)workloads[w][i];
+            run_argv[n] = NULL;
+
+            struct run_result best;
+            int r, ok = 0;
+            for (r = 0; r < repetitions; r++) {
+                struct run_result result;
+                if (run_once(run_argv, summary_fname, &result) != 0)
+                    break;
+                if (!ok || result.wall_seconds < best.wall_seconds)
+                    best = result;
+                ok = 1;
+            }
+            if (!ok) {
+                failed = 1;
+                if (!wrapper_modes[m][0])
+                    break;   /* nothing to compare with */
+                continue;
+            }
+            if (!wrapper_modes[m][0])
+                alone = best;
+            print_result(mode_name, &best, &alone);
+        }
+    }
+
+    unlink(summary_fname);
+    return failed;
+}
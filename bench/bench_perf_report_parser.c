@@ -0,0 +1,160 @@
+
+/* A micro-benchmark of the parsing of the output of "perf report": the
+ * previous getline() + sscanf(" %f%% %*s %ms %*s %ms") of
+ * upload_perf_report_to_NewRelic(), with its two malloc()/free() per line,
+ * against the zero-allocation perf_report_reader + perf_report_parse_line().
+ *
+ * Both parse the same synthetic report, from a temporary file, and it tells
+ * the nanoseconds per line of each one:
+ *
+ *     bench_perf_report_parser  [<number-of-lines>]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../perf_report_parser.h"
+
+
+static const char * so_objects[] = {
+    "[kernel.kallsyms]", "libc-2.17.so", "ld-2.17.so", "libpthread-2.17.so",
+    "libstdc++.so.6.0.19", "my_program"
+};
+
+static const char * symbols[] = {
+    "vm_normal_page", "__fxstat64", "_dl_relocate_object", "pthread_mutex_lock",
+    "std::string::append", "main", "page_fault", "memcpy", "_int_malloc",
+    "do_syscall_64"
+};
+
+
+static FILE *
+generate_report(unsigned long n_lines)
+{
+    FILE * report = tmpfile();
+    if (!report)
+        return NULL;
+
+    fprintf(report, "# Samples: %lu  of event 'cycles'\n#\n", n_lines);
+    fprintf(report, "# Overhead  Command  Shared Object  Symbol\n#\n");
+    unsigned long i;
+    for (i = 0; i < n_lines; i++) {
+        const char * so_object = so_objects[i % 6];
+        fprintf(report, "    %5.2f%%  my_program  %-20s  [%c] %s_%lu\n",
+                100.0 / (i + 1), so_object, so_object[0] == '[' ? 'k' : '.',
+                symbols[i % 10], i % 5000);
+    }
+    fflush(report);
+    return report;
+}
+
+
+static double
+elapsed_seconds(const struct timespec * start, const struct timespec * end)
+{
+    return (end->tv_sec - start->tv_sec) +
+           (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+
+/* the loop of upload_perf_report_to_NewRelic() before the tokenizer */
+static double
+bench_sscanf(FILE * report, unsigned long * out_parsed, double * out_checksum)
+{
+    rewind(report);
+    char * buff_line = NULL;
+    size_t buff_len = 0;
+    unsigned long parsed = 0;
+    double checksum = 0;
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (getline(&buff_line, &buff_len, report) != -1) {
+        if (buff_line[0] == '\0' || buff_line[0] == '\n' ||
+            buff_line[0] == '#')
+            continue;
+        float percent;
+        char *so_object = NULL, *symbol = NULL;
+        if (sscanf(buff_line, " %f%% %*s %ms %*s %ms", &percent,
+                   &so_object, &symbol) == 3) {
+            parsed++;
+            checksum += percent + strlen(symbol) + strlen(so_object);
+        }
+        free(so_object);
+        free(symbol);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    free(buff_line);
+
+    *out_parsed = parsed;
+    *out_checksum = checksum;
+    return elapsed_seconds(&start, &end);
+}
+
+
+static double
+bench_tokenizer(FILE * report, unsigned long * out_parsed,
+                double * out_checksum)
+{
+    lseek(fileno(report), 0, SEEK_SET);
+    static struct perf_report_reader reader;
+    perf_report_reader_init(&reader, fileno(report));
+    unsigned long parsed = 0;
+    double checksum = 0;
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    char * line;
+    size_t len;
+    while (perf_report_reader_next_line(&reader, &line, &len) == 1) {
+        struct perf_report_line parsed_line;
+        if (perf_report_parse_line(line, len, &parsed_line) !=
+                                                     PERF_REPORT_LINE_OK)
+            continue;
+        parsed++;
+        checksum += (float)parsed_line.percent + parsed_line.symbol.len +
+                    parsed_line.so_object.len;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    *out_parsed = parsed;
+    *out_checksum = checksum;
+    return elapsed_seconds(&start, &end);
+}
+
+
+int
+main(int argc, char * argv[])
+{
+    unsigned long n_lines = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+    FILE * report = generate_report(n_lines);
+    if (!report) {
+        perror("tmpfile");
+        return 1;
+    }
+
+    unsigned long parsed_sscanf, parsed_tokenizer;
+    double checksum_sscanf, checksum_tokenizer;
+    double secs_sscanf = bench_sscanf(report, &parsed_sscanf,
+                                      &checksum_sscanf);
+    double secs_tokenizer = bench_tokenizer(report, &parsed_tokenizer,
+                                            &checksum_tokenizer);
+
+    printf("%lu lines of 'perf report'\n", n_lines);
+    printf("  getline() + sscanf(%%ms):  %8.1f ns/line  (%lu parsed)\n",
+           1e9 * secs_sscanf / n_lines, parsed_sscanf);
+    printf("  perf_report_parse_line(): %8.1f ns/line  (%lu parsed)\n",
+           1e9 * secs_tokenizer / n_lines, parsed_tokenizer);
+    printf("  speed-up: %.2fx\n", secs_sscanf / secs_tokenizer);
+
+    fclose(report);
+    if (parsed_sscanf != parsed_tokenizer ||
+        checksum_sscanf != checksum_tokenizer) {
+        fprintf(stderr, "ERROR: the two parsers disagree\n");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,274 @@
+
+/* A benchmark of the whole pipeline of the output of "perf report" in the
+ * wrapper, as upload_perf_report_to_NewRelic() runs it: the reader, the
+ * header of the --fields, the parsing of the entries and of their folded
+ * call-graphs, the aggregation per (symbol, DSO) and per thread, the trie
+ * of the stacks, and the top-K at the end.
+ *
+ * It replays synthetic reports of the given numbers of lines (by default,
+ * of 10k, 100k and 1M lines, with the call-graphs of "-g"), or a report
+ * recorded from "perf report --stdio --field-separator=<tab> --fields=..."
+ * (eg., with the fields of the wrapper) with -f, and tells for each one the
+ * wall-clock time, the lines and the samples per second, the allocations
+ * (see "bench_alloc.h") and the peak RSS (of the process so far, so it only
+ * grows from one report to the next). As in the wrapper, the aggregations
+ * and the reader are allocated from the arena of the window:
+ *
+ *     bench_report_pipeline  [<number-of-lines> ...]
+ *     bench_report_pipeline  -f <recorded-perf-report>
+ *
+ * Nothing is sent anywhere: the top-K is only computed.
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../arena.h"
+#include "../perf_report_parser.h"
+#include "../sample_aggregation.h"
+#include "../stack_trie.h"
+#include "../symbol_aggregation.h"
+#include "bench_alloc.h"
+
+
+#define FIELD_SEPARATOR  '\t'
+#define TOP_SYMBOLS      50
+
+static const char * so_objects[] = {
+    "[kernel.kallsyms]", "libc-2.17.so", "ld-2.17.so", "libpthread-2.17.so",
+    "libstdc++.so.6.0.19", "my_program"
+};
+
+static const char * symbols[] = {
+    "vm_normal_page", "__fxstat64", "_dl_relocate_object", "pthread_mutex_lock",
+    "std::string::append", "main", "page_fault", "memcpy", "_int_malloc",
+    "do_syscall_64"
+};
+
+
+/* A report in the layout of the default --fields of the wrapper
+ * ("overhead,period,sample,pid,dso,sym"), each entry followed by two of its
+ * stacks, on 256 threads and 20000 distinct symbols, with some of them
+ * unresolved, as "perf report" prints them */
+static FILE *
+generate_report(unsigned long n_lines)
+{
+    FILE * report = tmpfile();
+    if (!report)
+        return NULL;
+
+    fprintf(report, "# Total Lost Samples: 0\n#\n"
+                    "# Samples: %lu  of event 'cycles'\n#\n", n_lines);
+    fprintf(report, "# Overhead\tPeriod\tSamples\tPid:Command\t"
+                    "Shared Object\tSymbol\n#\n");
+    unsigned long line = 6, i;
+    for (i = 0; line < n_lines; i++) {
+        const char * so_object = so_objects[i % 6];
+        unsigned long samples = 1 + 1000000 / (i + 1);
+        if (i % 97 == 0)
+            fprintf(report, "%.2f%%\t%lu\t%lu\t%lu:my_program\t%s\t"
+                            "[.] 0x%016lx\n", 100.0 / (i + 1),
+                    samples * 250000, samples, 1000 + i % 256, so_object,
+                    0x400000 + i * 16);
+        else
+            fprintf(report, "%.2f%%\t%lu\t%lu\t%lu:my_program\t%s\t"
+                            "[%c] %s_%lu\n", 100.0 / (i + 1),
+                    samples * 250000, samples, 1000 + i % 256, so_object,
+                    so_object[0] == '[' ? 'k' : '.', symbols[i % 10],
+                    i % 20000);
+        fprintf(report, "%lu _start;__libc_start_main;main;%s_%lu;%s_%lu\n",
+                samples - samples / 3, symbols[(i + 1) % 10], i % 500,
+                symbols[i % 10], i % 20000);
+        fprintf(report, "%lu _start;__libc_start_main;main;%s_%lu\n",
+                samples / 3, symbols[i % 10], i % 20000);
+        line += 3;
+    }
+    fflush(report);
+    rewind(report);
+    return report;
+}
+
+
+static double
+elapsed_seconds(const struct timespec * start, const struct timespec * end)
+{
+    return (end->tv_sec - start->tv_sec) +
+           (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+
+struct pipeline_result {
+    unsigned long      lines;
+    unsigned long      entries;
+    unsigned long      stacks;
+    unsigned long      malformed;
+    unsigned long long samples;
+    size_t             symbols;
+    size_t             stack_nodes;
+    double             checksum;     /* of the top-K, to use its result */
+};
+
+
+/* The loop of upload_perf_report_to_NewRelic(), over the report in "fd" */
+static int
+replay_report(int fd, struct pipeline_result * out_result)
+{
+    memset(out_result, 0, sizeof *out_result);
+    struct arena window_arena;
+    arena_init(&window_arena, 0);
+    struct symbol_aggregation * aggregation =
+                   symbol_aggregation_new_in_arena(&window_arena);
+    struct symbol_aggregation * threads =
+                   symbol_aggregation_new_in_arena(&window_arena);
+    struct stack_trie * stacks = stack_trie_new();
+    struct perf_report_reader * reader = arena_alloc(&window_arena,
+                                                     sizeof *reader);
+    struct symbol_aggregate * top = arena_alloc(&window_arena,
+                                                TOP_SYMBOLS * sizeof *top);
+    if (!aggregation || !threads || !stacks || !reader || !top) {
+        stack_trie_free(stacks);
+        arena_free(&window_arena);
+        return -1;
+    }
+    perf_report_reader_init(reader, fd);
+
+    struct perf_report_schema schema;
+    int schema_found = 0;
+    char * line;
+    size_t len;
+    while (perf_report_reader_next_line(reader, &line, &len) == 1) {
+        out_result->lines++;
+        if (!schema_found && line[0] == '#') {
+            schema_found = perf_report_schema_parse_header(&schema,
+                                                 FIELD_SEPARATOR, line,
+                                                 len) == 0;
+            continue;
+        }
+        if (schema_found && !memchr(line, FIELD_SEPARATOR, len)) {
+            unsigned long long stack_samples;
+            struct string_view frames;
+            if (perf_report_parse_folded_callchain(line, len, &stack_samples,
+                                                   &frames) ==
+                                                   PERF_REPORT_LINE_OK) {
+                sample_aggregation_add_folded_stack(stacks, aggregation,
+                                                    &frames, stack_samples);
+                out_result->stacks++;
+                continue;
+            }
+        }
+        struct perf_report_line parsed;
+        enum perf_report_parse_result parse_result = schema_found ?
+                        perf_report_parse_fields(&schema, line, len, &parsed) :
+                        perf_report_parse_line(line, len, &parsed);
+        if (parse_result == PERF_REPORT_LINE_SKIPPED)
+            continue;
+        if (parse_result == PERF_REPORT_LINE_MALFORMED) {
+            out_result->malformed++;
+            continue;
+        }
+
+        const char * interned_symbol =
+                   symbol_aggregation_intern(aggregation, parsed.symbol.ptr,
+                                             parsed.symbol.len);
+        const char * interned_so_object =
+                   symbol_aggregation_intern(aggregation, parsed.so_object.ptr,
+                                             parsed.so_object.len);
+        if (interned_symbol && interned_so_object)
+            symbol_aggregation_add(aggregation, interned_symbol,
+                                   interned_so_object, parsed.samples,
+                                   parsed.period, parsed.percent);
+        if (parsed.tid >= 0)
+            sample_aggregation_add_thread(threads, parsed.comm.ptr,
+                                          parsed.comm.len, parsed.tid,
+                                          parsed.samples, parsed.period,
+                                          parsed.percent);
+        out_result->entries++;
+        out_result->samples += parsed.samples;
+    }
+
+    size_t n_top = symbol_aggregation_top(aggregation, TOP_SYMBOLS, top), i;
+    for (i = 0; i < n_top; i++)
+        out_result->checksum += top[i].weight;
+    n_top = symbol_aggregation_top(threads, TOP_SYMBOLS, top);
+    for (i = 0; i < n_top; i++)
+        out_result->checksum += top[i].weight;
+    out_result->symbols = symbol_aggregation_count(aggregation);
+    out_result->stack_nodes = stack_trie_node_count(stacks);
+
+    stack_trie_free(stacks);
+    arena_free(&window_arena);
+    return 0;
+}
+
+
+static int
+bench_report(int fd, const char * name)
+{
+    struct bench_alloc_counts before, after;
+    struct timespec start, end;
+    struct pipeline_result result;
+
+    bench_alloc_get_counts(&before);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int ret = replay_report(fd, &result);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    bench_alloc_get_counts(&after);
+    if (ret != 0) {
+        fprintf(stderr, "ERROR: %s: couldn't allocate memory\n", name);
+        return -1;
+    }
+
+    double seconds = elapsed_seconds(&start, &end);
+    printf("%s: %lu lines (%lu entries, %lu stacks, %lu malformed)\n", name,
+           result.lines, result.entries, result.stacks, result.malformed);
+    printf("  wall time:    %10.3f ms  (%.1f ns/line)\n", 1e3 * seconds,
+           1e9 * seconds / (result.lines ? result.lines : 1));
+    printf("  throughput:   %10.0f lines/s  %.0f samples/s\n",
+           result.lines / seconds, result.samples / seconds);
+    printf("  allocations:  %10lu  (%llu bytes, %lu frees)\n",
+           after.allocations - before.allocations, after.bytes - before.bytes,
+           after.frees - before.frees);
+    printf("  peak RSS:     %10ld KB\n", bench_peak_rss_kb());
+    printf("  aggregated:   %10zu symbols, %zu stack nodes  (checksum %g)\n",
+           result.symbols, result.stack_nodes, result.checksum);
+    return 0;
+}
+
+
+int
+main(int argc, char * argv[])
+{
+    if (argc == 3 && strcmp(argv[1], "-f") == 0) {
+        int fd = open(argv[2], O_RDONLY);
+        if (fd < 0) {
+            perror(argv[2]);
+            return 1;
+        }
+        int ret = bench_report(fd, argv[2]);
+        close(fd);
+        return ret == 0 ? 0 : 1;
+    }
+
+    static const char * default_sizes[] = { "10000", "100000", "1000000" };
+    const char ** sizes = argc > 1 ? (const char **)argv + 1 : default_sizes;
+    int n_sizes = argc > 1 ? argc - 1 : 3, i;
+    for (i = 0; i < n_sizes; i++) {
+        unsigned long n_lines = strtoul(sizes[i], NULL, 10);
+        FILE * report = generate_report(n_lines);
+        if (!report) {
+            perror("tmpfile");
+            return 1;
+        }
+        char name[64];
+        snprintf(name, sizeof name, "synthetic report of %lu lines", n_lines);
+        int ret = bench_report(fileno(report), name);
+        fclose(report);
+        if (ret != 0)
+            return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,158 @@
+
+/* A micro-benchmark of the symbol cache: how long it takes to open a cache
+ * file of a kallsyms-sized table (what a run with the cache pays instead of
+ * parsing /proc/kallsyms), and the lookups in its Eytzinger layout against
+ * a binary search on the sorted array (what the resolver does without it).
+ *
+ * The symbols are synthetic, and the addresses looked up are random:
+ *
+ *     bench_symbol_cache  [<number-of-symbols>]  [<number-of-lookups>]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../symbol_cache.h"
+
+
+static double
+elapsed_seconds(const struct timespec * start, const struct timespec * end)
+{
+    return (end->tv_sec - start->tv_sec) +
+           (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+
+/* xorshift64*: the addresses looked up, the same for both searches */
+static unsigned long long
+next_random(unsigned long long * state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 2685821657736338717ULL;
+}
+
+
+/* the binary search of search_symbol_table() in "symbol_resolver.c" */
+static const struct symbol_cache_symbol *
+binary_search(const struct symbol_cache_symbol * symbols, size_t n_symbols,
+              unsigned long long addr)
+{
+    size_t lo = 0, hi = n_symbols;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (symbols[mid].start <= addr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == 0 || addr >= symbols[lo - 1].end)
+        return NULL;
+    return &symbols[lo - 1];
+}
+
+
+int
+main(int argc, char * argv[])
+{
+    size_t n_symbols = argc > 1 ? strtoul(argv[1], NULL, 10) : 200000;
+    unsigned long n_lookups = argc > 2 ? strtoul(argv[2], NULL, 10) : 10000000;
+    if (n_symbols == 0)
+        return 1;
+
+    /* functions of 16 to 1024 bytes, with some gaps between them */
+    struct symbol_cache_symbol * symbols = calloc(n_symbols, sizeof *symbols);
+    char * names = malloc(n_symbols * 24);
+    if (!symbols || !names) {
+        perror("malloc");
+        return 1;
+    }
+    unsigned long long state = 88172645463325252ULL;
+    unsigned long long addr = 0xffffffff81000000ULL;
+    size_t i;
+    for (i = 0; i < n_symbols; i++) {
+        snprintf(names + 24 * i, 24, "func_%zu", i);
+        symbols[i].start = addr;
+        symbols[i].end = addr + 16 + next_random(&state) % 1008;
+        symbols[i].name = names + 24 * i;
+        addr = symbols[i].end + (i % 4 == 0 ? 64 : 0);
+    }
+    unsigned long long first = symbols[0].start, span = addr - first;
+
+    char fname[] = "/tmp/bench_symbol_cache.XXXXXX";
+    int fd = mkstemp(fname);
+    if (fd < 0) {
+        perror("mkstemp");
+        return 1;
+    }
+    close(fd);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int written = symbol_cache_write(fname, symbols, n_symbols, NULL, 1);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double secs_write = elapsed_seconds(&start, &end);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    struct symbol_cache * cache = symbol_cache_open(fname);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double secs_open = elapsed_seconds(&start, &end);
+    unlink(fname);
+    if (written != 0 || !cache || symbol_cache_count(cache) != n_symbols) {
+        fprintf(stderr, "ERROR: couldn't write or open the cache file\n");
+        return 1;
+    }
+
+    unsigned long found_bsearch = 0, found_cache = 0;
+    unsigned long long checksum_bsearch = 0, checksum_cache = 0;
+    state = 1181783497276652981ULL;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    unsigned long j;
+    for (j = 0; j < n_lookups; j++) {
+        const struct symbol_cache_symbol * symbol =
+            binary_search(symbols, n_symbols,
+                          first + next_random(&state) % span);
+        if (symbol) {
+            found_bsearch++;
+            checksum_bsearch += strlen(symbol->name);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double secs_bsearch = elapsed_seconds(&start, &end);
+
+    state = 1181783497276652981ULL;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (j = 0; j < n_lookups; j++) {
+        const char * name;
+        unsigned int owner;
+        if (symbol_cache_lookup(cache, first + next_random(&state) % span,
+                                &name, &owner)) {
+            found_cache++;
+            checksum_cache += strlen(name);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double secs_cache = elapsed_seconds(&start, &end);
+
+    printf("%zu symbols, %lu lookups\n", n_symbols, n_lookups);
+    printf("  symbol_cache_write():     %8.1f ms\n", 1e3 * secs_write);
+    printf("  symbol_cache_open():      %8.3f ms\n", 1e3 * secs_open);
+    printf("  binary search:            %8.1f ns/lookup  (%lu found)\n",
+           1e9 * secs_bsearch / n_lookups, found_bsearch);
+    printf("  symbol_cache_lookup():    %8.1f ns/lookup  (%lu found)\n",
+           1e9 * secs_cache / n_lookups, found_cache);
+    printf("  speed-up: %.2fx\n", secs_bsearch / secs_cache);
+
+    symbol_cache_close(cache);
+    free(symbols);
+    free(names);
+    if (found_bsearch != found_cache || checksum_bsearch != checksum_cache) {
+        fprintf(stderr, "ERROR: the two searches disagree\n");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,176 @@
+
+/* The synthetic workloads profiled by bench_overhead: a fixed amount of
+ * work, so that the slow-down of the wall-clock time under the wrapper is
+ * its overhead.
+ *
+ *     bench_workload  cpu      [<millions-of-iterations>]
+ *     bench_workload  threads  [<threads>]  [<millions-of-iterations>]
+ *
+ * "cpu" is one CPU-bound thread, whose time is spread over a few functions
+ * of different weights (a hot one, a warm one and a cold one, in a call
+ * chain), so that the profile has a few symbols and stacks. "threads" does
+ * the same work split over many threads, while the main thread creates and
+ * joins short-lived ones: the thread-heavy case, with the perf-events that
+ * are inherited by each new thread and the samples spread over many tids.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+static volatile unsigned long long sink;
+
+
+/* an xorshift64 loop, which the compiler can't remove nor vectorize */
+static __attribute__((noinline)) unsigned long long
+spin(unsigned long long state, unsigned long iterations)
+{
+    unsigned long i;
+    for (i = 0; i < iterations; i++) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+    }
+    return state;
+}
+
+
+static __attribute__((noinline)) unsigned long long
+cold_function(unsigned long long state, unsigned long iterations)
+{
+    return spin(state, iterations);
+}
+
+
+static __attribute__((noinline)) unsigned long long
+warm_function(unsigned long long state, unsigned long iterations)
+{
+    return spin(state, iterations) ^ cold_function(state, iterations / 4);
+}
+
+
+static __attribute__((noinline)) unsigned long long
+hot_function(unsigned long long state, unsigned long iterations)
+{
+    return spin(state, iterations) ^ warm_function(state, iterations / 4);
+}
+
+
+/* "iterations" of the mix of hot, warm and cold functions, in chunks of
+ * 10000 iterations */
+static void
+run_work(unsigned long long seed, unsigned long long iterations)
+{
+    unsigned long long state = seed | 1, done;
+    for (done = 0; done < iterations; done += 10000)
+        state = hot_function(state, 6000) ^ warm_function(state, 2000);
+    sink ^= state;
+}
+
+
+struct worker {
+    pthread_t          thread;
+    unsigned long long iterations;
+    unsigned long long seed;
+};
+
+
+static void *
+worker_thread(void * arg)
+{
+    struct worker * worker = arg;
+    run_work(worker->seed, worker->iterations);
+    return NULL;
+}
+
+
+static void *
+short_lived_thread(void * arg)
+{
+    run_work((unsigned long long)(size_t)arg, 10000);
+    return NULL;
+}
+
+
+static volatile int workers_done;
+
+
+static void *
+joiner_thread(void * arg)
+{
+    (void)arg;
+    unsigned long n = 0;
+    while (!workers_done) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, short_lived_thread,
+                           (void *)(size_t)++n) != 0)
+            break;
+        pthread_join(thread, NULL);
+    }
+    printf("%lu short-lived threads\n", n);
+    return NULL;
+}
+
+
+static int
+run_threads(unsigned int n_threads, unsigned long long iterations)
+{
+    struct worker * workers = calloc(n_threads, sizeof *workers);
+    if (!workers) {
+        perror("calloc");
+        return 1;
+    }
+
+    pthread_t joiner;
+    int joiner_started = pthread_create(&joiner, NULL, joiner_thread,
+                                        NULL) == 0;
+    unsigned int i, n_started = 0;
+    for (i = 0; i < n_threads; i++) {
+        workers[i].iterations = iterations / n_threads;
+        workers[i].seed = 0x9e3779b97f4a7c15ULL * (i + 1);
+        if (pthread_create(&workers[i].thread, NULL, worker_thread,
+                           &workers[i]) != 0) {
+            perror("pthread_create");
+            break;
+        }
+        n_started++;
+    }
+    for (i = 0; i < n_started; i++)
+        pthread_join(workers[i].thread, NULL);
+    workers_done = 1;
+    if (joiner_started)
+        pthread_join(joiner, NULL);
+
+    free(workers);
+    return n_started == n_threads ? 0 : 1;
+}
+
+
+int
+main(int argc, char * argv[])
+{
+    if (argc < 2 || (strcmp(argv[1], "cpu") != 0 &&
+                     strcmp(argv[1], "threads") != 0)) {
+        fprintf(stderr, "Usage: %s cpu [<millions-of-iterations>]\n"
+                        "       %s threads [<threads>] "
+                        "[<millions-of-iterations>]\n", argv[0], argv[0]);
+        return 2;
+    }
+
+    if (strcmp(argv[1], "cpu") == 0) {
+        unsigned long long millions = argc > 2 ? strtoull(argv[2], NULL, 10)
+                                               : 1000;
+        run_work(1, millions * 1000000);
+        return 0;
+    }
+
+    unsigned int n_threads = argc > 2 ? (unsigned)strtoul(argv[2], NULL, 10)
+                                      : 64;
+    unsigned long long millions = argc > 3 ? strtoull(argv[3], NULL, 10)
+                                           : 1000;
+    if (n_threads == 0)
+        n_threads = 1;
+    return run_threads(n_threads, millions * 1000000);
+}
@@ -0,0 +1,33 @@
+
+/* The subset of the "newrelic_collector_client.h" of the NewRelic Agent SDK
+ * which the wrapper uses, for the stub SDK: the collector client is the one
+ * that talks to New Relic, and the stub never connects to anything. */
+
+#ifndef NEWRELIC_COLLECTOR_CLIENT_H_
+#define NEWRELIC_COLLECTOR_CLIENT_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define NEWRELIC_STATUS_CODE_SHUTDOWN  0
+#define NEWRELIC_STATUS_CODE_STARTING  1
+#define NEWRELIC_STATUS_CODE_STOPPING  2
+#define NEWRELIC_STATUS_CODE_STARTED   3
+
+void newrelic_register_status_callback(void (*callback)(int));
+
+void newrelic_register_message_handler(void * (*handler)(void *));
+
+void * newrelic_message_handler(void * raw_message);
+
+int newrelic_init(const char * license, const char * app_name,
+                  const char * language, const char * language_version);
+
+int newrelic_request_shutdown(const char * reason);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* NEWRELIC_COLLECTOR_CLIENT_H_ */
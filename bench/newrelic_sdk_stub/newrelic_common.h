@@ -0,0 +1,29 @@
+
+/* The subset of the "newrelic_common.h" of the NewRelic Agent SDK which the
+ * wrapper uses, to build it against the stub SDK of "newrelic_sdk_stub.c"
+ * (see "make bench"): the declarations are the ones of the SDK. */
+
+#ifndef NEWRELIC_COMMON_H_
+#define NEWRELIC_COMMON_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define NEWRELIC_ROOT_SEGMENT  0
+#define NEWRELIC_AUTOSCOPE     1
+
+#define NEWRELIC_RETURN_CODE_OK                        0
+#define NEWRELIC_RETURN_CODE_OTHER                     -0x10001
+#define NEWRELIC_RETURN_CODE_DISABLED                  -0x20001
+#define NEWRELIC_RETURN_CODE_INVALID_PARAM             -0x30001
+#define NEWRELIC_RETURN_CODE_INVALID_ID                -0x30002
+#define NEWRELIC_RETURN_CODE_TRANSACTION_NOT_STARTED   -0x40001
+#define NEWRELIC_RETURN_CODE_TRANSACTION_IN_PROGRESS   -0x40002
+#define NEWRELIC_RETURN_CODE_TRANSACTION_NOT_NAMED     -0x40003
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* NEWRELIC_COMMON_H_ */
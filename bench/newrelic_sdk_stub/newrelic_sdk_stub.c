@@ -0,0 +1,216 @@
+
+/* A stub of the NewRelic Agent SDK, to build the wrapper for the benchmarks
+ * ("make bench") without the SDK, offline and reproducibly: the calls do
+ * nothing but count what would have been sent to New Relic.
+ *
+ * If the environment variable NEWRELIC_STUB_SUMMARY is the name of a file,
+ * a one-line summary of the counts is written to it at the exit of the
+ * program, with the allocations of "bench_alloc.h" (the stub is linked with
+ * it), to be read by bench_overhead:
+ *
+ *     transactions=<N> attributes=<N> metrics=<N> errors=<N> samples=<N>
+ *         allocations=<N> allocated_bytes=<N> peak_rss_kb=<N>
+ *         cpu_seconds=<S>
+ *
+ * where the samples are the sum of the "ct_total_samples" attributes, and
+ * the peak RSS and the CPU time (user + system) are the ones of the wrapper
+ * itself, not of its children (the program, "perf record"...). With
+ * NEWRELIC_STUB_VERBOSE set, each attribute and metric is also printed to
+ * stderr. NEWRELIC_STUB_STATUS is the status given to the status callback
+ * (NEWRELIC_STATUS_CODE_STARTED by default), eg., 1 (STARTING) to play a
+ * collector which is not reachable.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+
+#include "newrelic_common.h"
+#include "newrelic_transaction.h"
+#include "newrelic_collector_client.h"
+#include "../bench_alloc.h"
+
+
+static unsigned long n_transactions, n_attributes, n_metrics, n_errors;
+static unsigned long long total_samples;
+static long last_transaction_id;
+static int verbose;
+
+
+static void
+write_summary(void)
+{
+    const char * summary_fname = getenv("NEWRELIC_STUB_SUMMARY");
+    if (!summary_fname || !*summary_fname)
+        return;
+    FILE * summary = fopen(summary_fname, "w");
+    if (!summary)
+        return;
+
+    struct bench_alloc_counts allocs;
+    bench_alloc_get_counts(&allocs);
+    struct rusage usage;
+    memset(&usage, 0, sizeof usage);
+    getrusage(RUSAGE_SELF, &usage);
+    double cpu_seconds = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+                         usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+    fprintf(summary, "transactions=%lu attributes=%lu metrics=%lu errors=%lu "
+                     "samples=%llu allocations=%lu allocated_bytes=%llu "
+                     "peak_rss_kb=%ld cpu_seconds=%.3f\n",
+            __atomic_load_n(&n_transactions, __ATOMIC_RELAXED),
+            __atomic_load_n(&n_attributes, __ATOMIC_RELAXED),
+            __atomic_load_n(&n_metrics, __ATOMIC_RELAXED),
+            __atomic_load_n(&n_errors, __ATOMIC_RELAXED),
+            __atomic_load_n(&total_samples, __ATOMIC_RELAXED),
+            allocs.allocations, allocs.bytes, usage.ru_maxrss, cpu_seconds);
+    fclose(summary);
+}
+
+
+void
+newrelic_register_status_callback(void (*callback)(int))
+{
+    const char * status = getenv("NEWRELIC_STUB_STATUS");
+    if (callback)
+        callback(status ? atoi(status) : NEWRELIC_STATUS_CODE_STARTED);
+}
+
+
+void
+newrelic_register_message_handler(void * (*handler)(void *))
+{
+    (void)handler;
+}
+
+
+void *
+newrelic_message_handler(void * raw_message)
+{
+    (void)raw_message;
+    return NULL;
+}
+
+
+int
+newrelic_init(const char * license, const char * app_name,
+              const char * language, const char * language_version)
+{
+    (void)license; (void)app_name; (void)language; (void)language_version;
+    verbose = getenv("NEWRELIC_STUB_VERBOSE") != NULL;
+    atexit(write_summary);
+    return NEWRELIC_RETURN_CODE_OK;
+}
+
+
+int
+newrelic_request_shutdown(const char * reason)
+{
+    (void)reason;
+    return NEWRELIC_RETURN_CODE_OK;
+}
+
+
+void
+newrelic_enable_instrumentation(int set_enabled)
+{
+    (void)set_enabled;
+}
+
+
+int
+newrelic_record_metric(const char * name, double value)
+{
+    __atomic_fetch_add(&n_metrics, 1, __ATOMIC_RELAXED);
+    if (verbose)
+        fprintf(stderr, "NEWRELIC_STUB: metric %s = %f\n", name, value);
+    return NEWRELIC_RETURN_CODE_OK;
+}
+
+
+long
+newrelic_transaction_begin(void)
+{
+    __atomic_fetch_add(&n_transactions, 1, __ATOMIC_RELAXED);
+    return __atomic_add_fetch(&last_transaction_id, 1, __ATOMIC_RELAXED);
+}
+
+
+int
+newrelic_transaction_set_type_other(long transaction_id)
+{
+    (void)transaction_id;
+    return NEWRELIC_RETURN_CODE_OK;
+}
+
+
+int
+newrelic_transaction_set_category(long transaction_id, const char * category)
+{
+    (void)transaction_id; (void)category;
+    return NEWRELIC_RETURN_CODE_OK;
+}
+
+
+int
+newrelic_transaction_notice_error(long transaction_id,
+                                  const char * exception_type,
+                                  const char * error_message,
+                                  const char * stack_trace,
+                                  const char * stack_frame_delimiter)
+{
+    (void)transaction_id; (void)stack_trace; (void)stack_frame_delimiter;
+    __atomic_fetch_add(&n_errors, 1, __ATOMIC_RELAXED);
+    if (verbose)
+        fprintf(stderr, "NEWRELIC_STUB: error %s: %s\n", exception_type,
+                error_message);
+    return NEWRELIC_RETURN_CODE_OK;
+}
+
+
+int
+newrelic_transaction_add_attribute(long transaction_id, const char * name,
+                                   const char * value)
+{
+    (void)transaction_id;
+    __atomic_fetch_add(&n_attributes, 1, __ATOMIC_RELAXED);
+    if (strcmp(name, "ct_total_samples") == 0)
+        __atomic_fetch_add(&total_samples, strtoull(value, NULL, 10),
+                           __ATOMIC_RELAXED);
+    if (verbose)
+        fprintf(stderr, "NEWRELIC_STUB: attribute %s = %s\n", name, value);
+    return NEWRELIC_RETURN_CODE_OK;
+}
+
+
+int
+newrelic_transaction_set_name(long transaction_id, const char * name)
+{
+    (void)transaction_id; (void)name;
+    return NEWRELIC_RETURN_CODE_OK;
+}
+
+
+int
+newrelic_transaction_end(long transaction_id)
+{
+    (void)transaction_id;
+    return NEWRELIC_RETURN_CODE_OK;
+}
+
+
+long
+newrelic_segment_external_begin(long transaction_id, long parent_segment_id,
+                                const char * host, const char * name)
+{
+    (void)transaction_id; (void)parent_segment_id; (void)host; (void)name;
+    return 1;
+}
+
+
+int
+newrelic_segment_end(long transaction_id, long segment_id)
+{
+    (void)transaction_id; (void)segment_id;
+    return NEWRELIC_RETURN_CODE_OK;
+}
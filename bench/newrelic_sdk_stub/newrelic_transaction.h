@@ -0,0 +1,46 @@
+
+/* The subset of the "newrelic_transaction.h" of the NewRelic Agent SDK which
+ * the wrapper uses, for the stub SDK. */
+
+#ifndef NEWRELIC_TRANSACTION_H_
+#define NEWRELIC_TRANSACTION_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void newrelic_enable_instrumentation(int set_enabled);
+
+int newrelic_record_metric(const char * name, double value);
+
+long newrelic_transaction_begin(void);
+
+int newrelic_transaction_set_type_other(long transaction_id);
+
+int newrelic_transaction_set_category(long transaction_id,
+                                      const char * category);
+
+int newrelic_transaction_notice_error(long transaction_id,
+                                      const char * exception_type,
+                                      const char * error_message,
+                                      const char * stack_trace,
+                                      const char * stack_frame_delimiter);
+
+int newrelic_transaction_add_attribute(long transaction_id, const char * name,
+                                       const char * value);
+
+int newrelic_transaction_set_name(long transaction_id, const char * name);
+
+int newrelic_transaction_end(long transaction_id);
+
+long newrelic_segment_external_begin(long transaction_id,
+                                     long parent_segment_id,
+                                     const char * host, const char * name);
+
+int newrelic_segment_end(long transaction_id, long segment_id);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* NEWRELIC_TRANSACTION_H_ */
@@ -0,0 +1,552 @@
+/* The in-kernel aggregation of the samples: see "bpf_aggregator.h".
+ *
+ * The program, for each sample (its context is a struct
+ * bpf_perf_event_data), in the set of maps of the control map:
+ *
+ *     key = { pid, tid, bpf_get_stackid(kernel), bpf_get_stackid(user) }
+ *     value = counts[key]
+ *     if (value)  value->samples++, value->period += ctx->sample_period
+ *     else if (update(counts, key, { 1, ctx->sample_period }) != 0)
+ *         dropped[0]++
+ *     return 0    (the sample is not written to the ring-buffer)
+ *
+ * The maps of the counts are per-CPU, so that the program updates them
+ * without atomic operations, and the drain adds the values of the CPUs. A
+ * stack id which is negative is a call-graph which is not there (-EFAULT:
+ * no kernel part in user-space, no user part in a kernel thread), or which
+ * didn't fit in the stack-trace map (-EEXIST, on a collision in its
+ * buckets, or -ENOMEM): the samples of such an aggregate are counted as
+ * dropped, rather than given to the other half of their call-graph, to
+ * which they don't belong. The stack-trace maps are a few times larger than
+ * those of the counts, for their collisions to be rare.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/bpf.h>
+#include <linux/bpf_perf_event.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "bpf_aggregator.h"
+
+
+#define MAX_PROGRAM_INSNS    96
+#define VERIFIER_LOG_SIZE    (64 * 1024)
+#define STACKS_PER_AGGREGATE 4     /* the entries of the stack-trace maps */
+
+
+struct aggregate_key {
+    unsigned int pid;
+    unsigned int tid;
+    int          kernel_stack;
+    int          user_stack;
+};
+
+struct aggregate_value {
+    unsigned long long samples;
+    unsigned long long period;
+};
+
+
+struct bpf_aggregator {
+    int                  control_fd;     /* [0]: the set being filled */
+    int                  dropped_fd;     /* per-CPU */
+    int                  counts_fds[2];  /* per-CPU, by aggregate_key */
+    int                  stacks_fds[2];  /* BPF_MAP_TYPE_STACK_TRACE */
+    int                  program_fd;
+    unsigned int         active;         /* as in the control map */
+    size_t               max_stacks;
+    unsigned int         possible_cpus;  /* of the values of the maps */
+    unsigned long long   dropped_stacks; /* samples without their stacks */
+
+    /* the buffers of the drain */
+    struct aggregate_key *   keys;
+    struct aggregate_value * cpu_values;
+    unsigned long long *     cpu_dropped;
+    unsigned long long       kernel_stack[BPF_AGGREGATOR_MAX_DEPTH];
+    unsigned long long       user_stack[BPF_AGGREGATOR_MAX_DEPTH];
+};
+
+
+static long
+sys_bpf(int cmd, union bpf_attr * attr)
+{
+    return syscall(__NR_bpf, cmd, attr, sizeof *attr);
+}
+
+
+static int
+create_map(unsigned int type, unsigned int key_size, unsigned int value_size,
+           unsigned int max_entries)
+{
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof attr);
+    attr.map_type = type;
+    attr.key_size = key_size;
+    attr.value_size = value_size;
+    attr.max_entries = max_entries;
+    return (int)sys_bpf(BPF_MAP_CREATE, &attr);
+}
+
+
+static int
+map_lookup(int map_fd, const void * key, void * out_value)
+{
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof attr);
+    attr.map_fd = map_fd;
+    attr.key = (unsigned long)key;
+    attr.value = (unsigned long)out_value;
+    return (int)sys_bpf(BPF_MAP_LOOKUP_ELEM, &attr);
+}
+
+
+static int
+map_update(int map_fd, const void * key, const void * value)
+{
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof attr);
+    attr.map_fd = map_fd;
+    attr.key = (unsigned long)key;
+    attr.value = (unsigned long)value;
+    attr.flags = BPF_ANY;
+    return (int)sys_bpf(BPF_MAP_UPDATE_ELEM, &attr);
+}
+
+
+static int
+map_delete(int map_fd, const void * key)
+{
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof attr);
+    attr.map_fd = map_fd;
+    attr.key = (unsigned long)key;
+    return (int)sys_bpf(BPF_MAP_DELETE_ELEM, &attr);
+}
+
+
+/* The key after "key" (or the first one, if "key" is NULL). Returns 0, or
+ * -1 with errno ENOENT after the last one */
+static int
+map_next_key(int map_fd, const void * key, void * out_next_key)
+{
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof attr);
+    attr.map_fd = map_fd;
+    attr.key = (unsigned long)key;
+    attr.next_key = (unsigned long)out_next_key;
+    return (int)sys_bpf(BPF_MAP_GET_NEXT_KEY, &attr);
+}
+
+
+/* The number of the possible CPUs, by which the values of the per-CPU maps
+ * are indexed: the last one in /sys/devices/system/cpu/possible, plus one */
+static unsigned int
+read_possible_cpus(void)
+{
+    char cpu_list[256];
+    FILE * file = fopen("/sys/devices/system/cpu/possible", "r");
+    if (!file)
+        return 0;
+    size_t len = fread(cpu_list, 1, sizeof cpu_list - 1, file);
+    fclose(file);
+    cpu_list[len] = '\0';
+    while (len > 0 && (cpu_list[len - 1] < '0' || cpu_list[len - 1] > '9'))
+        cpu_list[--len] = '\0';
+    while (len > 0 && cpu_list[len - 1] >= '0' && cpu_list[len - 1] <= '9')
+        len--;
+    return (unsigned int)strtoul(cpu_list + len, NULL, 10) + 1;
+}
+
+
+/* The assembly of the program, with the offsets of its jumps patched once
+ * their targets are known */
+struct program {
+    struct bpf_insn insns[MAX_PROGRAM_INSNS];
+    unsigned int    n_insns;
+};
+
+static unsigned int
+emit(struct program * program, unsigned char code, unsigned char dst,
+     unsigned char src, short off, int imm)
+{
+    struct bpf_insn * insn = &program->insns[program->n_insns];
+    memset(insn, 0, sizeof *insn);
+    insn->code = code;
+    insn->dst_reg = dst;
+    insn->src_reg = src;
+    insn->off = off;
+    insn->imm = imm;
+    return program->n_insns++;
+}
+
+static void
+emit_load_map_fd(struct program * program, unsigned char dst, int map_fd)
+{
+    emit(program, BPF_LD | BPF_DW | BPF_IMM, dst, BPF_PSEUDO_MAP_FD, 0,
+         map_fd);
+    emit(program, 0, 0, 0, 0, 0);   /* the upper half of the immediate */
+}
+
+/* Make the jump at "insn" go to the next instruction emitted */
+static void
+patch_jump_here(struct program * program, unsigned int insn)
+{
+    program->insns[insn].off = (short)(program->n_insns - insn - 1);
+}
+
+
+/* The registers: r1-r5 the arguments of the helpers, r0 their results, r10
+ * the frame pointer; r6 the context, r7 the set of maps, r8 the counts and
+ * r9 the stack-traces of that set. The stack: the key at -16, the value at
+ * -32, and the key of the arrays at -40. */
+static void
+assemble_program(const struct bpf_aggregator * aggregator,
+                 struct program * program)
+{
+    enum { R0, R1, R2, R3, R4, R5, R6, R7, R8, R9, R10 };
+    const short key = -16, value = -32, index = -40;
+    const short period = (short)offsetof(struct bpf_perf_event_data,
+                                         sample_period);
+    unsigned int to_exit[4], n_to_exit = 0;
+
+    program->n_insns = 0;
+    emit(program, BPF_ALU64 | BPF_MOV | BPF_X, R6, R1, 0, 0);
+
+    /* r7 = control[0] */
+    emit(program, BPF_ST | BPF_W | BPF_MEM, R10, 0, index, 0);
+    emit_load_map_fd(program, R1, aggregator->control_fd);
+    emit(program, BPF_ALU64 | BPF_MOV | BPF_X, R2, R10, 0, 0);
+    emit(program, BPF_ALU64 | BPF_ADD | BPF_K, R2, 0, 0, index);
+    emit(program, BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem);
+    to_exit[n_to_exit++] = emit(program, BPF_JMP | BPF_JEQ | BPF_K, R0, 0, 0,
+                                0);
+    emit(program, BPF_LDX | BPF_W | BPF_MEM, R7, R0, 0, 0);
+
+    /* key.pid, key.tid */
+    emit(program, BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_get_current_pid_tgid);
+    emit(program, BPF_STX | BPF_W | BPF_MEM, R10, R0, key + 4, 0);
+    emit(program, BPF_ALU64 | BPF_RSH | BPF_K, R0, 0, 0, 32);
+    emit(program, BPF_STX | BPF_W | BPF_MEM, R10, R0, key, 0);
+
+    /* r8, r9 = the maps of the set */
+    unsigned int to_second_set = emit(program, BPF_JMP | BPF_JNE | BPF_K,
+                                      R7, 0, 0, 0);
+    emit_load_map_fd(program, R8, aggregator->counts_fds[0]);
+    emit_load_map_fd(program, R9, aggregator->stacks_fds[0]);
+    unsigned int to_stacks = emit(program, BPF_JMP | BPF_JA, 0, 0, 0, 0);
+    patch_jump_here(program, to_second_set);
+    emit_load_map_fd(program, R8, aggregator->counts_fds[1]);
+    emit_load_map_fd(program, R9, aggregator->stacks_fds[1]);
+    patch_jump_here(program, to_stacks);
+
+    /* key.kernel_stack, key.user_stack */
+    emit(program, BPF_ALU64 | BPF_MOV | BPF_X, R1, R6, 0, 0);
+    emit(program, BPF_ALU64 | BPF_MOV | BPF_X, R2, R9, 0, 0);
+    emit(program, BPF_ALU64 | BPF_MOV | BPF_K, R3, 0, 0, 0);
+    emit(program, BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_get_stackid);
+    emit(program, BPF_STX | BPF_W | BPF_MEM, R10, R0, key + 8, 0);
+    emit(program, BPF_ALU64 | BPF_MOV | BPF_X, R1, R6, 0, 0);
+    emit(program, BPF_ALU64 | BPF_MOV | BPF_X, R2, R9, 0, 0);
+    emit(program, BPF_ALU64 | BPF_MOV | BPF_K, R3, 0, 0, BPF_F_USER_STACK);
+    emit(program, BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_get_stackid);
+    emit(program, BPF_STX | BPF_W | BPF_MEM, R10, R0, key + 12, 0);
+
+    /* an aggregate already there: add the sample to it */
+    emit(program, BPF_ALU64 | BPF_MOV | BPF_X, R1, R8, 0, 0);
+    emit(program, BPF_ALU64 | BPF_MOV | BPF_X, R2, R10, 0, 0);
+    emit(program, BPF_ALU64 | BPF_ADD | BPF_K, R2, 0, 0, key);
+    emit(program, BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem);
+    unsigned int to_new = emit(program, BPF_JMP | BPF_JEQ | BPF_K, R0, 0, 0,
+                               0);
+    emit(program, BPF_LDX | BPF_DW | BPF_MEM, R1, R0, 0, 0);
+    emit(program, BPF_ALU64 | BPF_ADD | BPF_K, R1, 0, 0, 1);
+    emit(program, BPF_STX | BPF_DW | BPF_MEM, R0, R1, 0, 0);
+    emit(program, BPF_LDX | BPF_DW | BPF_MEM, R1, R6, period, 0);
+    emit(program, BPF_LDX | BPF_DW | BPF_MEM, R2, R0, 8, 0);
+    emit(program, BPF_ALU64 | BPF_ADD | BPF_X, R2, R1, 0, 0);
+    emit(program, BPF_STX | BPF_DW | BPF_MEM, R0, R2, 8, 0);
+    to_exit[n_to_exit++] = emit(program, BPF_JMP | BPF_JA, 0, 0, 0, 0);
+
+    /* a new aggregate */
+    patch_jump_here(program, to_new);
+    emit(program, BPF_ALU64 | BPF_MOV | BPF_K, R1, 0, 0, 1);
+    emit(program, BPF_STX | BPF_DW | BPF_MEM, R10, R1, value, 0);
+    emit(program, BPF_LDX | BPF_DW | BPF_MEM, R1, R6, period, 0);
+    emit(program, BPF_STX | BPF_DW | BPF_MEM, R10, R1, value + 8, 0);
+    emit(program, BPF_ALU64 | BPF_MOV | BPF_X, R1, R8, 0, 0);
+    emit(program, BPF_ALU64 | BPF_MOV | BPF_X, R2, R10, 0, 0);
+    emit(program, BPF_ALU64 | BPF_ADD | BPF_K, R2, 0, 0, key);
+    emit(program, BPF_ALU64 | BPF_MOV | BPF_X, R3, R10, 0, 0);
+    emit(program, BPF_ALU64 | BPF_ADD | BPF_K, R3, 0, 0, value);
+    emit(program, BPF_ALU64 | BPF_MOV | BPF_K, R4, 0, 0, BPF_NOEXIST);
+    emit(program, BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_update_elem);
+    to_exit[n_to_exit++] = emit(program, BPF_JMP | BPF_JEQ | BPF_K, R0, 0, 0,
+                                0);
+
+    /* no room for it: dropped[0]++ */
+    emit(program, BPF_ST | BPF_W | BPF_MEM, R10, 0, index, 0);
+    emit_load_map_fd(program, R1, aggregator->dropped_fd);
+    emit(program, BPF_ALU64 | BPF_MOV | BPF_X, R2, R10, 0, 0);
+    emit(program, BPF_ALU64 | BPF_ADD | BPF_K, R2, 0, 0, index);
+    emit(program, BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem);
+    to_exit[n_to_exit++] = emit(program, BPF_JMP | BPF_JEQ | BPF_K, R0, 0, 0,
+                                0);
+    emit(program, BPF_LDX | BPF_DW | BPF_MEM, R1, R0, 0, 0);
+    emit(program, BPF_ALU64 | BPF_ADD | BPF_K, R1, 0, 0, 1);
+    emit(program, BPF_STX | BPF_DW | BPF_MEM, R0, R1, 0, 0);
+
+    /* return 0: the sample is not written to the ring-buffer */
+    unsigned int i;
+    for (i = 0; i < n_to_exit; i++)
+        patch_jump_here(program, to_exit[i]);
+    emit(program, BPF_ALU64 | BPF_MOV | BPF_K, R0, 0, 0, 0);
+    emit(program, BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+}
+
+
+static int
+load_program(const struct program * program)
+{
+    static const char license[] = "GPL";   /* bpf_get_stackid() needs it */
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof attr);
+    attr.prog_type = BPF_PROG_TYPE_PERF_EVENT;
+    attr.insns = (unsigned long)program->insns;
+    attr.insn_cnt = program->n_insns;
+    attr.license = (unsigned long)license;
+    int fd = (int)sys_bpf(BPF_PROG_LOAD, &attr);
+    if (fd >= 0 || (errno != EINVAL && errno != EACCES))
+        return fd;
+
+    /* rejected by the verifier: load it again, for its log */
+    char * log = malloc(VERIFIER_LOG_SIZE);
+    if (log) {
+        log[0] = '\0';
+        attr.log_buf = (unsigned long)log;
+        attr.log_size = VERIFIER_LOG_SIZE;
+        attr.log_level = 1;
+        int errno_load = errno;
+        if (sys_bpf(BPF_PROG_LOAD, &attr) < 0)
+            fprintf(stderr, "DEBUG: the BPF verifier said:\n%s\n", log);
+        free(log);
+        errno = errno_load;
+    }
+    return -1;
+}
+
+
+struct bpf_aggregator *
+bpf_aggregator_new(size_t max_stacks)
+{
+    struct bpf_aggregator * aggregator = calloc(1, sizeof *aggregator);
+    if (!aggregator)
+        return NULL;
+    aggregator->control_fd = aggregator->dropped_fd = -1;
+    aggregator->counts_fds[0] = aggregator->counts_fds[1] = -1;
+    aggregator->stacks_fds[0] = aggregator->stacks_fds[1] = -1;
+    aggregator->program_fd = -1;
+    aggregator->max_stacks = max_stacks;
+    aggregator->possible_cpus = read_possible_cpus();
+    if (aggregator->possible_cpus == 0) {
+        errno = ENOENT;
+        goto error_creating_aggregator;
+    }
+    aggregator->keys = calloc(max_stacks, sizeof *aggregator->keys);
+    aggregator->cpu_values = calloc(aggregator->possible_cpus,
+                                    sizeof *aggregator->cpu_values);
+    aggregator->cpu_dropped = calloc(aggregator->possible_cpus,
+                                     sizeof *aggregator->cpu_dropped);
+    if (!aggregator->keys || !aggregator->cpu_values ||
+        !aggregator->cpu_dropped)
+        goto error_creating_aggregator;
+
+    /* the maps are charged to RLIMIT_MEMLOCK before Linux 5.11 */
+    struct rlimit memlock = { RLIM_INFINITY, RLIM_INFINITY };
+    setrlimit(RLIMIT_MEMLOCK, &memlock);
+
+    aggregator->control_fd = create_map(BPF_MAP_TYPE_ARRAY,
+                                        sizeof(unsigned int),
+                                        sizeof(unsigned int), 1);
+    aggregator->dropped_fd = create_map(BPF_MAP_TYPE_PERCPU_ARRAY,
+                                        sizeof(unsigned int),
+                                        sizeof(unsigned long long), 1);
+    if (aggregator->control_fd < 0 || aggregator->dropped_fd < 0)
+        goto error_creating_aggregator;
+    unsigned int set;
+    for (set = 0; set < 2; set++) {
+        aggregator->counts_fds[set] = create_map(BPF_MAP_TYPE_PERCPU_HASH,
+                                         sizeof(struct aggregate_key),
+                                         sizeof(struct aggregate_value),
+                                         (unsigned int)max_stacks);
+        aggregator->stacks_fds[set] = create_map(BPF_MAP_TYPE_STACK_TRACE,
+                                         sizeof(unsigned int),
+                                         BPF_AGGREGATOR_MAX_DEPTH *
+                                         sizeof(unsigned long long),
+                                         (unsigned int)max_stacks *
+                                         STACKS_PER_AGGREGATE);
+        if (aggregator->counts_fds[set] < 0 ||
+            aggregator->stacks_fds[set] < 0)
+            goto error_creating_aggregator;
+    }
+
+    struct program program;
+    assemble_program(aggregator, &program);
+    aggregator->program_fd = load_program(&program);
+    if (aggregator->program_fd < 0)
+        goto error_creating_aggregator;
+    return aggregator;
+
+error_creating_aggregator: {
+        int errno_create = errno;
+        bpf_aggregator_free(aggregator);
+        errno = errno_create;
+        return NULL;
+    }
+}
+
+
+void
+bpf_aggregator_free(struct bpf_aggregator * aggregator)
+{
+    if (!aggregator)
+        return;
+
+    int * fds[] = { &aggregator->program_fd, &aggregator->control_fd,
+                    &aggregator->dropped_fd, &aggregator->counts_fds[0],
+                    &aggregator->counts_fds[1], &aggregator->stacks_fds[0],
+                    &aggregator->stacks_fds[1] };
+    unsigned int i;
+    for (i = 0; i < sizeof fds / sizeof fds[0]; i++)
+        if (*fds[i] >= 0)
+            close(*fds[i]);
+    free(aggregator->keys);
+    free(aggregator->cpu_values);
+    free(aggregator->cpu_dropped);
+    free(aggregator);
+}
+
+
+int
+bpf_aggregator_attach(struct bpf_aggregator * aggregator, int perf_event_fd)
+{
+    return ioctl(perf_event_fd, PERF_EVENT_IOC_SET_BPF,
+                 aggregator->program_fd);
+}
+
+
+/* The frames of a call-graph of the stack-trace map (the unused ones are
+ * zeros): returns their number, 0 if it is not there (-EFAULT), or -1 if it
+ * was lost. When the perf-event samples the call-graphs itself
+ * (PERF_SAMPLE_CALLCHAIN), bpf_get_stackid() takes them from its callchain,
+ * whose PERF_CONTEXT_* markers may be left in: they are removed. */
+static int
+read_stack(int stacks_fd, int stack_id, unsigned long long * out_stack)
+{
+    if (stack_id == -EFAULT)
+        return 0;
+    if (stack_id < 0)
+        return -1;
+    unsigned int id = (unsigned int)stack_id;
+    if (map_lookup(stacks_fd, &id, out_stack) != 0)
+        return -1;
+    int depth = 0;
+    unsigned int i;
+    for (i = 0; i < BPF_AGGREGATOR_MAX_DEPTH && out_stack[i] != 0; i++)
+        if (out_stack[i] < PERF_CONTEXT_MAX)
+            out_stack[depth++] = out_stack[i];
+    return depth;
+}
+
+
+long
+bpf_aggregator_drain(struct bpf_aggregator * aggregator,
+                     bpf_aggregate_callback callback, void * callback_arg)
+{
+    /* the program goes on with the other set */
+    unsigned int drained = aggregator->active;
+    unsigned int next = !drained;
+    unsigned int zero = 0;
+    if (map_update(aggregator->control_fd, &zero, &next) != 0)
+        return -1;
+    aggregator->active = next;
+    int counts_fd = aggregator->counts_fds[drained];
+    int stacks_fd = aggregator->stacks_fds[drained];
+
+    /* the keys first: the map is not iterated while it is emptied */
+    size_t n_keys = 0;
+    const struct aggregate_key * previous = NULL;
+    while (n_keys < aggregator->max_stacks &&
+           map_next_key(counts_fd, previous, &aggregator->keys[n_keys]) == 0)
+        previous = &aggregator->keys[n_keys++];
+
+    /* a program which was already running on another CPU at the flip may
+     * still add to the drained set: each key is looked up again right
+     * before it is deleted, and the samples added meanwhile are counted as
+     * dropped. Only those added between that last lookup and the deletion
+     * (a few microseconds) are lost uncounted. */
+    size_t i;
+    for (i = 0; i < n_keys; i++) {
+        const struct aggregate_key * key = &aggregator->keys[i];
+        if (map_lookup(counts_fd, key, aggregator->cpu_values) != 0)
+            continue;
+        struct bpf_aggregate aggregate;
+        memset(&aggregate, 0, sizeof aggregate);
+        unsigned int cpu;
+        for (cpu = 0; cpu < aggregator->possible_cpus; cpu++) {
+            aggregate.samples += aggregator->cpu_values[cpu].samples;
+            aggregate.period += aggregator->cpu_values[cpu].period;
+        }
+        aggregate.pid = (pid_t)key->pid;
+        aggregate.tid = (pid_t)key->tid;
+        int kernel_depth = read_stack(stacks_fd, key->kernel_stack,
+                                      aggregator->kernel_stack);
+        int user_depth = read_stack(stacks_fd, key->user_stack,
+                                    aggregator->user_stack);
+        if (kernel_depth < 0 || user_depth < 0) {
+            aggregator->dropped_stacks += aggregate.samples;
+        } else if (aggregate.samples > 0) {
+            aggregate.kernel_stack = aggregator->kernel_stack;
+            aggregate.kernel_depth = (unsigned int)kernel_depth;
+            aggregate.user_stack = aggregator->user_stack;
+            aggregate.user_depth = (unsigned int)user_depth;
+            callback(callback_arg, &aggregate);
+        }
+
+        /* empty the set, for when it is filled again */
+        if (map_lookup(counts_fd, key, aggregator->cpu_values) == 0) {
+            unsigned long long samples = 0;
+            for (cpu = 0; cpu < aggregator->possible_cpus; cpu++)
+                samples += aggregator->cpu_values[cpu].samples;
+            if (samples > aggregate.samples)
+                aggregator->dropped_stacks += samples - aggregate.samples;
+        }
+        map_delete(counts_fd, key);
+    }
+    unsigned int stack_id;
+    while (map_next_key(stacks_fd, NULL, &stack_id) == 0 &&
+           map_delete(stacks_fd, &stack_id) == 0)
+        ;
+    return (long)n_keys;
+}
+
+
+unsigned long long
+bpf_aggregator_dropped(const struct bpf_aggregator * aggregator)
+{
+    unsigned int zero = 0;
+    if (map_lookup(aggregator->dropped_fd, &zero,
+                   aggregator->cpu_dropped) != 0)
+        return aggregator->dropped_stacks;
+    unsigned long long dropped = aggregator->dropped_stacks;
+    unsigned int cpu;
+    for (cpu = 0; cpu < aggregator->possible_cpus; cpu++)
+        dropped += aggregator->cpu_dropped[cpu];
+    return dropped;
+}
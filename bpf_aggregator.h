@@ -0,0 +1,93 @@
+/* The in-kernel aggregation of the samples, with eBPF: a BPF program,
+ * attached to the sampling perf-events (PERF_EVENT_IOC_SET_BPF), counts the
+ * samples and adds their periods per (process, thread, kernel call-graph,
+ * user-space call-graph) in a map of the kernel, and returns 0, so that the
+ * samples are not written to the ring-buffers at all. The call-graphs are
+ * kept in stack-trace maps (bpf_get_stackid()), once each, and the maps are
+ * read, and emptied, once per flush window: the cost of the crossings
+ * between the kernel and the user-space depends on the number of distinct
+ * call-graphs of the window, and not on the sampling rate.
+ *
+ * The program is assembled here, without libbpf nor a compiler of BPF, and
+ * loaded with the bpf() system-call. It needs the right to load tracing
+ * programs (root, or CAP_BPF and CAP_PERFMON).
+ *
+ * There are two sets of maps, the one which the program fills (which of the
+ * two is in a control map) and the one of the previous window, which is
+ * drained: the drain switches the program to the other set first, so that
+ * it reads a set which is no longer written, but by the programs which were
+ * running on the other CPUs at that moment (what they add after it was read
+ * is counted as dropped, see bpf_aggregator_drain()). The aggregates which
+ * don't fit in the map of a window, and those whose call-graphs didn't fit
+ * in the stack-trace map, are counted as dropped: the maps should be drained
+ * often enough (about every second) for a window to fit in them.
+ */
+
+#ifndef BPF_AGGREGATOR_H_
+#define BPF_AGGREGATOR_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+
+/* The frames kept of each call-graph: the stack-trace maps take this many
+ * u64 per entry, whatever the depth of the call-graph */
+#define BPF_AGGREGATOR_MAX_DEPTH             64
+#define BPF_AGGREGATOR_DEFAULT_MAX_STACKS    8192    /* per window */
+
+
+/* The samples of a window with the same call-graphs */
+struct bpf_aggregate {
+    pid_t                      pid;
+    pid_t                      tid;
+    unsigned long long         samples;
+    unsigned long long         period;
+    /* from the leaf to the outermost caller, or none (a sample in the user
+     * space has no kernel call-graph, and a kernel thread no user one) */
+    const unsigned long long * kernel_stack;
+    unsigned int               kernel_depth;
+    const unsigned long long * user_stack;
+    unsigned int               user_depth;
+};
+
+
+typedef void (*bpf_aggregate_callback)(void * callback_arg,
+                                       const struct bpf_aggregate * aggregate);
+
+
+struct bpf_aggregator;
+
+
+/* Create the maps, of at most "max_stacks" aggregates (and call-graphs) per
+ * window, and load the program. Returns NULL (with errno) if eBPF is not
+ * there, or not allowed. */
+struct bpf_aggregator *
+bpf_aggregator_new(size_t max_stacks);
+
+
+void
+bpf_aggregator_free(struct bpf_aggregator * aggregator);
+
+
+/* Attach the program to a sampling perf-event (and so to the perf-events
+ * that it inherits). Returns 0, or -1 with errno. */
+int
+bpf_aggregator_attach(struct bpf_aggregator * aggregator, int perf_event_fd);
+
+
+/* Give each aggregate of the window to "callback", in no particular order,
+ * empty the maps of the window, and start a new one. Returns the number of
+ * aggregates, or -1 with errno. */
+long
+bpf_aggregator_drain(struct bpf_aggregator * aggregator,
+                     bpf_aggregate_callback callback, void * callback_arg);
+
+
+/* The samples which didn't fit in the maps of their window, whose
+ * call-graphs were lost, or which were added to a window while it was
+ * drained, since the start */
+unsigned long long
+bpf_aggregator_dropped(const struct bpf_aggregator * aggregator);
+
+
+#endif  /* BPF_AGGREGATOR_H_ */
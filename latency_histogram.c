@@ -0,0 +1,160 @@
+/* A log-linear histogram of durations: see "latency_histogram.h".
+ *
+ * With S = LATENCY_HISTOGRAM_SUB_BUCKET_BITS, a value v whose highest bit is
+ * h (h >= S) is shifted right by h - S, which leaves its S + 1 highest bits,
+ * a "mantissa" in [2^S, 2^(S+1)[, and it is counted in the bucket
+ *
+ *     ((h - S) << S) + mantissa
+ *
+ * so that the powers of two follow each other, 2^S buckets each, after the
+ * 2^(S+1) buckets of width 1 of the values below 2^(S+1) (whose shift is 0,
+ * and bucket, themselves).
+ */
+
+#include <string.h>
+
+#include "latency_histogram.h"
+
+
+static inline unsigned int
+bucket_of_value(unsigned long long value)
+{
+    if (value >> LATENCY_HISTOGRAM_MAX_BITS)
+        return LATENCY_HISTOGRAM_BUCKETS - 1;
+    if (value >> (LATENCY_HISTOGRAM_SUB_BUCKET_BITS + 1) == 0)
+        return (unsigned int)value;
+    unsigned int highest_bit = 63 - __builtin_clzll(value);
+    unsigned int shift = highest_bit - LATENCY_HISTOGRAM_SUB_BUCKET_BITS;
+    return (shift << LATENCY_HISTOGRAM_SUB_BUCKET_BITS) +
+           (unsigned int)(value >> shift);
+}
+
+
+/* The highest value counted in a bucket */
+static inline unsigned long long
+highest_value_of_bucket(unsigned int bucket)
+{
+    if (bucket >> (LATENCY_HISTOGRAM_SUB_BUCKET_BITS + 1) == 0)
+        return bucket;
+    unsigned int shift = (bucket >> LATENCY_HISTOGRAM_SUB_BUCKET_BITS) - 1;
+    unsigned long long mantissa = bucket -
+                                  (shift << LATENCY_HISTOGRAM_SUB_BUCKET_BITS);
+    return ((mantissa + 1) << shift) - 1;
+}
+
+
+static void
+update_max(struct latency_histogram * histogram, unsigned long long value)
+{
+    unsigned long long max = __atomic_load_n(&histogram->max,
+                                             __ATOMIC_RELAXED);
+    while (value > max &&
+           !__atomic_compare_exchange_n(&histogram->max, &max, value, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;   /* "max" was reloaded: retry while "value" is still larger */
+}
+
+
+void
+latency_histogram_record(struct latency_histogram * histogram,
+                         unsigned long long value)
+{
+    __atomic_fetch_add(&histogram->counts[bucket_of_value(value)], 1,
+                       __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->sum, value, __ATOMIC_RELAXED);
+    update_max(histogram, value);
+}
+
+
+void
+latency_histogram_merge(struct latency_histogram * destination,
+                        const struct latency_histogram * source)
+{
+    unsigned int bucket;
+    for (bucket = 0; bucket < LATENCY_HISTOGRAM_BUCKETS; bucket++) {
+        unsigned long long count = __atomic_load_n(&source->counts[bucket],
+                                                   __ATOMIC_RELAXED);
+        if (count > 0)
+            __atomic_fetch_add(&destination->counts[bucket], count,
+                               __ATOMIC_RELAXED);
+    }
+    __atomic_fetch_add(&destination->count,
+                       __atomic_load_n(&source->count, __ATOMIC_RELAXED),
+                       __ATOMIC_RELAXED);
+    __atomic_fetch_add(&destination->sum,
+                       __atomic_load_n(&source->sum, __ATOMIC_RELAXED),
+                       __ATOMIC_RELAXED);
+    update_max(destination, __atomic_load_n(&source->max, __ATOMIC_RELAXED));
+}
+
+
+void
+latency_histogram_drain(struct latency_histogram * destination,
+                        struct latency_histogram * source)
+{
+    unsigned int bucket;
+    for (bucket = 0; bucket < LATENCY_HISTOGRAM_BUCKETS; bucket++) {
+        /* most buckets are empty: don't dirty their cache lines */
+        if (__atomic_load_n(&source->counts[bucket], __ATOMIC_RELAXED) == 0)
+            continue;
+        unsigned long long count = __atomic_exchange_n(&source->counts[bucket],
+                                                       0, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&destination->counts[bucket], count,
+                           __ATOMIC_RELAXED);
+    }
+    __atomic_fetch_add(&destination->count,
+                       __atomic_exchange_n(&source->count, 0,
+                                           __ATOMIC_RELAXED),
+                       __ATOMIC_RELAXED);
+    __atomic_fetch_add(&destination->sum,
+                       __atomic_exchange_n(&source->sum, 0, __ATOMIC_RELAXED),
+                       __ATOMIC_RELAXED);
+    update_max(destination,
+               __atomic_exchange_n(&source->max, 0, __ATOMIC_RELAXED));
+}
+
+
+void
+latency_histogram_reset(struct latency_histogram * histogram)
+{
+    memset(histogram, 0, sizeof *histogram);
+}
+
+
+unsigned long long
+latency_histogram_value_at_quantile(const struct latency_histogram * histogram,
+                                    double quantile)
+{
+    /* the count of the buckets, and not histogram->count, which a drain
+     * during a record may have taken apart from the bucket */
+    unsigned long long total = 0;
+    unsigned int bucket;
+    for (bucket = 0; bucket < LATENCY_HISTOGRAM_BUCKETS; bucket++)
+        total += histogram->counts[bucket];
+    if (total == 0)
+        return 0;
+
+    /* the rank of the value, from 1: ceil(quantile * total) */
+    if (quantile < 0)
+        quantile = 0;
+    double exact_rank = quantile * total;
+    unsigned long long rank = (unsigned long long)exact_rank;
+    if (rank < exact_rank)
+        rank++;
+    if (rank == 0)
+        rank = 1;
+    if (rank > total)
+        rank = total;
+
+    unsigned long long seen = 0;
+    for (bucket = 0; bucket < LATENCY_HISTOGRAM_BUCKETS; bucket++) {
+        seen += histogram->counts[bucket];
+        if (seen >= rank)
+            break;
+    }
+    if (bucket == LATENCY_HISTOGRAM_BUCKETS - 1)
+        return histogram->max;   /* the values too large for the buckets */
+    unsigned long long value = highest_value_of_bucket(bucket);
+    return value < histogram->max ? value : histogram->max;
+}
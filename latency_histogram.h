@@ -0,0 +1,82 @@
+/* A log-linear histogram of durations (in the way of the HdrHistogram), for
+ * the distributions of the latencies that the wrapper measures (the bursts
+ * of the threads on the CPUs, their intervals off the CPUs and in the
+ * run-queue, the segments of the profile), so that their tails are sent as
+ * percentiles, without sending the durations themselves.
+ *
+ * The values (eg., nanoseconds) below 2^(LATENCY_HISTOGRAM_SUB_BUCKET_BITS +
+ * 1) have a bucket each; above, each power of two [2^h, 2^(h+1)[ is split in
+ * 2^LATENCY_HISTOGRAM_SUB_BUCKET_BITS buckets of the same width, so that the
+ * value of a bucket is known to within 1 / 2^LATENCY_HISTOGRAM_SUB_BUCKET_BITS
+ * (3%) of itself, whatever its magnitude. The values of
+ * 2^LATENCY_HISTOGRAM_MAX_BITS and more are counted in the last bucket (but
+ * the maximum is exact).
+ *
+ * A histogram is of a fixed size, with no allocation (eg., "static struct
+ * latency_histogram h;", or inside another structure, zeroed), and its
+ * counters are updated with atomic operations, without a lock: a histogram
+ * can be recorded into by several threads at once, and drained by another
+ * one while they record into it. To avoid the contention of the threads on
+ * its cache lines, each thread can also have a histogram of its own, and
+ * the histograms of the threads be merged (or drained) into one for their
+ * percentiles.
+ */
+
+#ifndef LATENCY_HISTOGRAM_H_
+#define LATENCY_HISTOGRAM_H_
+
+
+#define LATENCY_HISTOGRAM_SUB_BUCKET_BITS   5
+/* 2^44 nanoseconds: almost 5 hours */
+#define LATENCY_HISTOGRAM_MAX_BITS          44
+#define LATENCY_HISTOGRAM_BUCKETS           ((LATENCY_HISTOGRAM_MAX_BITS - \
+                                              LATENCY_HISTOGRAM_SUB_BUCKET_BITS \
+                                              + 1) << \
+                                             LATENCY_HISTOGRAM_SUB_BUCKET_BITS)
+
+
+struct latency_histogram {
+    unsigned long long counts[LATENCY_HISTOGRAM_BUCKETS];
+    unsigned long long count;    /* of all the values */
+    unsigned long long sum;
+    unsigned long long max;
+};
+
+
+/* Add a value to a histogram: lock-free, from any thread */
+void
+latency_histogram_record(struct latency_histogram * histogram,
+                         unsigned long long value);
+
+
+/* Add the values of "source" to "destination" (the values which "source"
+ * gets meanwhile may be added or not) */
+void
+latency_histogram_merge(struct latency_histogram * destination,
+                        const struct latency_histogram * source);
+
+
+/* Move the values of "source" to "destination", leaving "source" empty: each
+ * value recorded meanwhile into "source" is either moved or left for the
+ * next drain, never lost. This is how a window of a histogram which is being
+ * recorded into is taken. */
+void
+latency_histogram_drain(struct latency_histogram * destination,
+                        struct latency_histogram * source);
+
+
+/* Empty a histogram which is not being recorded into */
+void
+latency_histogram_reset(struct latency_histogram * histogram);
+
+
+/* The value at the "quantile" (in [0, 1], eg. 0.999 for the 99.9th
+ * percentile) of the values of a histogram which is not being recorded into:
+ * the highest value of the bucket which holds it, but no more than the
+ * maximum. Returns 0 for an empty histogram. */
+unsigned long long
+latency_histogram_value_at_quantile(const struct latency_histogram * histogram,
+                                    double quantile);
+
+
+#endif  /* LATENCY_HISTOGRAM_H_ */
@@ -0,0 +1,636 @@
+/* The spool of the metrics: see "metric_spool.h".
+ *
+ * The layout of a spool file, of a fixed size:
+ *
+ *     struct metric_spool_header            (the first page)
+ *     names[names_size]    the names, by id, as varint(length) + chars
+ *     ring[ring_size]      the frames
+ *
+ * A frame, which never wraps around the end of the ring (if there isn't
+ * room for it at the end, a zero length there, or less bytes than a length,
+ * says to go on at the start of the ring):
+ *
+ *     uint32_t length      of the whole frame, with this header
+ *     uint32_t n_records
+ *     int64_t  window      the time_t of the window
+ *     records: varint((id - previous id) << 1 | is_double), then the value,
+ *              as a zigzag varint (integers) or as the 8 bytes of a double
+ *
+ * The records are sorted by id, so the deltas are small. "head" and "tail"
+ * are free-running byte positions in the ring (their offset is the position
+ * modulo ring_size): a frame is written at the head, and then the head is
+ * advanced past it, so a crash leaves at most the last frame unwritten.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "metric_spool.h"
+
+
+#define METRIC_SPOOL_VERSION      1
+#define METRIC_SPOOL_HEADER_SIZE  4096
+#define FRAME_HEADER_SIZE         16
+#define MAX_RECORD_SIZE           (10 + 10)   /* two varints of 64 bits */
+
+static const char METRIC_SPOOL_MAGIC[8] = { 'P', 'R', 'N', 'R', 'S', 'P',
+                                            'L', '\0' };
+
+struct metric_spool_header {
+    char     magic[8];
+    uint32_t version;
+    uint32_t n_names;
+    uint64_t file_size;
+    uint64_t names_offset;
+    uint64_t names_size;
+    uint64_t names_used;
+    uint64_t ring_offset;
+    uint64_t ring_size;
+    uint64_t head;
+    uint64_t tail;
+    uint64_t n_frames;
+    uint64_t dropped_frames;
+};
+
+/* a record of the pending frame */
+struct pending_record {
+    uint32_t id;
+    double   value;
+};
+
+struct metric_spool {
+    unsigned char *              image;      /* the mmap'ed file */
+    size_t                       image_size;
+    struct metric_spool_header * header;
+    unsigned char *              names;
+    unsigned char *              ring;
+
+    /* the names by id, NUL-terminated copies, and a hash table of their ids
+     * (open-addressing: the slots are id + 1, 0 is empty) */
+    char **                      name_strings;
+    size_t                       name_capacity;
+    uint32_t *                   name_slots;
+    size_t                       name_slots_mask;
+
+    struct pending_record *      pending;
+    size_t                       n_pending;
+    unsigned char *              frame;      /* where a frame is encoded */
+    unsigned long long           dropped_records;
+};
+
+
+static inline uint64_t
+hash_name(const char * name, size_t len)
+{
+    /* FNV-1a */
+    uint64_t h = 0xcbf29ce484222325ULL;
+    size_t i;
+    for (i = 0; i < len; i++) {
+        h ^= (unsigned char)name[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+
+static size_t
+put_varint(unsigned char * out, uint64_t value)
+{
+    size_t n = 0;
+    while (value >= 0x80) {
+        out[n++] = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    out[n++] = (unsigned char)value;
+    return n;
+}
+
+
+/* Returns the number of bytes read, or 0 if the varint runs past "end" */
+static size_t
+get_varint(const unsigned char * in, const unsigned char * end,
+           uint64_t * out_value)
+{
+    uint64_t value = 0;
+    size_t n = 0;
+    unsigned int shift;
+    for (shift = 0; shift < 64 && in + n < end; shift += 7) {
+        unsigned char byte = in[n++];
+        value |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            *out_value = value;
+            return n;
+        }
+    }
+    return 0;
+}
+
+
+static inline uint64_t
+zigzag_encode(int64_t value)
+{
+    return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+
+static inline int64_t
+zigzag_decode(uint64_t value)
+{
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+
+/* Add the name of id "id" (the next one) to the in-memory tables. Returns
+ * 0, or -1 if it couldn't allocate memory. */
+static int
+index_name(struct metric_spool * spool, uint32_t id, const char * name,
+           size_t len)
+{
+    if (id >= spool->name_capacity) {
+        size_t new_capacity = spool->name_capacity ? 2 * spool->name_capacity
+                                                   : 256;
+        char ** strings = realloc(spool->name_strings,
+                                  new_capacity * sizeof *strings);
+        if (!strings)
+            return -1;
+        spool->name_strings = strings;
+        spool->name_capacity = new_capacity;
+    }
+    char * copy = malloc(len + 1);
+    if (!copy)
+        return -1;
+    memcpy(copy, name, len);
+    copy[len] = '\0';
+    spool->name_strings[id] = copy;
+
+    /* the hash table stays at most half full */
+    if (2 * (id + 1) > spool->name_slots_mask + 1) {
+        size_t new_size = 2 * (spool->name_slots_mask + 1), i;
+        uint32_t * slots = calloc(new_size, sizeof *slots);
+        if (!slots)
+            return -1;
+        for (i = 0; i < id; i++) {
+            const char * other = spool->name_strings[i];
+            size_t slot = hash_name(other, strlen(other)) & (new_size - 1);
+            while (slots[slot])
+                slot = (slot + 1) & (new_size - 1);
+            slots[slot] = (uint32_t)i + 1;
+        }
+        free(spool->name_slots);
+        spool->name_slots = slots;
+        spool->name_slots_mask = new_size - 1;
+    }
+    size_t slot = hash_name(name, len) & spool->name_slots_mask;
+    while (spool->name_slots[slot])
+        slot = (slot + 1) & spool->name_slots_mask;
+    spool->name_slots[slot] = id + 1;
+    return 0;
+}
+
+
+/* The id of the name, adding it to the names table if it is new. Returns
+ * -1 if it is new and the table is full. */
+static int64_t
+name_id(struct metric_spool * spool, const char * name, size_t len)
+{
+    size_t slot = hash_name(name, len) & spool->name_slots_mask;
+    uint32_t entry;
+    while ((entry = spool->name_slots[slot]) != 0) {
+        const char * other = spool->name_strings[entry - 1];
+        if (strncmp(other, name, len) == 0 && other[len] == '\0')
+            return entry - 1;
+        slot = (slot + 1) & spool->name_slots_mask;
+    }
+
+    struct metric_spool_header * header = spool->header;
+    unsigned char encoded_len[10];
+    size_t len_size = put_varint(encoded_len, len);
+    if (header->names_used + len_size + len > header->names_size)
+        return -1;
+    uint32_t id = header->n_names;
+    if (index_name(spool, id, name, len) != 0)
+        return -1;
+    memcpy(spool->names + header->names_used, encoded_len, len_size);
+    memcpy(spool->names + header->names_used + len_size, name, len);
+    header->names_used += len_size + len;
+    header->n_names = id + 1;
+    return id;
+}
+
+
+/* Empty the names table, in the file and in memory. Only when no frame nor
+ * pending record refers to its ids: the names of the metrics change over
+ * time (eg., they have tids), so that it would otherwise end up full, and
+ * then drop all the new names. */
+static void
+reset_names(struct metric_spool * spool)
+{
+    uint32_t id;
+    for (id = 0; id < spool->header->n_names && id < spool->name_capacity;
+         id++)
+        free(spool->name_strings[id]);
+    memset(spool->name_slots, 0,
+           (spool->name_slots_mask + 1) * sizeof *spool->name_slots);
+    spool->header->n_names = 0;
+    spool->header->names_used = 0;
+}
+
+
+/* Load the names table of an existing file. Returns 0, or -1 if it is
+ * corrupted. */
+static int
+load_names(struct metric_spool * spool)
+{
+    const struct metric_spool_header * header = spool->header;
+    const unsigned char * p = spool->names;
+    const unsigned char * end = spool->names + header->names_used;
+    uint32_t id;
+    for (id = 0; id < header->n_names; id++) {
+        uint64_t len;
+        size_t n = get_varint(p, end, &len);
+        if (n == 0 || len > METRIC_SPOOL_MAX_NAME_LEN ||
+            len > (uint64_t)(end - p - n))
+            return -1;
+        if (index_name(spool, id, (const char *)p + n, (size_t)len) != 0)
+            return -1;
+        p += n + len;
+    }
+    return 0;
+}
+
+
+static void
+init_header(struct metric_spool_header * header, size_t file_size)
+{
+    memset(header, 0, sizeof *header);
+    memcpy(header->magic, METRIC_SPOOL_MAGIC, sizeof header->magic);
+    header->version = METRIC_SPOOL_VERSION;
+    header->file_size = file_size;
+    /* 1/16 of the file for the names, from 64 KB to 4 MB */
+    uint64_t names_size = file_size / 16;
+    if (names_size < 64 * 1024)
+        names_size = 64 * 1024;
+    if (names_size > 4 * 1024 * 1024)
+        names_size = 4 * 1024 * 1024;
+    header->names_offset = METRIC_SPOOL_HEADER_SIZE;
+    header->names_size = names_size;
+    header->ring_offset = METRIC_SPOOL_HEADER_SIZE + names_size;
+    header->ring_size = file_size - header->ring_offset;
+}
+
+
+static int
+header_is_valid(const struct metric_spool_header * header, size_t file_size)
+{
+    return memcmp(header->magic, METRIC_SPOOL_MAGIC,
+                  sizeof header->magic) == 0 &&
+           header->version == METRIC_SPOOL_VERSION &&
+           header->file_size == file_size &&
+           header->names_offset == METRIC_SPOOL_HEADER_SIZE &&
+           header->names_used <= header->names_size &&
+           header->ring_offset == header->names_offset + header->names_size &&
+           header->ring_offset + header->ring_size == file_size &&
+           header->tail <= header->head &&
+           header->head - header->tail <= header->ring_size;
+}
+
+
+struct metric_spool *
+metric_spool_open(const char * fname, size_t max_size)
+{
+    if (max_size < METRIC_SPOOL_MIN_SIZE) {
+        errno = EINVAL;
+        return NULL;
+    }
+    max_size &= ~(size_t)(METRIC_SPOOL_HEADER_SIZE - 1);
+
+    int fd = open(fname, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0)
+        return NULL;
+    struct stat st;
+    int is_new = 0;
+    if (fstat(fd, &st) != 0)
+        goto error_opening_spool;
+    if ((size_t)st.st_size != max_size) {
+        /* a new file, or one of another size: it is re-created */
+        if (ftruncate(fd, 0) != 0 || ftruncate(fd, (off_t)max_size) != 0)
+            goto error_opening_spool;
+        is_new = 1;
+    }
+
+    unsigned char * image = mmap(NULL, max_size, PROT_READ | PROT_WRITE,
+                                 MAP_SHARED, fd, 0);
+    if (image == MAP_FAILED)
+        goto error_opening_spool;
+    close(fd);
+
+    struct metric_spool * spool = calloc(1, sizeof *spool);
+    if (!spool) {
+        munmap(image, max_size);
+        errno = ENOMEM;
+        return NULL;
+    }
+    spool->image = image;
+    spool->image_size = max_size;
+    spool->header = (struct metric_spool_header *)image;
+    spool->name_slots = calloc(256, sizeof *spool->name_slots);
+    spool->name_slots_mask = 255;
+    spool->pending = malloc(METRIC_SPOOL_MAX_FRAME_RECORDS *
+                            sizeof *spool->pending);
+    spool->frame = malloc(FRAME_HEADER_SIZE +
+                          METRIC_SPOOL_MAX_FRAME_RECORDS * MAX_RECORD_SIZE);
+    if (!spool->name_slots || !spool->pending || !spool->frame) {
+        metric_spool_close(spool);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    if (!is_new && !header_is_valid(spool->header, max_size)) {
+        fprintf(stderr, "DEBUG: spool '%s' is not valid: re-creating it\n",
+                fname);
+        is_new = 1;
+    }
+    if (is_new)
+        init_header(spool->header, max_size);
+    spool->names = image + spool->header->names_offset;
+    spool->ring = image + spool->header->ring_offset;
+    if (!is_new && load_names(spool) != 0) {
+        fprintf(stderr, "DEBUG: the names of the spool '%s' are corrupted: "
+                        "re-creating it\n", fname);
+        reset_names(spool);
+        init_header(spool->header, max_size);
+    }
+    return spool;
+
+error_opening_spool:
+    {
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+    }
+    return NULL;
+}
+
+
+void
+metric_spool_close(struct metric_spool * spool)
+{
+    if (!spool)
+        return;
+    if (spool->n_pending > 0)
+        metric_spool_commit(spool, time(NULL));
+    uint32_t n_names = spool->header ? spool->header->n_names : 0, id;
+    if (spool->image) {
+        msync(spool->image, spool->image_size, MS_SYNC);
+        munmap(spool->image, spool->image_size);
+    }
+    for (id = 0; id < n_names && id < spool->name_capacity; id++)
+        free(spool->name_strings[id]);
+    free(spool->name_strings);
+    free(spool->name_slots);
+    free(spool->pending);
+    free(spool->frame);
+    free(spool);
+}
+
+
+int
+metric_spool_add(struct metric_spool * spool, const char * name,
+                 double value)
+{
+    size_t len = strlen(name);
+    if (len > METRIC_SPOOL_MAX_NAME_LEN) {
+        spool->dropped_records++;
+        return -1;
+    }
+    int64_t id = name_id(spool, name, len);
+    if (id < 0 && spool->n_pending == 0 && metric_spool_is_empty(spool)) {
+        /* the table is full, but none of its names is used any more */
+        reset_names(spool);
+        id = name_id(spool, name, len);
+    }
+    if (id < 0) {
+        spool->dropped_records++;
+        return -1;
+    }
+    if (spool->n_pending == METRIC_SPOOL_MAX_FRAME_RECORDS)
+        metric_spool_commit(spool, time(NULL));
+    spool->pending[spool->n_pending].id = (uint32_t)id;
+    spool->pending[spool->n_pending++].value = value;
+    return 0;
+}
+
+
+static int
+compare_pending_records(const void * a, const void * b)
+{
+    const struct pending_record * ra = a;
+    const struct pending_record * rb = b;
+    return ra->id < rb->id ? -1 : ra->id > rb->id;
+}
+
+
+/* The length of the frame at the tail, after skipping to the start of the
+ * ring if the tail is at a wrap; 0 if the ring is empty */
+static uint32_t
+tail_frame_length(struct metric_spool * spool)
+{
+    struct metric_spool_header * header = spool->header;
+    while (header->tail < header->head) {
+        uint64_t offset = header->tail % header->ring_size;
+        uint32_t length = 0;
+        if (offset + sizeof length <= header->ring_size)
+            memcpy(&length, spool->ring + offset, sizeof length);
+        if (length >= FRAME_HEADER_SIZE &&
+            offset + length <= header->ring_size &&
+            header->tail + length <= header->head)
+            return length;
+        if (length != 0 && offset + sizeof length <= header->ring_size) {
+            /* corrupted: drop all the rest */
+            header->tail = header->head;
+            header->n_frames = 0;
+            return 0;
+        }
+        header->tail += header->ring_size - offset;   /* the wrap */
+    }
+    return 0;
+}
+
+
+static void
+drop_tail_frame(struct metric_spool * spool)
+{
+    uint32_t length = tail_frame_length(spool);
+    if (length == 0)
+        return;
+    spool->header->tail += length;
+    if (spool->header->n_frames > 0)
+        spool->header->n_frames--;
+}
+
+
+int
+metric_spool_commit(struct metric_spool * spool, time_t window)
+{
+    if (spool->n_pending == 0)
+        return 0;
+    struct metric_spool_header * header = spool->header;
+
+    /* encode the frame, and then copy it into the ring, where its length
+     * is known to fit */
+    qsort(spool->pending, spool->n_pending, sizeof *spool->pending,
+          compare_pending_records);
+    unsigned char * frame = spool->frame;
+    size_t length = FRAME_HEADER_SIZE, i;
+    uint32_t previous_id = 0;
+    for (i = 0; i < spool->n_pending; i++) {
+        const struct pending_record * record = &spool->pending[i];
+        double value = record->value;
+        int is_integer = value > -9e15 && value < 9e15 &&
+                         (double)(int64_t)value == value;
+        length += put_varint(frame + length,
+                             (uint64_t)(record->id - previous_id) << 1 |
+                             !is_integer);
+        if (is_integer) {
+            length += put_varint(frame + length,
+                                 zigzag_encode((int64_t)value));
+        } else {
+            memcpy(frame + length, &value, sizeof value);
+            length += sizeof value;
+        }
+        previous_id = record->id;
+    }
+    uint32_t frame_length = (uint32_t)length;
+    uint32_t n_records = (uint32_t)spool->n_pending;
+    int64_t frame_window = (int64_t)window;
+    memcpy(frame, &frame_length, sizeof frame_length);
+    memcpy(frame + 4, &n_records, sizeof n_records);
+    memcpy(frame + 8, &frame_window, sizeof frame_window);
+    spool->n_pending = 0;
+
+    if (length > header->ring_size / 2) {
+        spool->dropped_records += n_records;
+        return -1;
+    }
+
+    /* where the frame goes: at the head, or at the start of the ring if it
+     * doesn't fit before the end */
+    uint64_t start = header->head;
+    uint64_t offset = start % header->ring_size;
+    if (offset + length > header->ring_size)
+        start += header->ring_size - offset;
+    /* make room: drop the oldest frames */
+    while (start + length - header->tail > header->ring_size &&
+           header->tail < header->head) {
+        drop_tail_frame(spool);
+        header->dropped_frames++;
+        if (header->tail == header->head)
+            break;
+    }
+    if (header->tail == header->head)
+        header->tail = header->head = start;   /* it is empty */
+
+    offset = start % header->ring_size;
+    if (start != header->head) {
+        uint64_t head_offset = header->head % header->ring_size;
+        if (head_offset + sizeof(uint32_t) <= header->ring_size)
+            memset(spool->ring + head_offset, 0, sizeof(uint32_t));
+    }
+    memcpy(spool->ring + offset, frame, length);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    header->head = start + length;
+    header->n_frames++;
+    return 0;
+}
+
+
+int
+metric_spool_is_empty(const struct metric_spool * spool)
+{
+    return spool->header->tail == spool->header->head;
+}
+
+
+int
+metric_spool_peek(struct metric_spool * spool, time_t * out_window,
+                  struct metric_spool_record * out_records)
+{
+    for (;;) {
+        uint32_t length = tail_frame_length(spool);
+        if (length == 0)
+            return -1;
+
+        const unsigned char * frame = spool->ring + spool->header->tail %
+                                                    spool->header->ring_size;
+        const unsigned char * end = frame + length;
+        uint32_t n_records;
+        int64_t window;
+        memcpy(&n_records, frame + 4, sizeof n_records);
+        memcpy(&window, frame + 8, sizeof window);
+
+        const unsigned char * p = frame + FRAME_HEADER_SIZE;
+        uint64_t id = 0;
+        uint32_t i;
+        for (i = 0; i < n_records && i < METRIC_SPOOL_MAX_FRAME_RECORDS;
+             i++) {
+            uint64_t tagged_delta, encoded;
+            size_t n = get_varint(p, end, &tagged_delta);
+            if (n == 0)
+                break;
+            p += n;
+            id += tagged_delta >> 1;
+            if (id >= spool->header->n_names)
+                break;
+            if (tagged_delta & 1) {
+                if (end - p < (long)sizeof(double))
+                    break;
+                memcpy(&out_records[i].value, p, sizeof(double));
+                p += sizeof(double);
+            } else {
+                if ((n = get_varint(p, end, &encoded)) == 0)
+                    break;
+                p += n;
+                out_records[i].value = (double)zigzag_decode(encoded);
+            }
+            out_records[i].name = spool->name_strings[id];
+        }
+        if (i == n_records) {
+            *out_window = (time_t)window;
+            return (int)n_records;
+        }
+
+        fprintf(stderr, "DEBUG: spool: dropping a corrupted frame\n");
+        drop_tail_frame(spool);
+        spool->header->dropped_frames++;
+    }
+}
+
+
+void
+metric_spool_pop(struct metric_spool * spool)
+{
+    drop_tail_frame(spool);
+    if (spool->n_pending == 0 && metric_spool_is_empty(spool))
+        reset_names(spool);
+}
+
+
+void
+metric_spool_get_stats(const struct metric_spool * spool,
+                       struct metric_spool_stats * out_stats)
+{
+    const struct metric_spool_header * header = spool->header;
+    out_stats->frames = header->n_frames;
+    out_stats->used_bytes = header->head - header->tail;
+    out_stats->ring_bytes = header->ring_size;
+    out_stats->names = header->n_names;
+    out_stats->dropped_frames = header->dropped_frames;
+    out_stats->dropped_records = spool->dropped_records;
+}
@@ -0,0 +1,112 @@
+
+/* A local spool of the numeric metrics and attributes which couldn't be sent
+ * to New Relic (eg., the collector is unreachable), and which are replayed
+ * to it once it is reachable again.
+ *
+ * The spool is a file of a fixed size, mapped in memory, which holds an
+ * append-only ring of frames: a frame is the batch of the records of a
+ * window (the time they were uploaded), and a record is the (metric id,
+ * value) of a metric. The names of the metrics are kept once, in a table at
+ * the start of the file, and the records refer to them by their ids: the
+ * ids are sorted and delta-encoded in varints, and the values which are
+ * integers (eg., the numbers of samples) are zigzag varints too, so that a
+ * record takes a few bytes instead of the hundreds of a "perf.data".
+ *
+ * The size is a hard cap: when the ring is full, the oldest frames are
+ * dropped to make room for the new ones, so that a long outage never fills
+ * the disk. The names table is emptied whenever the ring is (all of its
+ * frames were replayed), so that the names which change over time (eg.,
+ * with the tids of the threads) don't fill it for good. The file survives
+ * the restarts of the wrapper: its frames are replayed by the next run.
+ *
+ * A spool is not thread-safe: it is used only by the uploader thread.
+ */
+
+#ifndef METRIC_SPOOL_H_
+#define METRIC_SPOOL_H_
+
+#include <stddef.h>
+#include <time.h>
+
+
+#define METRIC_SPOOL_DEFAULT_SIZE      (64 * 1024 * 1024)
+#define METRIC_SPOOL_MIN_SIZE          (1024 * 1024)
+#define METRIC_SPOOL_MAX_NAME_LEN      255
+#define METRIC_SPOOL_MAX_FRAME_RECORDS 4096   /* then the frame is committed */
+
+
+struct metric_spool;
+
+
+/* A record of a frame, as decoded by metric_spool_peek(): the name is owned
+ * by the spool, and lives till metric_spool_close() */
+struct metric_spool_record {
+    const char * name;
+    double       value;
+};
+
+
+struct metric_spool_stats {
+    unsigned long long frames;            /* in the ring now */
+    unsigned long long used_bytes;        /* of the ring */
+    unsigned long long ring_bytes;
+    unsigned int       names;
+    unsigned long long dropped_frames;    /* the oldest ones, for room */
+    unsigned long long dropped_records;   /* the names table was full */
+};
+
+
+/* Open the spool file "fname" (creating it, or re-creating it if it is not
+ * a spool of the same size), of "max_size" bytes in total. Returns NULL with
+ * errno set on error. */
+struct metric_spool *
+metric_spool_open(const char * fname, size_t max_size);
+
+
+/* Commit the pending frame, sync the file and close it */
+void
+metric_spool_close(struct metric_spool * spool);
+
+
+/* Add the metric "name" = "value" to the pending frame (committing it first
+ * if it is full). Returns 0, or -1 if the record was dropped: its name is
+ * too long, or its name is new and the names table is full (it is emptied
+ * first if no frame nor pending record refers to it). */
+int
+metric_spool_add(struct metric_spool * spool, const char * name,
+                 double value);
+
+
+/* Write the pending frame, if any, into the ring, as the window "window",
+ * dropping the oldest frames if there is no room. Returns 0, or -1 if the
+ * frame couldn't be written (it is dropped). */
+int
+metric_spool_commit(struct metric_spool * spool, time_t window);
+
+
+/* Non-zero if the ring has no frame to replay */
+int
+metric_spool_is_empty(const struct metric_spool * spool);
+
+
+/* Decode the oldest frame of the ring, without removing it: its window and
+ * its records, into out_records[] (of METRIC_SPOOL_MAX_FRAME_RECORDS).
+ * Returns the number of records, or -1 if the ring is empty (a corrupted
+ * frame is dropped, and the next one is decoded). */
+int
+metric_spool_peek(struct metric_spool * spool, time_t * out_window,
+                  struct metric_spool_record * out_records);
+
+
+/* Remove the oldest frame, once it was replayed (and the names, if it was
+ * the last one and there is no pending record) */
+void
+metric_spool_pop(struct metric_spool * spool);
+
+
+void
+metric_spool_get_stats(const struct metric_spool * spool,
+                       struct metric_spool_stats * out_stats);
+
+
+#endif  /* METRIC_SPOOL_H_ */
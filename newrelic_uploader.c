@@ -0,0 +1,543 @@
+
+/* The asynchronous uploader to New Relic: see "newrelic_uploader.h".
+ *
+ * The ring has a power-of-two number of slots, and two free-running
+ * counters: "head", written only by the producer, and "tail", written only by
+ * the consumer. The producer fills the slot head % capacity and then
+ * publishes it with a release store of head+1; the consumer reads it after an
+ * acquire load of head, and gives it back with a release store of tail
+ * (once per batch, not once per record).
+ *
+ * When the ring is empty, the uploader thread sleeps on an eventfd, which the
+ * producer writes only if the consumer said it was going to sleep, so that
+ * the producer makes no system-call per record while the uploader is busy.
+ *
+ * The spool is used only by the uploader thread: while the collector is not
+ * reachable, each batch of the metrics (and of the numeric attributes) is a
+ * frame of the spool, and the spooled frames are replayed when the thread
+ * would otherwise sleep, one per wake-up (at most 10 per second).
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "newrelic_transaction.h"
+
+#include "newrelic_uploader.h"
+
+
+/* After a failed call to the SDK, the collector is taken as not reachable
+ * for this long, before the replay of the spool tries it again */
+#define SPOOL_RETRY_SECONDS  30
+
+/* The records spooled in this many seconds make one frame (one window) of
+ * the spool */
+#define SPOOL_FRAME_SECONDS  5
+
+
+enum upload_record_type {
+    UPLOAD_ATTRIBUTE,
+    UPLOAD_METRIC,
+    UPLOAD_TRANSACTION_END
+};
+
+struct upload_record {
+    enum upload_record_type type;
+    long                    transaction_id;
+    double                  metric_value;
+    char                    name[NEWRELIC_UPLOADER_NAME_SIZE];
+    char                    value[NEWRELIC_UPLOADER_VALUE_SIZE];
+};
+
+
+struct newrelic_uploader {
+    /* the producer and the consumer sides are in different cache lines */
+    _Alignas(64) atomic_size_t head;
+    unsigned long long         dropped;         /* written by the producer */
+    size_t                     peak_queued;     /* written by the producer */
+    _Alignas(64) atomic_size_t tail;
+    _Alignas(64) atomic_int    consumer_sleeping;
+    atomic_int                 stopping;
+
+    int                        wakeup_fd;       /* eventfd */
+    pthread_t                  thread;
+    size_t                     mask;            /* capacity - 1 */
+    struct upload_record *     ring;
+
+    /* the spool, and the state of the collector, used by the consumer */
+    struct metric_spool *        spool;
+    atomic_int                   reachable;     /* from the status callback */
+    time_t                       failed_until;  /* after a failed SDK call */
+    time_t                       frame_start;   /* of the pending frame */
+    struct metric_spool_record * replayed;      /* a frame being replayed */
+    unsigned long long           spooled;
+    unsigned long long           unspoolable;   /* non-numeric attributes */
+    unsigned long long           replayed_frames;
+
+    /* recorded into by the consumer, drained by the producer */
+    struct latency_histogram     sdk_latencies;
+};
+
+
+/* The durations of the synchronous calls to the SDK, without an uploader */
+static struct latency_histogram synchronous_sdk_latencies;
+
+
+/* Returns the return code of the SDK call, whose duration is recorded into
+ * "latencies" */
+static int
+upload_record_to_NewRelic(const struct upload_record * record,
+                          struct latency_histogram * latencies)
+{
+    int ret_code = 0;
+    const char * sdk_call = "";
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    switch (record->type) {
+    case UPLOAD_ATTRIBUTE:
+        sdk_call = "newrelic_transaction_add_attribute()";
+        ret_code = newrelic_transaction_add_attribute(record->transaction_id,
+                                                      record->name,
+                                                      record->value);
+        break;
+    case UPLOAD_METRIC:
+        sdk_call = "newrelic_record_metric()";
+        ret_code = newrelic_record_metric(record->name, record->metric_value);
+        break;
+    case UPLOAD_TRANSACTION_END:
+        sdk_call = "newrelic_transaction_end()";
+        fprintf(stderr, "DEBUG: about to call newrelic_transaction_end()\n");
+        ret_code = newrelic_transaction_end(record->transaction_id);
+        break;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    latency_histogram_record(latencies,
+                     (unsigned long long)(end.tv_sec - start.tv_sec) *
+                     1000000000ULL + end.tv_nsec - start.tv_nsec);
+
+    if (ret_code < 0)
+        fprintf(stderr, "ERROR: %s returned %d\n", sdk_call, ret_code);
+    return ret_code;
+}
+
+
+static int
+collector_is_reachable(const struct newrelic_uploader * uploader)
+{
+    return atomic_load(&uploader->reachable) &&
+           time(NULL) >= uploader->failed_until;
+}
+
+
+/* Add a metric, or an attribute whose value is a number, to the pending
+ * frame of the spool (the other attributes, eg., the names of the events
+ * or the folded stacks, can't be spooled) */
+static void
+spool_record(struct newrelic_uploader * uploader,
+             const struct upload_record * record)
+{
+    double value = record->metric_value;
+    if (record->type == UPLOAD_ATTRIBUTE) {
+        char * end;
+        value = strtod(record->value, &end);
+        if (end == record->value || *end != '\0') {
+            uploader->unspoolable++;
+            return;
+        }
+    }
+    if (metric_spool_add(uploader->spool, record->name, value) == 0) {
+        uploader->spooled++;
+        if (uploader->frame_start == 0)
+            uploader->frame_start = time(NULL);
+    }
+}
+
+
+/* Commit the pending frame of the spool, if it is old enough (or "force") */
+static void
+commit_spool_frame(struct newrelic_uploader * uploader, int force)
+{
+    if (!uploader->spool || uploader->frame_start == 0 ||
+        (!force && time(NULL) - uploader->frame_start < SPOOL_FRAME_SECONDS))
+        return;
+    metric_spool_commit(uploader->spool, uploader->frame_start);
+    uploader->frame_start = 0;
+}
+
+
+/* Send the oldest window of the spool as a transaction. It is removed from
+ * the spool only if all the SDK calls succeeded. */
+static void
+replay_spooled_window(struct newrelic_uploader * uploader)
+{
+    time_t window;
+    int n_records = metric_spool_peek(uploader->spool, &window,
+                                      uploader->replayed);
+    if (n_records < 0)
+        return;
+
+    long transaction_id = newrelic_transaction_begin();
+    if (transaction_id < 0) {
+        fprintf(stderr, "ERROR: newrelic_transaction_begin() returned %ld\n",
+                transaction_id);
+        uploader->failed_until = time(NULL) + SPOOL_RETRY_SECONDS;
+        return;
+    }
+    int failed = newrelic_transaction_set_type_other(transaction_id) < 0 ||
+                 newrelic_transaction_set_name(transaction_id,
+                                     "Linux Perf Counters/spooled") < 0 ||
+                 newrelic_transaction_set_category(transaction_id,
+                                     "BackendTrans/Perf/counters") < 0;
+    char value[64];
+    snprintf(value, sizeof value, "%lld", (long long)window);
+    failed = failed || newrelic_transaction_add_attribute(transaction_id,
+                                             "ct_tx_start_time", value) < 0;
+    int i;
+    for (i = 0; i < n_records && !failed; i++) {
+        snprintf(value, sizeof value, "%.15g", uploader->replayed[i].value);
+        failed = newrelic_transaction_add_attribute(transaction_id,
+                                             uploader->replayed[i].name,
+                                             value) < 0;
+    }
+    failed = newrelic_transaction_end(transaction_id) < 0 || failed;
+
+    if (failed) {
+        fprintf(stderr, "ERROR: the replay of the spool failed: retrying it "
+                        "in %d seconds\n", SPOOL_RETRY_SECONDS);
+        uploader->failed_until = time(NULL) + SPOOL_RETRY_SECONDS;
+        return;
+    }
+    metric_spool_pop(uploader->spool);
+    uploader->replayed_frames++;
+}
+
+
+/* Upload a record, or spool it if the collector is not reachable */
+static void
+upload_or_spool_record(struct newrelic_uploader * uploader,
+                       const struct upload_record * record)
+{
+    /* the ends of the transactions are always given to the SDK, so that no
+     * transaction is left open in it */
+    int spoolable = uploader->spool && record->type != UPLOAD_TRANSACTION_END;
+    if (spoolable && !collector_is_reachable(uploader)) {
+        spool_record(uploader, record);
+        return;
+    }
+    if (upload_record_to_NewRelic(record, &uploader->sdk_latencies) < 0 && spoolable) {
+        uploader->failed_until = time(NULL) + SPOOL_RETRY_SECONDS;
+        spool_record(uploader, record);
+    }
+}
+
+
+static void *
+uploader_thread(void * arg)
+{
+    struct newrelic_uploader * uploader = arg;
+
+    for (;;) {
+        size_t tail = atomic_load_explicit(&uploader->tail,
+                                           memory_order_relaxed);
+        size_t head = atomic_load_explicit(&uploader->head,
+                                           memory_order_acquire);
+        if (head != tail) {
+            /* a batch: all the records published till now */
+            for (; tail != head; tail++)
+                upload_or_spool_record(uploader,
+                                       &uploader->ring[tail & uploader->mask]);
+            atomic_store_explicit(&uploader->tail, tail, memory_order_release);
+            commit_spool_frame(uploader, 0);
+            continue;
+        }
+
+        if (atomic_load(&uploader->stopping)) {
+            commit_spool_frame(uploader, 1);
+            break;
+        }
+        commit_spool_frame(uploader, 0);
+
+        /* nothing else to upload: the time to replay the spool */
+        if (uploader->spool && !metric_spool_is_empty(uploader->spool) &&
+            collector_is_reachable(uploader))
+            replay_spooled_window(uploader);
+
+        /* the ring is empty: say that we are going to sleep, and check it
+         * again, in case the producer published a record before seeing it */
+        atomic_store(&uploader->consumer_sleeping, 1);
+        if (atomic_load(&uploader->head) == tail &&
+            !atomic_load(&uploader->stopping)) {
+            struct pollfd pfd = { uploader->wakeup_fd, POLLIN, 0 };
+            if (poll(&pfd, 1, 100) > 0) {
+                uint64_t count;
+                if (read(uploader->wakeup_fd, &count, sizeof count) < 0 &&
+                    errno != EAGAIN)
+                    fprintf(stderr, "ERROR: read(eventfd) of the uploader: "
+                                    "%s\n", strerror(errno));
+            }
+        }
+        atomic_store(&uploader->consumer_sleeping, 0);
+    }
+    return NULL;
+}
+
+
+static void
+wake_up_consumer(struct newrelic_uploader * uploader)
+{
+    if (atomic_load(&uploader->consumer_sleeping)) {
+        uint64_t one = 1;
+        if (write(uploader->wakeup_fd, &one, sizeof one) < 0)
+            fprintf(stderr, "ERROR: write(eventfd) of the uploader: %s\n",
+                    strerror(errno));
+    }
+}
+
+
+struct newrelic_uploader *
+newrelic_uploader_start(size_t capacity, struct metric_spool * spool,
+                        int reachable)
+{
+    size_t ring_size = 1;
+    while (ring_size < capacity)
+        ring_size <<= 1;
+
+    struct newrelic_uploader * uploader = aligned_alloc(64,
+                                   (sizeof *uploader + 63) / 64 * 64);
+    if (!uploader)
+        return NULL;
+    memset(uploader, 0, sizeof *uploader);
+    atomic_init(&uploader->head, 0);
+    atomic_init(&uploader->tail, 0);
+    atomic_init(&uploader->consumer_sleeping, 0);
+    atomic_init(&uploader->stopping, 0);
+    atomic_init(&uploader->reachable, reachable != 0);
+    uploader->mask = ring_size - 1;
+    uploader->ring = calloc(ring_size, sizeof *uploader->ring);
+    uploader->wakeup_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (!uploader->ring || uploader->wakeup_fd < 0)
+        goto error_starting_uploader;
+    if (spool) {
+        uploader->spool = spool;
+        uploader->replayed = malloc(METRIC_SPOOL_MAX_FRAME_RECORDS *
+                                    sizeof *uploader->replayed);
+        if (!uploader->replayed)
+            goto error_starting_uploader;
+    }
+
+    int err = pthread_create(&uploader->thread, NULL, uploader_thread,
+                             uploader);
+    if (err != 0) {
+        fprintf(stderr, "ERROR: pthread_create() of the uploader: %s\n",
+                strerror(err));
+        goto error_starting_uploader;
+    }
+    return uploader;
+
+error_starting_uploader:
+    if (uploader->wakeup_fd >= 0)
+        close(uploader->wakeup_fd);
+    free(uploader->ring);
+    free(uploader->replayed);
+    free(uploader);
+    return NULL;
+}
+
+
+void
+newrelic_uploader_set_reachable(struct newrelic_uploader * uploader,
+                                int reachable)
+{
+    if (!uploader)
+        return;
+    atomic_store(&uploader->reachable, reachable != 0);
+    if (reachable)
+        wake_up_consumer(uploader);   /* to replay the spool */
+}
+
+
+/* The next free slot of the ring, or NULL if it is full */
+static struct upload_record *
+reserve_slot(struct newrelic_uploader * uploader)
+{
+    size_t head = atomic_load_explicit(&uploader->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&uploader->tail, memory_order_acquire);
+    if (head - tail > uploader->mask)
+        return NULL;
+    return &uploader->ring[head & uploader->mask];
+}
+
+
+static void
+publish_slot(struct newrelic_uploader * uploader)
+{
+    size_t head = atomic_load_explicit(&uploader->head, memory_order_relaxed);
+    size_t queued = head + 1 - atomic_load_explicit(&uploader->tail,
+                                                     memory_order_relaxed);
+    if (queued > uploader->peak_queued)
+        uploader->peak_queued = queued;
+    /* seq_cst, against the store of consumer_sleeping by the consumer */
+    atomic_store(&uploader->head, head + 1);
+    wake_up_consumer(uploader);
+}
+
+
+static void
+copy_string(char * dest, size_t dest_size, const char * src)
+{
+    size_t len = strlen(src);
+    if (len >= dest_size)
+        len = dest_size - 1;
+    memcpy(dest, src, len);
+    dest[len] = '\0';
+}
+
+
+int
+newrelic_uploader_add_attribute(struct newrelic_uploader * uploader,
+                                long transaction_id, const char * name,
+                                const char * value)
+{
+    struct upload_record record;
+    struct upload_record * slot = uploader ? reserve_slot(uploader) : &record;
+    if (!slot) {
+        uploader->dropped++;
+        return -1;
+    }
+
+    slot->type = UPLOAD_ATTRIBUTE;
+    slot->transaction_id = transaction_id;
+    copy_string(slot->name, sizeof slot->name, name);
+    copy_string(slot->value, sizeof slot->value, value);
+
+    if (uploader)
+        publish_slot(uploader);
+    else
+        upload_record_to_NewRelic(slot, &synchronous_sdk_latencies);
+    return 0;
+}
+
+
+int
+newrelic_uploader_record_metric(struct newrelic_uploader * uploader,
+                                const char * name, double value)
+{
+    struct upload_record record;
+    struct upload_record * slot = uploader ? reserve_slot(uploader) : &record;
+    if (!slot) {
+        uploader->dropped++;
+        return -1;
+    }
+
+    slot->type = UPLOAD_METRIC;
+    slot->transaction_id = 0;
+    slot->metric_value = value;
+    copy_string(slot->name, sizeof slot->name, name);
+
+    if (uploader)
+        publish_slot(uploader);
+    else
+        upload_record_to_NewRelic(slot, &synchronous_sdk_latencies);
+    return 0;
+}
+
+
+int
+newrelic_uploader_end_transaction(struct newrelic_uploader * uploader,
+                                  long transaction_id)
+{
+    struct upload_record record;
+    struct upload_record * slot = uploader ? reserve_slot(uploader) : &record;
+    while (!slot) {
+        /* never drop the end of a transaction: wait for the uploader */
+        wake_up_consumer(uploader);
+        sched_yield();
+        slot = reserve_slot(uploader);
+    }
+
+    slot->type = UPLOAD_TRANSACTION_END;
+    slot->transaction_id = transaction_id;
+
+    if (uploader)
+        publish_slot(uploader);
+    else
+        upload_record_to_NewRelic(slot, &synchronous_sdk_latencies);
+    return 0;
+}
+
+
+unsigned long long
+newrelic_uploader_dropped(const struct newrelic_uploader * uploader)
+{
+    return uploader ? uploader->dropped : 0;
+}
+
+
+void
+newrelic_uploader_take_stats(struct newrelic_uploader * uploader,
+                             struct newrelic_uploader_stats * out_stats)
+{
+    memset(out_stats, 0, sizeof *out_stats);
+    if (!uploader)
+        return;
+    size_t head = atomic_load_explicit(&uploader->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&uploader->tail, memory_order_relaxed);
+    out_stats->queued = head - tail;
+    out_stats->peak_queued = uploader->peak_queued > out_stats->queued ?
+                             uploader->peak_queued : out_stats->queued;
+    out_stats->dropped = uploader->dropped;
+    uploader->peak_queued = out_stats->queued;
+}
+
+
+struct latency_histogram *
+newrelic_uploader_sdk_latencies(struct newrelic_uploader * uploader)
+{
+    return uploader ? &uploader->sdk_latencies : &synchronous_sdk_latencies;
+}
+
+
+void
+newrelic_uploader_stop(struct newrelic_uploader * uploader)
+{
+    if (!uploader)
+        return;
+
+    atomic_store(&uploader->stopping, 1);
+    uint64_t one = 1;
+    if (write(uploader->wakeup_fd, &one, sizeof one) < 0)
+        fprintf(stderr, "ERROR: write(eventfd) of the uploader: %s\n",
+                strerror(errno));
+    pthread_join(uploader->thread, NULL);
+
+    if (uploader->dropped > 0)
+        fprintf(stderr, "DEBUG: uploader: %llu records dropped, the queue "
+                        "was full\n", uploader->dropped);
+    if (uploader->spool) {
+        struct metric_spool_stats stats;
+        metric_spool_get_stats(uploader->spool, &stats);
+        fprintf(stderr, "DEBUG: spool: %llu records spooled (%llu attributes "
+                        "not numeric), %llu windows replayed; %llu windows "
+                        "(%llu of %llu bytes) left, %llu windows and %llu "
+                        "records dropped\n", uploader->spooled,
+                uploader->unspoolable, uploader->replayed_frames,
+                stats.frames, stats.used_bytes, stats.ring_bytes,
+                stats.dropped_frames, stats.dropped_records);
+    }
+
+    close(uploader->wakeup_fd);
+    free(uploader->ring);
+    free(uploader->replayed);
+    free(uploader);
+}
@@ -0,0 +1,120 @@
+
+/* An asynchronous uploader to New Relic: a dedicated thread which makes the
+ * calls to the New Relic Agent SDK (newrelic_transaction_add_attribute(),
+ * newrelic_record_metric() and newrelic_transaction_end()), so that the
+ * collection of the samples never waits for the latency of the SDK.
+ *
+ * The collector (a single producer) pushes the records to upload into a
+ * bounded, lock-free, single-producer/single-consumer ring, and the uploader
+ * thread (the single consumer) drains it in batches. When the ring is full,
+ * the attributes and metrics are dropped, and counted, instead of blocking
+ * the collector; only the ends of the transactions wait for room, so that no
+ * transaction is left open in New Relic.
+ *
+ * The records of one transaction are uploaded in the order they were pushed,
+ * so its end comes after all its attributes.
+ *
+ * With a spool (see "metric_spool.h"), the metrics and the numeric
+ * attributes go to the spool instead while the New Relic collector is not
+ * reachable (or after the SDK failed a call, for a while), and they are
+ * replayed from it when it is reachable again: one spooled window at a time,
+ * as a transaction "Linux Perf Counters/spooled" whose "ct_tx_start_time" is
+ * the time of the window, and only while there is nothing else to upload,
+ * so that the replay never delays the profiles of now.
+ *
+ * The durations of the calls to the SDK are kept in a latency histogram
+ * (see "latency_histogram.h"), and the depth of the ring is followed, so
+ * that the wrapper can tell if its uploads are falling behind.
+ */
+
+#ifndef NEWRELIC_UPLOADER_H_
+#define NEWRELIC_UPLOADER_H_
+
+#include <stddef.h>
+
+#include "latency_histogram.h"
+#include "metric_spool.h"
+
+
+#define NEWRELIC_UPLOADER_NAME_SIZE   256
+#define NEWRELIC_UPLOADER_VALUE_SIZE  256   /* New Relic keeps up to 255 chars */
+
+#define NEWRELIC_UPLOADER_DEFAULT_CAPACITY  4096
+
+
+struct newrelic_uploader;
+
+
+/* Start the uploader thread, with a ring of "capacity" records (rounded up
+ * to a power of two), and the spool "spool" (or NULL), which stays owned by
+ * the caller. "reachable" tells if the New Relic collector is reachable, as
+ * far as it is known yet. Returns NULL on error: then the callers can pass
+ * NULL as the uploader to the functions below, which call the SDK
+ * synchronously (and never spool). */
+struct newrelic_uploader *
+newrelic_uploader_start(size_t capacity, struct metric_spool * spool,
+                        int reachable);
+
+
+/* Tell if the New Relic collector is reachable, from the status callback of
+ * the SDK */
+void
+newrelic_uploader_set_reachable(struct newrelic_uploader * uploader,
+                                int reachable);
+
+
+/* Queue a newrelic_transaction_add_attribute(). Returns 0, or -1 if it was
+ * dropped because the ring was full. */
+int
+newrelic_uploader_add_attribute(struct newrelic_uploader * uploader,
+                                long transaction_id, const char * name,
+                                const char * value);
+
+
+/* Queue a newrelic_record_metric(). Returns 0, or -1 if it was dropped. */
+int
+newrelic_uploader_record_metric(struct newrelic_uploader * uploader,
+                                const char * name, double value);
+
+
+/* Queue a newrelic_transaction_end(), after the records already queued for
+ * that transaction. It is never dropped: it waits for room in the ring. */
+int
+newrelic_uploader_end_transaction(struct newrelic_uploader * uploader,
+                                  long transaction_id);
+
+
+/* The number of records dropped because the ring was full */
+unsigned long long
+newrelic_uploader_dropped(const struct newrelic_uploader * uploader);
+
+
+/* The depth of the ring, as seen by the producer */
+struct newrelic_uploader_stats {
+    size_t             queued;        /* now */
+    size_t             peak_queued;   /* since the last call */
+    unsigned long long dropped;       /* since the start */
+};
+
+
+/* The stats of the ring, from the producer; the peak starts again. All of
+ * them are 0 without an uploader. */
+void
+newrelic_uploader_take_stats(struct newrelic_uploader * uploader,
+                             struct newrelic_uploader_stats * out_stats);
+
+
+/* The durations of the calls to the SDK, in nanoseconds, which the caller
+ * may drain (see latency_histogram_drain()): those made by the uploader
+ * thread, or, without an uploader (NULL), those made synchronously */
+struct latency_histogram *
+newrelic_uploader_sdk_latencies(struct newrelic_uploader * uploader);
+
+
+/* Upload (or spool) all the records still in the ring, stop the uploader
+ * thread and free it */
+void
+newrelic_uploader_stop(struct newrelic_uploader * uploader);
+
+
+#endif  /* NEWRELIC_UPLOADER_H_ */
@@ -0,0 +1,425 @@
+/* The off-CPU profile: see "off_cpu.h".
+ *
+ * The threads are in an open-addressing hash table with linear probing keyed
+ * by their tid (an empty slot has a tid 0, the idle task, which is never
+ * tracked), which is grown (doubled) when it is half full, up to a maximum,
+ * and from which the threads which exit are removed by shifting back the
+ * entries which follow them, as there are no tombstones.
+ *
+ * The aggregates of a window are in an array, in the order in which they
+ * were first seen, indexed by a hash table of their (pid, tid, call-graph)
+ * whose slots are the indexes in the array plus one (0: empty), of a fixed
+ * capacity of at least twice the maximum of aggregates.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "off_cpu.h"
+
+
+#define INITIAL_OFF_CPU_THREADS_CAPACITY  1024
+
+/* The state of a thread between its records */
+struct off_cpu_thread {
+    pid_t              tid;              /* 0: empty slot */
+    pid_t              pid;
+    unsigned long long switch_out_time;  /* 0: on a CPU */
+    unsigned long long wakeup_time;      /* 0: not woken up yet */
+    unsigned long long switch_in_time;   /* the last one */
+    int                runnable;         /* at its switch-out */
+    unsigned int       callchain_depth;
+    unsigned long long callchain[OFF_CPU_MAX_DEPTH];
+};
+
+struct off_cpu_tracker {
+    struct off_cpu_thread * threads;
+    size_t                  threads_capacity;
+    size_t                  n_threads;
+    size_t                  max_threads;
+
+    struct off_cpu_stack *  stacks;
+    size_t                  n_stacks;
+    size_t                  stacks_capacity;   /* of the array */
+    size_t                  max_stacks;
+    unsigned int *          stack_slots;
+    size_t                  n_stack_slots;
+
+    struct off_cpu_counters counters;
+    struct off_cpu_histograms histograms;
+};
+
+
+static inline uint64_t
+mix_hash(uint64_t h)
+{
+    /* the finalizer of MurmurHash3 */
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+
+static inline uint64_t
+hash_stack_key(pid_t pid, pid_t tid, const unsigned long long * callchain,
+               unsigned int depth)
+{
+    uint64_t h = ((uint64_t)(unsigned int)pid << 32) | (unsigned int)tid;
+    unsigned int i;
+    for (i = 0; i < depth; i++)
+        h = (h ^ callchain[i]) * 0x9e3779b97f4a7c15ULL;
+    return mix_hash(h ^ depth);
+}
+
+
+struct off_cpu_tracker *
+off_cpu_tracker_new(size_t max_threads, size_t max_stacks)
+{
+    struct off_cpu_tracker * tracker = calloc(1, sizeof *tracker);
+    if (!tracker)
+        return NULL;
+
+    tracker->max_threads = max_threads;
+    tracker->max_stacks = max_stacks;
+    tracker->threads_capacity = INITIAL_OFF_CPU_THREADS_CAPACITY;
+    tracker->n_stack_slots = 1;
+    while (tracker->n_stack_slots < 2 * max_stacks)
+        tracker->n_stack_slots <<= 1;
+    tracker->threads = calloc(tracker->threads_capacity,
+                              sizeof *tracker->threads);
+    tracker->stack_slots = calloc(tracker->n_stack_slots,
+                                  sizeof *tracker->stack_slots);
+    if (!tracker->threads || !tracker->stack_slots) {
+        off_cpu_tracker_free(tracker);
+        return NULL;
+    }
+    return tracker;
+}
+
+
+void
+off_cpu_tracker_free(struct off_cpu_tracker * tracker)
+{
+    if (!tracker)
+        return;
+    free(tracker->threads);
+    free(tracker->stacks);
+    free(tracker->stack_slots);
+    free(tracker);
+}
+
+
+static struct off_cpu_thread *
+find_thread(struct off_cpu_tracker * tracker, pid_t tid)
+{
+    size_t mask = tracker->threads_capacity - 1;
+    size_t slot = mix_hash((uint64_t)(unsigned int)tid) & mask;
+    while (tracker->threads[slot].tid != 0) {
+        if (tracker->threads[slot].tid == tid)
+            return &tracker->threads[slot];
+        slot = (slot + 1) & mask;
+    }
+    return NULL;
+}
+
+
+static int
+grow_threads_table(struct off_cpu_tracker * tracker)
+{
+    size_t new_capacity = 2 * tracker->threads_capacity;
+    struct off_cpu_thread * new_threads = calloc(new_capacity,
+                                                 sizeof *new_threads);
+    if (!new_threads)
+        return -1;
+
+    size_t i;
+    for (i = 0; i < tracker->threads_capacity; i++) {
+        const struct off_cpu_thread * thread = &tracker->threads[i];
+        if (thread->tid == 0)
+            continue;
+        size_t slot = mix_hash((uint64_t)(unsigned int)thread->tid) &
+                      (new_capacity - 1);
+        while (new_threads[slot].tid != 0)
+            slot = (slot + 1) & (new_capacity - 1);
+        new_threads[slot] = *thread;
+    }
+
+    free(tracker->threads);
+    tracker->threads = new_threads;
+    tracker->threads_capacity = new_capacity;
+    return 0;
+}
+
+
+/* The state of the thread "tid", a new one if it is not tracked yet, or NULL
+ * if there is no room for it */
+static struct off_cpu_thread *
+find_or_add_thread(struct off_cpu_tracker * tracker, pid_t tid)
+{
+    struct off_cpu_thread * thread = find_thread(tracker, tid);
+    if (thread)
+        return thread;
+    if (tracker->n_threads >= tracker->max_threads)
+        return NULL;
+    if (2 * (tracker->n_threads + 1) > tracker->threads_capacity &&
+        grow_threads_table(tracker) != 0 &&
+        tracker->n_threads + 1 >= tracker->threads_capacity)
+        return NULL;   /* completely full: can't grow it */
+
+    size_t mask = tracker->threads_capacity - 1;
+    size_t slot = mix_hash((uint64_t)(unsigned int)tid) & mask;
+    while (tracker->threads[slot].tid != 0)
+        slot = (slot + 1) & mask;
+    thread = &tracker->threads[slot];
+    memset(thread, 0, sizeof *thread);
+    thread->tid = tid;
+    tracker->n_threads++;
+    return thread;
+}
+
+
+/* Remove an exited thread, shifting back the entries of its cluster which
+ * would not be found anymore behind the empty slot */
+static void
+remove_thread(struct off_cpu_tracker * tracker, struct off_cpu_thread * thread)
+{
+    size_t mask = tracker->threads_capacity - 1;
+    size_t hole = (size_t)(thread - tracker->threads);
+    size_t slot = hole;
+    for (;;) {
+        slot = (slot + 1) & mask;
+        const struct off_cpu_thread * next = &tracker->threads[slot];
+        if (next->tid == 0)
+            break;
+        size_t home = mix_hash((uint64_t)(unsigned int)next->tid) & mask;
+        /* it can fill the hole if its home is not in ]hole, slot] */
+        if (((slot - home) & mask) >= ((slot - hole) & mask)) {
+            tracker->threads[hole] = *next;
+            hole = slot;
+        }
+    }
+    tracker->threads[hole].tid = 0;
+    tracker->n_threads--;
+}
+
+
+/* The aggregate of the window of a (pid, tid, call-graph), a new one if it
+ * is not there yet, or NULL if there is no room for it */
+static struct off_cpu_stack *
+find_or_add_stack(struct off_cpu_tracker * tracker,
+                  const struct off_cpu_thread * thread)
+{
+    size_t mask = tracker->n_stack_slots - 1;
+    size_t slot = hash_stack_key(thread->pid, thread->tid, thread->callchain,
+                                 thread->callchain_depth) & mask;
+    while (tracker->stack_slots[slot] != 0) {
+        struct off_cpu_stack * stack =
+                           &tracker->stacks[tracker->stack_slots[slot] - 1];
+        if (stack->tid == thread->tid && stack->pid == thread->pid &&
+            stack->callchain_depth == thread->callchain_depth &&
+            memcmp(stack->callchain, thread->callchain,
+                   thread->callchain_depth * sizeof *thread->callchain) == 0)
+            return stack;
+        slot = (slot + 1) & mask;
+    }
+
+    if (tracker->n_stacks >= tracker->max_stacks)
+        return NULL;
+    if (tracker->n_stacks == tracker->stacks_capacity) {
+        size_t new_capacity = tracker->stacks_capacity ?
+                              2 * tracker->stacks_capacity : 256;
+        struct off_cpu_stack * new_stacks = realloc(tracker->stacks,
+                                                    new_capacity *
+                                                    sizeof *new_stacks);
+        if (!new_stacks)
+            return NULL;
+        tracker->stacks = new_stacks;
+        tracker->stacks_capacity = new_capacity;
+    }
+    struct off_cpu_stack * stack = &tracker->stacks[tracker->n_stacks++];
+    memset(stack, 0, sizeof *stack);
+    stack->pid = thread->pid;
+    stack->tid = thread->tid;
+    stack->callchain_depth = thread->callchain_depth;
+    memcpy(stack->callchain, thread->callchain,
+           thread->callchain_depth * sizeof *thread->callchain);
+    tracker->stack_slots[slot] = (unsigned int)tracker->n_stacks;
+    return stack;
+}
+
+
+static unsigned int
+latency_bucket(unsigned long long nsecs)
+{
+    unsigned long long usecs = nsecs / 1000;
+    unsigned int bucket = 0;
+    while (usecs > 0 && bucket < OFF_CPU_LATENCY_BUCKETS - 1) {
+        usecs >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+
+struct off_cpu_histograms *
+off_cpu_tracker_histograms(struct off_cpu_tracker * tracker)
+{
+    return &tracker->histograms;
+}
+
+
+unsigned long long
+off_cpu_latency_bucket_limit(unsigned int bucket)
+{
+    return bucket < OFF_CPU_LATENCY_BUCKETS - 1 ? 1ULL << bucket : 0;
+}
+
+
+/* A thread which leaves a CPU */
+static void
+switch_out(struct off_cpu_tracker * tracker,
+           const struct perf_sched_event * event)
+{
+    struct off_cpu_thread * thread;
+    if (event->prev_state & PERF_SCHED_STATE_EXITED_MASK) {
+        thread = find_thread(tracker, event->tid);
+        if (thread)
+            remove_thread(tracker, thread);
+        return;
+    }
+    if (!event->profiled)
+        return;
+
+    thread = find_or_add_thread(tracker, event->tid);
+    if (!thread) {
+        tracker->counters.dropped_threads++;
+        return;
+    }
+    if (thread->switch_in_time > event->time) {
+        /* a switch-out read after the switch-in which followed it */
+        tracker->counters.unordered++;
+        return;
+    }
+    /* the end of its burst on the CPU, if its start was seen */
+    if (thread->switch_out_time == 0 && thread->switch_in_time != 0)
+        latency_histogram_record(&tracker->histograms.on_cpu,
+                                 event->time - thread->switch_in_time);
+    thread->pid = event->pid;
+    thread->switch_out_time = event->time;
+    thread->wakeup_time = 0;
+    thread->runnable = (event->prev_state &
+                        PERF_SCHED_STATE_RUNNABLE_MASK) == 0;
+    thread->callchain_depth = event->callchain_depth < OFF_CPU_MAX_DEPTH ?
+                              event->callchain_depth : OFF_CPU_MAX_DEPTH;
+    memcpy(thread->callchain, event->callchain,
+           thread->callchain_depth * sizeof *thread->callchain);
+}
+
+
+/* A thread which gets a CPU again: the end of its interval off the CPUs */
+static void
+switch_in(struct off_cpu_tracker * tracker, pid_t tid,
+          unsigned long long time)
+{
+    struct off_cpu_thread * thread = find_thread(tracker, tid);
+    if (!thread)
+        return;   /* not one of ours */
+    unsigned long long switch_out_time = thread->switch_out_time;
+    if (thread->switch_in_time < time)
+        thread->switch_in_time = time;
+    thread->switch_out_time = 0;
+    if (switch_out_time == 0)
+        return;   /* its switch-out wasn't seen */
+    if (time < switch_out_time) {
+        tracker->counters.unordered++;
+        return;
+    }
+
+    unsigned long long off_cpu_ns = time - switch_out_time;
+    unsigned long long blocked_ns, runqueue_ns;
+    int has_runqueue = 1;
+    if (thread->runnable) {
+        blocked_ns = 0;
+        runqueue_ns = off_cpu_ns;
+    } else if (thread->wakeup_time >= switch_out_time &&
+               thread->wakeup_time <= time) {
+        blocked_ns = thread->wakeup_time - switch_out_time;
+        runqueue_ns = time - thread->wakeup_time;
+    } else {
+        blocked_ns = off_cpu_ns;   /* its wakeup wasn't seen yet */
+        runqueue_ns = 0;
+        has_runqueue = 0;
+    }
+
+    latency_histogram_record(&tracker->histograms.off_cpu, off_cpu_ns);
+    if (has_runqueue)
+        latency_histogram_record(&tracker->histograms.runqueue, runqueue_ns);
+
+    struct off_cpu_stack * stack = find_or_add_stack(tracker, thread);
+    if (!stack) {
+        tracker->counters.dropped_intervals++;
+        return;
+    }
+    stack->intervals++;
+    stack->off_cpu_ns += off_cpu_ns;
+    stack->blocked_ns += blocked_ns;
+    stack->runqueue_ns += runqueue_ns;
+    if (has_runqueue)
+        stack->runqueue_latency[latency_bucket(runqueue_ns)]++;
+    tracker->counters.intervals++;
+}
+
+
+void
+off_cpu_tracker_add_event(struct off_cpu_tracker * tracker,
+                          const struct perf_sched_event * event)
+{
+    if (event->type == PERF_SCHED_SWITCH) {
+        if (event->tid != 0)
+            switch_out(tracker, event);
+        if (event->next_tid != 0)
+            switch_in(tracker, event->next_tid, event->time);
+        return;
+    }
+
+    /* the first wakeup since its switch-out */
+    struct off_cpu_thread * thread = find_thread(tracker, event->wakee_tid);
+    if (thread && thread->switch_out_time != 0 && thread->wakeup_time == 0 &&
+        event->time >= thread->switch_out_time)
+        thread->wakeup_time = event->time;
+}
+
+
+const struct off_cpu_stack *
+off_cpu_tracker_stacks(const struct off_cpu_tracker * tracker,
+                       size_t * out_n_stacks)
+{
+    *out_n_stacks = tracker->n_stacks;
+    return tracker->stacks;
+}
+
+
+void
+off_cpu_tracker_get_counters(const struct off_cpu_tracker * tracker,
+                             struct off_cpu_counters * out_counters)
+{
+    *out_counters = tracker->counters;
+    out_counters->threads = tracker->n_threads;
+}
+
+
+void
+off_cpu_tracker_reset_window(struct off_cpu_tracker * tracker)
+{
+    memset(tracker->stack_slots, 0,
+           tracker->n_stack_slots * sizeof *tracker->stack_slots);
+    tracker->n_stacks = 0;
+    memset(&tracker->counters, 0, sizeof tracker->counters);
+    latency_histogram_reset(&tracker->histograms.on_cpu);
+    latency_histogram_reset(&tracker->histograms.off_cpu);
+    latency_histogram_reset(&tracker->histograms.runqueue);
+}
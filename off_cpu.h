@@ -0,0 +1,141 @@
+/* The off-CPU profile: the time that the threads of the profile spend off
+ * the CPUs, from the records of the sched_switch and sched_wakeup
+ * tracepoints of the native sampler (see perf_sampler_set_sched_callback()).
+ *
+ * A thread which leaves a CPU is either still runnable (it was preempted:
+ * all its time off the CPU is spent waiting in the run-queue), or it blocks
+ * (on a lock, an I/O, a sleep...) till it is woken up, and then waits in the
+ * run-queue till it gets a CPU again:
+ *
+ *     switch-out ...... blocked ...... wakeup .. run-queue .. switch-in
+ *
+ * The tracker keeps the state of each thread between its records, and, when
+ * it gets a CPU again, adds the interval to the aggregate of the thread and
+ * of the user-space call-graph where it left the CPU, so that only the
+ * aggregates of a flush window are kept, and not its intervals, which are
+ * thousands per second and per CPU. The interval is in the window in which
+ * the thread got the CPU again.
+ *
+ * The rings of the CPUs are read one after the other, so the records of a
+ * thread which moved to another CPU can come out of order: such an interval
+ * is given up (it is counted as "unordered"), and so is the run-queue time of
+ * a thread whose wakeup comes after its switch-in (it is counted as blocked).
+ * Both tables are bound: the threads and the call-graphs which don't fit
+ * in them are counted as "dropped".
+ *
+ * The distributions of the durations of the window, of all the threads
+ * together, are also kept in log-linear histograms (see
+ * "latency_histogram.h"), for their percentiles: the intervals off the
+ * CPUs, their time in the run-queue, and the bursts of the threads on the
+ * CPUs (from a switch-in to the next switch-out of a thread).
+ */
+
+#ifndef OFF_CPU_H_
+#define OFF_CPU_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "latency_histogram.h"
+#include "perf_event_sampler.h"
+
+
+#define OFF_CPU_MAX_DEPTH             32      /* of the call-graphs kept */
+#define OFF_CPU_DEFAULT_MAX_THREADS   32768
+#define OFF_CPU_DEFAULT_MAX_STACKS    16384   /* per window */
+
+/* The histogram of the run-queue latencies: bucket 0 is below 1 us, bucket
+ * b in [2^(b-1), 2^b[ us, and the last one is 2^(N-2) us (4 seconds) and
+ * more */
+#define OFF_CPU_LATENCY_BUCKETS       24
+
+
+/* The aggregate of the intervals of a thread off the CPUs which left them at
+ * the same call-graph, in a window */
+struct off_cpu_stack {
+    pid_t              pid;
+    pid_t              tid;
+    /* as the kernel gives it: from the leaf to the outermost caller, with
+     * its PERF_CONTEXT_USER marker, and cut at OFF_CPU_MAX_DEPTH */
+    unsigned long long callchain[OFF_CPU_MAX_DEPTH];
+    unsigned int       callchain_depth;
+    unsigned long long intervals;
+    unsigned long long off_cpu_ns;      /* blocked_ns + runqueue_ns */
+    unsigned long long blocked_ns;
+    unsigned long long runqueue_ns;
+    /* the intervals whose run-queue latency is known (without those whose
+     * wakeup wasn't seen before their switch-in) */
+    unsigned int       runqueue_latency[OFF_CPU_LATENCY_BUCKETS];
+};
+
+
+/* The counters of the tracker in a window */
+struct off_cpu_counters {
+    unsigned long long intervals;
+    unsigned long long unordered;          /* given up */
+    unsigned long long dropped_intervals;  /* no room for their stack */
+    unsigned long long dropped_threads;    /* no room for their state */
+    size_t             threads;            /* tracked now */
+};
+
+
+/* The distributions of the durations of a window, in nanoseconds */
+struct off_cpu_histograms {
+    struct latency_histogram on_cpu;     /* the bursts on a CPU */
+    struct latency_histogram off_cpu;    /* the intervals off the CPUs */
+    struct latency_histogram runqueue;   /* when their wakeup was seen */
+};
+
+
+struct off_cpu_tracker;
+
+
+/* A new tracker of at most "max_threads" threads, and of at most
+ * "max_stacks" aggregates per window. Returns NULL if it couldn't allocate
+ * memory. */
+struct off_cpu_tracker *
+off_cpu_tracker_new(size_t max_threads, size_t max_stacks);
+
+
+void
+off_cpu_tracker_free(struct off_cpu_tracker * tracker);
+
+
+/* Follow the threads of the profile (the switches of the threads which are
+ * not event->profiled are ignored) with a record of the sched tracepoints */
+void
+off_cpu_tracker_add_event(struct off_cpu_tracker * tracker,
+                          const struct perf_sched_event * event);
+
+
+/* The aggregates of the window, in no particular order, valid till the next
+ * off_cpu_tracker_add_event() or off_cpu_tracker_reset_window() */
+const struct off_cpu_stack *
+off_cpu_tracker_stacks(const struct off_cpu_tracker * tracker,
+                       size_t * out_n_stacks);
+
+
+void
+off_cpu_tracker_get_counters(const struct off_cpu_tracker * tracker,
+                             struct off_cpu_counters * out_counters);
+
+
+/* The histograms of the window, which the caller may drain (see
+ * latency_histogram_drain()) */
+struct off_cpu_histograms *
+off_cpu_tracker_histograms(struct off_cpu_tracker * tracker);
+
+
+/* The upper bound of bucket "b" of the latencies, in microseconds, or 0 for
+ * the last bucket, which has none */
+unsigned long long
+off_cpu_latency_bucket_limit(unsigned int bucket);
+
+
+/* Start a new window: forget the aggregates, the counters and the
+ * histograms, but not the threads which are still off the CPUs */
+void
+off_cpu_tracker_reset_window(struct off_cpu_tracker * tracker);
+
+
+#endif  /* OFF_CPU_H_ */
@@ -0,0 +1,248 @@
+/* The counting mode of the native engine: see "perf_event_counters.h".
+ *
+ * With inherit (the counters of a program), there is one perf-event per
+ * counter, with cpu == -1, and the kernel adds the counts of the children
+ * into it when they exit. In the system-wide mode there is one perf-event per
+ * counter and CPU, and the counts of the CPUs are added when they are read.
+ * The counters are read one by one (not with PERF_FORMAT_GROUP, which is not
+ * allowed with inherit), with their times enabled and running to scale them
+ * if they were multiplexed.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+
+#include "perf_event_counters.h"
+
+
+static const struct {
+    const char *       name;
+    unsigned int       type;
+    unsigned long long config;
+    int                group_leader;   /* starts a new group */
+} counter_definitions[PERF_N_COUNTERS] = {
+    [PERF_COUNTER_TASK_CLOCK] =
+        { "task-clock",       PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, 1 },
+    [PERF_COUNTER_CYCLES] =
+        { "cycles",           PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, 1 },
+    [PERF_COUNTER_INSTRUCTIONS] =
+        { "instructions",     PERF_TYPE_HARDWARE,
+                              PERF_COUNT_HW_INSTRUCTIONS, 0 },
+    [PERF_COUNTER_CACHE_REFERENCES] =
+        { "cache-references", PERF_TYPE_HARDWARE,
+                              PERF_COUNT_HW_CACHE_REFERENCES, 1 },
+    [PERF_COUNTER_CACHE_MISSES] =
+        { "cache-misses",     PERF_TYPE_HARDWARE,
+                              PERF_COUNT_HW_CACHE_MISSES, 0 },
+    [PERF_COUNTER_BRANCHES] =
+        { "branches",         PERF_TYPE_HARDWARE,
+                              PERF_COUNT_HW_BRANCH_INSTRUCTIONS, 1 },
+    [PERF_COUNTER_BRANCH_MISSES] =
+        { "branch-misses",    PERF_TYPE_HARDWARE,
+                              PERF_COUNT_HW_BRANCH_MISSES, 0 },
+};
+
+
+struct perf_counters {
+    unsigned int n_cpus;          /* 1 for the counters of a program */
+    int *        fds;             /* [cpu * PERF_N_COUNTERS + counter] */
+};
+
+
+static int
+sys_perf_event_open(struct perf_event_attr * attr, pid_t pid, int cpu,
+                    int group_fd, unsigned long flags)
+{
+    return (int)syscall(SYS_perf_event_open, attr, pid, cpu, group_fd, flags);
+}
+
+
+struct perf_counters *
+perf_counters_open(pid_t target_pid, int system_wide)
+{
+    struct perf_counters * counters = calloc(1, sizeof *counters);
+    if (!counters)
+        return NULL;
+
+    long n_cpus = system_wide ? sysconf(_SC_NPROCESSORS_CONF) : 1;
+    if (n_cpus <= 0)
+        n_cpus = 1;
+    counters->n_cpus = (unsigned int)n_cpus;
+    counters->fds = malloc(counters->n_cpus * PERF_N_COUNTERS *
+                           sizeof *counters->fds);
+    if (!counters->fds) {
+        free(counters);
+        return NULL;
+    }
+
+    int n_opened = 0;
+    unsigned int cpu;
+    for (cpu = 0; cpu < counters->n_cpus; cpu++) {
+        int * fds = &counters->fds[cpu * PERF_N_COUNTERS];
+        int leader_fd = -1;
+        int id;
+        for (id = 0; id < PERF_N_COUNTERS; id++) {
+            fds[id] = -1;
+            if (counter_definitions[id].group_leader)
+                leader_fd = -1;
+            else if (leader_fd < 0)
+                continue;   /* its group leader is not supported */
+
+            struct perf_event_attr attr;
+            memset(&attr, 0, sizeof attr);
+            attr.size = sizeof attr;
+            attr.type = counter_definitions[id].type;
+            attr.config = counter_definitions[id].config;
+            attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+                               PERF_FORMAT_TOTAL_TIME_RUNNING;
+            attr.disabled = counter_definitions[id].group_leader;
+            if (!system_wide) {
+                attr.inherit = 1;
+                attr.enable_on_exec = 1;
+            }
+
+            fds[id] = sys_perf_event_open(&attr,
+                                          system_wide ? -1 : target_pid,
+                                          system_wide ? (int)cpu : -1,
+                                          leader_fd, PERF_FLAG_FD_CLOEXEC);
+            if (fds[id] < 0 && (errno == EACCES || errno == EPERM)) {
+                /* not allowed to count in the kernel (see
+                 * /proc/sys/kernel/perf_event_paranoid): only user-space */
+                attr.exclude_kernel = 1;
+                attr.exclude_hv = 1;
+                fds[id] = sys_perf_event_open(&attr,
+                                              system_wide ? -1 : target_pid,
+                                              system_wide ? (int)cpu : -1,
+                                              leader_fd, PERF_FLAG_FD_CLOEXEC);
+            }
+            if (fds[id] < 0) {
+                if (cpu == 0)
+                    fprintf(stderr, "DEBUG: counter '%s' not supported: %s\n",
+                            counter_definitions[id].name, strerror(errno));
+                continue;
+            }
+            if (counter_definitions[id].group_leader)
+                leader_fd = fds[id];
+            n_opened++;
+        }
+    }
+
+    if (n_opened == 0) {
+        perf_counters_close(counters);
+        return NULL;
+    }
+    return counters;
+}
+
+
+static int
+ioctl_group_leaders(struct perf_counters * counters, unsigned long request)
+{
+    int ret = 0;
+    unsigned int i;
+    for (i = 0; i < counters->n_cpus * PERF_N_COUNTERS; i++)
+        if (counters->fds[i] >= 0 &&
+            counter_definitions[i % PERF_N_COUNTERS].group_leader &&
+            ioctl(counters->fds[i], request, PERF_IOC_FLAG_GROUP) != 0)
+            ret = -1;
+    return ret;
+}
+
+
+int
+perf_counters_enable(struct perf_counters * counters)
+{
+    return ioctl_group_leaders(counters, PERF_EVENT_IOC_ENABLE);
+}
+
+
+int
+perf_counters_disable(struct perf_counters * counters)
+{
+    return ioctl_group_leaders(counters, PERF_EVENT_IOC_DISABLE);
+}
+
+
+/* a / b, or -1 if any of them is not supported or if b is 0 */
+static double
+counter_ratio(const struct perf_counter_totals * totals,
+              enum perf_counter_id a, enum perf_counter_id b, double scale)
+{
+    if (!totals->counters[a].supported || !totals->counters[b].supported ||
+        totals->counters[b].value == 0)
+        return -1;
+    return scale * (double)totals->counters[a].value /
+                   (double)totals->counters[b].value;
+}
+
+
+int
+perf_counters_read(struct perf_counters * counters,
+                   struct perf_counter_totals * out_totals)
+{
+    memset(out_totals, 0, sizeof *out_totals);
+
+    int id;
+    for (id = 0; id < PERF_N_COUNTERS; id++) {
+        struct perf_counter_value * counter = &out_totals->counters[id];
+        double value = 0, enabled = 0, running = 0;
+        unsigned int cpu;
+        for (cpu = 0; cpu < counters->n_cpus; cpu++) {
+            int fd = counters->fds[cpu * PERF_N_COUNTERS + id];
+            if (fd < 0)
+                continue;
+
+            /* read_format: u64 value, time_enabled, time_running */
+            unsigned long long data[3];
+            if (read(fd, data, sizeof data) != (ssize_t)sizeof data)
+                return -1;
+            counter->supported = 1;
+            enabled += data[1];
+            running += data[2];
+            /* scale it if it was multiplexed with other groups */
+            if (data[2] > 0)
+                value += (double)data[0] * ((double)data[1] / data[2]);
+        }
+        counter->value = (unsigned long long)value;
+        counter->running = enabled > 0 ? running / enabled : 0;
+    }
+
+    out_totals->ipc = counter_ratio(out_totals, PERF_COUNTER_INSTRUCTIONS,
+                                    PERF_COUNTER_CYCLES, 1);
+    out_totals->cache_mpki = counter_ratio(out_totals,
+                                           PERF_COUNTER_CACHE_MISSES,
+                                           PERF_COUNTER_INSTRUCTIONS, 1000);
+    out_totals->branch_miss_rate = counter_ratio(out_totals,
+                                                 PERF_COUNTER_BRANCH_MISSES,
+                                                 PERF_COUNTER_BRANCHES, 1);
+    return 0;
+}
+
+
+const char *
+perf_counter_name(enum perf_counter_id id)
+{
+    return counter_definitions[id].name;
+}
+
+
+void
+perf_counters_close(struct perf_counters * counters)
+{
+    if (!counters)
+        return;
+
+    unsigned int i;
+    for (i = 0; i < counters->n_cpus * PERF_N_COUNTERS; i++)
+        if (counters->fds[i] >= 0)
+            close(counters->fds[i]);
+    free(counters->fds);
+    free(counters);
+}
@@ -0,0 +1,94 @@
+
+/* The counting mode of the native engine, similar to "perf stat": instead of
+ * sampling, it opens a few groups of hardware counters for the program (and
+ * its descendants), or for all the CPUs if system-wide, and reads their
+ * totals when the program exits.
+ *
+ * The counters are opened in groups whose ratios are meaningful, so that the
+ * counters of a group are always scheduled together in the PMU, even if there
+ * are more counters than the PMU has:
+ *
+ *     { cycles, instructions }            ->  IPC
+ *     { cache-references, cache-misses }  ->  cache misses per kilo-instr.
+ *     { branches, branch-misses }         ->  branch-miss rate
+ *
+ * and the "task-clock" software counter, the CPU time of the program. A
+ * counter that the machine doesn't have (eg., there are usually no hardware
+ * counters in a virtual machine) is reported as not supported, and so are
+ * the derived metrics that need it.
+ */
+
+#ifndef PERF_EVENT_COUNTERS_H_
+#define PERF_EVENT_COUNTERS_H_
+
+#include <sys/types.h>
+
+
+enum perf_counter_id {
+    PERF_COUNTER_TASK_CLOCK = 0,
+    PERF_COUNTER_CYCLES,
+    PERF_COUNTER_INSTRUCTIONS,
+    PERF_COUNTER_CACHE_REFERENCES,
+    PERF_COUNTER_CACHE_MISSES,
+    PERF_COUNTER_BRANCHES,
+    PERF_COUNTER_BRANCH_MISSES,
+    PERF_N_COUNTERS
+};
+
+
+struct perf_counter_value {
+    int                supported;   /* the counter could be opened */
+    unsigned long long value;       /* scaled, if it was multiplexed */
+    double             running;     /* fraction of the time it was counting */
+};
+
+
+/* The counters read, and the metrics derived from them (negative if they
+ * can't be computed) */
+struct perf_counter_totals {
+    struct perf_counter_value counters[PERF_N_COUNTERS];
+    double                    ipc;               /* instructions per cycle */
+    double                    cache_mpki;        /* cache-misses per 1000
+                                                  * instructions */
+    double                    branch_miss_rate;  /* branch-misses / branches */
+};
+
+
+struct perf_counters;
+
+
+/* Open the counters for the process "target_pid" (and its descendants, with
+ * inherit), which are enabled when it does its exec() (see
+ * perf_sampler_launch_program()), or, if "system_wide", for all the CPUs,
+ * which must be enabled with perf_counters_enable(). Returns NULL if not even
+ * one counter could be opened. */
+struct perf_counters *
+perf_counters_open(pid_t target_pid, int system_wide);
+
+
+int
+perf_counters_enable(struct perf_counters * counters);
+
+
+int
+perf_counters_disable(struct perf_counters * counters);
+
+
+/* Read the totals of the counters (for an inherited counter, they include the
+ * children which already exited) and derive the metrics from them. Returns
+ * 0, or -1 on a read error. */
+int
+perf_counters_read(struct perf_counters * counters,
+                   struct perf_counter_totals * out_totals);
+
+
+/* The name of a counter, as in "perf stat": "cycles", "instructions", ... */
+const char *
+perf_counter_name(enum perf_counter_id id);
+
+
+void
+perf_counters_close(struct perf_counters * counters);
+
+
+#endif  /* PERF_EVENT_COUNTERS_H_ */
@@ -0,0 +1,1924 @@
+
+/* The native sampling engine, with the perf_event_open() system-call.
+ *
+ * See "perf_event_sampler.h" for the interface. The layout of the ring-
+ * buffers and of the records in them is described in the perf_event_open(2)
+ * man page:
+ *
+ *    http://man7.org/linux/man-pages/man2/perf_event_open.2.html
+ *
+ * and in the kernel header <linux/perf_event.h>.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "bpf_aggregator.h"
+#include "perf_event_sampler.h"
+
+
+/* The ring-buffer of one perf-event, in one CPU */
+struct perf_ring {
+    int                           fd;
+    unsigned int                  cpu;
+    struct perf_event_mmap_page * meta;      /* the first page of the mmap */
+    unsigned char *               data;      /* the 2^n pages of data */
+    unsigned long long            data_size;
+    size_t                        mmap_size;
+
+    /* the perf-events of this CPU in sampler->fds[], for the adaptive rate,
+     * and what happened in them in the current control interval */
+    unsigned int                  first_fd, n_fds;
+    unsigned long long            sample_freq;
+    unsigned long long            lost, throttled;
+
+    /* with options->off_cpu, the identifiers (PERF_SAMPLE_IDENTIFIER) of the
+     * scheduler tracepoints of this CPU, or 0: sched_switch, and
+     * sched_wakeup and sched_wakeup_new */
+    unsigned long long            switch_id, wakeup_ids[2];
+};
+
+/* A field of the raw data of a tracepoint, from its "format" in tracefs */
+struct tracepoint_field {
+    unsigned int offset, size;
+};
+
+/* The scheduler tracepoints: their configs (the ids of tracefs), and the
+ * fields of their raw data that we decode */
+struct sched_tracepoints {
+    unsigned long long      switch_config;
+    unsigned long long      wakeup_config;
+    unsigned long long      wakeup_new_config;   /* 0 if not there */
+    struct tracepoint_field prev_state, next_pid;    /* of sched_switch */
+    struct tracepoint_field wakee_pid;               /* of sched_wakeup */
+};
+
+/* Where tracefs is mounted: by itself, or in debugfs before Linux 4.1 */
+static const char * const TRACEFS_DIRS[] = {
+    "/sys/kernel/tracing",
+    "/sys/kernel/debug/tracing"
+};
+
+/* The adaptive rate is adjusted at most once per interval, and never goes
+ * below the minimum frequency (nor above the kernel's limit); a CPU which
+ * lost records or was throttled halves its frequency, and the others are
+ * scaled by at most these factors per interval */
+static const double             RATE_CONTROL_INTERVAL = 1.0;   /* secs */
+static const unsigned long long MIN_ADAPTIVE_SAMPLE_FREQ = 10;
+static const double             MAX_RATE_DECREASE = 0.5;
+static const double             MAX_RATE_INCREASE = 1.25;
+
+/* The initial size of the log of a reader thread, which grows as needed */
+#define READER_LOG_SIZE  (1U << 20)
+
+/* A reader thread, pinned to the CPUs of its rings (one CPU, or a NUMA
+ * node). It copies the records of its rings, as they are, into its own log,
+ * which is allocated by itself after it is pinned (so, with the first-touch
+ * policy of Linux, in the memory of its node, as the ring-buffers of the
+ * kernel are), and which is swapped out and replayed by the thread that
+ * calls perf_sampler_poll(). The lock of a log is taken once per round of
+ * the reader over its rings, and only contended by that swap. */
+struct perf_reader {
+    struct perf_sampler *    sampler;
+    pthread_t                thread;
+    unsigned int *           ring_indexes;
+    unsigned int             n_rings;
+    struct pollfd *          pollfds;
+    unsigned long            cpu_mask[4096 / (8 * sizeof(unsigned long))];
+    int                      stop;       /* atomic */
+
+    pthread_mutex_t          lock;       /* of the log */
+    unsigned char *          log;
+    size_t                   log_size, log_capacity;
+    unsigned char *          spare;      /* of the replaying thread */
+    size_t                   spare_capacity;
+};
+
+/* Each record in the log of a reader is preceded by the ring it came from */
+struct logged_record {
+    unsigned int ring_index;
+    unsigned int size;       /* of the record that follows */
+};
+
+struct perf_sampler {
+    struct perf_ring *       rings;
+    unsigned int             n_rings;
+    struct pollfd *          pollfds;
+    /* all the perf-events: those of the rings, and, when attached to
+     * several threads, the other perf-events of each CPU, whose records go
+     * to the ring of that CPU (PERF_EVENT_IOC_SET_OUTPUT) */
+    int *                    fds;
+    unsigned int             n_fds;
+    /* the processes and threads attached to, to know when they are gone */
+    pid_t *                  attached;
+    size_t                   n_attached;
+    int                      cgroup_fd;
+    char *                   cgroup_path;   /* relative to /sys/fs/cgroup */
+    struct symbol_resolver * resolver;
+    perf_sample_callback     callback;
+    void *                   callback_arg;
+
+    /* with options->off_cpu, the scheduler tracepoints of each CPU, which
+     * are not adjusted by the adaptive rate (their period is 1) */
+    struct sched_tracepoints sched;
+    int *                    sched_fds;
+    unsigned int             n_sched_fds;
+    perf_sched_callback      sched_callback;
+    void *                   sched_callback_arg;
+    unsigned long long       lost_samples;
+    unsigned long long       throttles;
+    struct perf_sampler_options options;   /* after the fallbacks */
+
+    /* with options->bpf, the program which aggregates the samples of the
+     * perf-events (all of sampler->fds) in the kernel, and the frames of
+     * the aggregate being flushed */
+    struct bpf_aggregator *  bpf;
+    unsigned long long       bpf_lost_samples;   /* without any call-graph */
+    unsigned long long       bpf_flush_time;     /* CLOCK_MONOTONIC, in ns */
+    unsigned long long       bpf_callchain[2 * BPF_AGGREGATOR_MAX_DEPTH + 2];
+
+    /* the adaptive rate: the last control, the CPU time of this process
+     * then, and the sum of the frequencies of the rings over time */
+    struct timespec          last_control;
+    double                   last_cpu_seconds;
+    unsigned long long       max_sample_freq;
+    double                   freq_seconds, ring_seconds;
+
+    /* with options->readers, the reader threads of the rings */
+    struct perf_reader *     readers;
+    unsigned int             n_readers;
+    unsigned int             readers_running;
+
+    /* a record which wraps around the end of its ring-buffer is copied here
+     * to be decoded (the size of a record is an u16) */
+    unsigned char            wrapped_record[65536];
+
+    /* with the LBR call-stack, the call-graph of the sample being handled:
+     * its kernel part, then the user-space part from the LBR */
+    unsigned long long       lbr_callchain[PERF_MAX_STACK_DEPTH + 2 +
+                                           PERF_SAMPLER_MAX_LBR_DEPTH];
+};
+
+
+void
+perf_sampler_default_options(struct perf_sampler_options * options)
+{
+    memset(options, 0, sizeof *options);
+    options->event_name = "cycles";
+    options->event_type = PERF_TYPE_HARDWARE;
+    options->event_config = PERF_COUNT_HW_CPU_CYCLES;
+    options->sample_freq = 4000;
+    options->mmap_pages = 128;
+}
+
+
+static const struct {
+    const char *       name;
+    unsigned int       type;
+    unsigned long long config;
+} known_perf_events[] = {
+    { "cycles",              PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { "cpu-cycles",          PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { "instructions",        PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { "cache-references",    PERF_TYPE_HARDWARE,
+                                           PERF_COUNT_HW_CACHE_REFERENCES },
+    { "cache-misses",        PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    { "branches",            PERF_TYPE_HARDWARE,
+                                           PERF_COUNT_HW_BRANCH_INSTRUCTIONS },
+    { "branch-instructions", PERF_TYPE_HARDWARE,
+                                           PERF_COUNT_HW_BRANCH_INSTRUCTIONS },
+    { "branch-misses",       PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+    { "bus-cycles",          PERF_TYPE_HARDWARE, PERF_COUNT_HW_BUS_CYCLES },
+    { "ref-cycles",          PERF_TYPE_HARDWARE, PERF_COUNT_HW_REF_CPU_CYCLES },
+    { "cpu-clock",           PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_CLOCK },
+    { "task-clock",          PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK },
+    { "page-faults",         PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+    { "faults",              PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+    { "minor-faults",        PERF_TYPE_SOFTWARE,
+                                           PERF_COUNT_SW_PAGE_FAULTS_MIN },
+    { "major-faults",        PERF_TYPE_SOFTWARE,
+                                           PERF_COUNT_SW_PAGE_FAULTS_MAJ },
+    { "context-switches",    PERF_TYPE_SOFTWARE,
+                                           PERF_COUNT_SW_CONTEXT_SWITCHES },
+    { "cs",                  PERF_TYPE_SOFTWARE,
+                                           PERF_COUNT_SW_CONTEXT_SWITCHES },
+    { "cpu-migrations",      PERF_TYPE_SOFTWARE,
+                                           PERF_COUNT_SW_CPU_MIGRATIONS },
+    { "migrations",          PERF_TYPE_SOFTWARE,
+                                           PERF_COUNT_SW_CPU_MIGRATIONS },
+};
+
+
+int
+perf_sampler_parse_event(const char * event_name, unsigned int * out_type,
+                         unsigned long long * out_config)
+{
+    size_t i;
+    for (i = 0; i < sizeof known_perf_events / sizeof known_perf_events[0];
+         i++)
+        if (strcmp(known_perf_events[i].name, event_name) == 0) {
+            *out_type = known_perf_events[i].type;
+            *out_config = known_perf_events[i].config;
+            return 0;
+        }
+    return -1;
+}
+
+
+static int
+sys_perf_event_open(struct perf_event_attr * attr, pid_t pid, int cpu,
+                    int group_fd, unsigned long flags)
+{
+    return (int)syscall(SYS_perf_event_open, attr, pid, cpu, group_fd, flags);
+}
+
+
+/* A list of CPUs in the format "0-3,6,8-11" of /sys, as the online CPUs
+ * or the CPUs of a NUMA node. Returns the number of CPUs written to
+ * out_cpus. */
+static int
+read_cpu_list(const char * fname, unsigned int * out_cpus, int max_cpus)
+{
+    int count = 0;
+    FILE * list = fopen(fname, "r");
+    if (list) {
+        unsigned int first, last;
+        while (count < max_cpus && fscanf(list, "%u", &first) == 1) {
+            last = first;
+            int c = fgetc(list);
+            if (c == '-') {
+                if (fscanf(list, "%u", &last) != 1)
+                    break;
+                c = fgetc(list);
+            }
+            unsigned int cpu;
+            for (cpu = first; cpu <= last && count < max_cpus; cpu++)
+                out_cpus[count++] = cpu;
+            if (c != ',')
+                break;
+        }
+        fclose(list);
+    }
+    return count;
+}
+
+
+/* The online CPUs, from /sys/devices/system/cpu/online */
+static int
+read_online_cpus(unsigned int * out_cpus, int max_cpus)
+{
+    int count = read_cpu_list("/sys/devices/system/cpu/online", out_cpus,
+                              max_cpus);
+    if (count == 0) {
+        long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        for (count = 0; count < n_cpus && count < max_cpus; count++)
+            out_cpus[count] = (unsigned int)count;
+    }
+    return count;
+}
+
+
+/* The pages of data of a ring-buffer: a power of two */
+static unsigned int
+ring_data_pages(const struct perf_sampler_options * options)
+{
+    unsigned int data_pages = 1;
+    while (data_pages < options->mmap_pages)
+        data_pages <<= 1;
+    return data_pages;
+}
+
+
+static void
+fill_perf_event_attr(struct perf_event_attr * attr,
+                     const struct perf_sampler_options * options,
+                     int inherit, int enable_on_exec)
+{
+    memset(attr, 0, sizeof *attr);
+    attr->size = sizeof *attr;
+    attr->type = options->event_type;
+    attr->config = options->event_config;
+    if (options->sample_period) {
+        attr->sample_period = options->sample_period;
+    } else {
+        attr->freq = 1;
+        attr->sample_freq = options->sample_freq;
+    }
+    /* the identifier tells our samples from those of the scheduler
+     * tracepoints, in the same ring-buffers */
+    attr->sample_type = PERF_SAMPLE_IDENTIFIER | PERF_SAMPLE_IP |
+                        PERF_SAMPLE_TID | PERF_SAMPLE_TIME | PERF_SAMPLE_CPU |
+                        PERF_SAMPLE_PERIOD;
+    if (options->callchain)
+        attr->sample_type |= PERF_SAMPLE_CALLCHAIN;
+    /* the kernel part of the call-graphs still comes from the kernel: only
+     * the user-space part is from the LBR */
+    if (options->callchain && options->call_graph == PERF_CALL_GRAPH_LBR) {
+        attr->sample_type |= PERF_SAMPLE_BRANCH_STACK;
+        attr->branch_sample_type = PERF_SAMPLE_BRANCH_USER |
+                                   PERF_SAMPLE_BRANCH_CALL_STACK;
+        attr->exclude_callchain_user = 1;
+    }
+    attr->precise_ip = options->precise_ip;
+    attr->disabled = 1;
+    attr->mmap = 1;
+    attr->mmap2 = 1;
+    attr->comm = 1;
+    attr->task = 1;
+    /* wake up the poller only when a quarter of the ring is full, and not at
+     * each sample: the wrapper and the reader threads poll with a timeout of
+     * 100 ms, and read all the rings each time (see perf_sampler_poll()) */
+    attr->watermark = 1;
+    attr->wakeup_watermark = (unsigned int)((unsigned long long)
+                                            ring_data_pages(options) *
+                                            sysconf(_SC_PAGESIZE) / 4);
+    attr->inherit = inherit;
+    attr->enable_on_exec = enable_on_exec;
+}
+
+
+static int
+open_perf_event_on_cpu(struct perf_event_attr * attr,
+                       struct perf_sampler_options * options,
+                       pid_t pid, unsigned int cpu, unsigned long flags)
+{
+    flags |= PERF_FLAG_FD_CLOEXEC;
+    int fd = sys_perf_event_open(attr, pid, (int)cpu, -1, flags);
+    if (fd >= 0)
+        return fd;
+
+    /* the precise sampling of "-e <event>:p" is not there for all the
+     * events, nor in most virtual machines: as "perf record" does, lower the
+     * precision till the event opens */
+    while ((errno == EINVAL || errno == EOPNOTSUPP || errno == ENOENT) &&
+           attr->precise_ip > 0) {
+        attr->precise_ip--;
+        options->precise_ip = attr->precise_ip;
+        fprintf(stderr, "DEBUG: no precise sampling at this level: lowering "
+                        "it to %u\n", options->precise_ip);
+        fd = sys_perf_event_open(attr, pid, (int)cpu, -1, flags);
+        if (fd >= 0)
+            return fd;
+    }
+
+    /* nor the LBR call-stack, which also needs a hardware event: without
+     * it, the kernel unwinds the frame-pointers of user-space too */
+    if ((errno == EINVAL || errno == EOPNOTSUPP || errno == ENOENT) &&
+        (attr->sample_type & PERF_SAMPLE_BRANCH_STACK)) {
+        fprintf(stderr, "DEBUG: no LBR call-stack: falling back to the "
+                        "frame-pointers\n");
+        attr->sample_type &= ~(unsigned long long)PERF_SAMPLE_BRANCH_STACK;
+        attr->branch_sample_type = 0;
+        attr->exclude_callchain_user = 0;
+        options->call_graph = PERF_CALL_GRAPH_FP;
+        fd = sys_perf_event_open(attr, pid, (int)cpu, -1, flags);
+        if (fd >= 0)
+            return fd;
+    }
+
+    /* As "perf record" does: if there is no hardware "cycles" event (eg., in
+     * a virtual machine), fall back to the "cpu-clock" software event */
+    if ((errno == ENOENT || errno == EOPNOTSUPP || errno == ENODEV) &&
+        attr->type == PERF_TYPE_HARDWARE &&
+        attr->config == PERF_COUNT_HW_CPU_CYCLES) {
+        fprintf(stderr, "DEBUG: no hardware 'cycles' event: falling back to "
+                        "'cpu-clock'\n");
+        attr->type = options->event_type = PERF_TYPE_SOFTWARE;
+        attr->config = options->event_config = PERF_COUNT_SW_CPU_CLOCK;
+        options->event_name = "cpu-clock";
+        fd = sys_perf_event_open(attr, pid, (int)cpu, -1, flags);
+        if (fd >= 0)
+            return fd;
+    }
+
+    /* and if we are not allowed to sample the kernel (see
+     * /proc/sys/kernel/perf_event_paranoid), sample only user-space */
+    if ((errno == EACCES || errno == EPERM) && !attr->exclude_kernel) {
+        fprintf(stderr, "DEBUG: not allowed to sample the kernel: sampling "
+                        "only user-space\n");
+        attr->exclude_kernel = 1;
+        attr->exclude_hv = 1;
+        fd = sys_perf_event_open(attr, pid, (int)cpu, -1, flags);
+    }
+    return fd;
+}
+
+
+/* For the sampling of all the processes in the system: the processes which
+ * already exist won't send us their PERF_RECORD_MMAP2 records, so take their
+ * mappings from /proc, as "perf record" does */
+static void
+load_all_existing_processes(struct symbol_resolver * resolver)
+{
+    DIR * proc_dir = opendir("/proc");
+    if (!proc_dir)
+        return;
+
+    struct dirent * entry;
+    while ((entry = readdir(proc_dir)) != NULL) {
+        char * end;
+        long pid = strtol(entry->d_name, &end, 10);
+        if (*end != '\0' || pid <= 0)
+            continue;
+        symbol_resolver_load_proc_maps(resolver, (pid_t)pid);
+    }
+    closedir(proc_dir);
+}
+
+
+/* The thread group (process) of the thread "tid", from /proc/<tid>/status,
+ * or -1 if the thread doesn't exist */
+static pid_t
+thread_group_of(pid_t tid)
+{
+    char status_fname[64];
+    snprintf(status_fname, sizeof status_fname, "/proc/%d/status", (int)tid);
+    FILE * status_file = fopen(status_fname, "r");
+    if (!status_file)
+        return -1;
+
+    char line[256];
+    pid_t tgid = -1;
+    while (fgets(line, sizeof line, status_file))
+        if (strncmp(line, "Tgid:", 5) == 0) {
+            tgid = (pid_t)strtol(line + 5, NULL, 10);
+            break;
+        }
+    fclose(status_file);
+    return tgid;
+}
+
+
+static int
+append_pid(pid_t ** pids, size_t * n_pids, size_t * capacity, pid_t pid)
+{
+    if (*n_pids == *capacity) {
+        size_t new_capacity = *capacity ? 2 * *capacity : 64;
+        pid_t * new_pids = realloc(*pids, new_capacity * sizeof *new_pids);
+        if (!new_pids)
+            return -1;
+        *pids = new_pids;
+        *capacity = new_capacity;
+    }
+    (*pids)[(*n_pids)++] = pid;
+    return 0;
+}
+
+
+/* The threads of the processes "pids" (from /proc/<pid>/task), followed by
+ * the threads "tids". Returns the number of threads in *out_tids, which
+ * must be freed, or -1 on error. */
+static ssize_t
+list_target_threads(const struct perf_sampler_target * target,
+                    pid_t ** out_tids)
+{
+    pid_t * tids = NULL;
+    size_t n_tids = 0, capacity = 0, i;
+
+    for (i = 0; i < target->n_pids; i++) {
+        char task_dname[64];
+        snprintf(task_dname, sizeof task_dname, "/proc/%d/task",
+                 (int)target->pids[i]);
+        DIR * task_dir = opendir(task_dname);
+        if (!task_dir) {
+            fprintf(stderr, "ERROR: no process %d to attach to\n",
+                    (int)target->pids[i]);
+            free(tids);
+            return -1;
+        }
+        struct dirent * entry;
+        while ((entry = readdir(task_dir)) != NULL) {
+            char * end;
+            long tid = strtol(entry->d_name, &end, 10);
+            if (*end != '\0' || tid <= 0)
+                continue;
+            if (append_pid(&tids, &n_tids, &capacity, (pid_t)tid) != 0) {
+                closedir(task_dir);
+                free(tids);
+                return -1;
+            }
+        }
+        closedir(task_dir);
+    }
+    for (i = 0; i < target->n_tids; i++)
+        if (append_pid(&tids, &n_tids, &capacity, target->tids[i]) != 0) {
+            free(tids);
+            return -1;
+        }
+
+    *out_tids = tids;
+    return (ssize_t)n_tids;
+}
+
+
+static void
+start_readers(struct perf_sampler * sampler);
+
+
+static void
+stop_readers(struct perf_sampler * sampler);
+
+
+/* The CPU time (user and system) of this process, with all its threads */
+static double
+process_cpu_seconds(void)
+{
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+           usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+
+static double
+seconds_between(const struct timespec * start, const struct timespec * end)
+{
+    return (end->tv_sec - start->tv_sec) +
+           (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+
+static void
+start_rate_control(struct perf_sampler * sampler)
+{
+    /* the limit of the kernel on the frequency (it lowers it by itself when
+     * the sampling interrupts take too long), above which the
+     * PERF_EVENT_IOC_PERIOD fails */
+    sampler->max_sample_freq = 100000;
+    FILE * max_rate = fopen("/proc/sys/kernel/perf_event_max_sample_rate",
+                            "r");
+    if (max_rate) {
+        unsigned long long value;
+        if (fscanf(max_rate, "%llu", &value) == 1 && value > 0)
+            sampler->max_sample_freq = value;
+        fclose(max_rate);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &sampler->last_control);
+    sampler->last_cpu_seconds = process_cpu_seconds();
+}
+
+
+static void
+set_ring_sample_freq(struct perf_sampler * sampler, struct perf_ring * ring,
+                     unsigned long long sample_freq)
+{
+    /* with attr.freq, the "period" of PERF_EVENT_IOC_PERIOD is the new
+     * sample_freq; but the kernel turns the frequency of the clock events
+     * into a fixed period of their hrtimer, in nanoseconds */
+    unsigned long long period = sample_freq;
+    if (sampler->options.event_type == PERF_TYPE_SOFTWARE &&
+        (sampler->options.event_config == PERF_COUNT_SW_CPU_CLOCK ||
+         sampler->options.event_config == PERF_COUNT_SW_TASK_CLOCK))
+        period = 1000000000ULL / sample_freq;
+    unsigned int i;
+    for (i = 0; i < ring->n_fds; i++)
+        ioctl(sampler->fds[ring->first_fd + i], PERF_EVENT_IOC_PERIOD,
+              &period);
+    ring->sample_freq = sample_freq;
+}
+
+
+/* One step of the controller of the adaptive rate */
+static void
+control_sample_rate(struct perf_sampler * sampler)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = seconds_between(&sampler->last_control, &now);
+    if (elapsed < RATE_CONTROL_INTERVAL)
+        return;
+
+    double cpu_seconds = process_cpu_seconds();
+    double overhead = (cpu_seconds - sampler->last_cpu_seconds) / elapsed;
+    double budget = sampler->options.cpu_budget;
+    double factor = overhead > 0 ? budget / overhead : MAX_RATE_INCREASE;
+    if (factor < MAX_RATE_DECREASE)
+        factor = MAX_RATE_DECREASE;
+    else if (factor > MAX_RATE_INCREASE)
+        factor = MAX_RATE_INCREASE;
+    else if (factor > 1 && factor < 1.1)
+        factor = 1;   /* close enough to the budget: no change */
+
+    unsigned int i;
+    for (i = 0; i < sampler->n_rings; i++) {
+        struct perf_ring * ring = &sampler->rings[i];
+        sampler->freq_seconds += (double)ring->sample_freq * elapsed;
+        sampler->ring_seconds += elapsed;
+
+        double new_freq = ring->sample_freq *
+                          (ring->lost || ring->throttled ? MAX_RATE_DECREASE
+                                                         : factor);
+        if (new_freq < MIN_ADAPTIVE_SAMPLE_FREQ)
+            new_freq = MIN_ADAPTIVE_SAMPLE_FREQ;
+        if (new_freq > sampler->max_sample_freq)
+            new_freq = sampler->max_sample_freq;
+        if ((unsigned long long)new_freq != ring->sample_freq)
+            set_ring_sample_freq(sampler, ring, (unsigned long long)new_freq);
+        ring->lost = ring->throttled = 0;
+    }
+
+    sampler->last_control = now;
+    sampler->last_cpu_seconds = cpu_seconds;
+}
+
+
+/* The id of the tracepoint sched:<event> in tracefs, and the offsets and
+ * sizes of its fields "field_names" in its raw data, from its "format", eg.:
+ *
+ *     field:pid_t next_pid;   offset:56;   size:4;   signed:1;
+ *
+ * Returns 0, or -1 if tracefs is not mounted, or not readable by us, or if
+ * the tracepoint doesn't have those fields. */
+static int
+read_sched_tracepoint(const char * event, unsigned long long * out_config,
+                      const char * const * field_names,
+                      struct tracepoint_field * out_fields, size_t n_fields)
+{
+    size_t d;
+    for (d = 0; d < sizeof TRACEFS_DIRS / sizeof TRACEFS_DIRS[0]; d++) {
+        char fname[PATH_MAX];
+        snprintf(fname, sizeof fname, "%s/events/sched/%s/id",
+                 TRACEFS_DIRS[d], event);
+        FILE * id_file = fopen(fname, "r");
+        if (!id_file)
+            continue;
+        int has_id = fscanf(id_file, "%llu", out_config) == 1;
+        fclose(id_file);
+        snprintf(fname, sizeof fname, "%s/events/sched/%s/format",
+                 TRACEFS_DIRS[d], event);
+        FILE * format = has_id ? fopen(fname, "r") : NULL;
+        if (!format)
+            continue;
+
+        unsigned int found = 0;
+        char line[512];
+        while (fgets(line, sizeof line, format)) {
+            char * field = strstr(line, "field:");
+            char * semicolon = field ? strchr(field, ';') : NULL;
+            char * offset = semicolon ? strstr(semicolon, "offset:") : NULL;
+            char * size = offset ? strstr(offset, "size:") : NULL;
+            if (!size)
+                continue;
+            char * name = semicolon;
+            while (name > field && name[-1] != ' ' && name[-1] != '\t')
+                name--;
+            size_t i;
+            for (i = 0; i < n_fields; i++)
+                if (strlen(field_names[i]) == (size_t)(semicolon - name) &&
+                    strncmp(field_names[i], name, semicolon - name) == 0) {
+                    out_fields[i].offset = (unsigned int)strtoul(offset + 7,
+                                                                 NULL, 10);
+                    out_fields[i].size = (unsigned int)strtoul(size + 5, NULL,
+                                                               10);
+                    found |= 1U << i;
+                }
+        }
+        fclose(format);
+        return found == (1U << n_fields) - 1 ? 0 : -1;
+    }
+    return -1;
+}
+
+
+static int
+read_sched_tracepoints(struct sched_tracepoints * out_sched)
+{
+    static const char * const switch_fields[] = { "prev_state", "next_pid" };
+    static const char * const wakeup_fields[] = { "pid" };
+    struct tracepoint_field fields[2];
+
+    memset(out_sched, 0, sizeof *out_sched);
+    if (read_sched_tracepoint("sched_switch", &out_sched->switch_config,
+                              switch_fields, fields, 2) != 0)
+        return -1;
+    out_sched->prev_state = fields[0];
+    out_sched->next_pid = fields[1];
+    if (read_sched_tracepoint("sched_wakeup", &out_sched->wakeup_config,
+                              wakeup_fields, fields, 1) != 0)
+        return -1;
+    out_sched->wakee_pid = fields[0];
+    /* the first wakeup of a new thread, with the same format */
+    if (read_sched_tracepoint("sched_wakeup_new",
+                              &out_sched->wakeup_new_config, wakeup_fields,
+                              fields, 1) != 0)
+        out_sched->wakeup_new_config = 0;
+    return 0;
+}
+
+
+/* The scheduler tracepoints on the CPU of "ring", for all the processes (the
+ * threads that we sample are switched with the others), whose records go to
+ * the ring. They are created enabled if "enabled", else disabled till
+ * perf_sampler_enable(). Returns 0, or -1 with errno (the tracepoints which
+ * were opened are then closed by close_sched_tracepoints()). */
+static int
+open_sched_tracepoints(struct perf_sampler * sampler, struct perf_ring * ring,
+                       int enabled)
+{
+    const unsigned long long configs[3] = {
+        sampler->sched.switch_config, sampler->sched.wakeup_config,
+        sampler->sched.wakeup_new_config
+    };
+    unsigned long long * ids[3] = {
+        &ring->switch_id, &ring->wakeup_ids[0], &ring->wakeup_ids[1]
+    };
+
+    int k;
+    for (k = 0; k < 3; k++) {
+        if (configs[k] == 0)
+            continue;   /* no sched_wakeup_new */
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof attr);
+        attr.size = sizeof attr;
+        attr.type = PERF_TYPE_TRACEPOINT;
+        attr.config = configs[k];
+        attr.sample_period = 1;   /* every switch and wakeup */
+        attr.sample_type = PERF_SAMPLE_IDENTIFIER | PERF_SAMPLE_IP |
+                           PERF_SAMPLE_TID | PERF_SAMPLE_TIME |
+                           PERF_SAMPLE_CPU | PERF_SAMPLE_PERIOD |
+                           PERF_SAMPLE_RAW;
+        if (k == 0) {
+            /* where the thread switched out blocked, in user-space: its
+             * kernel part is always the same way into schedule() */
+            attr.sample_type |= PERF_SAMPLE_CALLCHAIN;
+            attr.exclude_callchain_kernel = 1;
+        }
+        attr.disabled = !enabled;
+
+        int fd = sys_perf_event_open(&attr, -1, (int)ring->cpu, -1,
+                                     PERF_FLAG_FD_CLOEXEC);
+        if (fd < 0)
+            return -1;
+        sampler->sched_fds[sampler->n_sched_fds++] = fd;
+        if (ioctl(fd, PERF_EVENT_IOC_SET_OUTPUT, ring->fd) != 0 ||
+            ioctl(fd, PERF_EVENT_IOC_ID, ids[k]) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+
+/* Give up the scheduler tracepoints: the profile goes on, only on-CPU */
+static void
+close_sched_tracepoints(struct perf_sampler * sampler, unsigned int n_rings)
+{
+    unsigned int i;
+    for (i = 0; i < sampler->n_sched_fds; i++)
+        close(sampler->sched_fds[i]);
+    sampler->n_sched_fds = 0;
+    for (i = 0; i < n_rings; i++)
+        sampler->rings[i].switch_id = sampler->rings[i].wakeup_ids[0] =
+                                      sampler->rings[i].wakeup_ids[1] = 0;
+}
+
+
+/* One perf-event per CPU and per target: its records go to the ring-buffer
+ * of that CPU, which is mmap'ed from the first perf-event on the CPU. A
+ * thread which exits while we open its perf-events is skipped.
+ *
+ * With options->off_cpu, the scheduler tracepoints of each CPU go to its ring
+ * too. Without them (no tracefs, or not allowed to trace the whole system,
+ * see /proc/sys/kernel/perf_event_paranoid), the profile is only on-CPU.
+ *
+ * With options->bpf, the BPF program is attached to the sampling perf-events
+ * (not to the tracepoints), so that only their other records (the mmaps,
+ * the comms, ...) go to the rings. Without eBPF, or if not allowed to load
+ * the program, the samples go to the rings. */
+static struct perf_sampler *
+open_sampler(const struct perf_sampler_options * in_options,
+             struct perf_event_attr * attr, const pid_t * targets,
+             size_t n_targets, unsigned long flags,
+             struct symbol_resolver * resolver,
+             perf_sample_callback callback, void * callback_arg)
+{
+    struct perf_sampler_options options = *in_options;
+
+    unsigned int online_cpus[4096];
+    int n_cpus = read_online_cpus(online_cpus,
+                                  sizeof online_cpus / sizeof online_cpus[0]);
+    if (n_cpus <= 0)
+        return NULL;
+
+    struct perf_sampler * sampler = calloc(1, sizeof *sampler);
+    if (!sampler)
+        return NULL;
+    sampler->cgroup_fd = -1;
+    sampler->rings = calloc(n_cpus, sizeof *sampler->rings);
+    sampler->pollfds = calloc(n_cpus, sizeof *sampler->pollfds);
+    sampler->fds = calloc((size_t)n_cpus * n_targets, sizeof *sampler->fds);
+    if (!sampler->rings || !sampler->pollfds || !sampler->fds)
+        goto error_opening_sampler;
+    sampler->resolver = resolver;
+    sampler->callback = callback;
+    sampler->callback_arg = callback_arg;
+
+    if (options.off_cpu && read_sched_tracepoints(&sampler->sched) != 0) {
+        fprintf(stderr, "ERROR: couldn't read the scheduler tracepoints in "
+                        "%s: profiling only on-CPU\n", TRACEFS_DIRS[0]);
+        options.off_cpu = 0;
+    }
+    if (options.off_cpu) {
+        sampler->sched_fds = calloc((size_t)n_cpus * 3,
+                                    sizeof *sampler->sched_fds);
+        if (!sampler->sched_fds)
+            goto error_opening_sampler;
+    }
+    if (options.bpf) {
+        sampler->bpf = bpf_aggregator_new(BPF_AGGREGATOR_DEFAULT_MAX_STACKS);
+        if (!sampler->bpf) {
+            char err_msg[256];
+            strerror_r(errno, err_msg, sizeof err_msg);
+            fprintf(stderr, "ERROR: couldn't load the BPF program of the "
+                            "in-kernel aggregation: %s: sampling to the "
+                            "ring-buffers\n", err_msg);
+            options.bpf = 0;
+        }
+    }
+
+    unsigned int data_pages = ring_data_pages(&options);
+    long page_size = sysconf(_SC_PAGESIZE);
+
+    int i;
+    for (i = 0; i < n_cpus; i++) {
+        struct perf_ring * ring = &sampler->rings[sampler->n_rings];
+        ring->cpu = online_cpus[i];
+        ring->fd = -1;
+        ring->first_fd = sampler->n_fds;
+        ring->sample_freq = options.sample_freq;
+
+        size_t t;
+        for (t = 0; t < n_targets; t++) {
+            int fd = open_perf_event_on_cpu(attr, &options, targets[t],
+                                            ring->cpu, flags);
+            if (fd < 0 && errno == ESRCH && n_targets > 1)
+                continue;   /* a thread which already exited */
+            if (fd < 0) {
+                char err_msg[256];
+                strerror_r(errno, err_msg, sizeof err_msg);
+                fprintf(stderr, "ERROR: perf_event_open() on CPU %u: %s\n",
+                        ring->cpu, err_msg);
+                goto error_opening_sampler;
+            }
+            sampler->fds[sampler->n_fds++] = fd;
+            ring->n_fds++;
+            if (options.bpf && bpf_aggregator_attach(sampler->bpf, fd) != 0) {
+                char err_msg[256];
+                strerror_r(errno, err_msg, sizeof err_msg);
+                if (sampler->n_fds > 1) {
+                    fprintf(stderr, "ERROR: PERF_EVENT_IOC_SET_BPF on CPU %u: "
+                                    "%s\n", ring->cpu, err_msg);
+                    goto error_opening_sampler;
+                }
+                /* the first one: none of them goes to the program yet */
+                fprintf(stderr, "ERROR: couldn't attach the BPF program of "
+                                "the in-kernel aggregation: %s: sampling to "
+                                "the ring-buffers\n", err_msg);
+                bpf_aggregator_free(sampler->bpf);
+                sampler->bpf = NULL;
+                options.bpf = 0;
+            }
+            if (ring->fd >= 0) {
+                if (ioctl(fd, PERF_EVENT_IOC_SET_OUTPUT, ring->fd) != 0) {
+                    fprintf(stderr, "ERROR: PERF_EVENT_IOC_SET_OUTPUT on CPU "
+                                    "%u: %s\n", ring->cpu, strerror(errno));
+                    goto error_opening_sampler;
+                }
+                continue;
+            }
+            ring->fd = fd;
+        }
+        if (ring->fd < 0) {
+            ring->n_fds = 0;
+            continue;   /* all the threads exited */
+        }
+
+        ring->mmap_size = (size_t)(data_pages + 1) * page_size;
+        void * base = mmap(NULL, ring->mmap_size, PROT_READ | PROT_WRITE,
+                           MAP_SHARED, ring->fd, 0);
+        if (base == MAP_FAILED) {
+            char err_msg[256];
+            strerror_r(errno, err_msg, sizeof err_msg);
+            fprintf(stderr, "ERROR: mmap() of the perf ring-buffer of CPU %u: "
+                            "%s\n", ring->cpu, err_msg);
+            goto error_opening_sampler;
+        }
+        ring->meta = base;
+        ring->data = (unsigned char *)base + page_size;
+        ring->data_size = (unsigned long long)data_pages * page_size;
+
+        /* the tracepoints can't be enabled by the exec() of the program,
+         * which they don't follow */
+        if (options.off_cpu &&
+            open_sched_tracepoints(sampler, ring, attr->enable_on_exec) != 0) {
+            char err_msg[256];
+            strerror_r(errno, err_msg, sizeof err_msg);
+            fprintf(stderr, "ERROR: couldn't open the scheduler tracepoints "
+                            "on CPU %u: %s: profiling only on-CPU\n",
+                    ring->cpu, err_msg);
+            close_sched_tracepoints(sampler, sampler->n_rings + 1);
+            options.off_cpu = 0;
+        }
+
+        sampler->pollfds[sampler->n_rings].fd = ring->fd;
+        sampler->pollfds[sampler->n_rings].events = POLLIN;
+        sampler->n_rings++;
+    }
+    if (sampler->n_rings == 0) {
+        fprintf(stderr, "ERROR: no thread left to attach to\n");
+        goto error_opening_sampler;
+    }
+
+    sampler->options = options;
+    if (options.cpu_budget > 0 && options.sample_period == 0 && !options.bpf)
+        start_rate_control(sampler);
+    else
+        sampler->options.cpu_budget = 0;   /* a fixed "-c" period, or bpf */
+    if (options.readers != PERF_READERS_NONE)
+        start_readers(sampler);
+    return sampler;
+
+error_opening_sampler:
+    perf_sampler_close(sampler);
+    return NULL;
+}
+
+
+struct perf_sampler *
+perf_sampler_open(const struct perf_sampler_options * options,
+                  pid_t target_pid, struct symbol_resolver * resolver,
+                  perf_sample_callback callback, void * callback_arg)
+{
+    struct perf_event_attr attr;
+    fill_perf_event_attr(&attr, options, !options->system_wide,
+                         !options->system_wide);
+    pid_t pid = options->system_wide ? -1 : target_pid;
+
+    struct perf_sampler * sampler = open_sampler(options, &attr, &pid, 1, 0,
+                                                 resolver, callback,
+                                                 callback_arg);
+    if (sampler && options->system_wide)
+        load_all_existing_processes(resolver);
+    return sampler;
+}
+
+
+struct perf_sampler *
+perf_sampler_attach(const struct perf_sampler_options * options,
+                    const struct perf_sampler_target * target,
+                    struct symbol_resolver * resolver,
+                    perf_sample_callback callback, void * callback_arg)
+{
+    struct perf_event_attr attr;
+    struct perf_sampler * sampler;
+
+    if (target->cgroup) {
+        /* a cgroup-v2 path is relative to /sys/fs/cgroup, with or without
+         * the leading '/' of "/proc/<pid>/cgroup" ("0::/system.slice/...");
+         * one which already starts with the mount point is kept as is */
+        static const char CGROUP_MOUNT[] = "/sys/fs/cgroup";
+        const char * cgroup = target->cgroup;
+        size_t mount_len = sizeof CGROUP_MOUNT - 1;
+        int is_mounted = strncmp(cgroup, CGROUP_MOUNT, mount_len) == 0 &&
+                         (cgroup[mount_len] == '/' ||
+                          cgroup[mount_len] == '\0');
+        char cgroup_dname[PATH_MAX];
+        if (is_mounted) {
+            snprintf(cgroup_dname, sizeof cgroup_dname, "%s", cgroup);
+        } else {
+            while (*cgroup == '/')
+                cgroup++;
+            snprintf(cgroup_dname, sizeof cgroup_dname, "%s/%s",
+                     CGROUP_MOUNT, cgroup);
+        }
+        int cgroup_fd = open(cgroup_dname, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (cgroup_fd < 0) {
+            fprintf(stderr, "ERROR: couldn't open the cgroup '%s': %s\n",
+                    cgroup_dname, strerror(errno));
+            return NULL;
+        }
+        /* the perf-events of a cgroup are per-CPU, as the system-wide ones,
+         * but only count while a task of the cgroup (or of its descendants)
+         * runs */
+        fill_perf_event_attr(&attr, options, 0, 0);
+        pid_t cgroup_target = cgroup_fd;
+        sampler = open_sampler(options, &attr, &cgroup_target, 1,
+                               PERF_FLAG_PID_CGROUP, resolver, callback,
+                               callback_arg);
+        if (!sampler) {
+            close(cgroup_fd);
+            return NULL;
+        }
+        sampler->cgroup_fd = cgroup_fd;
+        /* as /proc/<pid>/cgroup gives it, for the scheduler tracepoints */
+        const char * cgroup_path = cgroup_dname + strlen("/sys/fs/cgroup");
+        if (strncmp(cgroup_dname, "/sys/fs/cgroup", 14) != 0)
+            cgroup_path = cgroup_dname;
+        sampler->cgroup_path = strdup(cgroup_path[0] ? cgroup_path : "/");
+        if (!sampler->cgroup_path) {
+            perf_sampler_close(sampler);
+            return NULL;
+        }
+        size_t len = strlen(sampler->cgroup_path);
+        while (len > 1 && sampler->cgroup_path[len - 1] == '/')
+            sampler->cgroup_path[--len] = '\0';
+        load_all_existing_processes(resolver);
+        return sampler;
+    }
+
+    pid_t * tids;
+    ssize_t n_tids = list_target_threads(target, &tids);
+    if (n_tids <= 0)
+        return NULL;
+
+    /* as "perf record -p": one perf-event per thread and per CPU, inherited
+     * by the threads they create. On a large host these are many descriptors */
+    struct rlimit nofile;
+    if (getrlimit(RLIMIT_NOFILE, &nofile) == 0 &&
+        nofile.rlim_cur < nofile.rlim_max) {
+        nofile.rlim_cur = nofile.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &nofile);
+    }
+    fill_perf_event_attr(&attr, options, 1, 0);
+    sampler = open_sampler(options, &attr, tids, (size_t)n_tids, 0, resolver,
+                           callback, callback_arg);
+    if (!sampler) {
+        free(tids);
+        return NULL;
+    }
+
+    /* the mappings of the processes, which won't come as PERF_RECORD_MMAP2
+     * records (the threads are listed by process, so they are consecutive) */
+    pid_t last_tgid = -1;
+    ssize_t t;
+    for (t = 0; t < n_tids; t++) {
+        pid_t tgid = thread_group_of(tids[t]);
+        if (tgid > 0 && tgid != last_tgid)
+            symbol_resolver_load_proc_maps(resolver, tgid);
+        last_tgid = tgid;
+    }
+    free(tids);
+
+    /* the profile ends when all the processes and threads given are gone */
+    sampler->n_attached = target->n_pids + target->n_tids;
+    sampler->attached = calloc(sampler->n_attached, sizeof *sampler->attached);
+    if (!sampler->attached) {
+        perf_sampler_close(sampler);
+        return NULL;
+    }
+    memcpy(sampler->attached, target->pids,
+           target->n_pids * sizeof *target->pids);
+    memcpy(sampler->attached + target->n_pids, target->tids,
+           target->n_tids * sizeof *target->tids);
+    return sampler;
+}
+
+
+int
+perf_sampler_attached_alive(const struct perf_sampler * sampler)
+{
+    if (sampler->n_attached == 0)
+        return 1;
+
+    size_t i;
+    for (i = 0; i < sampler->n_attached; i++) {
+        char proc_dname[64];
+        snprintf(proc_dname, sizeof proc_dname, "/proc/%d",
+                 (int)sampler->attached[i]);
+        if (access(proc_dname, F_OK) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+
+int
+perf_sampler_enable(struct perf_sampler * sampler)
+{
+    unsigned int i;
+    for (i = 0; i < sampler->n_fds; i++)
+        if (ioctl(sampler->fds[i], PERF_EVENT_IOC_ENABLE, 0) != 0)
+            return -1;
+    for (i = 0; i < sampler->n_sched_fds; i++)
+        if (ioctl(sampler->sched_fds[i], PERF_EVENT_IOC_ENABLE, 0) != 0)
+            return -1;
+    return 0;
+}
+
+
+int
+perf_sampler_disable(struct perf_sampler * sampler)
+{
+    unsigned int i;
+    int ret = 0;
+    for (i = 0; i < sampler->n_fds; i++)
+        if (ioctl(sampler->fds[i], PERF_EVENT_IOC_DISABLE, 0) != 0)
+            ret = -1;
+    for (i = 0; i < sampler->n_sched_fds; i++)
+        if (ioctl(sampler->sched_fds[i], PERF_EVENT_IOC_DISABLE, 0) != 0)
+            ret = -1;
+    /* the last records are read by perf_sampler_poll() */
+    stop_readers(sampler);
+    return ret;
+}
+
+
+/* The layout of a PERF_RECORD_SAMPLE with our sample_type of
+ *     PERF_SAMPLE_IDENTIFIER | PERF_SAMPLE_IP | PERF_SAMPLE_TID |
+ *     PERF_SAMPLE_TIME | PERF_SAMPLE_CPU | PERF_SAMPLE_PERIOD
+ * whose fields come in this order in the record, followed, with
+ * PERF_SAMPLE_CALLCHAIN, by the callchain (an u64 "nr" and "nr" u64
+ * addresses) and, for the tracepoints, with PERF_SAMPLE_RAW, by their raw
+ * data (an u32 size and the data), or, for the samples with the LBR
+ * call-stack, with PERF_SAMPLE_BRANCH_STACK, by the branch stack (an u64
+ * "bnr" and "bnr" struct perf_branch_entry) */
+struct sample_record_layout {
+    struct perf_event_header header;
+    unsigned long long       id;
+    unsigned long long       ip;
+    unsigned int             pid, tid;
+    unsigned long long       time;
+    unsigned int             cpu, reserved;
+    unsigned long long       period;
+};
+
+
+/* A field of the raw data of a tracepoint, of 1 to 8 bytes, or 0 if it is
+ * not in the data */
+static unsigned long long
+raw_field_value(const unsigned char * raw, unsigned int raw_size,
+                const struct tracepoint_field * field)
+{
+    if (field->offset + field->size > raw_size)
+        return 0;
+    switch (field->size) {
+    case 1:
+        return raw[field->offset];
+    case 2: {
+        unsigned short value;
+        memcpy(&value, raw + field->offset, sizeof value);
+        return value;
+    }
+    case 4: {
+        unsigned int value;
+        memcpy(&value, raw + field->offset, sizeof value);
+        return value;
+    }
+    case 8: {
+        unsigned long long value;
+        memcpy(&value, raw + field->offset, sizeof value);
+        return value;
+    }
+    default:
+        return 0;
+    }
+}
+
+
+/* Whether the process "pid" is one of those sampled: the scheduler
+ * tracepoints are of the whole system */
+static int
+sched_process_profiled(struct perf_sampler * sampler, pid_t pid)
+{
+    if (sampler->options.system_wide)
+        return 1;
+    if (!symbol_resolver_has_process(sampler->resolver, pid))
+        return 0;
+    if (!sampler->cgroup_path)
+        return 1;
+
+    /* the processes of the cgroup, or of its descendants */
+    const char * cgroup = symbol_resolver_cgroup(sampler->resolver, pid);
+    size_t len = strlen(sampler->cgroup_path);
+    if (len == 1)
+        return 1;   /* the root cgroup */
+    return strncmp(cgroup, sampler->cgroup_path, len) == 0 &&
+           (cgroup[len] == '\0' || cgroup[len] == '/');
+}
+
+
+/* Decode the record of a scheduler tracepoint, whose raw data is in
+ * [raw, raw + raw_size[ */
+static void
+handle_sched_record(struct perf_sampler * sampler,
+                    enum perf_sched_event_type type,
+                    const struct sample_record_layout * record,
+                    const unsigned long long * callchain,
+                    unsigned int callchain_depth, const unsigned char * raw,
+                    unsigned int raw_size)
+{
+    struct perf_sched_event event;
+    memset(&event, 0, sizeof event);
+    event.type = type;
+    event.time = record->time;
+    event.cpu = record->cpu;
+    event.pid = (pid_t)record->pid;
+    event.tid = (pid_t)record->tid;
+    event.callchain = callchain;
+    event.callchain_depth = callchain_depth;
+    if (type == PERF_SCHED_SWITCH) {
+        event.prev_state = raw_field_value(raw, raw_size,
+                                           &sampler->sched.prev_state);
+        event.next_tid = (pid_t)raw_field_value(raw, raw_size,
+                                                &sampler->sched.next_pid);
+        event.profiled = sched_process_profiled(sampler, event.pid);
+    } else {
+        event.wakee_tid = (pid_t)raw_field_value(raw, raw_size,
+                                                 &sampler->sched.wakee_pid);
+    }
+    sampler->sched_callback(sampler->sched_callback_arg, &event);
+}
+
+
+/* Decode a PERF_RECORD_SAMPLE (see sample_record_layout), of our perf-event
+ * or, by its identifier, of one of the scheduler tracepoints of the ring */
+static void
+handle_sample_record(struct perf_sampler * sampler,
+                     const struct perf_ring * ring,
+                     const struct perf_event_header * header)
+{
+    if (header->size < sizeof(struct sample_record_layout))
+        return;
+
+    const struct sample_record_layout * record =
+                                 (const struct sample_record_layout *)header;
+    int sched_type = -1;
+    if (ring->switch_id != 0 && record->id == ring->switch_id)
+        sched_type = PERF_SCHED_SWITCH;
+    else if (ring->wakeup_ids[0] != 0 && (record->id == ring->wakeup_ids[0] ||
+                                          record->id == ring->wakeup_ids[1]))
+        sched_type = PERF_SCHED_WAKEUP;
+    if (sched_type >= 0 && !sampler->sched_callback)
+        return;
+
+    const unsigned char * end = (const unsigned char *)header + header->size;
+    const unsigned char * next = (const unsigned char *)(record + 1);
+    const unsigned long long * callchain = NULL;
+    unsigned int callchain_depth = 0;
+    if ((sched_type < 0 && sampler->options.callchain) ||
+        sched_type == PERF_SCHED_SWITCH) {
+        const unsigned long long * nr = (const unsigned long long *)next;
+        if (next + sizeof *nr <= end &&
+            *nr <= (unsigned long long)(end - next) / sizeof *nr - 1) {
+            callchain = nr + 1;
+            callchain_depth = (unsigned int)*nr;
+            next += (1 + *nr) * sizeof *nr;
+        } else if (sched_type >= 0) {
+            return;
+        }
+    }
+
+    if (sched_type >= 0) {
+        unsigned int raw_size;
+        if (next + sizeof raw_size > end)
+            return;
+        memcpy(&raw_size, next, sizeof raw_size);
+        next += sizeof raw_size;
+        if (raw_size > (size_t)(end - next))
+            return;
+        handle_sched_record(sampler, (enum perf_sched_event_type)sched_type,
+                            record, callchain, callchain_depth, next,
+                            raw_size);
+        return;
+    }
+
+    /* the LBR call-stack, innermost call first: the "from" of each entry is
+     * the address of a call which hasn't returned yet, as in a user-space
+     * callchain unwound by the kernel, after its kernel part */
+    if (sampler->options.callchain &&
+        sampler->options.call_graph == PERF_CALL_GRAPH_LBR) {
+        const unsigned long long * bnr = (const unsigned long long *)next;
+        if (next + sizeof *bnr > end ||
+            *bnr > (unsigned long long)(end - next - sizeof *bnr) /
+                   sizeof(struct perf_branch_entry))
+            return;
+        const struct perf_branch_entry * branches =
+                                    (const struct perf_branch_entry *)(bnr + 1);
+        unsigned int n_branches = (unsigned int)*bnr;
+        if (n_branches > PERF_SAMPLER_MAX_LBR_DEPTH)
+            n_branches = PERF_SAMPLER_MAX_LBR_DEPTH;
+
+        unsigned int depth = 0;
+        unsigned int i;
+        for (i = 0; i < callchain_depth && depth < PERF_MAX_STACK_DEPTH; i++) {
+            if (callchain[i] == PERF_CONTEXT_USER)
+                break;
+            sampler->lbr_callchain[depth++] = callchain[i];
+        }
+        int is_user = (header->misc & PERF_RECORD_MISC_CPUMODE_MASK) ==
+                                                     PERF_RECORD_MISC_USER;
+        if (is_user || n_branches > 0)
+            sampler->lbr_callchain[depth++] = PERF_CONTEXT_USER;
+        if (is_user)
+            sampler->lbr_callchain[depth++] = record->ip;
+        for (i = 0; i < n_branches; i++)
+            sampler->lbr_callchain[depth++] = branches[i].from;
+        callchain = sampler->lbr_callchain;
+        callchain_depth = depth;
+    }
+
+    struct perf_sample sample;
+    sample.ip = record->ip;
+    sample.time = record->time;
+    sample.period = record->period;
+    sample.pid = (pid_t)record->pid;
+    sample.tid = (pid_t)record->tid;
+    sample.cpu = record->cpu;
+    sample.is_kernel = (header->misc & PERF_RECORD_MISC_CPUMODE_MASK) ==
+                                                     PERF_RECORD_MISC_KERNEL;
+    sample.callchain = callchain;
+    sample.callchain_depth = callchain_depth;
+    sample.samples = 1;
+    sampler->callback(sampler->callback_arg, &sample);
+}
+
+
+static void
+handle_record(struct perf_sampler * sampler, struct perf_ring * ring,
+              const struct perf_event_header * header)
+{
+    switch (header->type) {
+    case PERF_RECORD_SAMPLE:
+        handle_sample_record(sampler, ring, header);
+        break;
+
+    case PERF_RECORD_MMAP2: {
+        struct mmap2_record_layout {
+            struct perf_event_header header;
+            unsigned int             pid, tid;
+            unsigned long long       addr, len, pgoff;
+            unsigned char            maj_min_ino_or_build_id[24];
+            unsigned int             prot, flags;
+            char                     filename[];
+        };
+        const struct mmap2_record_layout * record =
+                                   (const struct mmap2_record_layout *)header;
+        if (header->size > sizeof *record) {
+            char filename[4096];
+            size_t len = header->size - sizeof *record;
+            if (len >= sizeof filename)
+                len = sizeof filename - 1;
+            memcpy(filename, record->filename, len);
+            filename[len] = '\0';
+            symbol_resolver_add_mmap(sampler->resolver, (pid_t)record->pid,
+                                     record->addr, record->len, record->pgoff,
+                                     filename);
+        }
+        break;
+    }
+
+    case PERF_RECORD_COMM: {
+        /* u32 pid, tid; char comm[] */
+        const unsigned int * pid_tid = (const unsigned int *)(header + 1);
+        if (pid_tid[0] != pid_tid[1]) {
+            /* the name of a thread, not of the process */
+            symbol_resolver_set_thread_comm(sampler->resolver,
+                                            (pid_t)pid_tid[0],
+                                            (pid_t)pid_tid[1],
+                                            (const char *)(pid_tid + 2));
+            break;
+        }
+        if (header->misc & PERF_RECORD_MISC_COMM_EXEC)
+            symbol_resolver_exec(sampler->resolver, (pid_t)pid_tid[0]);
+        symbol_resolver_set_comm(sampler->resolver, (pid_t)pid_tid[0],
+                                 (const char *)(pid_tid + 2));
+        break;
+    }
+
+    case PERF_RECORD_FORK: {
+        /* u32 pid, ppid, tid, ptid; u64 time */
+        const unsigned int * ids = (const unsigned int *)(header + 1);
+        symbol_resolver_fork(sampler->resolver, (pid_t)ids[1], (pid_t)ids[0]);
+        break;
+    }
+
+    case PERF_RECORD_EXIT: {
+        /* u32 pid, ppid, tid, ptid; u64 time: the process exits when its
+         * main thread does */
+        const unsigned int * ids = (const unsigned int *)(header + 1);
+        if (ids[0] == ids[2])
+            symbol_resolver_exit(sampler->resolver, (pid_t)ids[0]);
+        else
+            symbol_resolver_thread_exit(sampler->resolver, (pid_t)ids[2]);
+        break;
+    }
+
+    case PERF_RECORD_LOST: {
+        /* u64 id, lost */
+        const unsigned long long * lost = (const unsigned long long *)
+                                                                (header + 1);
+        sampler->lost_samples += lost[1];
+        ring->lost += lost[1];
+        break;
+    }
+
+    case PERF_RECORD_THROTTLE:
+        /* the kernel lowered the rate of this CPU: too many interrupts */
+        sampler->throttles++;
+        ring->throttled++;
+        break;
+
+    default:
+        break;
+    }
+}
+
+
+static int
+drain_ring(struct perf_sampler * sampler, struct perf_ring * ring)
+{
+    int n_samples = 0;
+    unsigned long long head = __atomic_load_n(&ring->meta->data_head,
+                                              __ATOMIC_ACQUIRE);
+    unsigned long long tail = ring->meta->data_tail;
+
+    while (tail < head) {
+        unsigned long long offset = tail % ring->data_size;
+        const struct perf_event_header * header =
+                 (const struct perf_event_header *)(ring->data + offset);
+        if (header->size < sizeof *header)
+            break;   /* corrupted ring-buffer: shouldn't happen */
+
+        if (offset + header->size > ring->data_size) {
+            /* the record wraps around the end of the ring-buffer */
+            unsigned long long first_part = ring->data_size - offset;
+            memcpy(sampler->wrapped_record, ring->data + offset, first_part);
+            memcpy(sampler->wrapped_record + first_part, ring->data,
+                   header->size - first_part);
+            header = (const struct perf_event_header *)sampler->wrapped_record;
+        }
+
+        if (header->type == PERF_RECORD_SAMPLE)
+            n_samples++;
+        handle_record(sampler, ring, header);
+        tail += header->size;
+    }
+
+    __atomic_store_n(&ring->meta->data_tail, tail, __ATOMIC_RELEASE);
+    return n_samples;
+}
+
+
+/* Copy the records of a ring, as they are, to the log of its reader, whose
+ * lock is held. If the log can't grow, the records are left in the ring */
+static void
+log_ring_records(struct perf_reader * reader, unsigned int ring_index)
+{
+    struct perf_ring * ring = &reader->sampler->rings[ring_index];
+    unsigned long long head = __atomic_load_n(&ring->meta->data_head,
+                                              __ATOMIC_ACQUIRE);
+    unsigned long long tail = ring->meta->data_tail;
+
+    while (tail < head) {
+        unsigned long long offset = tail % ring->data_size;
+        const struct perf_event_header * header =
+                 (const struct perf_event_header *)(ring->data + offset);
+        if (header->size < sizeof *header)
+            break;   /* corrupted ring-buffer: shouldn't happen */
+
+        size_t needed = reader->log_size + sizeof(struct logged_record) +
+                        header->size;
+        if (needed > reader->log_capacity) {
+            size_t new_capacity = reader->log_capacity ?
+                                  2 * reader->log_capacity : READER_LOG_SIZE;
+            while (new_capacity < needed)
+                new_capacity *= 2;
+            unsigned char * new_log = realloc(reader->log, new_capacity);
+            if (!new_log)
+                break;
+            reader->log = new_log;
+            reader->log_capacity = new_capacity;
+        }
+
+        /* the records are multiples of 8 bytes, as the logged_record, so
+         * the records in the log stay aligned */
+        struct logged_record * entry = (struct logged_record *)
+                                       (reader->log + reader->log_size);
+        entry->ring_index = ring_index;
+        entry->size = header->size;
+        unsigned char * record = (unsigned char *)(entry + 1);
+        if (offset + header->size > ring->data_size) {
+            /* the record wraps around the end of the ring-buffer */
+            unsigned long long first_part = ring->data_size - offset;
+            memcpy(record, ring->data + offset, first_part);
+            memcpy(record + first_part, ring->data, entry->size - first_part);
+        } else {
+            memcpy(record, header, entry->size);
+        }
+        reader->log_size = needed;
+        tail += entry->size;
+    }
+
+    __atomic_store_n(&ring->meta->data_tail, tail, __ATOMIC_RELEASE);
+}
+
+
+static void *
+reader_thread(void * arg)
+{
+    struct perf_reader * reader = arg;
+
+    /* pinned first, so that its log is allocated in the memory of its node
+     * (with the sched_setaffinity() system-call, as the thread itself, so
+     * that no _GNU_SOURCE is needed) */
+    if (syscall(SYS_sched_setaffinity, 0, sizeof reader->cpu_mask,
+                reader->cpu_mask) != 0)
+        fprintf(stderr, "ERROR: couldn't pin a reader thread: %s\n",
+                strerror(errno));
+
+    while (!__atomic_load_n(&reader->stop, __ATOMIC_ACQUIRE)) {
+        if (poll(reader->pollfds, reader->n_rings, 100) < 0 && errno != EINTR)
+            break;
+        pthread_mutex_lock(&reader->lock);
+        unsigned int i;
+        for (i = 0; i < reader->n_rings; i++)
+            log_ring_records(reader, reader->ring_indexes[i]);
+        pthread_mutex_unlock(&reader->lock);
+    }
+    return NULL;
+}
+
+
+/* Swap out the log of a reader, and handle its records, in the order that
+ * they were read. Returns the number of samples. */
+static int
+replay_reader_log(struct perf_sampler * sampler, struct perf_reader * reader)
+{
+    pthread_mutex_lock(&reader->lock);
+    unsigned char * log = reader->log;
+    size_t log_size = reader->log_size;
+    size_t log_capacity = reader->log_capacity;
+    reader->log = reader->spare;
+    reader->log_capacity = reader->spare_capacity;
+    reader->log_size = 0;
+    pthread_mutex_unlock(&reader->lock);
+    reader->spare = log;
+    reader->spare_capacity = log_capacity;
+
+    int n_samples = 0;
+    size_t offset = 0;
+    while (offset < log_size) {
+        const struct logged_record * entry = (const struct logged_record *)
+                                             (log + offset);
+        const struct perf_event_header * header =
+                       (const struct perf_event_header *)(entry + 1);
+        if (header->type == PERF_RECORD_SAMPLE)
+            n_samples++;
+        handle_record(sampler, &sampler->rings[entry->ring_index], header);
+        offset += sizeof *entry + entry->size;
+    }
+    return n_samples;
+}
+
+
+/* The NUMA node of each CPU, from /sys/devices/system/node/node<N>/cpulist,
+ * or -1 */
+static void
+read_cpu_nodes(int * out_node_of_cpu, unsigned int max_cpus)
+{
+    unsigned int cpu;
+    for (cpu = 0; cpu < max_cpus; cpu++)
+        out_node_of_cpu[cpu] = -1;
+
+    DIR * node_dir = opendir("/sys/devices/system/node");
+    if (!node_dir)
+        return;
+    struct dirent * entry;
+    while ((entry = readdir(node_dir)) != NULL) {
+        char * end;
+        if (strncmp(entry->d_name, "node", 4) != 0)
+            continue;
+        long node = strtol(entry->d_name + 4, &end, 10);
+        if (*end != '\0' || end == entry->d_name + 4 || node < 0)
+            continue;
+
+        char cpulist_fname[320];
+        unsigned int node_cpus[4096];
+        snprintf(cpulist_fname, sizeof cpulist_fname,
+                 "/sys/devices/system/node/%s/cpulist", entry->d_name);
+        int n_cpus = read_cpu_list(cpulist_fname, node_cpus,
+                                   sizeof node_cpus / sizeof node_cpus[0]);
+        int i;
+        for (i = 0; i < n_cpus; i++)
+            if (node_cpus[i] < max_cpus)
+                out_node_of_cpu[node_cpus[i]] = (int)node;
+    }
+    closedir(node_dir);
+}
+
+
+/* Start the reader threads of options->readers: one per ring, or one per
+ * NUMA node with the rings of its CPUs. If they can't be started, the rings
+ * are read by perf_sampler_poll() */
+static void
+start_readers(struct perf_sampler * sampler)
+{
+    static int node_of_cpu[4096];
+    const unsigned int max_cpus = sizeof node_of_cpu / sizeof node_of_cpu[0];
+    if (sampler->options.readers == PERF_READERS_PER_NODE)
+        read_cpu_nodes(node_of_cpu, max_cpus);
+
+    sampler->readers = calloc(sampler->n_rings, sizeof *sampler->readers);
+    if (!sampler->readers)
+        return;
+
+    /* the group of each ring: its reader */
+    int reader_groups[4096 + 1];
+    unsigned int i, r;
+    for (i = 0; i < sampler->n_rings; i++) {
+        unsigned int cpu = sampler->rings[i].cpu;
+        int group = sampler->options.readers == PERF_READERS_PER_CPU ?
+                    (int)i : cpu < max_cpus ? node_of_cpu[cpu] : -1;
+        for (r = 0; r < sampler->n_readers; r++)
+            if (reader_groups[r] == group)
+                break;
+        struct perf_reader * reader = &sampler->readers[r];
+        if (r == sampler->n_readers) {
+            reader_groups[sampler->n_readers++] = group;
+            reader->sampler = sampler;
+            reader->ring_indexes = calloc(sampler->n_rings,
+                                          sizeof *reader->ring_indexes);
+            reader->pollfds = calloc(sampler->n_rings,
+                                     sizeof *reader->pollfds);
+            pthread_mutex_init(&reader->lock, NULL);
+            if (!reader->ring_indexes || !reader->pollfds)
+                return;   /* no thread running yet: the poll reads them */
+        }
+        reader->ring_indexes[reader->n_rings] = i;
+        reader->pollfds[reader->n_rings] = sampler->pollfds[i];
+        reader->n_rings++;
+        if (cpu < 8 * sizeof reader->cpu_mask)
+            reader->cpu_mask[cpu / (8 * sizeof(unsigned long))] |=
+                             1UL << (cpu % (8 * sizeof(unsigned long)));
+    }
+
+    for (r = 0; r < sampler->n_readers; r++) {
+        int err = pthread_create(&sampler->readers[r].thread, NULL,
+                                 reader_thread, &sampler->readers[r]);
+        if (err != 0) {
+            fprintf(stderr, "ERROR: pthread_create() of a reader: %s\n",
+                    strerror(err));
+            break;
+        }
+    }
+    sampler->readers_running = r;
+    if (r < sampler->n_readers)
+        stop_readers(sampler);   /* the started ones */
+    else
+        fprintf(stderr, "DEBUG: %u reader threads for %u CPUs\n",
+                sampler->n_readers, sampler->n_rings);
+}
+
+
+/* Stop and join the reader threads which are running: their logs are then
+ * replayed by the next perf_sampler_poll(), which reads the rings itself */
+static void
+stop_readers(struct perf_sampler * sampler)
+{
+    unsigned int r;
+    for (r = 0; r < sampler->readers_running; r++)
+        __atomic_store_n(&sampler->readers[r].stop, 1, __ATOMIC_RELEASE);
+    for (r = 0; r < sampler->readers_running; r++)
+        pthread_join(sampler->readers[r].thread, NULL);
+    sampler->readers_running = 0;
+}
+
+
+int
+perf_sampler_poll(struct perf_sampler * sampler, int timeout_ms)
+{
+    int n_samples = 0;
+    unsigned int i;
+
+    if (sampler->readers_running) {
+        /* the reader threads read the rings: just replay their logs */
+        if (timeout_ms != 0 && poll(NULL, 0, timeout_ms) < 0)
+            return -1;
+        for (i = 0; i < sampler->n_readers; i++)
+            n_samples += replay_reader_log(sampler, &sampler->readers[i]);
+    } else {
+        int ready = poll(sampler->pollfds, sampler->n_rings, timeout_ms);
+        if (ready < 0)
+            return -1;
+
+        /* what the reader threads read before they stopped comes before
+         * what is still in the rings */
+        for (i = 0; i < sampler->n_readers; i++)
+            n_samples += replay_reader_log(sampler, &sampler->readers[i]);
+
+        /* read all the rings, even the ones that didn't wake us: they wake
+         * us only at their watermark (a quarter of the ring) */
+        for (i = 0; i < sampler->n_rings; i++)
+            n_samples += drain_ring(sampler, &sampler->rings[i]);
+    }
+    if (sampler->options.cpu_budget > 0)
+        control_sample_rate(sampler);
+    return n_samples;
+}
+
+
+/* An aggregate of the BPF program as a sample: its leaf is the first frame
+ * of its kernel call-graph if it has one (it was in the kernel), else of its
+ * user-space one, and its callchain is laid out as the kernel gives it */
+static void
+handle_bpf_aggregate(void * callback_arg, const struct bpf_aggregate * aggregate)
+{
+    struct perf_sampler * sampler = callback_arg;
+    if (aggregate->kernel_depth == 0 && aggregate->user_depth == 0) {
+        sampler->bpf_lost_samples += aggregate->samples;
+        return;
+    }
+
+    struct perf_sample sample;
+    memset(&sample, 0, sizeof sample);
+    sample.is_kernel = aggregate->kernel_depth > 0;
+    sample.ip = sample.is_kernel ? aggregate->kernel_stack[0]
+                                 : aggregate->user_stack[0];
+    sample.time = sampler->bpf_flush_time;
+    sample.period = aggregate->period;
+    sample.pid = aggregate->pid;
+    sample.tid = aggregate->tid;
+    sample.cpu = (unsigned int)-1;   /* the aggregates are of all the CPUs */
+    sample.samples = aggregate->samples;
+    if (sampler->options.callchain) {
+        unsigned int depth = 0;
+        unsigned int i;
+        if (aggregate->kernel_depth > 0) {
+            sampler->bpf_callchain[depth++] = PERF_CONTEXT_KERNEL;
+            for (i = 0; i < aggregate->kernel_depth; i++)
+                sampler->bpf_callchain[depth++] = aggregate->kernel_stack[i];
+        }
+        if (aggregate->user_depth > 0) {
+            sampler->bpf_callchain[depth++] = PERF_CONTEXT_USER;
+            for (i = 0; i < aggregate->user_depth; i++)
+                sampler->bpf_callchain[depth++] = aggregate->user_stack[i];
+        }
+        sample.callchain = sampler->bpf_callchain;
+        sample.callchain_depth = depth;
+    }
+    sampler->callback(sampler->callback_arg, &sample);
+}
+
+
+long
+perf_sampler_flush_aggregates(struct perf_sampler * sampler)
+{
+    if (!sampler->bpf)
+        return 0;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    sampler->bpf_flush_time = (unsigned long long)now.tv_sec * 1000000000ULL +
+                              (unsigned long long)now.tv_nsec;
+    return bpf_aggregator_drain(sampler->bpf, handle_bpf_aggregate, sampler);
+}
+
+
+unsigned long long
+perf_sampler_lost_samples(const struct perf_sampler * sampler)
+{
+    if (sampler->bpf)
+        return sampler->lost_samples + sampler->bpf_lost_samples +
+               bpf_aggregator_dropped(sampler->bpf);
+    return sampler->lost_samples;
+}
+
+
+unsigned long long
+perf_sampler_throttles(const struct perf_sampler * sampler)
+{
+    return sampler->throttles;
+}
+
+
+double
+perf_sampler_take_sample_freq(struct perf_sampler * sampler)
+{
+    double sample_freq;
+    if (sampler->ring_seconds > 0) {
+        sample_freq = sampler->freq_seconds / sampler->ring_seconds;
+    } else {
+        double sum = 0;
+        unsigned int i;
+        for (i = 0; i < sampler->n_rings; i++)
+            sum += (double)sampler->rings[i].sample_freq;
+        sample_freq = sampler->n_rings ? sum / sampler->n_rings : 0;
+    }
+    sampler->freq_seconds = sampler->ring_seconds = 0;
+    return sample_freq;
+}
+
+
+void
+perf_sampler_set_sched_callback(struct perf_sampler * sampler,
+                                perf_sched_callback callback,
+                                void * callback_arg)
+{
+    sampler->sched_callback = callback;
+    sampler->sched_callback_arg = callback_arg;
+}
+
+
+const struct perf_sampler_options *
+perf_sampler_get_options(const struct perf_sampler * sampler)
+{
+    return &sampler->options;
+}
+
+
+void
+perf_sampler_close(struct perf_sampler * sampler)
+{
+    if (!sampler)
+        return;
+
+    stop_readers(sampler);
+    unsigned int i;
+    for (i = 0; i < sampler->n_readers; i++) {
+        struct perf_reader * reader = &sampler->readers[i];
+        pthread_mutex_destroy(&reader->lock);
+        free(reader->ring_indexes);
+        free(reader->pollfds);
+        free(reader->log);
+        free(reader->spare);
+    }
+    free(sampler->readers);
+    for (i = 0; i < sampler->n_rings; i++)
+        munmap(sampler->rings[i].meta, sampler->rings[i].mmap_size);
+    for (i = 0; i < sampler->n_fds; i++)
+        close(sampler->fds[i]);
+    for (i = 0; i < sampler->n_sched_fds; i++)
+        close(sampler->sched_fds[i]);
+    bpf_aggregator_free(sampler->bpf);
+    if (sampler->cgroup_fd >= 0)
+        close(sampler->cgroup_fd);
+    free(sampler->rings);
+    free(sampler->pollfds);
+    free(sampler->fds);
+    free(sampler->sched_fds);
+    free(sampler->cgroup_path);
+    free(sampler->attached);
+    free(sampler);
+}
+
+
+pid_t
+perf_sampler_launch_program(char * program_argv[], int * out_start_fd)
+{
+    int start_pipe[2];
+    if (pipe(start_pipe) != 0)
+        return -1;
+
+    /* the child has to wait before its exec(), which posix_spawn() can't
+     * do, so this is a fork(): of a process with other threads (eg., the
+     * uploader), so the child calls only async-signal-safe functions (no
+     * stdio, whose locks another thread may hold) */
+    pid_t child_pid = fork();
+    if (child_pid == 0) {
+        /* child process: wait for the parent to open our perf-events */
+        static const char exec_failed[] = "ERROR: execvp() failed: ";
+        char go;
+        close(start_pipe[1]);
+        if (read(start_pipe[0], &go, 1) != 1)
+            _exit(127);   /* the parent gave up */
+        close(start_pipe[0]);
+        execvp(program_argv[0], program_argv);
+        if (write(STDERR_FILENO, exec_failed, sizeof exec_failed - 1) > 0 &&
+            write(STDERR_FILENO, program_argv[0], strlen(program_argv[0])) > 0)
+            (void)write(STDERR_FILENO, "\n", 1);
+        _exit(127);
+    }
+
+    close(start_pipe[0]);
+    if (child_pid < 0) {
+        close(start_pipe[1]);
+        return -1;
+    }
+    *out_start_fd = start_pipe[1];
+    return child_pid;
+}
+
+
+int
+perf_sampler_start_program(int start_fd)
+{
+    char go = 1;
+    ssize_t written = write(start_fd, &go, 1);
+    close(start_fd);
+    return written == 1 ? 0 : -1;
+}
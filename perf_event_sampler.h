@@ -0,0 +1,310 @@
+
+/* The native sampling engine: it calls the perf_event_open() system-call
+ * directly, one perf-event per CPU, and reads the samples from the ring-
+ * buffers mmap'ed from those perf-events, instead of forking a "perf record"
+ * that writes a perf.data file to be read back later by a "perf report".
+ *
+ * The sampler is given a callback, which it calls for each sample read from
+ * the ring-buffers. The other records in the ring-buffers (mmaps, forks and
+ * execs of the processes) are used to keep a symbol_resolver updated, so that
+ * the callback can symbolize the samples whenever it wants (but note that the
+ * ring-buffers of the different CPUs are read independently, so a sample can
+ * be delivered before the PERF_RECORD_MMAP2 of the library it falls in, if
+ * they happened in different CPUs: it is better to defer the symbolization of
+ * the samples till the end of the poll in which they were read).
+ *
+ * With options->off_cpu, the sampler also opens the sched:sched_switch and
+ * sched:sched_wakeup tracepoints of the kernel on each CPU, whose records go
+ * to the same ring-buffers, and are given to another callback (see
+ * perf_sampler_set_sched_callback()), for the time that the threads spend
+ * off the CPUs: blocked, or waiting in the run-queue.
+ *
+ * The call-graphs ("-g") are unwound by the kernel from the frame-pointers,
+ * which most optimized binaries don't have, or, with options->call_graph at
+ * PERF_CALL_GRAPH_LBR, their user-space part is taken from the LBR
+ * call-stack of the CPU (the hardware keeps the return addresses of the
+ * last calls, at no cost to the program), and given to the callback in the
+ * same format. The precise sampling (options->precise_ip) attributes the
+ * samples to the instruction which caused them, without the "skid" of the
+ * interrupts: PEBS on Intel, IBS on AMD. Both fall back, as "perf record"
+ * does, when the CPU (or the virtual machine) doesn't have them.
+ */
+
+#ifndef PERF_EVENT_SAMPLER_H_
+#define PERF_EVENT_SAMPLER_H_
+
+#include <sys/types.h>
+
+#include "symbol_resolver.h"
+
+
+/* The threads which read the ring-buffers */
+enum perf_readers {
+    PERF_READERS_NONE = 0,     /* the caller of perf_sampler_poll() */
+    PERF_READERS_PER_NODE,     /* one thread per NUMA node, pinned to it */
+    PERF_READERS_PER_CPU       /* one thread per CPU, pinned to it */
+};
+
+
+/* Where the user-space part of the call-graphs comes from ("--call-graph") */
+enum perf_call_graph {
+    PERF_CALL_GRAPH_FP = 0,    /* the frame-pointers, unwound by the kernel */
+    PERF_CALL_GRAPH_LBR        /* the LBR call-stack (Intel, since Haswell) */
+};
+
+
+/* The most frames of a user-space call-graph from the LBR call-stack (the
+ * hardware has 8 to 32 entries) */
+#define PERF_SAMPLER_MAX_LBR_DEPTH  32
+
+
+struct perf_sampler_options {
+    int                system_wide;     /* "-a": all the processes */
+    const char *       event_name;      /* "-e": see perf_sampler_parse_event() */
+    unsigned int       event_type;      /* PERF_TYPE_* */
+    unsigned long long event_config;    /* PERF_COUNT_* */
+    unsigned long long sample_freq;     /* "-F": samples per second */
+    unsigned long long sample_period;   /* "-c": events per sample, or 0 */
+    unsigned int       mmap_pages;      /* "-m": pages per ring (power of 2) */
+    int                callchain;       /* "-g": sample the call-graphs */
+    enum perf_call_graph call_graph;    /* "--call-graph=fp|lbr" */
+    unsigned int       precise_ip;      /* the ":p" of "-e": 0 to 3 */
+    double             cpu_budget;      /* the adaptive rate: the fraction of
+                                         * a CPU that the profiler may use,
+                                         * or 0 for a fixed "-F" */
+    enum perf_readers  readers;         /* see perf_sampler_poll() */
+    int                off_cpu;         /* the scheduler tracepoints too */
+    int                bpf;             /* aggregate the samples in the
+                                         * kernel: see "bpf_aggregator.h" and
+                                         * perf_sampler_flush_aggregates() */
+};
+
+
+/* A sample, as decoded from a PERF_RECORD_SAMPLE in the ring-buffers */
+struct perf_sample {
+    unsigned long long ip;
+    unsigned long long time;
+    unsigned long long period;
+    pid_t              pid;
+    pid_t              tid;
+    unsigned int       cpu;
+    int                is_kernel;
+    /* with options->callchain, the call-graph, from the leaf (ip) to the
+     * outermost caller, as given by the kernel, with its PERF_CONTEXT_KERNEL
+     * and PERF_CONTEXT_USER markers: it points inside the ring-buffer, so it
+     * is valid only during the sample callback */
+    const unsigned long long * callchain;
+    unsigned int       callchain_depth;
+    /* the samples that this one stands for: 1 from the ring-buffers, or the
+     * count of an aggregate of options->bpf, whose period is their sum (and
+     * whose time is the flush) */
+    unsigned long long samples;
+};
+
+
+typedef void (*perf_sample_callback)(void * callback_arg,
+                                     const struct perf_sample * sample);
+
+
+enum perf_sched_event_type {
+    PERF_SCHED_SWITCH,      /* "tid" leaves the CPU, "next_tid" gets it */
+    PERF_SCHED_WAKEUP       /* "wakee_tid" becomes runnable */
+};
+
+/* The state of a thread which leaves the CPU, as the sched_switch
+ * tracepoint reports it ("prev_state"): 0 if it is still runnable (it was
+ * preempted, or it yielded), else the bits of its sleep or of its exit */
+#define PERF_SCHED_STATE_RUNNABLE_MASK  0xff
+#define PERF_SCHED_STATE_EXITED_MASK    0x30   /* EXIT_DEAD, EXIT_ZOMBIE */
+
+/* A record of the scheduler tracepoints. The pid and tid are those of the
+ * thread which was running on the CPU: for a switch, the one which leaves
+ * it, whose user-space call-graph is given (where it blocked); for a wakeup,
+ * the waker. */
+struct perf_sched_event {
+    enum perf_sched_event_type type;
+    unsigned long long         time;
+    unsigned int               cpu;
+    pid_t                      pid;
+    pid_t                      tid;
+    /* whether "pid" is one of the processes sampled (always, with
+     * options->system_wide): the tracepoints are of the whole system */
+    int                        profiled;
+    unsigned long long         prev_state;   /* PERF_SCHED_SWITCH */
+    pid_t                      next_tid;     /* PERF_SCHED_SWITCH */
+    pid_t                      wakee_tid;    /* PERF_SCHED_WAKEUP */
+    /* as the callchain of a perf_sample (but without the kernel part), valid
+     * only during the callback */
+    const unsigned long long * callchain;
+    unsigned int               callchain_depth;
+};
+
+
+typedef void (*perf_sched_callback)(void * callback_arg,
+                                    const struct perf_sched_event * event);
+
+
+struct perf_sampler;
+
+
+/* Fill "options" with the same defaults as "perf record": the "cycles" event
+ * at 4000 samples per second, and ring-buffers of 128 pages. */
+void
+perf_sampler_default_options(struct perf_sampler_options * options);
+
+
+/* Translate the name of an event to "-e" ("cycles", "instructions",
+ * "cpu-clock", ...) into its perf_event_attr type and config. Returns 0 on
+ * success, or -1 if the name is not known. */
+int
+perf_sampler_parse_event(const char * event_name, unsigned int * out_type,
+                         unsigned long long * out_config);
+
+
+/* Open one perf-event per online CPU, which sample the process "target_pid"
+ * (and its descendants), or all the processes if options->system_wide, and
+ * mmap their ring-buffers. The perf-events are created disabled, and are
+ * enabled by perf_sampler_enable() or, for the "target_pid", when it does
+ * its exec() (see perf_sampler_launch_program()). Returns NULL on error. */
+struct perf_sampler *
+perf_sampler_open(const struct perf_sampler_options * options,
+                  pid_t target_pid, struct symbol_resolver * resolver,
+                  perf_sample_callback callback, void * callback_arg);
+
+
+/* The processes, threads or cgroup which perf_sampler_attach() samples */
+struct perf_sampler_target {
+    const pid_t * pids;      /* processes: all their threads */
+    size_t        n_pids;
+    const pid_t * tids;      /* only these threads of their processes */
+    size_t        n_tids;
+    const char *  cgroup;    /* or a cgroup (a path relative to /sys/fs/cgroup,
+                              * as in /proc/<pid>/cgroup, with or without its
+                              * leading '/' or the mount point), all its
+                              * processes, or NULL */
+};
+
+
+/* Open the perf-events on processes, threads or a cgroup which are already
+ * running, without forking nor stopping them (the threads that they create
+ * later are sampled too), and load their mappings from /proc. As with
+ * perf_sampler_open(), the perf-events are created disabled, till
+ * perf_sampler_enable(). Returns NULL on error. */
+struct perf_sampler *
+perf_sampler_attach(const struct perf_sampler_options * options,
+                    const struct perf_sampler_target * target,
+                    struct symbol_resolver * resolver,
+                    perf_sample_callback callback, void * callback_arg);
+
+
+/* Whether any of the processes or threads given to perf_sampler_attach() is
+ * still running (always 1 for a cgroup, or without perf_sampler_attach()) */
+int
+perf_sampler_attached_alive(const struct perf_sampler * sampler);
+
+
+int
+perf_sampler_enable(struct perf_sampler * sampler);
+
+
+int
+perf_sampler_disable(struct perf_sampler * sampler);
+
+
+/* Wait up to "timeout_ms" milliseconds (-1 is forever) for a ring-buffer to
+ * be a quarter full (its watermark), and read all the records that the rings
+ * have, calling the sample callback for each sample. Returns the number of
+ * samples read, or -1 on error (errno is EINTR if it was interrupted by a
+ * signal).
+ *
+ * With options->readers, the rings are read by reader threads instead, each
+ * pinned to its CPU or NUMA node, which copy their records into logs of
+ * their own, in the memory of their node and without any lock shared with
+ * the other readers: perf_sampler_poll() then waits "timeout_ms", and
+ * replays the records of the logs, so that the callback and the resolver
+ * are still called only by its caller. The readers only take over the
+ * draining of the rings (so that they don't overflow while the caller is
+ * busy): the decoding of the records, their symbolization and their
+ * aggregation all still run in the thread of perf_sampler_poll().
+ * perf_sampler_disable() stops the reader threads: the next
+ * perf_sampler_poll() reads the last records. */
+int
+perf_sampler_poll(struct perf_sampler * sampler, int timeout_ms);
+
+
+/* With options->bpf, the samples are not in the ring-buffers, but in the
+ * maps of the BPF program, which perf_sampler_poll() doesn't read: this calls
+ * the sample callback with each aggregate of the window (a sample whose
+ * "samples" is their count), and starts a new window. Call it often enough
+ * for the maps to hold the distinct call-graphs in between (about every
+ * second), before reading the counters of a window, and after the last
+ * poll. Returns the number of
+ * aggregates, 0 without options->bpf, or -1 on error. */
+long
+perf_sampler_flush_aggregates(struct perf_sampler * sampler);
+
+
+/* Counters of records that were not samples, but that tell about the
+ * quality of the profile (with options->bpf, the lost samples are those
+ * which didn't fit in the maps of their window). */
+unsigned long long
+perf_sampler_lost_samples(const struct perf_sampler * sampler);
+
+
+unsigned long long
+perf_sampler_throttles(const struct perf_sampler * sampler);
+
+
+/* With options->cpu_budget, perf_sampler_poll() adjusts the frequency of
+ * each CPU about every second, to keep the CPU time of this process (the
+ * reading and the aggregation of the samples) within the budget: it lowers
+ * it multiplicatively on the CPUs which lost records or were throttled by
+ * the kernel, and it scales all of them by the ratio of the budget to the
+ * overhead, up to the limit of the kernel (perf_event_max_sample_rate).
+ *
+ * This returns the mean frequency of the CPUs, weighted by time, since the
+ * previous call (or the current mean, if no time passed), and restarts the
+ * mean. Note that only the perf-events we opened are adjusted, not the ones
+ * inherited by the processes that the program forks, and that there is no
+ * adaptive rate with options->bpf, where the cost of the samples is in the
+ * kernel, and not in the CPU time of this process. */
+double
+perf_sampler_take_sample_freq(struct perf_sampler * sampler);
+
+
+/* Give the records of the scheduler tracepoints to "callback", which is
+ * called, as the sample callback, by perf_sampler_poll() (without a
+ * callback, they are ignored) */
+void
+perf_sampler_set_sched_callback(struct perf_sampler * sampler,
+                                perf_sched_callback callback,
+                                void * callback_arg);
+
+
+/* The options with which the perf-events were really opened: eg., with the
+ * "cpu-clock" event if there was no hardware "cycles" event, without
+ * off_cpu if the scheduler tracepoints couldn't be opened, or without bpf if
+ * the BPF program couldn't be loaded */
+const struct perf_sampler_options *
+perf_sampler_get_options(const struct perf_sampler * sampler);
+
+
+void
+perf_sampler_close(struct perf_sampler * sampler);
+
+
+/* Fork the <program> to sample, but the child process waits, before doing its
+ * execvp(), till perf_sampler_start_program() is called, so that its perf-
+ * events can be opened with its pid before it starts running. Returns the pid
+ * of the child process, or -1 on error; *out_start_fd is the descriptor to
+ * pass later to perf_sampler_start_program(). */
+pid_t
+perf_sampler_launch_program(char * program_argv[], int * out_start_fd);
+
+
+/* Let the child process of perf_sampler_launch_program() do its execvp() */
+int
+perf_sampler_start_program(int start_fd);
+
+
+#endif  /* PERF_EVENT_SAMPLER_H_ */
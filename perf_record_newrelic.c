@@ -23,9 +23,19 @@
  * also make difficult to parse results from "perf report" to NewRelic:
  * such options will need to be sanitized too.)
  *
- * Todo: not to invoke two sub-processes "perf record" and "perf report" via a
- *       perf.data file, but the system-call perf_counter_open() directly to
- *       NewRelic.
+ * With the "--native" option (before the options-to-perf-record), this
+ * program doesn't invoke the two sub-processes "perf record" and "perf report"
+ * via a perf.data file, but the system-call perf_event_open() directly, and
+ * the samples are read from the mmap'ed ring-buffers of the perf-events and
+ * symbolized in memory, to be sent to NewRelic (see "perf_event_sampler.h"
+ * and "symbol_resolver.h"). Only a subset of the options to "perf record" is
+ * understood in this native mode: "-a", "-e <event>", "-F <freq>",
+ * "-c <count>" and "-m <pages>".
+ *
+ * With the "--counters" option, the native engine doesn't sample, but
+ * counts, as "perf stat": cycles, instructions, cache and branch misses, and
+ * their derived IPC, cache MPKI and branch-miss rate are sent as numeric
+ * metrics to NewRelic (see "perf_event_counters.h").
  *
  * Very first version from Linux Performance Counters to New Relic
  *
@@ -34,13 +44,19 @@
  */
 
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
 #include <linux/limits.h>
+#include <linux/perf_event.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 
@@ -48,28 +64,428 @@
 #include "newrelic_common.h"
 #include "newrelic_transaction.h"
 #include "newrelic_collector_client.h"
+#include "address_aggregation.h"
+#include "arena.h"
+#include "latency_histogram.h"
+#include "metric_spool.h"
+
+#include "perf_event_counters.h"
+#include "perf_event_sampler.h"
+#include "newrelic_uploader.h"
+#include "off_cpu.h"
+#include "perf_report_parser.h"
+#include "sample_aggregation.h"
+#include "stack_trie.h"
+#include "symbol_aggregation.h"
+#include "symbol_baseline.h"
+#include "symbol_resolver.h"
+
+
+/* How the samples of the whole host are grouped into New Relic transactions
+ * in the daemon mode: the processes in a container are always grouped by
+ * their container */
+enum process_grouping {
+    GROUP_BY_COMM = 0,    /* a transaction per program name (the default) */
+    GROUP_BY_PID,         /* a transaction per process */
+    GROUP_BY_CGROUP       /* a transaction per cgroup (eg., systemd unit) */
+};
+
+
+/* What is sent to New Relic of the call-graphs of the samples ("-g") */
+enum stack_upload {
+    STACKS_NONE = 0,
+    STACKS_INCLUSIVE,     /* the top-K frames by inclusive cost */
+    STACKS_FOLDED         /* the folded stacks, for a flame-graph */
+};
+
+
+/* How the samples are broken down by thread ("--breakdown[=...]"), to see
+ * which threads, or which pool of threads, of a program are hot */
+enum thread_breakdown_key {
+    BREAKDOWN_NONE = 0,
+    BREAKDOWN_BY_THREAD,  /* "<comm>/<tid>" */
+    BREAKDOWN_BY_COMM,    /* the name of the thread */
+    BREAKDOWN_BY_POOL     /* its name without its number ("worker-12") */
+};
+
+
+/* A running "perf report", whose output is read from the pipe "fd" */
+struct perf_report_process {
+    pid_t pid;
+    int   fd;
+};
+
+
+/* A named set of options-to-perf-record ("--preset=NAME"), so that the
+ * overhead of the profile is the same across the fleet: a fixed frequency
+ * and a bound ring-buffer, and, without call_graphs, none of the "-g",
+ * "--call-graph" and "--stacks" given besides */
+struct perf_record_preset {
+    const char *         name;
+    const char * const * options;      /* NULL-terminated */
+    int                  call_graphs;
+};
+
+
+/* The options of this wrapper itself, which come right after the
+ * NewRelic_license_key and before the options-to-perf-record */
+struct wrapper_options {
+    int native_sampling;     /* "--native": use perf_event_open() directly */
+    int counting;            /* "--counters": count, as "perf stat" */
+    unsigned int interval;   /* "--interval=N": flush every N seconds */
+    unsigned int top_symbols;   /* "--top=K": upload only the top-K symbols */
+    int symbol_metrics;         /* "--metrics": the symbols as metrics */
+    int rollup_by_dso;          /* "--rollup=dso": only the DSOs, as metrics */
+    int daemon;                 /* "--daemon": profile the whole host */
+    enum process_grouping group_by;   /* "--group-by=...", for --daemon */
+    unsigned int top_groups;    /* "--top-groups=N", for --daemon */
+    enum stack_upload stacks;   /* "--stacks=...", or "inclusive" with -g */
+    const char * report_fields; /* "--report-fields=...": perf report -F */
+    const char * symbol_cache_dir;    /* "--symbol-cache=DIR", or NULL */
+    int pipe_mode;              /* "--pipe": perf record | perf report */
+    /* "--pid=", "--tid=", "--cgroup=": attach to them, without a program */
+    struct perf_sampler_target attach;
+    int attaching;
+    unsigned int duration;      /* "--duration=S": stop after S seconds */
+    int signal_control;         /* "--signal-control": SIGUSR1 starts */
+    double cpu_budget;          /* "--cpu-budget=PCT": the adaptive rate */
+    enum perf_readers readers;  /* "--readers=node|cpu": reader threads */
+    const char * spool_fname;   /* "--spool=FILE": while NewRelic is down */
+    size_t spool_size;          /* "--spool-size=MB", in bytes */
+    int differential;           /* "--differential": only the regressions */
+    double diff_threshold;      /* "--diff-threshold=PCT", in points of % */
+    int off_cpu;                /* "--off-cpu": the time off the CPUs too */
+    int bpf;                    /* "--bpf": aggregate in the kernel */
+    enum thread_breakdown_key breakdown;   /* "--breakdown=..." */
+    unsigned int max_breakdown;            /* "--max-breakdown=N" */
+    const struct perf_record_preset * preset;   /* "--preset=NAME" */
+};
+
+/* The default number of symbols uploaded to New Relic per flush window */
+const unsigned int DEFAULT_TOP_SYMBOLS = 100;
+
+/* With --breakdown, the default number of threads (or comms, or pools)
+ * with metrics of their own per window, the others being summed into
+ * "[other]", and the number of symbols sent for each of them */
+const unsigned int DEFAULT_MAX_BREAKDOWN = 16;
+const unsigned int BREAKDOWN_TOP_SYMBOLS = 10;
+
+/* The native sampler symbolizes the hottest locations of a window till it
+ * has this many times the top-K symbols, and not the rest */
+const unsigned int LAZY_SYMBOLIZATION_MARGIN = 2;
+
+/* The second key of the aggregates by one name only (by DSO, by thread, by
+ * group), which must be the same pointer in all of them, since they are
+ * compared by pointer */
+static const char NO_SO_OBJECT[] = "";
+
+/* In the daemon mode: the default flush interval, and the default number of
+ * processes or containers with a transaction of their own per window (the
+ * others are grouped into one "[other]" transaction) */
+const unsigned int DEFAULT_DAEMON_INTERVAL = 60;
+const unsigned int DEFAULT_TOP_GROUPS = 20;
+
+/* The folded stacks are sent as attributes of at most 255 chars (the limit
+ * of New Relic), of which there are at most FOLDED_STACKS_MAX_CHUNKS per
+ * window; the stacks with less than FOLDED_STACKS_MIN_SHARE of the samples
+ * are folded into their callers */
+const unsigned int FOLDED_STACKS_MAX_CHUNKS = 64;
+const double FOLDED_STACKS_MIN_SHARE = 0.001;
+
+/* With --differential, a symbol of a window is a regression if its share of
+ * the samples grew, against the rolling baseline, by at least
+ * DEFAULT_DIFF_THRESHOLD points of percentage (or --diff-threshold) and by
+ * at least DIFFERENTIAL_MIN_Z standard deviations of the baseline */
+const double DEFAULT_DIFF_THRESHOLD = 1.0;
+const double DIFFERENTIAL_MIN_Z = 3.0;
+
+/* With --bpf, the maps of the BPF program are drained into the profile every
+ * BPF_DRAIN_INTERVAL seconds, whatever the flush interval (or without one),
+ * so that they hold the distinct call-graphs of a second, not of a window */
+const unsigned int BPF_DRAIN_INTERVAL = 1;
+
+/* The columns requested to "perf report --fields=", separated by a tab
+ * (a char that doesn't appear in the symbols), and parsed by their names in
+ * the header line, so that the layout is fixed whatever the sort options */
+const char DEFAULT_PERF_REPORT_FIELDS[] = "overhead,period,sample,pid,dso,sym";
+const char PERF_REPORT_FIELD_SEPARATOR = '\t';
+
+/* The options of "perf record" which take a value, so that a value in the
+ * next argument ("-e cycles", "--call-graph dwarf") is not taken for the
+ * <program>; the other options are flags, or take their optional value only
+ * after a '=' ("--switch-output=1G"). The options which break the "perf
+ * report" of the wrapper (its perf.data file, or its pipe) are dropped.
+ * This is the list of "perf record -h" of perf 6.x. */
+struct perf_record_option {
+    char         short_name;    /* or 0 */
+    const char * long_name;     /* or NULL */
+    int          has_value;
+    int          dropped;
+};
+static const struct perf_record_option PERF_RECORD_OPTIONS[] = {
+    { 'e', "event",          1, 0 },
+    { 0,   "filter",         1, 0 },
+    { 'F', "freq",           1, 0 },
+    { 'c', "count",          1, 0 },
+    { 'p', "pid",            1, 0 },
+    { 't', "tid",            1, 0 },
+    { 'u', "uid",            1, 0 },
+    { 'C', "cpu",            1, 0 },
+    { 'G', "cgroup",         1, 0 },
+    { 'm', "mmap-pages",     1, 0 },
+    { 0,   "call-graph",     1, 0 },
+    { 'j', "branch-filter",  1, 0 },
+    { 'r', "realtime",       1, 0 },
+    { 'D', "delay",          1, 0 },
+    { 'k', "clockid",        1, 0 },
+    { 0,   "affinity",       1, 0 },
+    { 0,   "max-size",       1, 0 },
+    { 0,   "proc-map-timeout", 1, 0 },
+    { 0,   "mmap-flush",     1, 0 },
+    { 0,   "control",        1, 0 },
+    { 0,   "num-thread-synthesize", 1, 0 },
+    { 0,   "synth",          1, 0 },
+    { 0,   "pfm-events",     1, 0 },
+    { 0,   "setup-filter",   1, 0 },
+    { 0,   "off-cpu-thresh", 1, 0 },
+    { 'b', "branch-any",     0, 0 },
+    { 'o', "output",         1, 1 },
+    { 0,   "switch-output",  0, 1 },   /* several perf.data files */
+    { 0,   "switch-output-event", 1, 1 },   /* the same, at an event */
+    { 0,   "switch-max-files", 1, 1 },   /* of --switch-output */
+    { 0,   "timestamp-filename", 0, 1 },   /* not the perf.data file */
+    { 0,   "dry-run",        0, 1 },   /* no profile at all */
+    { 'h', "help",           0, 1 },   /* no profile at all */
+    { 0,   NULL,             0, 0 }
+};
+
+/* The low-overhead presets: eg., "prod-light" samples 49 times a second,
+ * off the beat of the periodic work at 50 or 100 Hz, in rings of 16 pages
+ * per CPU, and unwinds no call-graph */
+static const char * const PRESET_PROD_LIGHT[] = {
+    "-F", "49", "-m", "16", NULL
+};
+static const char * const PRESET_PROD_STACKS[] = {
+    "-F", "49", "-m", "64", "-g", NULL
+};
+static const char * const PRESET_DETAILED[] = {
+    "-F", "999", "-m", "256", "-g", NULL
+};
+static const struct perf_record_preset PERF_RECORD_PRESETS[] = {
+    { "prod-light",  PRESET_PROD_LIGHT,  0 },
+    { "prod-stacks", PRESET_PROD_STACKS, 1 },
+    { "detailed",    PRESET_DETAILED,    1 },
+    { NULL,          NULL,               0 }
+};
+
+
+/* How the samples and the periods of a symbol (or of a thread) are turned
+ * into the CPU time that they represent. A sample is not a slice of the
+ * wall-clock duration of the program (it is not when the program has several
+ * threads, or when it sleeps), but of the CPU time of the sampled threads:
+ *
+ *   - with a clock event ("cpu-clock", "task-clock"), the periods of the
+ *     samples are the nanoseconds of CPU time between them;
+ *   - with a frequency ("-F", the default of "perf record"), the kernel
+ *     adjusts the period so that there are "sample_freq" samples for each
+ *     second that the event is active on a CPU, ie., that the thread runs;
+ *   - with a fixed period ("-c") of another event, the CPU time is not
+ *     known, and only the samples and their periods are reported.
+ */
+struct sample_cost_model {
+    const char *       event_name;          /* what the periods count */
+    int                period_in_nsecs;     /* a clock event */
+    unsigned long long sample_freq;         /* 0 with a fixed period */
+    double             seconds_per_weight;  /* only if there are no samples
+                                             * (an old "perf report"): the
+                                             * percentages of wall-clock */
+};
+
+/* The cost model of the intervals off the CPUs (see "off_cpu.h"), whose
+ * "periods" are the nanoseconds off the CPUs */
+static const struct sample_cost_model OFF_CPU_COST_MODEL = {
+    "sched:sched_switch", 1, 0, 0
+};
+
+
+/* How much a profile can be trusted: the samples that the kernel lost (its
+ * ring-buffers were full), the times that it throttled the sampling (too
+ * many interrupts), the samples whose symbol is not known, and the lines of
+ * "perf report" that couldn't be parsed. They are sent as metrics next to
+ * each profile, to tune the -m and the -F */
+struct profile_quality {
+    unsigned long long samples;
+    unsigned long long lost_samples;
+    unsigned long long unresolved_samples;
+    unsigned long long throttles;      /* only known by the native sampler */
+    int                has_throttles;
+    unsigned long long parse_failures; /* only with "perf report" */
+    int                has_parse_failures;
+};
+
+
+/* The in-memory profile collected by the native sampler: the raw samples,
+ * which are symbolized only when they are uploaded, after all the mmaps of
+ * the processes were seen in the ring-buffers, and then added per symbol in
+ * the aggregation table */
+struct native_profile {
+    struct symbol_resolver *    resolver;
+    struct symbol_aggregation * aggregation;
+    struct address_aggregation * addresses;   /* before symbolizing them */
+    struct symbol_aggregation * unresolved;   /* per (dso, "") */
+    struct stack_trie *         stacks;       /* NULL without --stacks */
+    struct symbol_baseline *    baseline;     /* NULL without --differential */
+    struct off_cpu_tracker *    off_cpu;      /* NULL without --off-cpu */
+    struct sample_cost_model    cost_model;
+    const struct wrapper_options * options;
+    struct perf_sample *        samples;
+    size_t                      n_samples;
+    size_t                      capacity;
+    /* the samples that they stand for: with --bpf, each one is the
+     * aggregate of the samples of a call-graph */
+    unsigned long long          samples_count;
+    unsigned long long          lost_samples;    /* since the start */
+    unsigned long long          throttles;
+    unsigned long long          window_lost_samples;   /* in the window */
+    unsigned long long          window_throttles;
+    unsigned long long          unresolved_samples;    /* of the window */
+    double                      sample_freq;  /* with --cpu-budget, the mean
+                                               * -F of the window, or 0 */
+    /* the callchains of the samples, one after the other: the samples do
+     * not point to theirs, which are found by adding their depths */
+    unsigned long long *        callchain_ips;
+    size_t                      n_callchain_ips;
+    size_t                      callchain_capacity;
+};
 
 
 int
 usage_and_exit(void);
 
 
+static int
+parse_native_sampler_options(int in_program_argc, char * in_program_argv[],
+                             struct perf_sampler_options * out_options,
+                             int warn_unsupported);
+
+
+static void
+sample_cost_model_from_options(const struct perf_sampler_options * options,
+                               struct sample_cost_model * out_cost_model);
+
+
+static int
+open_cloexec_pipe(int out_fds[2]);
+
+
+static int
+spawn_perf_report(const char * in_perf_data_fname, int stdin_fd,
+                  const struct wrapper_options * wrapper_opts,
+                  struct perf_report_process * out_report);
+
+
+static int
+finish_perf_report(struct perf_report_process * report);
+
+
+static void
+record_sampler_metrics_to_NewRelic(const struct native_profile * profile,
+                                   const struct timespec * duration);
+
+
+static void
+timespec_difference(const struct timespec * start, const struct timespec * end,
+                    struct timespec * out_difference);
+
+
+static void
+record_segment_latency(struct latency_histogram * histogram,
+                       const struct timespec * duration);
+
+
+static void
+record_segment_latencies_to_NewRelic(void);
+
+
+static void
+record_self_metrics_to_NewRelic(void);
+
+
+static double
+seconds_since(const struct timespec * start);
+
+
 void
-newrelic_perf_counters_wrapper(int program_argc, char * program_argv[]);
+newrelic_perf_counters_wrapper(const struct wrapper_options * wrapper_opts,
+                               int program_argc, char * program_argv[]);
 
 
 int
 execute_perf_record_and_program(int in_program_argc, char * in_program_argv[],
+                                int call_graph, int pipe_output_fd,
                                 struct timespec * out_duration,
                                 char * out_perf_data_file);
 
 
+static int
+perf_record_option_arguments(int in_argc, char * in_argv[],
+                             const struct perf_record_option ** out_option);
+
+
+static char **
+apply_perf_record_preset(const struct perf_record_preset * preset,
+                         int * in_out_argc, char * in_argv[]);
+
+
 int
-upload_perf_report_to_NewRelic(char * in_perf_data_fname,
+upload_perf_report_to_NewRelic(struct perf_report_process * in_report,
                                const struct timespec * prog_exec_duration,
+                               const struct wrapper_options * wrapper_opts,
+                               const struct sample_cost_model * cost_model,
                                long newrelic_transaction);
 
 
+int
+execute_native_sampler_and_program(int in_program_argc,
+                                   char * in_program_argv[],
+                                   unsigned int flush_interval,
+                                   struct timespec * out_duration,
+                                   struct native_profile * out_profile);
+
+
+int
+upload_native_profile_to_NewRelic(struct native_profile * in_profile,
+                                  const struct timespec * prog_exec_duration,
+                                  const char * const * sample_groups,
+                                  const char * const * off_cpu_groups,
+                                  const char * group,
+                                  long newrelic_transaction);
+
+
+void
+upload_native_window_to_NewRelic(struct native_profile * in_profile,
+                                 const struct timespec * window_duration,
+                                 unsigned long window_number);
+
+
+void
+upload_native_groups_to_NewRelic(struct native_profile * in_profile,
+                                 const struct timespec * window_duration,
+                                 unsigned long window_number);
+
+
+int
+execute_counters_and_program(int in_program_argc, char * in_program_argv[],
+                             struct timespec * out_duration,
+                             struct perf_counter_totals * out_totals);
+
+
+int
+upload_perf_counters_to_NewRelic(const struct perf_counter_totals * totals,
+                                 const struct timespec * prog_exec_duration,
+                                 long newrelic_transaction);
+
+
 /*
  * The general idea of this C program is this flow:
  *
@@ -105,19 +521,85 @@ upload_perf_report_to_NewRelic(char * in_perf_data_fname,
  *                   'perf record', in particular the '-o a_perf.data' file to
  *                   use instead the temporary file found in the first step
  *             gets the start-time
- *             forks a 'perf record' subprocess with its cmd-line options and
+ *             spawns a 'perf record' subprocess with its cmd-line options and
  *                   the '-o our_temporary_perf.data' and the program to measure
  *             gets the end-time and duration of the invocation
+ *
+ *    With the "--pid", "--tid" or "--cgroup" options, there is no program:
+ *    execute_native_sampler_and_program(...) attaches the perf-events to the
+ *    processes already running, with perf_sampler_attach(), and stops at the
+ *    "--duration", a SIGUSR2, or when they exit
+ *
+ *    With the "--pipe" option, 'perf report --input=-' is spawned before
+ *    execute_perf_record_and_program(...), which runs 'perf record --output=-'
+ *    with its stdout in a pipe to it, and without a temporary file
  *             
  *             
  *    upload_perf_report_to_NewRelic(...)
- *             opens a read pipe to 'perf report --input=our_temporary_perf.data'
+ *             spawns 'perf report --input=our_temporary_perf.data' with a pipe,
+ *                   asking it for a tab-separated list of fields (--fields=...)
  *             parses each line given to us by 'perf report' into 'symbol', '%time',
- *                   etc.
- *                   from the '%time' of the 'symbol' and the total duration of the
- *                        program, tries to find the relative duration of the 'symbol'
- *                   sends this 'symbol' and its 'relative duration' to New Relic
- *             close the read pipe to 'perf record'
+ *                   'period', 'samples', etc., by the names of the columns in its
+ *                   header line, and adds them per 'symbol' in an aggregation table
+ *             closes the pipe and waits for 'perf report'
+ *             for the top-K 'symbols' in the aggregation table, from the '%time'
+ *                   of the 'symbol' and the total duration of the program, tries
+ *                   to find the relative duration of the 'symbol' and sends this
+ *                   'symbol' and its 'relative duration' to New Relic
+ *
+ *    With the "--native" option, execute_native_sampler_and_program(...) and
+ *    upload_native_profile_to_NewRelic(...) take the places of the two
+ *    functions above:
+ *
+ *    execute_native_sampler_and_program(...)
+ *             forks the program to measure, which waits in a pipe before its
+ *                   exec()
+ *             opens a perf-event per CPU for that program with perf_event_open()
+ *             lets the program exec(), which enables its perf-events
+ *             reads the samples from the ring-buffers of the perf-events till
+ *                   the program exits
+ *
+ *    upload_native_profile_to_NewRelic(...)
+ *             symbolizes the samples and adds their periods per symbol
+ *             sends each symbol and its 'relative duration' to New Relic, as
+ *                   upload_perf_report_to_NewRelic(...) does
+ *
+ *    With the "--interval=N" option (streaming mode, for long-running
+ *    programs), execute_native_sampler_and_program(...) calls every N
+ *    seconds upload_native_window_to_NewRelic(...), which sends the samples
+ *    of that window in a New Relic transaction of its own and then drops
+ *    them, so that the memory used stays bounded by the samples of a window
+ *    (and there is no transaction of the whole run).
+ *
+ *    With the "--counters" option, execute_counters_and_program(...) and
+ *    upload_perf_counters_to_NewRelic(...) take their places: the program
+ *    runs under groups of counters, whose totals, and IPC, MPKI and
+ *    branch-miss rate, are sent to New Relic with newrelic_record_metric().
+ *
+ *    With the "--daemon" option, the native sampler samples all the CPUs,
+ *    without a program, till it is stopped by a signal, and every window is
+ *    split by upload_native_groups_to_NewRelic(...) into one transaction per
+ *    process or container (named "Linux Perf Counters/<group>").
+ *
+ *    With the "--stacks" option (or a "-g"), the call-graphs of the samples
+ *    are recorded too, and added into a prefix trie of frames (see
+ *    "stack_trie.h"), from which upload_stacks_to_NewRelic(...) sends the
+ *    top-K frames by inclusive time, or the folded stacks of a flame-graph.
+ *    With "--call-graph=lbr", the native sampler takes their user-space part
+ *    from the LBR call-stack of the CPU, in the same format.
+ *
+ *    The native sampler aggregates the samples by their locations (DSO, file
+ *    offset) first (see "address_aggregation.h"), and then
+ *    symbolize_hottest_locations(...) symbolizes only the hottest of them,
+ *    for the top-K.
+ *    With "--bpf", the samples are aggregated by call-graph in the kernel
+ *    instead, by a BPF program (see "bpf_aggregator.h"), whose maps are read
+ *    once per window: each aggregate comes as a sample which stands for the
+ *    "samples" that it counts.
+ *
+ *    The native sampler keeps the symbol tables it parses in an on-disk
+ *    cache, by build-id ("--symbol-cache=DIR", see "symbol_cache.h"), so
+ *    that the next runs don't parse the same ELF files and kallsyms again.
  *
  *  There is more error-checking around those instructions, that is the general idea
  *  of the program.
@@ -143,6 +625,53 @@ upload_perf_report_to_NewRelic(char * in_perf_data_fname,
 
 const int MAX_LENGTH_NEW_RELIC_IDENT = 255;
 
+/* The thread which makes the calls to the New Relic SDK which don't need to
+ * return a value to us (attributes, metrics, and the ends of transactions),
+ * so that the sampling doesn't wait for them. If it couldn't be started, it
+ * is NULL and the calls are made synchronously. */
+struct newrelic_uploader * newrelic_uploader = NULL;
+
+/* The temporary state of the uploads of a flush window (the top-K arrays,
+ * the tables of the roll-ups by DSO, by group, of the inclusive costs, the
+ * folded stacks...): all of it is allocated from this arena, and dropped at
+ * once at the end of the window, keeping its chunks for the next windows.
+ * It is used only by the thread which flushes the windows. */
+static struct arena window_arena;
+
+/* The durations of the two segments of the profiles: the one in which the
+ * samples are taken ("perf record", or the flush window of the native
+ * sampler) and the one in which they are sent ("perf report", or the upload
+ * of the window), whose percentiles are sent as metrics */
+static struct latency_histogram record_segments;
+static struct latency_histogram report_segments;
+
+/* The costs of the wrapper itself since its last metrics "Custom/ct_self/",
+ * by stage, so that it can be checked that the profiler is not the
+ * bottleneck. They are updated only by the thread which uploads. */
+struct self_costs {
+    unsigned long long report_lines;        /* read from "perf report" */
+    unsigned long long report_bytes;
+    double             report_seconds;      /* reading and aggregating them */
+    double             aggregation_seconds; /* of the native samples */
+    double             symbolization_seconds;
+    double             cpu_seconds;         /* at the last metrics */
+};
+static struct self_costs self_costs;
+
+/* The status of the collector of New Relic, from the status callback of the
+ * SDK, which may come before the uploader is started */
+volatile int newrelic_collector_status = NEWRELIC_STATUS_CODE_STARTED;
+
+static void
+newrelic_collector_status_changed(int status)
+{
+    fprintf(stderr, "DEBUG: the status of the NewRelic collector is %d\n",
+            status);
+    newrelic_collector_status = status;
+    newrelic_uploader_set_reachable(newrelic_uploader,
+                                    status == NEWRELIC_STATUS_CODE_STARTED);
+}
+
 /*
  * On this issue of the custom attributes, that New Relic documentation above:
  *
@@ -190,6 +719,54 @@ const int MAX_LENGTH_NEW_RELIC_IDENT = 255;
  */
 
 
+/* Parse a comma-separated list of pids or tids, as "--pid=12,34", into a
+ * new array. Returns the number of them, or 0 on error. */
+static size_t
+parse_pid_list(const char * list, pid_t ** out_pids)
+{
+    size_t n_pids = 1;
+    const char * c;
+    for (c = list; *c; c++)
+        if (*c == ',')
+            n_pids++;
+    pid_t * pids = calloc(n_pids, sizeof *pids);
+    if (!pids)
+        return 0;
+
+    size_t i;
+    for (i = 0; i < n_pids; i++) {
+        char * end;
+        long pid = strtol(list, &end, 10);
+        if (pid <= 0 || end == list || (*end != ',' && *end != '\0')) {
+            free(pids);
+            return 0;
+        }
+        pids[i] = (pid_t)pid;
+        list = end + 1;
+    }
+    *out_pids = pids;
+    return n_pids;
+}
+
+
+/* The default directory of the symbol cache, as the XDG Base Directory
+ * Specification says: "$XDG_CACHE_HOME", or "$HOME/.cache". Returns NULL
+ * (no cache) if neither is set. */
+static const char *
+default_symbol_cache(char * out_dir, size_t dir_size)
+{
+    const char * xdg_cache_home = getenv("XDG_CACHE_HOME");
+    const char * home = getenv("HOME");
+    if (xdg_cache_home && xdg_cache_home[0] == '/')
+        snprintf(out_dir, dir_size, "%s/perf_record_newrelic", xdg_cache_home);
+    else if (home && home[0] == '/')
+        snprintf(out_dir, dir_size, "%s/.cache/perf_record_newrelic", home);
+    else
+        return NULL;
+    return out_dir;
+}
+
+
 int
 main(int argc, char** argv)
 {
@@ -200,16 +777,282 @@ main(int argc, char** argv)
     /* the first argument in the command-line is the NewRelic license key of
      * the NewRelic account to send information to */
     char newrelic_license_key[256];
-    strncpy(newrelic_license_key, argv[1], sizeof newrelic_license_key);
+    snprintf(newrelic_license_key, sizeof newrelic_license_key, "%s", argv[1]);
 
     newrelic_register_message_handler(newrelic_message_handler);
+    newrelic_register_status_callback(newrelic_collector_status_changed);
+
+    /* the options of this wrapper come next, before the
+     * options-to-perf-record */
+    struct wrapper_options wrapper_opts;
+    memset(&wrapper_opts, 0, sizeof wrapper_opts);
+    wrapper_opts.top_symbols = DEFAULT_TOP_SYMBOLS;
+    wrapper_opts.report_fields = DEFAULT_PERF_REPORT_FIELDS;
+    wrapper_opts.top_groups = DEFAULT_TOP_GROUPS;
+    wrapper_opts.spool_size = METRIC_SPOOL_DEFAULT_SIZE;
+    wrapper_opts.diff_threshold = DEFAULT_DIFF_THRESHOLD;
+    wrapper_opts.max_breakdown = DEFAULT_MAX_BREAKDOWN;
+    char default_symbol_cache_dir[PATH_MAX];
+    wrapper_opts.symbol_cache_dir =
+        default_symbol_cache(default_symbol_cache_dir,
+                             sizeof default_symbol_cache_dir);
+    int arg_idx = 2;
+    while (arg_idx < argc) {
+        if (strcmp(argv[arg_idx], "--native") == 0) {
+            wrapper_opts.native_sampling = 1;
+        } else if (strcmp(argv[arg_idx], "--counters") == 0) {
+            wrapper_opts.counting = 1;
+            wrapper_opts.native_sampling = 1;
+        } else if (strncmp(argv[arg_idx], "--interval=", 11) == 0) {
+            /* the streaming mode needs the native sampler */
+            wrapper_opts.interval = (unsigned int)strtoul(argv[arg_idx] + 11,
+                                                          NULL, 10);
+            if (wrapper_opts.interval == 0)
+                usage_and_exit();
+            wrapper_opts.native_sampling = 1;
+        } else if (strncmp(argv[arg_idx], "--top=", 6) == 0) {
+            wrapper_opts.top_symbols = (unsigned int)strtoul(argv[arg_idx] + 6,
+                                                             NULL, 10);
+            if (wrapper_opts.top_symbols == 0)
+                usage_and_exit();
+        } else if (strcmp(argv[arg_idx], "--daemon") == 0) {
+            wrapper_opts.daemon = 1;
+            wrapper_opts.native_sampling = 1;
+        } else if (strncmp(argv[arg_idx], "--group-by=", 11) == 0) {
+            const char * group_by = argv[arg_idx] + 11;
+            if (strcmp(group_by, "comm") == 0)
+                wrapper_opts.group_by = GROUP_BY_COMM;
+            else if (strcmp(group_by, "pid") == 0)
+                wrapper_opts.group_by = GROUP_BY_PID;
+            else if (strcmp(group_by, "cgroup") == 0)
+                wrapper_opts.group_by = GROUP_BY_CGROUP;
+            else
+                usage_and_exit();
+        } else if (strncmp(argv[arg_idx], "--top-groups=", 13) == 0) {
+            wrapper_opts.top_groups = (unsigned int)strtoul(argv[arg_idx] + 13,
+                                                            NULL, 10);
+            if (wrapper_opts.top_groups == 0)
+                usage_and_exit();
+        } else if (strcmp(argv[arg_idx], "--stacks=inclusive") == 0) {
+            wrapper_opts.stacks = STACKS_INCLUSIVE;
+        } else if (strcmp(argv[arg_idx], "--stacks=folded") == 0) {
+            wrapper_opts.stacks = STACKS_FOLDED;
+        } else if (strcmp(argv[arg_idx], "--symbol-cache=off") == 0) {
+            wrapper_opts.symbol_cache_dir = NULL;
+        } else if (strncmp(argv[arg_idx], "--symbol-cache=", 15) == 0) {
+            wrapper_opts.symbol_cache_dir = argv[arg_idx] + 15;
+            if (wrapper_opts.symbol_cache_dir[0] == '\0')
+                usage_and_exit();
+        } else if (strcmp(argv[arg_idx], "--pipe") == 0) {
+            wrapper_opts.pipe_mode = 1;
+        } else if (strncmp(argv[arg_idx], "--spool=", 8) == 0) {
+            wrapper_opts.spool_fname = argv[arg_idx] + 8;
+            if (wrapper_opts.spool_fname[0] == '\0')
+                usage_and_exit();
+        } else if (strncmp(argv[arg_idx], "--spool-size=", 13) == 0) {
+            /* in MB: the hard cap of the spool file */
+            unsigned long megabytes = strtoul(argv[arg_idx] + 13, NULL, 10);
+            if (megabytes < METRIC_SPOOL_MIN_SIZE / (1024 * 1024))
+                usage_and_exit();
+            wrapper_opts.spool_size = (size_t)megabytes * 1024 * 1024;
+        } else if (strncmp(argv[arg_idx], "--pid=", 6) == 0) {
+            /* attaching needs the native sampler */
+            free((pid_t *)wrapper_opts.attach.pids);
+            pid_t * pids = NULL;
+            wrapper_opts.attach.n_pids = parse_pid_list(argv[arg_idx] + 6,
+                                                        &pids);
+            wrapper_opts.attach.pids = pids;
+            if (wrapper_opts.attach.n_pids == 0)
+                usage_and_exit();
+            wrapper_opts.attaching = 1;
+            wrapper_opts.native_sampling = 1;
+        } else if (strncmp(argv[arg_idx], "--tid=", 6) == 0) {
+            free((pid_t *)wrapper_opts.attach.tids);
+            pid_t * tids = NULL;
+            wrapper_opts.attach.n_tids = parse_pid_list(argv[arg_idx] + 6,
+                                                        &tids);
+            wrapper_opts.attach.tids = tids;
+            if (wrapper_opts.attach.n_tids == 0)
+                usage_and_exit();
+            wrapper_opts.attaching = 1;
+            wrapper_opts.native_sampling = 1;
+        } else if (strncmp(argv[arg_idx], "--cgroup=", 9) == 0) {
+            wrapper_opts.attach.cgroup = argv[arg_idx] + 9;
+            if (wrapper_opts.attach.cgroup[0] == '\0')
+                usage_and_exit();
+            wrapper_opts.attaching = 1;
+            wrapper_opts.native_sampling = 1;
+        } else if (strncmp(argv[arg_idx], "--duration=", 11) == 0) {
+            wrapper_opts.duration = (unsigned int)strtoul(argv[arg_idx] + 11,
+                                                          NULL, 10);
+            if (wrapper_opts.duration == 0)
+                usage_and_exit();
+        } else if (strcmp(argv[arg_idx], "--signal-control") == 0) {
+            wrapper_opts.signal_control = 1;
+        } else if (strcmp(argv[arg_idx], "--readers=node") == 0) {
+            wrapper_opts.readers = PERF_READERS_PER_NODE;
+            wrapper_opts.native_sampling = 1;
+        } else if (strcmp(argv[arg_idx], "--readers=cpu") == 0) {
+            wrapper_opts.readers = PERF_READERS_PER_CPU;
+            wrapper_opts.native_sampling = 1;
+        } else if (strncmp(argv[arg_idx], "--cpu-budget=", 13) == 0) {
+            /* a percentage of one CPU, as "1" or "0.5%": the rate adapts in
+             * the native sampler */
+            char * end;
+            wrapper_opts.cpu_budget = strtod(argv[arg_idx] + 13, &end);
+            if (end == argv[arg_idx] + 13 || (*end != '\0' && strcmp(end, "%")) ||
+                wrapper_opts.cpu_budget <= 0 || wrapper_opts.cpu_budget > 100)
+                usage_and_exit();
+            wrapper_opts.native_sampling = 1;
+        } else if (strcmp(argv[arg_idx], "--differential") == 0) {
+            /* the baseline is of the windows of the native sampler */
+            wrapper_opts.differential = 1;
+            wrapper_opts.native_sampling = 1;
+        } else if (strncmp(argv[arg_idx], "--diff-threshold=", 17) == 0) {
+            char * end;
+            wrapper_opts.diff_threshold = strtod(argv[arg_idx] + 17, &end);
+            if (end == argv[arg_idx] + 17 || (*end != '\0' && strcmp(end, "%")) ||
+                wrapper_opts.diff_threshold <= 0 ||
+                wrapper_opts.diff_threshold > 100)
+                usage_and_exit();
+        } else if (strcmp(argv[arg_idx], "--off-cpu") == 0) {
+            /* the scheduler tracepoints, in the rings of the native
+             * sampler */
+            wrapper_opts.off_cpu = 1;
+            wrapper_opts.native_sampling = 1;
+        } else if (strcmp(argv[arg_idx], "--bpf") == 0) {
+            /* the samples are counted by a BPF program of the native
+             * sampler, per call-graph, and read once per window */
+            wrapper_opts.bpf = 1;
+            wrapper_opts.native_sampling = 1;
+        } else if (strcmp(argv[arg_idx], "--breakdown") == 0) {
+            /* by pool by default: its keys stay the same across windows,
+             * whereas those of the threads change as they come and go */
+            wrapper_opts.breakdown = BREAKDOWN_BY_POOL;
+        } else if (strncmp(argv[arg_idx], "--breakdown=", 12) == 0) {
+            const char * breakdown = argv[arg_idx] + 12;
+            if (strcmp(breakdown, "thread") == 0)
+                wrapper_opts.breakdown = BREAKDOWN_BY_THREAD;
+            else if (strcmp(breakdown, "comm") == 0)
+                wrapper_opts.breakdown = BREAKDOWN_BY_COMM;
+            else if (strcmp(breakdown, "pool") == 0)
+                wrapper_opts.breakdown = BREAKDOWN_BY_POOL;
+            else
+                usage_and_exit();
+        } else if (strncmp(argv[arg_idx], "--max-breakdown=", 16) == 0) {
+            wrapper_opts.max_breakdown =
+                       (unsigned int)strtoul(argv[arg_idx] + 16, NULL, 10);
+            if (wrapper_opts.max_breakdown == 0)
+                usage_and_exit();
+        } else if (strncmp(argv[arg_idx], "--preset=", 9) == 0) {
+            const struct perf_record_preset * preset;
+            for (preset = PERF_RECORD_PRESETS; preset->name; preset++)
+                if (strcmp(preset->name, argv[arg_idx] + 9) == 0)
+                    break;
+            if (!preset->name)
+                usage_and_exit();
+            wrapper_opts.preset = preset;
+        } else if (strcmp(argv[arg_idx], "--metrics") == 0) {
+            wrapper_opts.symbol_metrics = 1;
+        } else if (strcmp(argv[arg_idx], "--rollup=dso") == 0) {
+            wrapper_opts.symbol_metrics = 1;
+            wrapper_opts.rollup_by_dso = 1;
+        } else if (strncmp(argv[arg_idx], "--report-fields=", 16) == 0) {
+            /* it goes into an argument of "perf report": only the names of
+             * fields */
+            wrapper_opts.report_fields = argv[arg_idx] + 16;
+            if (wrapper_opts.report_fields[0] == '\0' ||
+                strspn(wrapper_opts.report_fields,
+                       "abcdefghijklmnopqrstuvwxyz_,") !=
+                                         strlen(wrapper_opts.report_fields))
+                usage_and_exit();
+        } else {
+            break;
+        }
+        arg_idx++;
+    }
+    /* the daemon needs no program: it samples the whole host, in windows;
+     * nor the attach modes, which sample processes already running. Only
+     * these two can be stopped by --duration or --signal-control */
+    int needs_program = !wrapper_opts.daemon && !wrapper_opts.attaching;
+    if ((arg_idx >= argc && needs_program) ||
+        (wrapper_opts.counting && (wrapper_opts.interval || wrapper_opts.daemon ||
+                                   wrapper_opts.attaching ||
+                                   wrapper_opts.off_cpu || wrapper_opts.bpf)) ||
+        (wrapper_opts.pipe_mode && wrapper_opts.native_sampling) ||
+        (wrapper_opts.daemon && wrapper_opts.attaching) ||
+        (wrapper_opts.attach.cgroup && (wrapper_opts.attach.n_pids ||
+                                        wrapper_opts.attach.n_tids)) ||
+        ((wrapper_opts.duration || wrapper_opts.signal_control) &&
+         needs_program) ||
+        (wrapper_opts.differential && !wrapper_opts.interval &&
+         !wrapper_opts.daemon) ||
+        (wrapper_opts.differential && wrapper_opts.symbol_metrics))
+        usage_and_exit();
+    if (wrapper_opts.daemon && wrapper_opts.interval == 0)
+        wrapper_opts.interval = DEFAULT_DAEMON_INTERVAL;
+
+    /* the options of the preset come first, so that those given after it
+     * change them (but for the call-graphs of a preset which has none) */
+    if (wrapper_opts.preset) {
+        int preset_argc = argc - arg_idx;
+        char ** preset_argv = apply_perf_record_preset(wrapper_opts.preset,
+                                                       &preset_argc,
+                                                       argv + arg_idx);
+        if (!preset_argv) {
+            fprintf(stderr, "ERROR: calloc() failed\n");
+            return 1;
+        }
+        argv = preset_argv;
+        argc = preset_argc;
+        arg_idx = 0;
+        if (!wrapper_opts.preset->call_graphs &&
+            wrapper_opts.stacks != STACKS_NONE) {
+            fprintf(stderr, "Ignoring option --stacks: the preset '%s' has "
+                            "no call-graphs\n", wrapper_opts.preset->name);
+            wrapper_opts.stacks = STACKS_NONE;
+        }
+    }
+
+    /* a "-g" to "perf record" without "--stacks": the inclusive frames */
+    struct perf_sampler_options perf_record_options;
+    int program_idx = parse_native_sampler_options(argc-arg_idx, argv+arg_idx,
+                                                   &perf_record_options, 0);
+    /* only options-to-perf-record, and no program, when attaching */
+    if (wrapper_opts.attaching && program_idx >= 0)
+        usage_and_exit();
+    if (perf_record_options.callchain && wrapper_opts.stacks == STACKS_NONE)
+        wrapper_opts.stacks = STACKS_INCLUSIVE;
 
     newrelic_init(newrelic_license_key,
                   "Linux Performance Counters to NewRelic", "C", "4.8");
     // newrelic_enable_instrumentation(0);  /* 0 is enable */
 
-    newrelic_perf_counters_wrapper(argc-2, argv+2);
+    /* the spool, where the metrics go while New Relic is not reachable */
+    struct metric_spool * spool = NULL;
+    if (wrapper_opts.spool_fname) {
+        spool = metric_spool_open(wrapper_opts.spool_fname,
+                                  wrapper_opts.spool_size);
+        if (!spool)
+            fprintf(stderr, "ERROR: can't open the spool '%s': %s\n",
+                    wrapper_opts.spool_fname, strerror(errno));
+    }
+
+    newrelic_uploader =
+                 newrelic_uploader_start(NEWRELIC_UPLOADER_DEFAULT_CAPACITY,
+                                         spool, newrelic_collector_status ==
+                                                 NEWRELIC_STATUS_CODE_STARTED);
+    if (!newrelic_uploader && spool)
+        fprintf(stderr, "DEBUG: no uploader thread: the spool is not used\n");
+
+    newrelic_perf_counters_wrapper(&wrapper_opts, argc-arg_idx, argv+arg_idx);
+
+    /* upload (or spool) what is still in the queue before exiting */
+    newrelic_uploader_stop(newrelic_uploader);
+    metric_spool_close(spool);
 
+    free((pid_t *)wrapper_opts.attach.pids);
+    free((pid_t *)wrapper_opts.attach.tids);
     return 0;
 }
 
@@ -218,6 +1061,20 @@ void     (*newrelic_agent_sighandler)(int) = NULL;
 
 volatile sig_atomic_t interrupt_execution = 0;
 
+/* With --signal-control, a SIGUSR1 starts the profile, and a SIGUSR2 stops
+ * it (and it is still uploaded, unlike after a SIGINT) */
+volatile sig_atomic_t start_profiling = 0;
+volatile sig_atomic_t stop_profiling = 0;
+
+static void
+profiling_control_handler(int sig)
+{
+    if (sig == SIGUSR1)
+        start_profiling = 1;
+    else
+        stop_profiling = 1;
+}
+
 void signal_handler(int sig)
 {
     if (interrupt_execution == 0) {
@@ -259,22 +1116,23 @@ send_error_notice_to_NewRelic(long transaction_id, const char *exception_type,
 }
 
 
-
-void
-newrelic_perf_counters_wrapper(int program_argc, char * program_argv[])
+/* Begins a New Relic transaction for the Linux Performance Counters, named
+ * and with its start time as an attribute. Returns the transaction id, or a
+ * negative value on error.
+ */
+static long
+begin_perf_counters_transaction(const char * transaction_name)
 {
     int return_code;
 
     fprintf(stderr, "DEBUG: about to call newrelic_transaction_begin()\n");
     long newrelic_transxtion_id = newrelic_transaction_begin();
     if (newrelic_transxtion_id < 0) {
-        fprintf(stderr, "ERROR: newrelic_transaction_begin() returned %ld\n"
-                        "Aborting.\n", newrelic_transxtion_id);
-        return;
+        fprintf(stderr, "ERROR: newrelic_transaction_begin() returned %ld\n",
+                        newrelic_transxtion_id);
+        return newrelic_transxtion_id;
     }
 
-    long newr_segm_external_perf_record = 0;
-
     /* Naming transactions is optional.
      * Use caution when naming transactions. Issues come about when the
      * _ranularity of transaction names is too fine, resulting in hundreds if
@@ -287,8 +1145,15 @@ newrelic_perf_counters_wrapper(int program_argc, char * program_argv[])
        fprintf(stderr, "ERROR: newrelic_transaction_set_type_other() "
                        "returned %d\n", return_code);
 
+    char full_transaction_name[MAX_LENGTH_NEW_RELIC_IDENT+1];
+    if (transaction_name)
+        snprintf(full_transaction_name, sizeof full_transaction_name,
+                 "Linux Perf Counters/%s", transaction_name);
+    else
+        snprintf(full_transaction_name, sizeof full_transaction_name,
+                 "Linux Perf Counters");
     return_code = newrelic_transaction_set_name(newrelic_transxtion_id,
-                                               "Linux Perf Counters");
+                                                full_transaction_name);
     if (return_code < 0)
        fprintf(stderr, "ERROR: newrelic_transaction_set_name() "
                        "returned %d\n", return_code);
@@ -304,16 +1169,45 @@ newrelic_perf_counters_wrapper(int program_argc, char * program_argv[])
     snprintf(start_time, sizeof start_time, "%u",
                (unsigned)time(NULL));
 
-    return_code = newrelic_transaction_add_attribute(newrelic_transxtion_id,
-                                           "ct_tx_start_time", start_time);
+    newrelic_uploader_add_attribute(newrelic_uploader, newrelic_transxtion_id,
+                                    "ct_tx_start_time", start_time);
 
-    newr_segm_external_perf_record =
-           newrelic_segment_external_begin(newrelic_transxtion_id,
-                                           NEWRELIC_ROOT_SEGMENT,
-                                           "localhost", "perf record");
-    if (newr_segm_external_perf_record < 0)
-        fprintf(stderr, "ERROR: newrelic_segment_external_begin() "
-                        "returned %ld\n",newr_segm_external_perf_record);
+    return newrelic_transxtion_id;
+}
+
+
+void
+newrelic_perf_counters_wrapper(const struct wrapper_options * wrapper_opts,
+                               int program_argc, char * program_argv[])
+{
+    int return_code;
+
+    /* the windows of the streaming mode (and of the daemon) are sent in
+     * transactions of their own: there is no transaction of the whole run,
+     * which would stay open as long as it, with nothing in it */
+    int windowed = wrapper_opts->native_sampling && wrapper_opts->interval > 0;
+    long newrelic_transxtion_id = -1;
+    long newr_segm_external_perf_record = -1;
+    if (!windowed) {
+        newrelic_transxtion_id = begin_perf_counters_transaction(NULL);
+        if (newrelic_transxtion_id < 0) {
+            fprintf(stderr, "Aborting.\n");
+            return;
+        }
+
+        newr_segm_external_perf_record =
+               newrelic_segment_external_begin(newrelic_transxtion_id,
+                                               NEWRELIC_ROOT_SEGMENT,
+                                               "localhost",
+                                               wrapper_opts->counting ?
+                                                   "perf_event_open counting" :
+                                               wrapper_opts->native_sampling ?
+                                                   "perf_event_open sampling" :
+                                                   "perf record");
+        if (newr_segm_external_perf_record < 0)
+            fprintf(stderr, "ERROR: newrelic_segment_external_begin() "
+                            "returned %ld\n",newr_segm_external_perf_record);
+    }
 
     /* Set signal handler */
     /* see if NewRelic installed a signal-handler for INT in our thread */
@@ -327,18 +1221,79 @@ newrelic_perf_counters_wrapper(int program_argc, char * program_argv[])
     our_signal_handler.sa_handler = signal_handler;
     sigemptyset(&our_signal_handler.sa_mask);
     sigaction(SIGINT, &our_signal_handler, NULL);
+    /* a daemon is usually stopped with a SIGTERM */
+    sigaction(SIGTERM, &our_signal_handler, NULL);
+
+    /* the profiles without a program can be started and stopped */
+    if (wrapper_opts->daemon || wrapper_opts->attaching) {
+        struct sigaction control_handler;
+        memset(&control_handler, 0, sizeof control_handler);
+        control_handler.sa_handler = profiling_control_handler;
+        sigemptyset(&control_handler.sa_mask);
+        sigaction(SIGUSR1, &control_handler, NULL);
+        sigaction(SIGUSR2, &control_handler, NULL);
+    }
 
     /* Run "perf record" */
     char temp_perf_data_file[PATH_MAX];
     memset(temp_perf_data_file, 0, sizeof temp_perf_data_file);
     struct timespec  program_exec_duration;
-    int program_exit_code;
+    int program_exit_code = -3;
     struct stat buf;
-    if (interrupt_execution == 0)
-        program_exit_code = execute_perf_record_and_program(program_argc,
+    struct native_profile native_profile;
+    memset(&native_profile, 0, sizeof native_profile);
+    native_profile.options = wrapper_opts;
+    struct perf_counter_totals counter_totals;
+    struct perf_report_process perf_report = { -1, -1 };
+
+    /* the cost model of the samples of "perf record", from its options */
+    struct sample_cost_model report_cost_model;
+    struct perf_sampler_options perf_record_options;
+    parse_native_sampler_options(program_argc, program_argv,
+                                 &perf_record_options, 0);
+    sample_cost_model_from_options(&perf_record_options, &report_cost_model);
+    if (interrupt_execution == 0 && wrapper_opts->counting)
+        program_exit_code = execute_counters_and_program(program_argc,
                                                         program_argv,
                                                         &program_exec_duration,
+                                                        &counter_totals);
+    else if (interrupt_execution == 0 && wrapper_opts->native_sampling)
+        program_exit_code = execute_native_sampler_and_program(program_argc,
+                                                        program_argv,
+                                                        wrapper_opts->interval,
+                                                        &program_exec_duration,
+                                                        &native_profile);
+    else if (interrupt_execution == 0) {
+        /* with --pipe, "perf report" is started first, and it parses the
+         * stream of "perf record" while the program runs: only its output
+         * (the final histogram) is read after "perf record" exits */
+        int record_pipe[2] = { -1, -1 };
+        if (wrapper_opts->pipe_mode &&
+            (open_cloexec_pipe(record_pipe) != 0 ||
+             spawn_perf_report("-", record_pipe[0], wrapper_opts,
+                               &perf_report) != 0)) {
+            fprintf(stderr, "ERROR: couldn't run 'perf report': %s\n",
+                    strerror(errno));
+            if (record_pipe[0] >= 0) {
+                close(record_pipe[0]);
+                close(record_pipe[1]);
+            }
+            program_exit_code = -4;
+        } else {
+            if (record_pipe[0] >= 0)
+                close(record_pipe[0]);
+            program_exit_code = execute_perf_record_and_program(program_argc,
+                                                        program_argv,
+                                                        wrapper_opts->stacks &&
+                                                   !perf_record_options.callchain,
+                                                        record_pipe[1],
+                                                        &program_exec_duration,
                                                         temp_perf_data_file);
+            /* the end of the stream for "perf report" */
+            if (record_pipe[1] >= 0)
+                close(record_pipe[1]);
+        }
+    }
 
     /* Try to respect calling newrelic_segment_end() before interruption */
     /*
@@ -359,10 +1314,15 @@ newrelic_perf_counters_wrapper(int program_argc, char * program_argv[])
     if (interrupt_execution != 0)
         goto goto_point_delete_temp_perf_data_file;
 
-    if (program_exit_code < 0 && program_exit_code >= -4) {
-        /* An error was caught in execute_perf_record_and_program()
+    /* the windows of the streaming mode have recorded their own segments */
+    if (!windowed && program_exit_code >= 0)
+        record_segment_latency(&record_segments, &program_exec_duration);
+
+    if (program_exit_code < 0 && program_exit_code >= -5) {
+        /* An error was caught in execute_perf_record_and_program() or in
+         * execute_native_sampler_and_program()
          *
-         * Note that program_exit_code is between -4 and -1 only
+         * Note that program_exit_code is between -5 and -1 only
          * that are the error codes we pre-check.
          */
         const char *errors_in_execute_perf_record[] = {
@@ -370,28 +1330,72 @@ newrelic_perf_counters_wrapper(int program_argc, char * program_argv[])
                             "Couldn't find a temp filename for perf.data file",
                             "calloc() failed",
                             "Interrupted by a signal",
-                            "fork() failed"
+                            "posix_spawn() failed",
+                            "perf_event_open() failed"
              };
-        send_error_notice_to_NewRelic(newrelic_transxtion_id,
-                                      "execute_perf_record_and_program",
-                                      errors_in_execute_perf_record[
+        /* in the streaming mode, a transaction only for the error */
+        if (newrelic_transxtion_id < 0)
+            newrelic_transxtion_id = begin_perf_counters_transaction(NULL);
+        if (wrapper_opts->native_sampling && program_exit_code == -1)
+            send_error_notice_to_NewRelic(newrelic_transxtion_id,
+                                          wrapper_opts->counting ?
+                                          "execute_counters_and_program" :
+                                          "execute_native_sampler_and_program",
+                                          "No program to execute");
+        else
+            send_error_notice_to_NewRelic(newrelic_transxtion_id,
+                                          wrapper_opts->counting ?
+                                          "execute_counters_and_program" :
+                                          wrapper_opts->native_sampling ?
+                                          "execute_native_sampler_and_program" :
+                                          "execute_perf_record_and_program",
+                                          errors_in_execute_perf_record[
                                                          abs(program_exit_code)
                                                       ]);
         goto goto_point_delete_temp_perf_data_file;
     }
 
-    if (interrupt_execution == 0 && program_exit_code >= 0) {
+    /* in the streaming mode, the windows have sent all the profile */
+    if (interrupt_execution == 0 && program_exit_code >= 0 && !windowed) {
         long newr_segm_external_perf_report =
                 newrelic_segment_external_begin(newrelic_transxtion_id,
                                                 NEWRELIC_ROOT_SEGMENT,
-                                                "localhost", "perf report");
+                                                "localhost",
+                                                wrapper_opts->counting ?
+                                                    "upload counters" :
+                                                wrapper_opts->native_sampling ?
+                                                    "symbolize samples" :
+                                                    "perf report");
         if (newr_segm_external_perf_report < 0)
             fprintf(stderr, "ERROR: newrelic_segment_external_begin() "
                              "returned %ld\n", newr_segm_external_perf_report);
+        struct timespec report_start, report_end, report_duration;
+        clock_gettime(CLOCK_MONOTONIC, &report_start);
 
-        upload_perf_report_to_NewRelic(temp_perf_data_file,
-                                       &program_exec_duration,
-                                       newrelic_transxtion_id);
+        if (wrapper_opts->counting)
+            upload_perf_counters_to_NewRelic(&counter_totals,
+                                             &program_exec_duration,
+                                             newrelic_transxtion_id);
+        else if (wrapper_opts->native_sampling) {
+            upload_native_profile_to_NewRelic(&native_profile,
+                                              &program_exec_duration,
+                                              NULL, NULL, NULL,
+                                              newrelic_transxtion_id);
+            record_sampler_metrics_to_NewRelic(&native_profile,
+                                               &program_exec_duration);
+        }
+        else if (perf_report.pid < 0 &&
+                 spawn_perf_report(temp_perf_data_file, -1, wrapper_opts,
+                                   &perf_report) != 0) {
+            char err_msg[256];
+            strerror_r(errno, err_msg, sizeof err_msg);
+            send_error_notice_to_NewRelic(newrelic_transxtion_id,
+                                          "spawn_perf_report", err_msg);
+        } else
+            upload_perf_report_to_NewRelic(&perf_report,
+                                           &program_exec_duration,
+                                           wrapper_opts, &report_cost_model,
+                                           newrelic_transxtion_id);
 
         if (newr_segm_external_perf_report >= 0) {
             int ret_code = newrelic_segment_end(newrelic_transxtion_id,
@@ -400,10 +1404,37 @@ newrelic_perf_counters_wrapper(int program_argc, char * program_argv[])
                 fprintf(stderr, "ERROR: newrelic_segment_end() returned %d\n",
                         ret_code);
         }
+
+        clock_gettime(CLOCK_MONOTONIC, &report_end);
+        timespec_difference(&report_start, &report_end, &report_duration);
+        record_segment_latency(&report_segments, &report_duration);
+        record_segment_latencies_to_NewRelic();
+        record_self_metrics_to_NewRelic();
     }
 
 goto_point_delete_temp_perf_data_file:
-    if (stat(temp_perf_data_file, &buf) == 0) {
+    /* a "perf report --input=-" which was not read: it got the SIGINT too,
+     * or the end of its stream */
+    if (perf_report.pid >= 0)
+        finish_perf_report(&perf_report);
+    free(native_profile.samples);
+    free(native_profile.callchain_ips);
+    stack_trie_free(native_profile.stacks);
+    symbol_aggregation_free(native_profile.aggregation);
+    address_aggregation_free(native_profile.addresses);
+    symbol_aggregation_free(native_profile.unresolved);
+    symbol_baseline_free(native_profile.baseline);
+    off_cpu_tracker_free(native_profile.off_cpu);
+    arena_free(&window_arena);
+    if (native_profile.resolver && wrapper_opts->symbol_cache_dir) {
+        unsigned int hits, misses;
+        symbol_resolver_cache_stats(native_profile.resolver, &hits, &misses);
+        fprintf(stderr, "DEBUG: symbol cache: %u tables found, %u written\n",
+                hits, misses);
+    }
+    symbol_resolver_free(native_profile.resolver);
+
+    if (temp_perf_data_file[0] != '\0' && stat(temp_perf_data_file, &buf) == 0) {
        // There could be a race condition with another program that does
        // a `perf` command on this same "perf.data" temp file, or a newer one.
        // Even looking at the "perf.data" header to see if it is about the
@@ -425,12 +1456,11 @@ goto_point_delete_temp_perf_data_file:
        }
     }
 
-    /* Finnish the NewRelic transaction */
-    fprintf(stderr, "DEBUG: about to call newrelic_transaction_end()\n");
-    return_code = newrelic_transaction_end(newrelic_transxtion_id);
-    if (return_code < 0)
-        fprintf(stderr, "ERROR: newrelic_transaction_end() "
-                        "returned %d\n", return_code);
+    /* Finnish the NewRelic transaction, after its attributes (in the
+     * uploader) */
+    if (newrelic_transxtion_id >= 0)
+        newrelic_uploader_end_transaction(newrelic_uploader,
+                                          newrelic_transxtion_id);
 }
 
 
@@ -474,19 +1504,240 @@ create_a_temp_filename(char * out_new_temp_fname)
     return 0;
 }
 
+
+extern char ** environ;
+
+/* A pipe whose both ends are close-on-exec, so that the processes spawned
+ * get only the ends that are dup2()'ed into their stdin or stdout */
+static int
+open_cloexec_pipe(int out_fds[2])
+{
+    if (pipe(out_fds) != 0)
+        return -1;
+    fcntl(out_fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(out_fds[1], F_SETFD, FD_CLOEXEC);
+    return 0;
+}
+
+
+/* Run "perf" with the arguments "perf_argv" (perf_argv[0] is "perf"), with
+ * posix_spawnp() and no shell: this process has the threads and the SSL
+ * state of the New Relic SDK, which a fork() would copy (its page tables)
+ * only for the exec() to throw them away, and a fork() of a multithreaded
+ * process may leave its locks held in the child. "stdin_fd" and "stdout_fd"
+ * (if not -1) become the standard input and output of "perf". Returns the
+ * pid of "perf", or -1 with errno set on error. */
+static pid_t
+spawn_perf(char * perf_argv[], int stdin_fd, int stdout_fd)
+{
+    posix_spawn_file_actions_t file_actions;
+    posix_spawnattr_t attributes;
+    sigset_t no_signals;
+    pid_t perf_pid = -1;
+
+    posix_spawn_file_actions_init(&file_actions);
+    posix_spawnattr_init(&attributes);
+    if (stdin_fd >= 0)
+        posix_spawn_file_actions_adddup2(&file_actions, stdin_fd,
+                                         STDIN_FILENO);
+    if (stdout_fd >= 0)
+        posix_spawn_file_actions_adddup2(&file_actions, stdout_fd,
+                                         STDOUT_FILENO);
+
+    /* the signals that we block (if any) are not blocked in "perf" */
+    sigemptyset(&no_signals);
+    posix_spawnattr_setsigmask(&attributes, &no_signals);
+    posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETSIGMASK);
+
+    int err = posix_spawnp(&perf_pid, "perf", &file_actions, &attributes,
+                           perf_argv, environ);
+    posix_spawn_file_actions_destroy(&file_actions);
+    posix_spawnattr_destroy(&attributes);
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+    return perf_pid;
+}
+
+
+/* Spawn "perf report" on the "perf.data" file "in_perf_data_fname", or, if
+ * it is "-", on a pipe-mode stream from "stdin_fd", asking it for the
+ * separated --fields which upload_perf_report_to_NewRelic() parses from the
+ * pipe "out_report->fd". Returns 0, or -1 with errno set on error. */
+static int
+spawn_perf_report(const char * in_perf_data_fname, int stdin_fd,
+                  const struct wrapper_options * wrapper_opts,
+                  struct perf_report_process * out_report)
+{
+    /* the argv of "perf report", without a shell, so that no quoting of the
+     * arguments is needed. With the call-graphs, each entry is followed by
+     * its stacks, folded from the outermost caller, with their numbers of
+     * samples */
+    char field_separator_arg[32], fields_arg[256], input_arg[PATH_MAX+16];
+    snprintf(field_separator_arg, sizeof field_separator_arg,
+             "--field-separator=%c", PERF_REPORT_FIELD_SEPARATOR);
+    snprintf(fields_arg, sizeof fields_arg, "--fields=%s",
+             wrapper_opts->report_fields);
+    snprintf(input_arg, sizeof input_arg, "--input=%s", in_perf_data_fname);
+    char * perf_report_argv[] = { "perf", "report", "--stdio",
+                                  field_separator_arg, fields_arg, input_arg,
+                                  NULL, NULL, NULL, NULL };
+    if (wrapper_opts->stacks) {
+        perf_report_argv[6] = "-g";
+        perf_report_argv[7] = "folded,0,caller,count";
+        perf_report_argv[8] = "--no-children";
+    }
+
+    int stdout_pipe[2];
+    if (open_cloexec_pipe(stdout_pipe) != 0)
+        return -1;
+    out_report->pid = spawn_perf(perf_report_argv, stdin_fd, stdout_pipe[1]);
+    int err = errno;
+    close(stdout_pipe[1]);
+    if (out_report->pid < 0) {
+        close(stdout_pipe[0]);
+        errno = err;
+        return -1;
+    }
+    out_report->fd = stdout_pipe[0];
+    return 0;
+}
+
+
+/* Close the output of a "perf report" (if we stopped reading early, it gets
+ * a SIGPIPE) and wait for it to exit. Returns the result of waitpid(). */
+static int
+finish_perf_report(struct perf_report_process * report)
+{
+    close(report->fd);
+    report->fd = -1;
+    int ret;
+    while ((ret = waitpid(report->pid, NULL, 0)) < 0 && errno == EINTR)
+        ;
+    report->pid = -1;
+    return ret;
+}
+
+
+/* The number of arguments of the option-to-perf-record in_argv[0]: 1, or 2
+ * with its value in the next argument, or 0 if it is not an option (the
+ * <program>). "--" is an option of 1 argument, after which there is only the
+ * <program>. Returns in *out_option its entry in PERF_RECORD_OPTIONS[], or
+ * NULL if it has none (it is then taken as a flag). */
+static int
+perf_record_option_arguments(int in_argc, char * in_argv[],
+                             const struct perf_record_option ** out_option)
+{
+    const char * arg = in_argv[0];
+    const struct perf_record_option * option;
+    *out_option = NULL;
+    if (arg[0] != '-' || arg[1] == '\0')
+        return 0;
+    if (strcmp(arg, "--") == 0)
+        return 1;
+
+    if (arg[1] == '-') {
+        size_t name_len = strcspn(arg + 2, "=");
+        for (option = PERF_RECORD_OPTIONS; option->short_name ||
+                                           option->long_name; option++)
+            if (option->long_name &&
+                strlen(option->long_name) == name_len &&
+                strncmp(option->long_name, arg + 2, name_len) == 0) {
+                *out_option = option;
+                return option->has_value && arg[2 + name_len] == '\0' &&
+                       in_argc > 1 ? 2 : 1;
+            }
+        return 1;
+    }
+
+    /* the short options, possibly grouped ("-ag"): the first one with a
+     * value takes the rest of the argument, or the next one */
+    size_t i;
+    for (i = 1; arg[i] != '\0'; i++) {
+        for (option = PERF_RECORD_OPTIONS; option->short_name ||
+                                           option->long_name; option++)
+            if (option->short_name == arg[i])
+                break;
+        if (option->short_name == arg[i]) {
+            if (option->dropped || !*out_option)
+                *out_option = option;
+            if (option->has_value)
+                return arg[i + 1] == '\0' && in_argc > 1 ? 2 : 1;
+        }
+    }
+    return 1;
+}
+
+
+/* The options-to-perf-record of "preset", followed by those of in_argv[]
+ * (without their call-graphs, if the preset has none) and by the <program>,
+ * in a new argv[] of *in_out_argc arguments, which lives till the exit.
+ * Returns NULL if it couldn't allocate memory. */
+static char **
+apply_perf_record_preset(const struct perf_record_preset * preset,
+                         int * in_out_argc, char * in_argv[])
+{
+    int n_preset = 0;
+    while (preset->options[n_preset])
+        n_preset++;
+    char ** new_argv = calloc(n_preset + *in_out_argc + 1, sizeof *new_argv);
+    if (!new_argv)
+        return NULL;
+
+    int src_idx = 0, dest_idx;
+    for (dest_idx = 0; dest_idx < n_preset; dest_idx++)
+        new_argv[dest_idx] = (char *)preset->options[dest_idx];
+    while (src_idx < *in_out_argc) {
+        const struct perf_record_option * option;
+        int n_args = perf_record_option_arguments(*in_out_argc - src_idx,
+                                                  in_argv + src_idx, &option);
+        if (n_args == 0)
+            break;
+        const char * arg = in_argv[src_idx];
+        if (!preset->call_graphs &&
+            (strcmp(arg, "-g") == 0 || (option && option->long_name &&
+                                strcmp(option->long_name, "call-graph") == 0))) {
+            fprintf(stderr, "Ignoring option %s: the preset '%s' has no "
+                            "call-graphs\n", arg, preset->name);
+            src_idx += n_args;
+            continue;
+        }
+        int end_of_options = strcmp(arg, "--") == 0;
+        while (n_args-- > 0)
+            new_argv[dest_idx++] = in_argv[src_idx++];
+        if (end_of_options)
+            break;
+    }
+    while (src_idx < *in_out_argc)
+        new_argv[dest_idx++] = in_argv[src_idx++];
+    new_argv[dest_idx] = NULL;
+    *in_out_argc = dest_idx;
+    return new_argv;
+}
+
+
+/* Run "perf record" on the program. Its perf.data goes to a new temp file,
+ * whose name is returned in "out_perf_data_file", or, if "pipe_output_fd"
+ * is not -1, in perf's pipe-mode format to this pipe, to a "perf report
+ * --input=-" (then "perf record" writes the output of the program to its
+ * stderr, and no temp file is created) */
 int
 execute_perf_record_and_program(int in_program_argc, char * in_program_argv[],
+                                int call_graph, int pipe_output_fd,
                                 struct timespec * out_duration,
                                 char * out_perf_data_file)
 {
     int status;
-    status = create_a_temp_filename(out_perf_data_file);
-    if (status == 0)
-        return -1;
+    if (pipe_output_fd < 0) {
+        status = create_a_temp_filename(out_perf_data_file);
+        if (status == 0)
+            return -1;
+    }
 
     /* Prepare the new options and arguments to call "perf record ..." */
     char ** new_argv;
-    new_argv = calloc(in_program_argc+4, sizeof (char *));
+    new_argv = calloc(in_program_argc+5, sizeof (char *));
     if (!new_argv)
         return -2;
 
@@ -494,70 +1745,67 @@ execute_perf_record_and_program(int in_program_argc, char * in_program_argv[],
     new_argv[0] = "perf";
     new_argv[1] = "record";
     char output_arg[PATH_MAX+16];
-    snprintf(output_arg, sizeof output_arg, "--output=%s", out_perf_data_file);
+    snprintf(output_arg, sizeof output_arg, "--output=%s",
+             pipe_output_fd >= 0 ? "-" : out_perf_data_file);
     new_argv[2] = output_arg;
     /* Note that in the following argv copy, since "perf record" was
      * already inserted in the new_argv[], then the first argvs in
      * this copy are arguments that are passed directly as-is to
-     * "perf record".
-     * TODO: Some arguments to "perf record" can make difficult to
-     * parse a "perf report" later into NewRelic, so a sanitizing
-     * of these arguments is necessary in "perf record" for NewRelic
-     * transmission be factible. Ie., in this first version we
-     * sanitize the "-o" or "--output" option to "perf record", so
-     * NewRelic always see the perf.data file in the current directory
-     * -ie., the "perf report" feed to NewRelic
+     * "perf record", with their values, till the <program>. Some of
+     * them make the "perf report" to NewRelic impossible (eg., "-o" or
+     * "--output", since the wrapper reads its own perf.data file): those
+     * are sanitized (see PERF_RECORD_OPTIONS[]).
      */
-    int src_idx=0, dest_idx=3, still_in_perf_record_options=1;
+    int src_idx=0, dest_idx=3;
+    /* "--stacks" without a "-g" to "perf record": add it */
+    if (call_graph)
+        new_argv[dest_idx++] = "-g";
     while (src_idx < in_program_argc) {
-        /* Sanitize */
-        if (still_in_perf_record_options == 1 &&
-            strncmp(in_program_argv[src_idx], "--output=", 9) == 0) {
+        const struct perf_record_option * option;
+        int n_args = perf_record_option_arguments(in_program_argc - src_idx,
+                                                  in_program_argv + src_idx,
+                                                  &option);
+        if (n_args == 0)
+            break;   /* the <program> */
+        if (option && option->dropped) {
             fprintf(stderr, "Ignoring option %s\n", in_program_argv[src_idx]);
-            src_idx++;
-        } else if (still_in_perf_record_options == 1 &&
-                 strncmp(in_program_argv[src_idx], "-o", 2) == 0) {
-             fprintf(stderr, "Ignoring option %s\n", in_program_argv[src_idx]);
-             if (in_program_argv[src_idx][2] == '\0')
-                src_idx += 2; /* fmt: "-o <file>" */
-             else
-                src_idx++; /* fmt: "-o<file>" without space */
-        } else {
-             new_argv[dest_idx] = in_program_argv[src_idx];
-             if (in_program_argv[src_idx] && in_program_argv[src_idx][0] != '-')
-                 still_in_perf_record_options = 0;
-             dest_idx++;
-             src_idx++;
+            src_idx += n_args;
+            continue;
         }
+        int end_of_options = strcmp(in_program_argv[src_idx], "--") == 0;
+        while (n_args-- > 0)
+            new_argv[dest_idx++] = in_program_argv[src_idx++];
+        if (end_of_options)
+            break;
     }
+    /* the <program> and its arguments, as they are */
+    while (src_idx < in_program_argc)
+        new_argv[dest_idx++] = in_program_argv[src_idx++];
     new_argv[dest_idx] = NULL;
 
     struct timespec start_time, end_time;
-    clock_gettime(CLOCK_REALTIME, &start_time);
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
 
     if (interrupt_execution != 0) {
         free(new_argv);
         return -3;
     }
 
-    int forked_pid;
-    forked_pid = fork();
-    if (forked_pid == 0) {
-        /* child process */
-        execvp("perf", new_argv);
-    } else if (forked_pid > 0) {
-        /* parent process */
-        wait(&status);
-    } else {
+    pid_t perf_pid = spawn_perf(new_argv, -1, pipe_output_fd);
+    if (perf_pid < 0) {
+        fprintf(stderr, "ERROR: couldn't run 'perf record': %s\n",
+                strerror(errno));
         free(new_argv);
         return -4;
     }
+    while (waitpid(perf_pid, &status, 0) < 0 && errno == EINTR)
+        ;   /* "perf record" gets the SIGINT too, and finishes */
 
     free(new_argv);
     if (interrupt_execution != 0)
         return -3;
 
-    clock_gettime(CLOCK_REALTIME, &end_time);
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
 
     out_duration->tv_sec = end_time.tv_sec - start_time.tv_sec;
     out_duration->tv_nsec = end_time.tv_nsec - start_time.tv_nsec;
@@ -570,123 +1818,2649 @@ execute_perf_record_and_program(int in_program_argc, char * in_program_argv[],
 }
 
 
-int
-upload_perf_report_to_NewRelic(char * in_perf_data_fname,
-                               const struct timespec * prog_exec_duration,
-                               long newrelic_transaction)
+/* The CPU time, in seconds, of "samples" samples whose periods add up to
+ * "period" (and whose weight is "weight"), or a negative value if it can't
+ * be known with this cost model */
+static double
+sample_cost_cpu_seconds(const struct sample_cost_model * cost_model,
+                        unsigned long long samples, unsigned long long period,
+                        double weight)
 {
-    FILE * perf_report_pipe;
+    if (cost_model->period_in_nsecs && period > 0)
+        return period / 1e9;
+    if (cost_model->sample_freq > 0 && samples > 0)
+        return (double)samples / cost_model->sample_freq;
+    if (cost_model->seconds_per_weight > 0)
+        return weight * cost_model->seconds_per_weight;
+    return -1;
+}
 
-    char perf_report_cmd[PATH_MAX+64];
-    snprintf(perf_report_cmd, sizeof perf_report_cmd,
-             "perf report --input=%s", in_perf_data_fname);
 
-    if (interrupt_execution != 0) return -1;
+/* The cost model of the options to "perf record" or to the native sampler */
+static void
+sample_cost_model_from_options(const struct perf_sampler_options * options,
+                               struct sample_cost_model * out_cost_model)
+{
+    memset(out_cost_model, 0, sizeof *out_cost_model);
+    out_cost_model->event_name = options->event_name;
+    out_cost_model->period_in_nsecs =
+                       options->event_type == PERF_TYPE_SOFTWARE &&
+                       (options->event_config == PERF_COUNT_SW_CPU_CLOCK ||
+                        options->event_config == PERF_COUNT_SW_TASK_CLOCK);
+    if (options->sample_period == 0)
+        out_cost_model->sample_freq = options->sample_freq;
+}
 
-    perf_report_pipe = popen(perf_report_cmd, "r");
-    if (!perf_report_pipe) {
-        char err_msg[256];
-        strerror_r(errno, err_msg, sizeof err_msg);
-        send_error_notice_to_NewRelic(newrelic_transaction,
-                                      "popen_perf_report", err_msg);
-        return -1;
-    }
 
-    double total_progr_duration;
-    total_progr_duration = prog_exec_duration->tv_sec +
-                           (prog_exec_duration->tv_nsec/1000000000);
-    fprintf(stderr, "DEBUG: Total duration %.06f\n", total_progr_duration);
+/* Send one value of a (symbol, DSO) or of a thread to NewRelic, as the
+ * attribute "Custom/ct_<family><name>". Values which are zero are not sent.
+ */
+static void
+upload_cost_attribute_to_NewRelic(long newrelic_transaction,
+                                  const char * family, const char * name,
+                                  const char * format, double value)
+{
+    char newrelic_attrib_from_perf_record[MAX_LENGTH_NEW_RELIC_IDENT+1];
+    snprintf(newrelic_attrib_from_perf_record,
+             sizeof newrelic_attrib_from_perf_record,
+             "Custom/ct_%s%s", family, name);
 
-    char * buff_line = NULL;
-    size_t buff_len = 0;
+    char value_str[32];
+    snprintf(value_str, sizeof value_str, format, value);
 
-    while (interrupt_execution == 0 &&
-           getline(&buff_line, &buff_len, perf_report_pipe) != -1) {
-         if (!buff_line || buff_line[0] == '\0' ||
-             buff_line[0] == '\n' || buff_line[0] == '#') /* '#' is a comment */
-             continue;
-         /* buff_line is in the format:
-               16.67%       <prog>  [kernel.kallsyms]  [k] vm_normal_page
-               16.67%       <prog>  libc-2.17.so       [.] __fxstat64
-         */
-         /* fprintf(stderr, "DEBUG: %s", buff_line); */
-         float percent;
-         char *so_object, *symbol;
-         sscanf(buff_line, " %f%% %*s %ms %*s %ms", &percent,
-                           &so_object, &symbol);
-         // fprintf(stderr, "DEBUG: %f %s %s\n", percent, symbol, so_object);
-
-         char newrelic_attrib_from_perf_record[MAX_LENGTH_NEW_RELIC_IDENT+1];
-         snprintf(newrelic_attrib_from_perf_record,
-                  sizeof newrelic_attrib_from_perf_record,
-                  "Custom/ct_%s@%s", symbol, so_object);
-
-         double relative_duration;
-         relative_duration = (percent/100) * total_progr_duration;
-         char relative_duration_str[32];
-         snprintf(relative_duration_str, sizeof relative_duration_str,
-                  "%.06f", relative_duration);
-
-         fprintf(stderr, "DEBUG: %s: %s\n", newrelic_attrib_from_perf_record,
-                                            relative_duration_str);
-
-         if (strcmp(relative_duration_str, "0.000000") == 0)
-             /* This symbol didn't have a weight (relative-duration) in the
-              * execution of the program: ignore it */
-             goto free_dynamic_buffers_in_this_while_loop;
-
-         /* Send the "perf record" to NewRelic for this symbol */
-         /* TODO: how to send the "perf report" to NewRelic:
-          *        newrelic_record_metric()
-          * or
-          *        newrelic_transaction_add_attribute()
-          * The current newrelic_record_metric() for this version 0.16.2.0 of
-          * the NewRelic Agent SDK doesn't allow to specify a transaction
-          * argument, and newrelic_transaction_add_attribute() allows it,
-          * but sends the value as a string, and not as  floating-point
-          * number. The latter option is chosen here, although the change to
-          * newrelic_record_metric() is below and is very small, just that
-          *  line */
-         int ret_code;
-         ret_code = newrelic_transaction_add_attribute(newrelic_transaction,
-                                            newrelic_attrib_from_perf_record,
-                                            relative_duration_str);
-
-         if (ret_code < 0)
-             fprintf(stderr, "ERROR: newrelic_transaction_add_attribute() "
-                             "returned %d\n", ret_code);
-
-       free_dynamic_buffers_in_this_while_loop:
-         if (so_object) free(so_object);
-         if (symbol) free(symbol);
-    }
-
-    if (buff_line)
-        free(buff_line);
-
-    int ret = pclose(perf_report_pipe);
-    if (ret < 0) {
-        char err_msg[256];
-        strerror_r(errno, err_msg, sizeof err_msg);
-        send_error_notice_to_NewRelic(newrelic_transaction,
-                                      "pclose_perf_report", err_msg);
-        return -2;
-    }
+    fprintf(stderr, "DEBUG: %s: %s\n", newrelic_attrib_from_perf_record,
+                                       value_str);
 
-    return 0;
+    if (strcmp(value_str, "0.000000") == 0 || strcmp(value_str, "0") == 0)
+        /* This symbol didn't have a weight (relative-duration) in the
+         * execution of the program: ignore it */
+        return;
+
+    /* Send the "perf record" to NewRelic for this symbol */
+    /* TODO: how to send the "perf report" to NewRelic:
+     *        newrelic_record_metric()
+     * or
+     *        newrelic_transaction_add_attribute()
+     * The current newrelic_record_metric() for this version 0.16.2.0 of
+     * the NewRelic Agent SDK doesn't allow to specify a transaction
+     * argument, and newrelic_transaction_add_attribute() allows it,
+     * but sends the value as a string, and not as  floating-point
+     * number. The latter option is chosen here, although the change to
+     * newrelic_record_metric() is below and is very small, just that
+     *  line */
+    newrelic_uploader_add_attribute(newrelic_uploader, newrelic_transaction,
+                                    newrelic_attrib_from_perf_record,
+                                    value_str);
 }
 
 
+/* Send to NewRelic the cost of one (symbol, DSO) of the aggregation table:
+ *
+ *     Custom/ct_<symbol>@<dso>           its CPU time, in seconds
+ *     Custom/ct_samples/<symbol>@<dso>   its number of samples
+ *     Custom/ct_period/<symbol>@<dso>    the sum of its periods, in units of
+ *                                        the event (attribute "ct_event")
+ *
+ * This is the common upload path of the "perf report" output and of the
+ * native sampler. For the aggregates of threads, "family" is "thread/" and
+ * only their CPU time and samples are sent.
+ */
+static void
+upload_aggregate_cost_to_NewRelic(long newrelic_transaction,
+                                  const char * family,
+                                  const struct symbol_aggregate * aggregate,
+                                  const struct sample_cost_model * cost_model)
+{
+    char name[MAX_LENGTH_NEW_RELIC_IDENT+1];
+    if (aggregate->so_object[0] != '\0')
+        snprintf(name, sizeof name, "%s@%s", aggregate->symbol,
+                 aggregate->so_object);
+    else
+        snprintf(name, sizeof name, "%s", aggregate->symbol);
+
+    double cpu_seconds = sample_cost_cpu_seconds(cost_model, aggregate->samples,
+                                                 aggregate->period,
+                                                 aggregate->weight);
+    if (cpu_seconds >= 0)
+        upload_cost_attribute_to_NewRelic(newrelic_transaction, family, name,
+                                          "%.06f", cpu_seconds);
+
+    char samples_family[64];
+    snprintf(samples_family, sizeof samples_family, "%ssamples/", family);
+    upload_cost_attribute_to_NewRelic(newrelic_transaction, samples_family,
+                                      name, "%.0f", (double)aggregate->samples);
+    if (family[0] == '\0')
+        upload_cost_attribute_to_NewRelic(newrelic_transaction, "period/",
+                                          name, "%.0f",
+                                          (double)aggregate->period);
+}
+
+
+/* Send a numeric metric to NewRelic. Unlike the attributes of the symbols,
+ * these are aggregated by NewRelic as numbers (averages, percentiles) over
+ * all the runs, so they can be charted and alerted on. */
+static void
+record_metric_to_NewRelic(const char * metric_name, double value)
+{
+    fprintf(stderr, "DEBUG: metric %s: %f\n", metric_name, value);
+
+    newrelic_uploader_record_metric(newrelic_uploader, metric_name, value);
+}
+
+
+/* Send the counters of the quality of a profile as metrics: with the ratio
+ * of the samples lost to all the samples, which tells if the numbers of the
+ * profile can be trusted */
+static void
+record_profile_quality_to_NewRelic(const struct profile_quality * quality)
+{
+    record_metric_to_NewRelic("Custom/ct_quality/lost_samples",
+                              (double)quality->lost_samples);
+    if (quality->samples + quality->lost_samples > 0)
+        record_metric_to_NewRelic("Custom/ct_quality/lost_ratio",
+                                  (double)quality->lost_samples /
+                                  (quality->samples + quality->lost_samples));
+    record_metric_to_NewRelic("Custom/ct_quality/unresolved_samples",
+                              (double)quality->unresolved_samples);
+    if (quality->has_throttles)
+        record_metric_to_NewRelic("Custom/ct_quality/throttles",
+                                  (double)quality->throttles);
+    if (quality->has_parse_failures)
+        record_metric_to_NewRelic("Custom/ct_quality/parse_failures",
+                                  (double)quality->parse_failures);
+}
+
+
+/* Send the percentiles of the durations recorded into a histogram since the
+ * last time, in seconds, as the metrics "<prefix>p50", p90, p99, p99.9 and
+ * max (none if there were no durations), and empty it */
+static void
+record_percentiles_to_NewRelic(const char * prefix,
+                               struct latency_histogram * histogram)
+{
+    static const struct {
+        const char * suffix;
+        double       quantile;
+    } percentiles[] = {
+        { "p50", 0.5 }, { "p90", 0.9 }, { "p99", 0.99 }, { "p99.9", 0.999 },
+        { "max", 1.0 }
+    };
+
+    /* the histogram can be recorded into while it is drained */
+    struct latency_histogram * window = arena_calloc(&window_arena, 1,
+                                                     sizeof *window);
+    if (!window)
+        return;
+    latency_histogram_drain(window, histogram);
+    if (window->count == 0)
+        return;
+
+    unsigned int i;
+    for (i = 0; i < sizeof percentiles / sizeof percentiles[0]; i++) {
+        char metric_name[MAX_LENGTH_NEW_RELIC_IDENT + 1];
+        snprintf(metric_name, sizeof metric_name, "%s%s", prefix,
+                 percentiles[i].suffix);
+        record_metric_to_NewRelic(metric_name,
+                      latency_histogram_value_at_quantile(window,
+                                                  percentiles[i].quantile) /
+                      1e9);
+    }
+}
+
+
+/* The percentiles of a histogram, as "Custom/ct_latency/<name>/p50"... */
+static void
+record_latency_to_NewRelic(const char * name,
+                           struct latency_histogram * histogram)
+{
+    char prefix[MAX_LENGTH_NEW_RELIC_IDENT + 1];
+    snprintf(prefix, sizeof prefix, "Custom/ct_latency/%s/", name);
+    record_percentiles_to_NewRelic(prefix, histogram);
+}
+
+
+static void
+record_segment_latency(struct latency_histogram * histogram,
+                       const struct timespec * duration)
+{
+    latency_histogram_record(histogram,
+                             (unsigned long long)duration->tv_sec *
+                             1000000000ULL + duration->tv_nsec);
+}
+
+
+static void
+record_segment_latencies_to_NewRelic(void)
+{
+    record_latency_to_NewRelic("segment/record", &record_segments);
+    record_latency_to_NewRelic("segment/report", &report_segments);
+}
+
+
+static double
+seconds_since(const struct timespec * start)
+{
+    struct timespec now, duration;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    timespec_difference(start, &now, &duration);
+    return duration.tv_sec + duration.tv_nsec / 1e9;
+}
+
+
+/* The resident memory of the wrapper now, in bytes, or 0 if unknown */
+static double
+resident_set_size(void)
+{
+    FILE * statm = fopen("/proc/self/statm", "r");
+    if (!statm)
+        return 0;
+    unsigned long size_pages, resident_pages;
+    int n_fields = fscanf(statm, "%lu %lu", &size_pages, &resident_pages);
+    fclose(statm);
+    return n_fields == 2 ? (double)resident_pages * sysconf(_SC_PAGESIZE) : 0;
+}
+
+
+/* Send the costs of the wrapper since the last time as the metrics
+ * "Custom/ct_self/...", and start counting them again: its CPU time and its
+ * memory, the lines of "perf report" it parsed (and how fast), the time it
+ * took to aggregate and to symbolize the native samples, the depth of the
+ * queue of the uploader, and the percentiles of the calls to the SDK */
+static void
+record_self_metrics_to_NewRelic(void)
+{
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        double cpu_seconds = usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+                             (usage.ru_utime.tv_usec +
+                              usage.ru_stime.tv_usec) / 1e6;
+        record_metric_to_NewRelic("Custom/ct_self/cpu_seconds",
+                                  cpu_seconds - self_costs.cpu_seconds);
+        self_costs.cpu_seconds = cpu_seconds;
+        /* ru_maxrss is in kilobytes */
+        record_metric_to_NewRelic("Custom/ct_self/peak_rss_bytes",
+                                  usage.ru_maxrss * 1024.0);
+    }
+    double rss = resident_set_size();
+    if (rss > 0)
+        record_metric_to_NewRelic("Custom/ct_self/rss_bytes", rss);
+
+    struct arena_stats arena_stats;
+    arena_get_stats(&window_arena, &arena_stats);
+    record_metric_to_NewRelic("Custom/ct_self/window_bytes",
+                              (double)arena_stats.used_bytes);
+
+    if (self_costs.report_lines > 0) {
+        record_metric_to_NewRelic("Custom/ct_self/report_lines",
+                                  (double)self_costs.report_lines);
+        record_metric_to_NewRelic("Custom/ct_self/report_bytes",
+                                  (double)self_costs.report_bytes);
+        record_metric_to_NewRelic("Custom/ct_self/report_seconds",
+                                  self_costs.report_seconds);
+        if (self_costs.report_seconds > 0)
+            record_metric_to_NewRelic("Custom/ct_self/report_lines_per_second",
+                                      self_costs.report_lines /
+                                      self_costs.report_seconds);
+    }
+    if (self_costs.aggregation_seconds > 0) {
+        record_metric_to_NewRelic("Custom/ct_self/aggregation_seconds",
+                                  self_costs.aggregation_seconds);
+        record_metric_to_NewRelic("Custom/ct_self/symbolization_seconds",
+                                  self_costs.symbolization_seconds);
+    }
+
+    struct newrelic_uploader_stats uploader_stats;
+    newrelic_uploader_take_stats(newrelic_uploader, &uploader_stats);
+    if (newrelic_uploader) {
+        record_metric_to_NewRelic("Custom/ct_self/upload_queue_depth",
+                                  (double)uploader_stats.queued);
+        record_metric_to_NewRelic("Custom/ct_self/upload_queue_peak",
+                                  (double)uploader_stats.peak_queued);
+        record_metric_to_NewRelic("Custom/ct_self/upload_dropped",
+                                  (double)uploader_stats.dropped);
+    }
+    record_percentiles_to_NewRelic("Custom/ct_self/sdk_call/",
+                        newrelic_uploader_sdk_latencies(newrelic_uploader));
+
+    double cpu_seconds = self_costs.cpu_seconds;
+    memset(&self_costs, 0, sizeof self_costs);
+    self_costs.cpu_seconds = cpu_seconds;
+}
+
+
+/* Send to NewRelic, in one batch and sorted by weight, the top-K aggregates
+ * of an aggregation table of a flush window (of symbols, or of threads) */
+static int
+upload_top_aggregates_to_NewRelic(long newrelic_transaction,
+                                  const struct symbol_aggregation * aggregation,
+                                  const char * family,
+                                  unsigned int top_symbols,
+                                  const struct sample_cost_model * cost_model)
+{
+    struct symbol_aggregate * top = arena_calloc(&window_arena, top_symbols,
+                                                 sizeof *top);
+    if (!top) {
+        send_error_notice_to_NewRelic(newrelic_transaction,
+                                      "upload_top_symbols", "calloc() failed");
+        return -1;
+    }
+
+    size_t n_top = symbol_aggregation_top(aggregation, top_symbols, top);
+    fprintf(stderr, "DEBUG: uploading the top %zu of %zu %s\n", n_top,
+            symbol_aggregation_count(aggregation),
+            family[0] ? family : "symbols");
+
+    size_t i;
+    for (i = 0; i < n_top && interrupt_execution == 0; i++)
+        upload_aggregate_cost_to_NewRelic(newrelic_transaction, family,
+                                          &top[i], cost_model);
+    return 0;
+}
+
+
+/* Send to NewRelic the totals of the profile: the event that was sampled,
+ * its number of samples and periods, and the CPU time that they represent,
+ * next to the wall-clock duration */
+static void
+upload_profile_totals_to_NewRelic(long newrelic_transaction,
+                                  const struct symbol_aggregation * aggregation,
+                                  const struct symbol_aggregation * unresolved,
+                                  const struct sample_cost_model * cost_model,
+                                  double wall_clock_seconds)
+{
+    struct {
+        const char * name;
+        char         value[32];
+    } totals[5];
+    unsigned long long total_samples =
+                             symbol_aggregation_total_samples(aggregation);
+    unsigned long long total_period =
+                             symbol_aggregation_total_period(aggregation);
+    double total_weight = symbol_aggregation_total_weight(aggregation);
+    if (unresolved) {
+        total_samples += symbol_aggregation_total_samples(unresolved);
+        total_period += symbol_aggregation_total_period(unresolved);
+        total_weight += symbol_aggregation_total_weight(unresolved);
+    }
+    double cpu_seconds = sample_cost_cpu_seconds(cost_model, total_samples,
+                                                 total_period, total_weight);
+    size_t n_totals = 0;
+
+    totals[n_totals].name = "ct_event";
+    snprintf(totals[n_totals++].value, sizeof totals[0].value, "%s",
+             cost_model->event_name ? cost_model->event_name : "[unknown]");
+    totals[n_totals].name = "ct_total_samples";
+    snprintf(totals[n_totals++].value, sizeof totals[0].value, "%llu",
+             total_samples);
+    totals[n_totals].name = "ct_total_period";
+    snprintf(totals[n_totals++].value, sizeof totals[0].value, "%llu",
+             total_period);
+    totals[n_totals].name = "ct_wall_clock_time";
+    snprintf(totals[n_totals++].value, sizeof totals[0].value, "%.06f",
+             wall_clock_seconds);
+    if (cpu_seconds >= 0) {
+        totals[n_totals].name = "ct_cpu_time";
+        snprintf(totals[n_totals++].value, sizeof totals[0].value, "%.06f",
+                 cpu_seconds);
+    }
+
+    size_t i;
+    for (i = 0; i < n_totals; i++) {
+        fprintf(stderr, "DEBUG: %s: %s\n", totals[i].name, totals[i].value);
+        newrelic_uploader_add_attribute(newrelic_uploader, newrelic_transaction,
+                                        totals[i].name, totals[i].value);
+    }
+}
+
+
+/* The value of the metric of an aggregate (or of a sum of aggregates): its
+ * CPU time in seconds, or, if it can't be known, its number of samples */
+static double
+aggregate_metric_value(const struct symbol_aggregate * aggregate,
+                       const struct sample_cost_model * cost_model)
+{
+    double cpu_seconds = sample_cost_cpu_seconds(cost_model, aggregate->samples,
+                                                 aggregate->period,
+                                                 aggregate->weight);
+    return cpu_seconds >= 0 ? cpu_seconds : (double)aggregate->samples;
+}
+
+
+/* Add an aggregate of the unresolved samples of a DSO, which already is by
+ * (dso, ""), to the aggregates folded per DSO */
+static void
+add_unresolved_by_dso(void * callback_arg,
+                      const struct symbol_aggregate * aggregate)
+{
+    symbol_aggregation_add(callback_arg, aggregate->symbol,
+                           aggregate->so_object, aggregate->samples,
+                           aggregate->period, aggregate->weight);
+}
+
+
+/* The aggregates which are not in the top-K, folded per DSO */
+struct fold_by_dso_arg {
+    const struct symbol_aggregation * top_set;   /* NULL: fold them all */
+    struct symbol_aggregation *       by_dso;    /* by (dso, "") */
+};
+
+static void
+fold_aggregate_by_dso(void * callback_arg,
+                      const struct symbol_aggregate * aggregate)
+{
+    struct fold_by_dso_arg * arg = callback_arg;
+    if (arg->top_set && symbol_aggregation_find(arg->top_set, aggregate->symbol,
+                                                aggregate->so_object))
+        return;
+    symbol_aggregation_add(arg->by_dso, aggregate->so_object, NO_SO_OBJECT,
+                           aggregate->samples, aggregate->period,
+                           aggregate->weight);
+}
+
+
+/* Send to NewRelic the symbols of the aggregation table as numeric metrics,
+ * with a bounded and stable set of metric names (New Relic recommends fewer
+ * than 2000 metric names per account):
+ *
+ *     Custom/ct_<symbol>@<dso>   for each of the top-K symbols
+ *     Custom/ct_other@<dso>      the sum of the other symbols of each DSO
+ *
+ * or, with "rollup_by_dso", only per DSO:
+ *
+ *     Custom/ct_dso@<dso>        for each of the top-K DSOs
+ *     Custom/ct_other@[other]    the sum of the other DSOs
+ *
+ * The values are CPU seconds (or samples, if the CPU time is not known).
+ * The samples which were not symbolized ("unresolved", by (dso, ""), or
+ * NULL) are in the sums of their DSOs.
+ */
+static int
+upload_symbol_metrics_to_NewRelic(long newrelic_transaction,
+                                  const struct symbol_aggregation * aggregation,
+                                  const struct symbol_aggregation * unresolved,
+                                  unsigned int top_symbols, int rollup_by_dso,
+                                  const struct sample_cost_model * cost_model)
+{
+    struct symbol_aggregation * top_set = NULL;
+    struct symbol_aggregation * by_dso =
+                   symbol_aggregation_new_in_arena(&window_arena);
+    struct symbol_aggregate * top = arena_calloc(&window_arena, top_symbols,
+                                                 sizeof *top);
+    if (!by_dso || !top) {
+        send_error_notice_to_NewRelic(newrelic_transaction,
+                                      "upload_symbol_metrics",
+                                      "calloc() failed");
+        return -1;
+    }
+
+    char metric_name[MAX_LENGTH_NEW_RELIC_IDENT+1];
+    struct fold_by_dso_arg fold_arg = { NULL, by_dso };
+    size_t n_top, i;
+
+    if (rollup_by_dso) {
+        symbol_aggregation_for_each(aggregation, fold_aggregate_by_dso,
+                                    &fold_arg);
+        if (unresolved)
+            symbol_aggregation_for_each(unresolved, add_unresolved_by_dso,
+                                        by_dso);
+        n_top = symbol_aggregation_top(by_dso, top_symbols, top);
+        fprintf(stderr, "DEBUG: uploading the top %zu of %zu DSOs as "
+                        "metrics\n", n_top, symbol_aggregation_count(by_dso));
+
+        struct symbol_aggregate other;
+        memset(&other, 0, sizeof other);
+        other.samples = symbol_aggregation_total_samples(by_dso);
+        other.period = symbol_aggregation_total_period(by_dso);
+        other.weight = symbol_aggregation_total_weight(by_dso);
+        for (i = 0; i < n_top && interrupt_execution == 0; i++) {
+            snprintf(metric_name, sizeof metric_name, "Custom/ct_dso@%s",
+                     top[i].symbol);
+            record_metric_to_NewRelic(metric_name,
+                                      aggregate_metric_value(&top[i],
+                                                             cost_model));
+            other.samples -= top[i].samples;
+            other.period -= top[i].period;
+            other.weight -= top[i].weight;
+        }
+        if (n_top < symbol_aggregation_count(by_dso))
+            record_metric_to_NewRelic("Custom/ct_other@[other]",
+                                      aggregate_metric_value(&other,
+                                                             cost_model));
+    } else {
+        n_top = symbol_aggregation_top(aggregation, top_symbols, top);
+        fprintf(stderr, "DEBUG: uploading the top %zu of %zu symbols as "
+                        "metrics\n", n_top,
+                        symbol_aggregation_count(aggregation));
+
+        top_set = symbol_aggregation_new_in_arena(&window_arena);
+        for (i = 0; i < n_top && interrupt_execution == 0; i++) {
+            snprintf(metric_name, sizeof metric_name, "Custom/ct_%s@%s",
+                     top[i].symbol, top[i].so_object);
+            record_metric_to_NewRelic(metric_name,
+                                      aggregate_metric_value(&top[i],
+                                                             cost_model));
+            if (top_set)
+                symbol_aggregation_add(top_set, top[i].symbol,
+                                       top[i].so_object, 0, 0, 0);
+        }
+
+        /* the rest, folded per DSO (if the top set couldn't be allocated,
+         * they are not sent, instead of being counted twice) */
+        if (top_set && (n_top < symbol_aggregation_count(aggregation) ||
+                        (unresolved &&
+                         symbol_aggregation_count(unresolved) > 0))) {
+            fold_arg.top_set = top_set;
+            symbol_aggregation_for_each(aggregation, fold_aggregate_by_dso,
+                                        &fold_arg);
+            if (unresolved)
+                symbol_aggregation_for_each(unresolved, add_unresolved_by_dso,
+                                            by_dso);
+            struct symbol_aggregate * others =
+                   arena_calloc(&window_arena, symbol_aggregation_count(by_dso),
+                                sizeof *others);
+            size_t n_others = others ?
+                   symbol_aggregation_top(by_dso,
+                                          symbol_aggregation_count(by_dso),
+                                          others) : 0;
+            for (i = 0; i < n_others && interrupt_execution == 0; i++) {
+                snprintf(metric_name, sizeof metric_name,
+                         "Custom/ct_other@%s", others[i].symbol);
+                record_metric_to_NewRelic(metric_name,
+                                          aggregate_metric_value(&others[i],
+                                                                 cost_model));
+            }
+        }
+    }
+    return 0;
+}
+
+
+/* Send the symbols of the aggregation table to NewRelic: as numeric metrics
+ * with "--metrics" or "--rollup=dso", or else as attributes of the
+ * transaction (where the samples which were not symbolized, "unresolved",
+ * are only in the totals) */
+static int
+upload_symbols_to_NewRelic(long newrelic_transaction,
+                           const struct symbol_aggregation * aggregation,
+                           const struct symbol_aggregation * unresolved,
+                           const struct wrapper_options * wrapper_opts,
+                           const struct sample_cost_model * cost_model)
+{
+    if (wrapper_opts->symbol_metrics)
+        return upload_symbol_metrics_to_NewRelic(newrelic_transaction,
+                                                 aggregation, unresolved,
+                                                 wrapper_opts->top_symbols,
+                                                 wrapper_opts->rollup_by_dso,
+                                                 cost_model);
+    return upload_top_aggregates_to_NewRelic(newrelic_transaction, aggregation,
+                                             "", wrapper_opts->top_symbols,
+                                             cost_model);
+}
+
+
+/* Send the call-graphs of the trie to NewRelic: with "--stacks=inclusive"
+ * the top-K frames by their inclusive cost (the samples of the stacks in
+ * which they appear), as the attributes "ct_inclusive/<symbol>@<dso>", or
+ * with "--stacks=folded" the folded stacks (see stack_trie_write_folded()),
+ * split into the attributes "ct_folded_stacks/000", "ct_folded_stacks/001",
+ * ... which are to be concatenated in order */
+static int
+upload_stacks_to_NewRelic(long newrelic_transaction,
+                          const struct stack_trie * stacks,
+                          const struct wrapper_options * wrapper_opts,
+                          const struct sample_cost_model * cost_model)
+{
+    if (stack_trie_total_samples(stacks) == 0)
+        return 0;
+    fprintf(stderr, "DEBUG: %llu stacks in a trie of %zu frames\n",
+            stack_trie_total_samples(stacks), stack_trie_node_count(stacks));
+
+    if (wrapper_opts->stacks == STACKS_INCLUSIVE) {
+        struct symbol_aggregation * inclusive =
+                   symbol_aggregation_new_in_arena(&window_arena);
+        if (!inclusive || stack_trie_add_inclusive(stacks, inclusive) != 0) {
+            send_error_notice_to_NewRelic(newrelic_transaction,
+                                          "upload_stacks", "malloc() failed");
+            return -1;
+        }
+        return upload_top_aggregates_to_NewRelic(newrelic_transaction,
+                                                 inclusive, "inclusive/",
+                                                 wrapper_opts->top_symbols,
+                                                 cost_model);
+    }
+
+    /* a chunk is as long as the longest value of an attribute */
+    size_t chunk_size = NEWRELIC_UPLOADER_VALUE_SIZE - 1;
+    size_t buffer_size = FOLDED_STACKS_MAX_CHUNKS * chunk_size + 1;
+    char * buffer = arena_alloc(&window_arena, buffer_size);
+    unsigned long long omitted = 0;
+    long length = -1;
+    if (buffer)
+        length = stack_trie_write_folded(stacks, FOLDED_STACKS_MIN_SHARE *
+                                                 stack_trie_total_weight(stacks),
+                                         buffer, buffer_size, &omitted,
+                                         &window_arena);
+    if (length < 0) {
+        send_error_notice_to_NewRelic(newrelic_transaction,
+                                      "upload_stacks", "malloc() failed");
+        return -1;
+    }
+
+    char attribute_name[MAX_LENGTH_NEW_RELIC_IDENT+1];
+    char attribute_value[NEWRELIC_UPLOADER_VALUE_SIZE];
+    unsigned int n_chunks = 0;
+    size_t offset;
+    for (offset = 0; offset < (size_t)length; offset += chunk_size) {
+        snprintf(attribute_name, sizeof attribute_name,
+                 "ct_folded_stacks/%03u", n_chunks++);
+        snprintf(attribute_value, sizeof attribute_value, "%.*s",
+                 (int)chunk_size, buffer + offset);
+        newrelic_uploader_add_attribute(newrelic_uploader,
+                                        newrelic_transaction, attribute_name,
+                                        attribute_value);
+    }
+
+    snprintf(attribute_value, sizeof attribute_value, "%u", n_chunks);
+    newrelic_uploader_add_attribute(newrelic_uploader, newrelic_transaction,
+                                    "ct_folded_stacks_chunks", attribute_value);
+    if (omitted > 0) {
+        snprintf(attribute_value, sizeof attribute_value, "%llu", omitted);
+        newrelic_uploader_add_attribute(newrelic_uploader,
+                                        newrelic_transaction,
+                                        "ct_folded_stacks_omitted",
+                                        attribute_value);
+    }
+    fprintf(stderr, "DEBUG: %ld bytes of folded stacks in %u attributes, "
+                    "%llu samples omitted\n", length, n_chunks, omitted);
+    return 0;
+}
+
+
+/* The breakdown of the samples of a window by thread (--breakdown): the
+ * total of each key (a thread, a comm, or a pool of threads), and the
+ * symbols of only the top --max-breakdown keys, so that the number of
+ * metric names it makes is bound, whatever the number of threads.
+ *
+ * The keys are only known to be in the top at the end of the window, so
+ * the samples are seen twice: once for the totals of their keys, and once
+ * for the symbols of the top keys, from the lines of "perf report" kept
+ * meanwhile (see thread_breakdown_defer()) or from the raw samples of the
+ * native sampler, which are then only symbolized if their key is in the
+ * top. Everything is allocated from the arena of the window. */
+struct breakdown_entry {
+    const char *                key;       /* interned in "keys" */
+    struct symbol_aggregation * symbols;
+};
+
+/* A line of "perf report" whose symbols go to its key, if it is in the top */
+struct breakdown_line {
+    const char *       key;
+    const char *       symbol;
+    const char *       so_object;
+    unsigned long long samples;
+    unsigned long long period;
+    double             weight;
+};
+
+#define BREAKDOWN_LINES_PER_BLOCK  256
+
+struct breakdown_lines {
+    struct breakdown_lines * next;
+    size_t                   n_lines;
+    struct breakdown_line    lines[BREAKDOWN_LINES_PER_BLOCK];
+};
+
+struct thread_breakdown {
+    enum thread_breakdown_key   by;
+    struct symbol_aggregation * keys;      /* per (key, "") */
+    struct breakdown_entry *    top;       /* by decreasing weight */
+    size_t                      n_top;
+    struct breakdown_lines *    deferred;  /* the newest block first */
+};
+
+
+static struct thread_breakdown *
+thread_breakdown_new(enum thread_breakdown_key by)
+{
+    struct thread_breakdown * breakdown = arena_calloc(&window_arena, 1,
+                                                       sizeof *breakdown);
+    if (!breakdown)
+        return NULL;
+    breakdown->by = by;
+    breakdown->keys = symbol_aggregation_new_in_arena(&window_arena);
+    return breakdown->keys ? breakdown : NULL;
+}
+
+
+/* Add the samples of a thread to the total of its key. Returns the key
+ * (interned), or NULL if the sample has none (eg., "perf report" without
+ * the tids) or if it couldn't allocate memory. */
+static const char *
+thread_breakdown_add(struct thread_breakdown * breakdown, const char * comm,
+                     size_t comm_len, int tid, unsigned long long samples,
+                     unsigned long long period, double weight)
+{
+    char key[64];
+    int len;
+    if (comm_len > 32)
+        comm_len = 32;
+    if (breakdown->by == BREAKDOWN_BY_THREAD) {
+        if (tid < 0)
+            return NULL;
+        len = snprintf(key, sizeof key, "%.*s/%d", (int)comm_len, comm, tid);
+    } else {
+        /* a pool is the name without the number of the thread at its end,
+         * and the separator before it: "worker-12", "worker_3" -> "worker" */
+        size_t pool_len = comm_len;
+        if (breakdown->by == BREAKDOWN_BY_POOL) {
+            while (pool_len > 0 && comm[pool_len - 1] >= '0' &&
+                   comm[pool_len - 1] <= '9')
+                pool_len--;
+            while (pool_len > 0 && strchr("-_.:#/ ", comm[pool_len - 1]))
+                pool_len--;
+            if (pool_len == 0)
+                pool_len = comm_len;   /* only a number */
+        }
+        len = snprintf(key, sizeof key, "%.*s", (int)pool_len, comm);
+    }
+    if (len <= 0)
+        return NULL;
+
+    const char * interned = symbol_aggregation_intern(breakdown->keys, key,
+                                                      (size_t)len);
+    if (!interned || symbol_aggregation_add(breakdown->keys, interned,
+                                            NO_SO_OBJECT, samples, period,
+                                            weight) != 0)
+        return NULL;
+    return interned;
+}
+
+
+/* Keep a line of "perf report" of "key" (and its interned symbol and DSO)
+ * till the top keys are known */
+static int
+thread_breakdown_defer(struct thread_breakdown * breakdown, const char * key,
+                       const char * symbol, const char * so_object,
+                       unsigned long long samples, unsigned long long period,
+                       double weight)
+{
+    struct breakdown_lines * block = breakdown->deferred;
+    if (!block || block->n_lines == BREAKDOWN_LINES_PER_BLOCK) {
+        block = arena_alloc(&window_arena, sizeof *block);
+        if (!block)
+            return -1;
+        block->n_lines = 0;
+        block->next = breakdown->deferred;
+        breakdown->deferred = block;
+    }
+    struct breakdown_line * line = &block->lines[block->n_lines++];
+    line->key = key;
+    line->symbol = symbol;
+    line->so_object = so_object;
+    line->samples = samples;
+    line->period = period;
+    line->weight = weight;
+    return 0;
+}
+
+
+/* The aggregation of the symbols of a key, if it is in the top */
+static struct symbol_aggregation *
+thread_breakdown_symbols(const struct thread_breakdown * breakdown,
+                         const char * key)
+{
+    size_t i;
+    for (i = 0; i < breakdown->n_top; i++)
+        if (breakdown->top[i].key == key)
+            return breakdown->top[i].symbols;
+    return NULL;
+}
+
+
+/* Choose the top "max_keys" keys, once all the samples were added, and give
+ * them the lines deferred so far. Returns 0, or -1 if it couldn't allocate
+ * memory. */
+static int
+thread_breakdown_select_top(struct thread_breakdown * breakdown,
+                            unsigned int max_keys)
+{
+    struct symbol_aggregate * top = arena_calloc(&window_arena, max_keys,
+                                                 sizeof *top);
+    breakdown->top = arena_calloc(&window_arena, max_keys,
+                                  sizeof *breakdown->top);
+    if (!top || !breakdown->top)
+        return -1;
+
+    size_t n_top = symbol_aggregation_top(breakdown->keys, max_keys, top);
+    for (breakdown->n_top = 0; breakdown->n_top < n_top; breakdown->n_top++) {
+        struct breakdown_entry * entry = &breakdown->top[breakdown->n_top];
+        entry->key = top[breakdown->n_top].symbol;
+        entry->symbols = symbol_aggregation_new_in_arena(&window_arena);
+        if (!entry->symbols)
+            return -1;
+    }
+
+    const struct breakdown_lines * block;
+    for (block = breakdown->deferred; block; block = block->next) {
+        size_t i;
+        for (i = 0; i < block->n_lines; i++) {
+            const struct breakdown_line * line = &block->lines[i];
+            struct symbol_aggregation * symbols =
+                               thread_breakdown_symbols(breakdown, line->key);
+            if (symbols)
+                symbol_aggregation_add(symbols, line->symbol, line->so_object,
+                                       line->samples, line->period,
+                                       line->weight);
+        }
+    }
+    breakdown->deferred = NULL;
+    return 0;
+}
+
+
+/* Send the breakdown as numeric metrics, scoped by key:
+ *
+ *     Custom/ct_breakdown/<key>/total              the CPU time of the key
+ *     Custom/ct_breakdown/<key>/<symbol>@<dso>     of its top symbols
+ *     Custom/ct_breakdown/[other]/total            of the keys not in the top
+ *     Custom/ct_breakdown/keys                     the number of keys
+ *     Custom/ct_breakdown/imbalance                the total of the hottest
+ *                                                  key over the mean total
+ *
+ * (in CPU seconds, or samples if the CPU time is not known), so that a pool
+ * (or a thread) which is hotter than the others shows up: the imbalance is
+ * 1 when all the keys are equally busy, and the number of keys when all the
+ * samples are in one of them. */
+static void
+upload_thread_breakdown_to_NewRelic(long newrelic_transaction,
+                                    const struct thread_breakdown * breakdown,
+                                    const struct sample_cost_model * cost_model)
+{
+    size_t n_keys = symbol_aggregation_count(breakdown->keys);
+    if (n_keys == 0)
+        return;
+    struct symbol_aggregate * top = arena_calloc(&window_arena,
+                                                 BREAKDOWN_TOP_SYMBOLS,
+                                                 sizeof *top);
+    if (!top) {
+        send_error_notice_to_NewRelic(newrelic_transaction,
+                                      "upload_thread_breakdown",
+                                      "calloc() failed");
+        return;
+    }
+    fprintf(stderr, "DEBUG: uploading the breakdown of the top %zu of %zu "
+                    "threads\n", breakdown->n_top, n_keys);
+
+    char metric_name[MAX_LENGTH_NEW_RELIC_IDENT+1];
+    struct symbol_aggregate other;
+    memset(&other, 0, sizeof other);
+    other.samples = symbol_aggregation_total_samples(breakdown->keys);
+    other.period = symbol_aggregation_total_period(breakdown->keys);
+    other.weight = symbol_aggregation_total_weight(breakdown->keys);
+    double total_value = aggregate_metric_value(&other, cost_model);
+    double max_value = 0;
+
+    size_t i, j;
+    for (i = 0; i < breakdown->n_top && interrupt_execution == 0; i++) {
+        const struct breakdown_entry * entry = &breakdown->top[i];
+        const struct symbol_aggregate * total =
+                 symbol_aggregation_find(breakdown->keys, entry->key,
+                                         NO_SO_OBJECT);
+        if (!total)
+            continue;
+        double value = aggregate_metric_value(total, cost_model);
+        if (value > max_value)
+            max_value = value;
+        snprintf(metric_name, sizeof metric_name,
+                 "Custom/ct_breakdown/%s/total", entry->key);
+        record_metric_to_NewRelic(metric_name, value);
+        other.samples -= total->samples;
+        other.period -= total->period;
+        other.weight -= total->weight;
+
+        size_t n_symbols = symbol_aggregation_top(entry->symbols,
+                                                  BREAKDOWN_TOP_SYMBOLS, top);
+        for (j = 0; j < n_symbols; j++) {
+            snprintf(metric_name, sizeof metric_name,
+                     "Custom/ct_breakdown/%s/%s@%s", entry->key,
+                     top[j].symbol, top[j].so_object);
+            record_metric_to_NewRelic(metric_name,
+                                      aggregate_metric_value(&top[j],
+                                                             cost_model));
+        }
+    }
+    if (breakdown->n_top < n_keys)
+        record_metric_to_NewRelic("Custom/ct_breakdown/[other]/total",
+                                  aggregate_metric_value(&other, cost_model));
+    record_metric_to_NewRelic("Custom/ct_breakdown/keys", (double)n_keys);
+    if (total_value > 0)
+        record_metric_to_NewRelic("Custom/ct_breakdown/imbalance",
+                                  max_value / (total_value / n_keys));
+}
+
+
+int
+upload_perf_report_to_NewRelic(struct perf_report_process * in_report,
+                               const struct timespec * prog_exec_duration,
+                               const struct wrapper_options * wrapper_opts,
+                               const struct sample_cost_model * cost_model,
+                               long newrelic_transaction)
+{
+    if (interrupt_execution != 0) {
+        finish_perf_report(in_report);
+        return -1;
+    }
+
+    struct symbol_aggregation * aggregation =
+                   symbol_aggregation_new_in_arena(&window_arena);
+    struct symbol_aggregation * threads =
+                   symbol_aggregation_new_in_arena(&window_arena);
+    struct stack_trie * stacks = wrapper_opts->stacks ? stack_trie_new() : NULL;
+    struct thread_breakdown * breakdown = wrapper_opts->breakdown ?
+                           thread_breakdown_new(wrapper_opts->breakdown) : NULL;
+    if (!aggregation || !threads || (wrapper_opts->stacks && !stacks) ||
+        (wrapper_opts->breakdown && !breakdown)) {
+        send_error_notice_to_NewRelic(newrelic_transaction,
+                                      "upload_perf_report", "calloc() failed");
+        finish_perf_report(in_report);
+        stack_trie_free(stacks);
+        arena_reset(&window_arena);
+        return -1;
+    }
+
+    double total_progr_duration;
+    total_progr_duration = prog_exec_duration->tv_sec +
+                           prog_exec_duration->tv_nsec / 1e9;
+    fprintf(stderr, "DEBUG: Total duration %.06f\n", total_progr_duration);
+
+    /* the lines are read into the fixed buffer of the reader, and parsed
+     * into string views inside that buffer: no allocation per line */
+    struct perf_report_reader * reader = arena_alloc(&window_arena,
+                                                     sizeof *reader);
+    if (!reader) {
+        send_error_notice_to_NewRelic(newrelic_transaction,
+                                      "upload_perf_report", "malloc() failed");
+        finish_perf_report(in_report);
+        stack_trie_free(stacks);
+        arena_reset(&window_arena);
+        return -1;
+    }
+    perf_report_reader_init(reader, in_report->fd);
+
+    char * buff_line;
+    size_t line_len;
+    unsigned long malformed_lines = 0;
+    struct profile_quality quality;
+    memset(&quality, 0, sizeof quality);
+    quality.has_parse_failures = 1;
+
+    /* the layout of the lines, from the header line of the --fields; till
+     * it is found, the lines are parsed in the default layout of a
+     * "perf report" (eg., an old "perf" which doesn't know --fields) */
+    struct perf_report_schema schema;
+    int schema_found = 0;
+
+    struct timespec parse_start;
+    clock_gettime(CLOCK_MONOTONIC, &parse_start);
+    while (interrupt_execution == 0 &&
+           perf_report_reader_next_line(reader, &buff_line, &line_len) == 1) {
+         self_costs.report_lines++;
+         /* buff_line is in the format:
+               16.67%       <prog>  [kernel.kallsyms]  [k] vm_normal_page
+               16.67%       <prog>  libc-2.17.so       [.] __fxstat64
+         */
+         /* fprintf(stderr, "DEBUG: %s\n", buff_line); */
+         if (!schema_found && buff_line[0] == '#') {
+             if (perf_report_parse_lost_samples(buff_line, line_len,
+                                                &quality.lost_samples) == 0)
+                 continue;
+             schema_found = perf_report_schema_parse_header(&schema,
+                                                 PERF_REPORT_FIELD_SEPARATOR,
+                                                 buff_line, line_len) == 0;
+             continue;
+         }
+         /* the lines of the call-graphs have no field separators */
+         if (stacks && schema_found &&
+             !memchr(buff_line, PERF_REPORT_FIELD_SEPARATOR, line_len)) {
+             unsigned long long stack_samples;
+             struct string_view frames;
+             if (perf_report_parse_folded_callchain(buff_line, line_len,
+                                                    &stack_samples,
+                                                    &frames) ==
+                                                    PERF_REPORT_LINE_OK) {
+                 sample_aggregation_add_folded_stack(stacks, aggregation,
+                                                     &frames, stack_samples);
+                 continue;
+             }
+         }
+         struct perf_report_line parsed;
+         enum perf_report_parse_result parse_result;
+         if (schema_found)
+             parse_result = perf_report_parse_fields(&schema, buff_line,
+                                                     line_len, &parsed);
+         else
+             parse_result = perf_report_parse_line(buff_line, line_len,
+                                                   &parsed);
+         if (parse_result == PERF_REPORT_LINE_SKIPPED) {
+             continue;   /* empty, or '#' is a comment */
+         } else if (parse_result == PERF_REPORT_LINE_MALFORMED) {
+             fprintf(stderr, "DEBUG: ignoring malformed line: %s\n",
+                     buff_line);
+             malformed_lines++;
+             continue;
+         }
+
+         /* Add the "perf record" of this symbol to the aggregation table;
+          * the top-K symbols are sent to NewRelic after the whole report */
+         const char * interned_symbol =
+                   symbol_aggregation_intern(aggregation, parsed.symbol.ptr,
+                                             parsed.symbol.len);
+         const char * interned_so_object =
+                   symbol_aggregation_intern(aggregation, parsed.so_object.ptr,
+                                             parsed.so_object.len);
+         if (interned_symbol && interned_so_object)
+             symbol_aggregation_add(aggregation, interned_symbol,
+                                    interned_so_object, parsed.samples,
+                                    parsed.period, parsed.percent);
+         quality.samples += parsed.samples;
+         if (perf_report_symbol_is_unresolved(&parsed.symbol))
+             quality.unresolved_samples += parsed.samples;
+         if (parsed.tid >= 0)
+             sample_aggregation_add_thread(threads, parsed.comm.ptr,
+                                           parsed.comm.len, parsed.tid,
+                                           parsed.samples, parsed.period,
+                                           parsed.percent);
+         if (breakdown && parsed.comm.len > 0 && interned_symbol &&
+             interned_so_object) {
+             const char * key = thread_breakdown_add(breakdown,
+                                                     parsed.comm.ptr,
+                                                     parsed.comm.len,
+                                                     parsed.tid,
+                                                     parsed.samples,
+                                                     parsed.period,
+                                                     parsed.percent);
+             if (key)
+                 thread_breakdown_defer(breakdown, key, interned_symbol,
+                                        interned_so_object, parsed.samples,
+                                        parsed.period, parsed.percent);
+         }
+    }
+
+    self_costs.report_seconds += seconds_since(&parse_start);
+    self_costs.report_bytes += reader->bytes_read;
+
+    if (malformed_lines > 0 || reader->truncated_lines > 0)
+        fprintf(stderr, "DEBUG: 'perf report': %lu malformed lines, %lu "
+                        "too long lines\n", malformed_lines,
+                        reader->truncated_lines);
+    quality.parse_failures = malformed_lines + reader->truncated_lines;
+
+    if (finish_perf_report(in_report) < 0) {
+        char err_msg[256];
+        strerror_r(errno, err_msg, sizeof err_msg);
+        send_error_notice_to_NewRelic(newrelic_transaction,
+                                      "waitpid_perf_report", err_msg);
+        stack_trie_free(stacks);
+        arena_reset(&window_arena);
+        return -2;
+    }
+
+    /* the weights in the aggregation are the percentages: they are used for
+     * the CPU time only if "perf report" didn't give the samples (eg., an
+     * old "perf" without --fields), as a share of the wall-clock duration,
+     * which is only right for a single-threaded program that never sleeps */
+    struct sample_cost_model report_cost_model = *cost_model;
+    if (symbol_aggregation_total_samples(aggregation) == 0) {
+        report_cost_model.sample_freq = 0;
+        report_cost_model.period_in_nsecs = 0;
+        report_cost_model.seconds_per_weight = total_progr_duration / 100;
+    }
+
+    if (interrupt_execution == 0) {
+        upload_profile_totals_to_NewRelic(newrelic_transaction, aggregation,
+                                          NULL, &report_cost_model,
+                                          total_progr_duration);
+        upload_symbols_to_NewRelic(newrelic_transaction, aggregation, NULL,
+                                   wrapper_opts, &report_cost_model);
+        if (symbol_aggregation_count(threads) > 0)
+            upload_top_aggregates_to_NewRelic(newrelic_transaction, threads,
+                                              "thread/",
+                                              wrapper_opts->top_symbols,
+                                              &report_cost_model);
+        if (breakdown &&
+            thread_breakdown_select_top(breakdown,
+                                        wrapper_opts->max_breakdown) == 0)
+            upload_thread_breakdown_to_NewRelic(newrelic_transaction,
+                                                breakdown, &report_cost_model);
+        if (stacks)
+            upload_stacks_to_NewRelic(newrelic_transaction, stacks,
+                                      wrapper_opts, &report_cost_model);
+        record_profile_quality_to_NewRelic(&quality);
+    }
+
+    stack_trie_free(stacks);
+    arena_reset(&window_arena);
+    return 0;
+}
+
+
+/* Parse the subset of the options-to-perf-record that the native sampler
+ * understands. Returns the index in in_program_argv[] of the <program> to
+ * execute, or -1 if there is no program.
+ */
+static int
+parse_native_sampler_options(int in_program_argc, char * in_program_argv[],
+                             struct perf_sampler_options * out_options,
+                             int warn_unsupported)
+{
+    perf_sampler_default_options(out_options);
+
+    int idx = 0;
+    while (idx < in_program_argc && in_program_argv[idx][0] == '-') {
+        const char * arg = in_program_argv[idx];
+        const char * value = NULL;
+
+        if (strcmp(arg, "--") == 0)
+            return idx + 1 < in_program_argc ? idx + 1 : -1;
+
+        if (strcmp(arg, "-a") == 0 || strcmp(arg, "--all-cpus") == 0) {
+            out_options->system_wide = 1;
+            idx++;
+            continue;
+        }
+
+        /* the call-graphs: the native sampler has the frame-pointers ("fp")
+         * of the kernel and the LBR call-stack ("lbr"), but not "dwarf",
+         * which would copy the user stacks of all the samples */
+        if (strcmp(arg, "-g") == 0 || strncmp(arg, "--call-graph", 12) == 0) {
+            const char * mode = NULL;
+            if (strncmp(arg, "--call-graph=", 13) == 0)
+                mode = arg + 13;
+            else if (strcmp(arg, "--call-graph") == 0 &&
+                     idx + 1 < in_program_argc)
+                mode = in_program_argv[++idx];
+            if (mode && strncmp(mode, "lbr", 3) == 0)
+                out_options->call_graph = PERF_CALL_GRAPH_LBR;
+            else if (mode && strncmp(mode, "fp", 2) != 0 && warn_unsupported)
+                fprintf(stderr, "Ignoring call-graph mode %s: the native "
+                                "sampler has only 'fp' and 'lbr'\n", mode);
+            out_options->callchain = 1;
+            idx++;
+            continue;
+        }
+
+        /* the options with a value, in the formats "-F 99", "-F99" and
+         * "--freq=99" */
+        char short_opt = 0;
+        if (arg[1] != '-' && strchr("Fceom", arg[1]) && arg[1] != '\0') {
+            short_opt = arg[1];
+            if (arg[2] != '\0') {
+                value = arg + 2;
+            } else if (idx + 1 < in_program_argc) {
+                value = in_program_argv[++idx];
+            }
+        } else if (strncmp(arg, "--freq=", 7) == 0) {
+            short_opt = 'F';
+            value = arg + 7;
+        } else if (strncmp(arg, "--count=", 8) == 0) {
+            short_opt = 'c';
+            value = arg + 8;
+        } else if (strncmp(arg, "--event=", 8) == 0) {
+            short_opt = 'e';
+            value = arg + 8;
+        } else if (strncmp(arg, "--output=", 9) == 0) {
+            short_opt = 'o';
+            value = arg + 9;
+        } else if (strncmp(arg, "--mmap-pages=", 13) == 0) {
+            short_opt = 'm';
+            value = arg + 13;
+        }
+        idx++;
+
+        if (short_opt == 0) {
+            if (warn_unsupported)
+                fprintf(stderr, "Ignoring option %s: not supported by the "
+                                "native sampler\n", arg);
+            /* and its value, which is not the <program> */
+            const struct perf_record_option * option;
+            int n_args = perf_record_option_arguments(in_program_argc - idx + 1,
+                                                      in_program_argv + idx - 1,
+                                                      &option);
+            if (n_args > 1)
+                idx += n_args - 1;
+            continue;
+        }
+        if (!value) {
+            if (warn_unsupported)
+                fprintf(stderr, "Ignoring option %s: it needs a value\n", arg);
+            continue;
+        }
+
+        switch (short_opt) {
+        case 'F':
+            out_options->sample_freq = strtoull(value, NULL, 10);
+            out_options->sample_period = 0;
+            break;
+        case 'c':
+            out_options->sample_period = strtoull(value, NULL, 10);
+            break;
+        case 'm':
+            out_options->mmap_pages = (unsigned int)strtoul(value, NULL, 10);
+            break;
+        case 'e': {
+            /* the precise sampling is the ":p" modifiers of the event, as
+             * "perf record -e cycles:pp" ("P": the most precise there is) */
+            char event[64];
+            const char * modifiers = strchr(value, ':');
+            size_t event_len = modifiers ? (size_t)(modifiers - value)
+                                         : strlen(value);
+            if (event_len >= sizeof event)
+                event_len = sizeof event - 1;
+            memcpy(event, value, event_len);
+            event[event_len] = '\0';
+            unsigned int precise_ip = 0;
+            for (; modifiers && *++modifiers != '\0'; ) {
+                if (*modifiers == 'p' && precise_ip < 3)
+                    precise_ip++;
+                else if (*modifiers == 'P')
+                    precise_ip = 3;
+                else if (*modifiers != 'p' && warn_unsupported)
+                    fprintf(stderr, "Ignoring modifier '%c' of -e %s: not "
+                                    "supported by the native sampler\n",
+                            *modifiers, value);
+            }
+            if (perf_sampler_parse_event(event, &out_options->event_type,
+                                         &out_options->event_config) == 0) {
+                out_options->event_name = value;
+                out_options->precise_ip = precise_ip;
+            }
+            else if (!warn_unsupported)
+                out_options->event_name = value;   /* "perf record" knows it */
+            else
+                fprintf(stderr, "Ignoring option -e %s: event not known by "
+                                "the native sampler\n", value);
+            break;
+        }
+        case 'o':
+            /* there is no perf.data file in the native mode */
+            if (warn_unsupported)
+                fprintf(stderr, "Ignoring option %s\n", arg);
+            break;
+        }
+    }
+
+    return idx < in_program_argc ? idx : -1;
+}
+
+
+static void
+native_profile_add_sample(void * callback_arg, const struct perf_sample * sample)
+{
+    struct native_profile * profile = callback_arg;
+
+    if (profile->n_samples == profile->capacity) {
+        size_t new_capacity = profile->capacity ? 2 * profile->capacity : 4096;
+        struct perf_sample * new_samples =
+                   realloc(profile->samples, new_capacity * sizeof *new_samples);
+        if (!new_samples)
+            return;   /* drop this sample */
+        profile->samples = new_samples;
+        profile->capacity = new_capacity;
+    }
+    struct perf_sample * stored = &profile->samples[profile->n_samples++];
+    *stored = *sample;
+    profile->samples_count += sample->samples;
+    stored->callchain = NULL;   /* it points into the ring-buffer */
+
+    /* its callchain is copied after those of the previous samples */
+    if (sample->callchain_depth > 0 &&
+        profile->n_callchain_ips + sample->callchain_depth >
+                                               profile->callchain_capacity) {
+        size_t new_capacity = profile->callchain_capacity ?
+                              2 * profile->callchain_capacity : 65536;
+        while (new_capacity < profile->n_callchain_ips +
+                              sample->callchain_depth)
+            new_capacity *= 2;
+        unsigned long long * new_ips = realloc(profile->callchain_ips,
+                                               new_capacity * sizeof *new_ips);
+        if (!new_ips) {
+            stored->callchain_depth = 0;   /* keep the sample, not its stack */
+            return;
+        }
+        profile->callchain_ips = new_ips;
+        profile->callchain_capacity = new_capacity;
+    }
+    memcpy(profile->callchain_ips + profile->n_callchain_ips, sample->callchain,
+           sample->callchain_depth * sizeof *sample->callchain);
+    profile->n_callchain_ips += sample->callchain_depth;
+}
+
+
+/* With --off-cpu, the records of the scheduler tracepoints go to the tracker
+ * of the threads, which aggregates their intervals off the CPUs at once (they
+ * are symbolized only when they are uploaded, as the samples) */
+static void
+native_profile_add_sched_event(void * callback_arg,
+                               const struct perf_sched_event * event)
+{
+    struct native_profile * profile = callback_arg;
+    off_cpu_tracker_add_event(profile->off_cpu, event);
+}
+
+
+static void
+timespec_difference(const struct timespec * start, const struct timespec * end,
+                    struct timespec * out_difference)
+{
+    out_difference->tv_sec = end->tv_sec - start->tv_sec;
+    out_difference->tv_nsec = end->tv_nsec - start->tv_nsec;
+    if (out_difference->tv_nsec < 0) {
+        out_difference->tv_sec--;
+        out_difference->tv_nsec += 1000000000;
+    }
+}
+
+
+/* The counters of the sampler for the profile of the window which ends: with
+ * the adaptive rate, the CPU time of a sample at a frequency is that of the
+ * mean frequency of the window */
+static void
+take_sampler_counters(struct native_profile * profile,
+                      struct perf_sampler * sampler)
+{
+    unsigned long long lost_samples = perf_sampler_lost_samples(sampler);
+    unsigned long long throttles = perf_sampler_throttles(sampler);
+    profile->window_lost_samples = lost_samples - profile->lost_samples;
+    profile->window_throttles = throttles - profile->throttles;
+    profile->lost_samples = lost_samples;
+    profile->throttles = throttles;
+    if (perf_sampler_get_options(sampler)->cpu_budget > 0) {
+        profile->sample_freq = perf_sampler_take_sample_freq(sampler);
+        if (profile->cost_model.sample_freq > 0 && profile->sample_freq >= 1)
+            profile->cost_model.sample_freq =
+                             (unsigned long long)(profile->sample_freq + 0.5);
+    }
+}
+
+
+/* The metrics of the sampler for the window, after it was uploaded (and so
+ * symbolized): its quality and, with the adaptive rate (--cpu-budget), the
+ * rate at which it was really sampled, the mean frequency per CPU, and the
+ * samples per second of all the CPUs */
+static void
+record_sampler_metrics_to_NewRelic(const struct native_profile * profile,
+                                   const struct timespec * duration)
+{
+    struct profile_quality quality;
+    memset(&quality, 0, sizeof quality);
+    quality.samples = profile->samples_count;
+    quality.lost_samples = profile->window_lost_samples;
+    quality.unresolved_samples = profile->unresolved_samples;
+    quality.throttles = profile->window_throttles;
+    quality.has_throttles = 1;
+    record_profile_quality_to_NewRelic(&quality);
+
+    /* the intervals off the CPUs which were not in the profile */
+    if (profile->off_cpu) {
+        struct off_cpu_counters counters;
+        off_cpu_tracker_get_counters(profile->off_cpu, &counters);
+        record_metric_to_NewRelic("Custom/ct_quality/offcpu_unordered",
+                                  (double)counters.unordered);
+        record_metric_to_NewRelic("Custom/ct_quality/offcpu_dropped",
+                                  (double)(counters.dropped_intervals +
+                                           counters.dropped_threads));
+        record_metric_to_NewRelic("Custom/ct_quality/offcpu_threads",
+                                  (double)counters.threads);
+
+        struct off_cpu_histograms * histograms =
+                                off_cpu_tracker_histograms(profile->off_cpu);
+        record_latency_to_NewRelic("oncpu", &histograms->on_cpu);
+        record_latency_to_NewRelic("offcpu", &histograms->off_cpu);
+        record_latency_to_NewRelic("runqueue", &histograms->runqueue);
+    }
+
+    if (profile->sample_freq <= 0)
+        return;
+    double seconds = duration->tv_sec + duration->tv_nsec / 1e9;
+    record_metric_to_NewRelic("Custom/ct_sampler/sample_freq",
+                              profile->sample_freq);
+    if (seconds > 0)
+        record_metric_to_NewRelic("Custom/ct_sampler/samples_per_second",
+                                  profile->samples_count / seconds);
+}
+
+
+/* Flush to New Relic the window of samples taken since window_start, and
+ * start a new window */
+static void
+flush_native_window(struct native_profile * profile,
+                    struct timespec * window_start, unsigned long window_number)
+{
+    struct timespec now, window_duration, upload_end, upload_duration;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    timespec_difference(window_start, &now, &window_duration);
+
+    if (profile->options->daemon)
+        upload_native_groups_to_NewRelic(profile, &window_duration,
+                                         window_number);
+    else
+        upload_native_window_to_NewRelic(profile, &window_duration,
+                                         window_number);
+    record_sampler_metrics_to_NewRelic(profile, &window_duration);
+
+    clock_gettime(CLOCK_MONOTONIC, &upload_end);
+    timespec_difference(&now, &upload_end, &upload_duration);
+    record_segment_latency(&record_segments, &window_duration);
+    record_segment_latency(&report_segments, &upload_duration);
+    record_segment_latencies_to_NewRelic();
+    record_self_metrics_to_NewRelic();
+
+    struct arena_stats arena_stats;
+    arena_get_stats(&window_arena, &arena_stats);
+    fprintf(stderr, "DEBUG: window %lu: %zu KB of temporary state, in %u "
+                    "chunks and %u large blocks (peak %zu KB)\n",
+            window_number, arena_stats.used_bytes / 1024, arena_stats.chunks,
+            arena_stats.large_blocks, arena_stats.peak_bytes / 1024);
+
+    /* drop the window: its temporary state at once, keeping the chunks of
+     * the arena, and the buffer of samples (its size is bound by the samples
+     * of the busiest window), but not the mappings of the processes which
+     * already exited */
+    arena_reset(&window_arena);
+    if (profile->off_cpu)
+        off_cpu_tracker_reset_window(profile->off_cpu);
+    profile->n_samples = 0;
+    profile->samples_count = 0;
+    profile->n_callchain_ips = 0;
+    profile->sample_freq = 0;
+    profile->unresolved_samples = 0;
+    profile->window_lost_samples = 0;
+    profile->window_throttles = 0;
+    symbol_resolver_forget_exited(profile->resolver);
+    *window_start = now;
+}
+
+
+int
+execute_native_sampler_and_program(int in_program_argc,
+                                   char * in_program_argv[],
+                                   unsigned int flush_interval,
+                                   struct timespec * out_duration,
+                                   struct native_profile * out_profile)
+{
+    struct perf_sampler_options sampler_options;
+    int program_idx = parse_native_sampler_options(in_program_argc,
+                                                   in_program_argv,
+                                                   &sampler_options, 1);
+    int daemon = out_profile->options->daemon;
+    int attaching = out_profile->options->attaching;
+    if (program_idx < 0 && !daemon && !attaching)
+        return -1;
+    if (daemon)
+        sampler_options.system_wide = 1;
+    if (attaching)
+        sampler_options.system_wide = 0;   /* only what we attach to */
+    if (out_profile->options->stacks)
+        sampler_options.callchain = 1;
+    sampler_options.cpu_budget = out_profile->options->cpu_budget / 100;
+    sampler_options.readers = out_profile->options->readers;
+    sampler_options.off_cpu = out_profile->options->off_cpu;
+    sampler_options.bpf = out_profile->options->bpf;
+
+    out_profile->resolver = symbol_resolver_new();
+    out_profile->aggregation = symbol_aggregation_new();
+    out_profile->addresses = address_aggregation_new();
+    out_profile->unresolved = symbol_aggregation_new();
+    if (sampler_options.callchain)
+        out_profile->stacks = stack_trie_new();
+    if (out_profile->options->differential)
+        out_profile->baseline = symbol_baseline_new(
+                                        SYMBOL_BASELINE_DEFAULT_ALPHA,
+                                        SYMBOL_BASELINE_DEFAULT_WARMUP,
+                                        SYMBOL_BASELINE_DEFAULT_MAX_ENTRIES);
+    if (sampler_options.off_cpu)
+        out_profile->off_cpu = off_cpu_tracker_new(
+                                        OFF_CPU_DEFAULT_MAX_THREADS,
+                                        OFF_CPU_DEFAULT_MAX_STACKS);
+    if (!out_profile->resolver || !out_profile->aggregation ||
+        !out_profile->addresses ||
+        !out_profile->unresolved ||
+        (sampler_options.callchain && !out_profile->stacks) ||
+        (out_profile->options->differential && !out_profile->baseline) ||
+        (sampler_options.off_cpu && !out_profile->off_cpu))
+        return -2;
+    /* without the cache, the sampler symbolizes from scratch: not an error */
+    const char * cache_dir = out_profile->options->symbol_cache_dir;
+    if (cache_dir &&
+        symbol_resolver_set_cache_dir(out_profile->resolver, cache_dir) != 0)
+        fprintf(stderr, "ERROR: couldn't create the symbol cache '%s': %s\n",
+                cache_dir, strerror(errno));
+
+    if (interrupt_execution != 0)
+        return -3;
+
+    /* the daemon without a program runs till it is stopped by a signal */
+    int start_fd = -1;
+    pid_t child_pid = -1;
+    if (program_idx >= 0) {
+        child_pid = perf_sampler_launch_program(in_program_argv + program_idx,
+                                                &start_fd);
+        if (child_pid < 0)
+            return -4;
+    }
+
+    /* with --signal-control, nothing is opened on the processes before the
+     * SIGUSR1, so that they pay nothing till then */
+    if (out_profile->options->signal_control) {
+        fprintf(stderr, "DEBUG: waiting for a SIGUSR1 to start the profile "
+                        "(pid %d)\n", (int)getpid());
+        while (!start_profiling && !stop_profiling && interrupt_execution == 0)
+            poll(NULL, 0, 100);
+        if (interrupt_execution != 0)
+            return -3;
+    }
+
+    struct perf_sampler * sampler;
+    if (attaching)
+        sampler = perf_sampler_attach(&sampler_options,
+                                      &out_profile->options->attach,
+                                      out_profile->resolver,
+                                      native_profile_add_sample, out_profile);
+    else
+        sampler = perf_sampler_open(&sampler_options, child_pid,
+                                    out_profile->resolver,
+                                    native_profile_add_sample, out_profile);
+    if (!sampler) {
+        /* the child exits when it sees the start pipe closed */
+        int status;
+        if (child_pid > 0) {
+            close(start_fd);
+            waitpid(child_pid, &status, 0);
+        }
+        return -5;
+    }
+
+    sample_cost_model_from_options(perf_sampler_get_options(sampler),
+                                   &out_profile->cost_model);
+
+    /* without the scheduler tracepoints the profile is only on-CPU */
+    if (perf_sampler_get_options(sampler)->off_cpu) {
+        perf_sampler_set_sched_callback(sampler, native_profile_add_sched_event,
+                                        out_profile);
+    } else if (out_profile->off_cpu) {
+        off_cpu_tracker_free(out_profile->off_cpu);
+        out_profile->off_cpu = NULL;
+    }
+
+    /* in the system-wide and attach modes the perf-events are not enabled by
+     * the exec() of the program */
+    if (sampler_options.system_wide || attaching)
+        perf_sampler_enable(sampler);
+
+    struct timespec start_time, end_time;
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+    if (child_pid > 0)
+        perf_sampler_start_program(start_fd);
+
+    struct timespec window_start, last_bpf_drain;
+    unsigned long window_number = 0;
+    clock_gettime(CLOCK_MONOTONIC, &window_start);
+    last_bpf_drain = window_start;
+
+    /* the profile finishes when the program exits or, without a program,
+     * after the --duration, at a SIGUSR2, or when the processes attached to
+     * are all gone */
+    int status = 0;
+    int program_finished = 0;
+    unsigned int duration = out_profile->options->duration;
+    while (!program_finished && interrupt_execution == 0 &&
+           stop_profiling == 0) {
+        if (perf_sampler_poll(sampler, 100) < 0 && errno != EINTR) {
+            fprintf(stderr, "ERROR: poll() on the perf ring-buffers failed: "
+                            "%s\n", strerror(errno));
+            break;
+        }
+        if (child_pid > 0 && waitpid(child_pid, &status, WNOHANG) == child_pid)
+            program_finished = 1;
+        if (attaching && !perf_sampler_attached_alive(sampler)) {
+            fprintf(stderr, "DEBUG: the processes attached to exited\n");
+            program_finished = 1;
+        }
+        if (duration > 0) {
+            struct timespec now, elapsed;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            timespec_difference(&start_time, &now, &elapsed);
+            if (elapsed.tv_sec >= (time_t)duration)
+                program_finished = 1;
+        }
+
+        if (perf_sampler_get_options(sampler)->bpf) {
+            struct timespec now, elapsed;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            timespec_difference(&last_bpf_drain, &now, &elapsed);
+            if (elapsed.tv_sec >= (time_t)BPF_DRAIN_INTERVAL) {
+                perf_sampler_flush_aggregates(sampler);
+                last_bpf_drain = now;
+            }
+        }
+
+        if (flush_interval > 0 && !program_finished) {
+            struct timespec now, elapsed;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            timespec_difference(&window_start, &now, &elapsed);
+            if (elapsed.tv_sec >= (time_t)flush_interval) {
+                perf_sampler_flush_aggregates(sampler);
+                take_sampler_counters(out_profile, sampler);
+                flush_native_window(out_profile, &window_start,
+                                    window_number++);
+            }
+        }
+    }
+
+    /* the last records in the ring-buffers */
+    perf_sampler_disable(sampler);
+    perf_sampler_poll(sampler, 0);
+    perf_sampler_flush_aggregates(sampler);
+    take_sampler_counters(out_profile, sampler);
+    perf_sampler_close(sampler);
+
+    /* in the streaming mode, the last window is also sent in a transaction
+     * of its own, like the previous windows */
+    if (flush_interval > 0 && !interrupt_execution)
+        flush_native_window(out_profile, &window_start, window_number++);
+
+    if (child_pid > 0 && !program_finished)
+        waitpid(child_pid, &status, 0);
+
+    if (interrupt_execution != 0)
+        return -3;
+
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+    timespec_difference(&start_time, &end_time, out_duration);
+
+    fprintf(stderr, "DEBUG: native sampler: %llu samples, %llu lost\n",
+            out_profile->samples_count, out_profile->lost_samples);
+
+    return WEXITSTATUS(status);
+}
+
+
+/* Symbolize the callchain of a sample, which the kernel gives from the leaf
+ * to the outermost caller, with markers of the context (kernel or user) of
+ * the addresses that follow them, and add it to the trie of stacks, which
+ * wants it from the outermost caller */
+static void
+add_native_stack(struct native_profile * profile,
+                 const struct perf_sample * sample,
+                 const unsigned long long * callchain)
+{
+    struct stack_frame frames[STACK_TRIE_MAX_DEPTH];
+    size_t depth = 0;
+    int is_kernel = sample->is_kernel;
+    unsigned int i;
+    for (i = 0; i < sample->callchain_depth && depth < STACK_TRIE_MAX_DEPTH;
+         i++) {
+        unsigned long long ip = callchain[i];
+        if (ip >= PERF_CONTEXT_MAX) {
+            if (ip == PERF_CONTEXT_KERNEL)
+                is_kernel = 1;
+            else if (ip == PERF_CONTEXT_USER)
+                is_kernel = 0;
+            continue;
+        }
+        symbol_resolver_lookup(profile->resolver, sample->pid, ip, is_kernel,
+                               &frames[depth].symbol,
+                               &frames[depth].so_object);
+        depth++;
+    }
+
+    size_t j;
+    for (j = 0; j < depth / 2; j++) {
+        struct stack_frame leaf_side = frames[j];
+        frames[j] = frames[depth - 1 - j];
+        frames[depth - 1 - j] = leaf_side;
+    }
+    stack_trie_add(profile->stacks, frames, depth, sample->samples,
+                   sample->period,
+                   (double)sample->period);
+}
+
+
+/* Symbolize the locations of the samples of the window, from the hottest
+ * one, into the aggregation by (symbol, dso), only till it has enough
+ * symbols for the top-K that is sent (with a margin, for the symbols whose
+ * samples are spread over many locations): the long tail of the colder
+ * locations is not symbolized, but added per DSO into "unresolved". With
+ * "--rollup=dso" nothing is symbolized. */
+static void
+symbolize_hottest_locations(struct native_profile * profile,
+                            long newrelic_transaction)
+{
+    size_t n_wanted = profile->options->rollup_by_dso ? 0 :
+                      LAZY_SYMBOLIZATION_MARGIN * profile->options->top_symbols;
+
+    size_t n_locations, i;
+    const struct address_aggregate * locations =
+                address_aggregation_sorted(profile->addresses, &n_locations);
+    if (!locations && address_aggregation_count(profile->addresses) > 0)
+        send_error_notice_to_NewRelic(newrelic_transaction,
+                                      "symbolize_samples", "realloc() failed");
+
+    for (i = 0; i < n_locations &&
+                symbol_aggregation_count(profile->aggregation) < n_wanted;
+         i++) {
+        const char * symbol;
+        const char * so_object;
+        if (!symbol_resolver_symbolize(profile->resolver,
+                                       &locations[i].location, &symbol,
+                                       &so_object))
+            profile->unresolved_samples += locations[i].samples;
+        symbol_aggregation_add(profile->aggregation, symbol, so_object,
+                               locations[i].samples, locations[i].period,
+                               locations[i].weight);
+    }
+    fprintf(stderr, "DEBUG: symbolized %zu of %zu locations\n", i,
+            n_locations);
+
+    for (; i < n_locations; i++) {
+        const char * dso = symbol_resolver_location_dso(
+                                                    &locations[i].location);
+        symbol_aggregation_add(profile->unresolved, dso, NO_SO_OBJECT,
+                               locations[i].samples, locations[i].period,
+                               locations[i].weight);
+    }
+    address_aggregation_reset(profile->addresses);
+}
+
+
+/* With --differential: compare the symbols of the window to the rolling
+ * baseline of its group, and send, instead of the top-K symbols, only the
+ * ones which regressed, ranked by the growth of their share of the samples:
+ * as the attributes "ct_regressed/<rank>" ("<symbol>@<dso>"), with their
+ * shares in "ct_regressed/<rank>/pct" and "ct_regressed/<rank>/baseline_pct",
+ * and as the metrics "Custom/ct_regressed/<symbol>@<dso>" (the growth, in
+ * points of percentage) */
+static int
+upload_symbol_regressions_to_NewRelic(long newrelic_transaction,
+                                      struct native_profile * profile,
+                                      const char * group)
+{
+    unsigned int max_regressions = profile->options->top_symbols;
+    struct symbol_regression * regressions =
+               arena_calloc(&window_arena, max_regressions,
+                            sizeof *regressions);
+    if (!regressions) {
+        send_error_notice_to_NewRelic(newrelic_transaction,
+                                      "upload_symbol_regressions",
+                                      "calloc() failed");
+        return -1;
+    }
+
+    /* the shares are of all the samples, the symbolized or not */
+    const char * baseline_group = group ? group : "";
+    unsigned int windows = symbol_baseline_windows(profile->baseline,
+                                                   baseline_group);
+    double total_weight =
+                  symbol_aggregation_total_weight(profile->aggregation) +
+                  symbol_aggregation_total_weight(profile->unresolved);
+    int n_regressions = symbol_baseline_update(profile->baseline,
+                                               baseline_group,
+                                               profile->aggregation,
+                                               total_weight,
+                                               profile->options->diff_threshold
+                                                                       / 100,
+                                               DIFFERENTIAL_MIN_Z,
+                                               regressions, max_regressions);
+    if (n_regressions < 0) {
+        send_error_notice_to_NewRelic(newrelic_transaction,
+                                      "upload_symbol_regressions",
+                                      "malloc() failed");
+        return -1;
+    }
+    fprintf(stderr, "DEBUG: %d regressed symbols of %zu, against a baseline "
+                    "of %u windows (%zu symbols)\n", n_regressions,
+            symbol_aggregation_count(profile->aggregation), windows,
+            symbol_baseline_count(profile->baseline));
+
+    char attribute_name[MAX_LENGTH_NEW_RELIC_IDENT+1];
+    char attribute_value[NEWRELIC_UPLOADER_VALUE_SIZE];
+    snprintf(attribute_value, sizeof attribute_value, "%u", windows);
+    newrelic_uploader_add_attribute(newrelic_uploader, newrelic_transaction,
+                                    "ct_baseline_windows", attribute_value);
+    snprintf(attribute_value, sizeof attribute_value, "%d", n_regressions);
+    newrelic_uploader_add_attribute(newrelic_uploader, newrelic_transaction,
+                                    "ct_regressed_symbols", attribute_value);
+
+    int i;
+    for (i = 0; i < n_regressions && interrupt_execution == 0; i++) {
+        const struct symbol_regression * regression = &regressions[i];
+        snprintf(attribute_name, sizeof attribute_name, "ct_regressed/%03d",
+                 i);
+        snprintf(attribute_value, sizeof attribute_value, "%s@%s",
+                 regression->symbol, regression->so_object);
+        newrelic_uploader_add_attribute(newrelic_uploader,
+                                        newrelic_transaction, attribute_name,
+                                        attribute_value);
+        snprintf(attribute_name, sizeof attribute_name,
+                 "ct_regressed/%03d/pct", i);
+        snprintf(attribute_value, sizeof attribute_value, "%.3f",
+                 100 * regression->share);
+        newrelic_uploader_add_attribute(newrelic_uploader,
+                                        newrelic_transaction, attribute_name,
+                                        attribute_value);
+        snprintf(attribute_name, sizeof attribute_name,
+                 "ct_regressed/%03d/baseline_pct", i);
+        snprintf(attribute_value, sizeof attribute_value, "%.3f",
+                 100 * regression->baseline_share);
+        newrelic_uploader_add_attribute(newrelic_uploader,
+                                        newrelic_transaction, attribute_name,
+                                        attribute_value);
+
+        snprintf(attribute_name, sizeof attribute_name,
+                 "Custom/ct_regressed/%s@%s", regression->symbol,
+                 regression->so_object);
+        record_metric_to_NewRelic(attribute_name, 100 * regression->delta);
+    }
+    return 0;
+}
+
+
+/* Symbolize the call-graph where a thread left the CPU, in user-space: its
+ * leaf is the function where it blocked (or was preempted), into "sites",
+ * and, with "inclusive", each of its frames, once per stack */
+static void
+add_off_cpu_frames(struct native_profile * profile,
+                   const struct off_cpu_stack * stack,
+                   struct symbol_aggregation * sites,
+                   struct symbol_aggregation * inclusive)
+{
+    struct stack_frame frames[OFF_CPU_MAX_DEPTH];
+    size_t depth = 0, j;
+    unsigned int i;
+    for (i = 0; i < stack->callchain_depth; i++) {
+        unsigned long long ip = stack->callchain[i];
+        if (ip >= PERF_CONTEXT_MAX)
+            continue;   /* the PERF_CONTEXT_USER marker */
+        const char * symbol;
+        const char * so_object;
+        symbol_resolver_lookup(profile->resolver, stack->pid, ip, 0, &symbol,
+                               &so_object);
+        if (depth == 0)
+            symbol_aggregation_add(sites, symbol, so_object, stack->intervals,
+                                   stack->off_cpu_ns,
+                                   (double)stack->off_cpu_ns);
+        if (!inclusive)
+            break;
+        for (j = 0; j < depth; j++)
+            if (frames[j].symbol == symbol && frames[j].so_object == so_object)
+                break;
+        if (j < depth)
+            continue;   /* a recursion: it is already in this stack */
+        frames[depth].symbol = symbol;
+        frames[depth].so_object = so_object;
+        depth++;
+        symbol_aggregation_add(inclusive, symbol, so_object, stack->intervals,
+                               stack->off_cpu_ns, (double)stack->off_cpu_ns);
+    }
+}
+
+
+/* With --off-cpu: send the time that the threads of the profile (or of the
+ * "group" of the daemon mode) spent off the CPUs in the window, next to
+ * their on-CPU profile in the same transaction:
+ *
+ *     ct_offcpu_seconds             the time off the CPUs, which is the sum of
+ *     ct_offcpu_blocked_seconds     the time blocked (locks, I/O, sleeps...)
+ *     ct_offcpu_runqueue_seconds    and the time waiting for a CPU
+ *     ct_offcpu_intervals           and the number of intervals
+ *     ct_offcpu_runqueue_us/<N>     the histogram of the run-queue latencies:
+ *                                   the intervals below N microseconds (and
+ *                                   above the previous bucket), or "inf"
+ *
+ * and, as the aggregates of the on-CPU profile, with the off-CPU seconds and
+ * the number of intervals: the top-K functions where the threads left the
+ * CPUs, as "Custom/ct_offcpu/<symbol>@<dso>", the top-K threads, as
+ * "Custom/ct_offcpu/thread/<comm>/<tid>", and, with --stacks, the top-K
+ * frames of their call-graphs by inclusive time, as
+ * "Custom/ct_offcpu/inclusive/<symbol>@<dso>" */
+static void
+upload_off_cpu_to_NewRelic(long newrelic_transaction,
+                           struct native_profile * profile,
+                           const char * const * off_cpu_groups,
+                           const char * group)
+{
+    size_t n_stacks, i;
+    const struct off_cpu_stack * stacks = off_cpu_tracker_stacks(
+                                                profile->off_cpu, &n_stacks);
+    struct symbol_aggregation * sites =
+                   symbol_aggregation_new_in_arena(&window_arena);
+    struct symbol_aggregation * threads =
+                   symbol_aggregation_new_in_arena(&window_arena);
+    struct symbol_aggregation * inclusive = profile->stacks ?
+                   symbol_aggregation_new_in_arena(&window_arena) : NULL;
+    if (!sites || !threads || (profile->stacks && !inclusive)) {
+        send_error_notice_to_NewRelic(newrelic_transaction, "upload_off_cpu",
+                                      "malloc() failed");
+        return;
+    }
+
+    unsigned long long intervals = 0, off_cpu_ns = 0, blocked_ns = 0,
+                       runqueue_ns = 0;
+    unsigned long long runqueue_latency[OFF_CPU_LATENCY_BUCKETS];
+    memset(runqueue_latency, 0, sizeof runqueue_latency);
+    unsigned int b;
+    for (i = 0; i < n_stacks; i++) {
+        const struct off_cpu_stack * stack = &stacks[i];
+        if (off_cpu_groups && off_cpu_groups[i] != group)
+            continue;   /* the threads of another process or container */
+        intervals += stack->intervals;
+        off_cpu_ns += stack->off_cpu_ns;
+        blocked_ns += stack->blocked_ns;
+        runqueue_ns += stack->runqueue_ns;
+        for (b = 0; b < OFF_CPU_LATENCY_BUCKETS; b++)
+            runqueue_latency[b] += stack->runqueue_latency[b];
+
+        const char * comm = symbol_resolver_thread_comm(profile->resolver,
+                                                        stack->pid,
+                                                        stack->tid);
+        sample_aggregation_add_thread(threads, comm, strlen(comm),
+                                      (int)stack->tid, stack->intervals,
+                                      stack->off_cpu_ns,
+                                      (double)stack->off_cpu_ns);
+        add_off_cpu_frames(profile, stack, sites, inclusive);
+    }
+    if (intervals == 0)
+        return;
+    fprintf(stderr, "DEBUG: %llu intervals off-CPU: %.06f seconds, %.06f "
+                    "blocked and %.06f in the run-queue\n", intervals,
+            off_cpu_ns / 1e9, blocked_ns / 1e9, runqueue_ns / 1e9);
+
+    char attribute_name[MAX_LENGTH_NEW_RELIC_IDENT+1];
+    char attribute_value[NEWRELIC_UPLOADER_VALUE_SIZE];
+    snprintf(attribute_value, sizeof attribute_value, "%.06f",
+             off_cpu_ns / 1e9);
+    newrelic_uploader_add_attribute(newrelic_uploader, newrelic_transaction,
+                                    "ct_offcpu_seconds", attribute_value);
+    snprintf(attribute_value, sizeof attribute_value, "%.06f",
+             blocked_ns / 1e9);
+    newrelic_uploader_add_attribute(newrelic_uploader, newrelic_transaction,
+                                    "ct_offcpu_blocked_seconds",
+                                    attribute_value);
+    snprintf(attribute_value, sizeof attribute_value, "%.06f",
+             runqueue_ns / 1e9);
+    newrelic_uploader_add_attribute(newrelic_uploader, newrelic_transaction,
+                                    "ct_offcpu_runqueue_seconds",
+                                    attribute_value);
+    snprintf(attribute_value, sizeof attribute_value, "%llu", intervals);
+    newrelic_uploader_add_attribute(newrelic_uploader, newrelic_transaction,
+                                    "ct_offcpu_intervals", attribute_value);
+
+    for (b = 0; b < OFF_CPU_LATENCY_BUCKETS; b++) {
+        if (runqueue_latency[b] == 0)
+            continue;
+        unsigned long long limit = off_cpu_latency_bucket_limit(b);
+        if (limit > 0)
+            snprintf(attribute_name, sizeof attribute_name,
+                     "ct_offcpu_runqueue_us/%llu", limit);
+        else
+            snprintf(attribute_name, sizeof attribute_name,
+                     "ct_offcpu_runqueue_us/inf");
+        snprintf(attribute_value, sizeof attribute_value, "%llu",
+                 runqueue_latency[b]);
+        newrelic_uploader_add_attribute(newrelic_uploader,
+                                        newrelic_transaction, attribute_name,
+                                        attribute_value);
+    }
+
+    unsigned int top_symbols = profile->options->top_symbols;
+    upload_top_aggregates_to_NewRelic(newrelic_transaction, sites, "offcpu/",
+                                      top_symbols, &OFF_CPU_COST_MODEL);
+    upload_top_aggregates_to_NewRelic(newrelic_transaction, threads,
+                                      "offcpu/thread/", top_symbols,
+                                      &OFF_CPU_COST_MODEL);
+    if (inclusive)
+        upload_top_aggregates_to_NewRelic(newrelic_transaction, inclusive,
+                                          "offcpu/inclusive/", top_symbols,
+                                          &OFF_CPU_COST_MODEL);
+}
+
+
+int
+upload_native_profile_to_NewRelic(struct native_profile * in_profile,
+                                  const struct timespec * prog_exec_duration,
+                                  const char * const * sample_groups,
+                                  const char * const * off_cpu_groups,
+                                  const char * group,
+                                  long newrelic_transaction)
+{
+    size_t n_off_cpu_stacks = 0;
+    if (in_profile->off_cpu)
+        off_cpu_tracker_stacks(in_profile->off_cpu, &n_off_cpu_stacks);
+    if (interrupt_execution != 0) return -1;
+    if (in_profile->n_samples == 0 && n_off_cpu_stacks == 0) return 0;
+
+    double total_progr_duration;
+    total_progr_duration = prog_exec_duration->tv_sec +
+                           prog_exec_duration->tv_nsec / 1e9;
+    fprintf(stderr, "DEBUG: Total duration %.06f\n", total_progr_duration);
+
+    /* group the samples by their locations (dso, offset), adding their
+     * periods, and then symbolize only the hottest locations, into the
+     * (symbol, dso) of the default sort order of "perf report". The strings
+     * of the resolver are interned, as the aggregation needs */
+    struct symbol_aggregation * aggregation = in_profile->aggregation;
+    /* the threads of the window, per ("comm/tid", ""): in the arena of the
+     * window, with the strings that they intern, as the tids come and go */
+    struct symbol_aggregation * threads =
+                   symbol_aggregation_new_in_arena(&window_arena);
+    if (!threads) {
+        send_error_notice_to_NewRelic(newrelic_transaction,
+                                      "upload_native_profile",
+                                      "malloc() failed");
+        return -1;
+    }
+    /* with --breakdown, the key of each sample, for its second pass */
+    enum thread_breakdown_key breakdown_by = in_profile->options->breakdown;
+    struct thread_breakdown * breakdown = breakdown_by ?
+                                   thread_breakdown_new(breakdown_by) : NULL;
+    const char ** sample_keys = breakdown && in_profile->n_samples > 0 ?
+              arena_calloc(&window_arena, in_profile->n_samples,
+                           sizeof *sample_keys) : NULL;
+    if (breakdown_by && in_profile->n_samples > 0 && !sample_keys)
+        send_error_notice_to_NewRelic(newrelic_transaction,
+                                      "thread_breakdown", "calloc() failed");
+    struct timespec stage_start;
+    clock_gettime(CLOCK_MONOTONIC, &stage_start);
+    size_t i, callchain_offset = 0;
+    for (i = 0; i < in_profile->n_samples; i++) {
+        const struct perf_sample * sample = &in_profile->samples[i];
+        const unsigned long long * callchain = in_profile->callchain_ips +
+                                               callchain_offset;
+        callchain_offset += sample->callchain_depth;
+        if (sample_groups && sample_groups[i] != group)
+            continue;   /* the sample of another process or container */
+        if (in_profile->stacks && sample->callchain_depth > 0)
+            add_native_stack(in_profile, sample, callchain);
+        struct symbol_location location;
+        symbol_resolver_locate(in_profile->resolver, sample->pid, sample->ip,
+                               sample->is_kernel, &location);
+        address_aggregation_add(in_profile->addresses, &location,
+                                sample->samples,
+                                sample->period, (double)sample->period);
+
+        const char * comm = symbol_resolver_thread_comm(in_profile->resolver,
+                                                        sample->pid,
+                                                        sample->tid);
+        sample_aggregation_add_thread(threads, comm, strlen(comm),
+                                      (int)sample->tid, sample->samples,
+                                      sample->period, (double)sample->period);
+        if (sample_keys)
+            sample_keys[i] = thread_breakdown_add(breakdown, comm,
+                                                  strlen(comm),
+                                                  (int)sample->tid,
+                                                  sample->samples,
+                                                  sample->period,
+                                                  (double)sample->period);
+    }
+
+    self_costs.aggregation_seconds += seconds_since(&stage_start);
+    clock_gettime(CLOCK_MONOTONIC, &stage_start);
+
+    /* the second pass of the breakdown: only the samples of the top keys
+     * are symbolized, one by one */
+    if (sample_keys &&
+        thread_breakdown_select_top(breakdown,
+                                    in_profile->options->max_breakdown) == 0) {
+        for (i = 0; i < in_profile->n_samples; i++) {
+            const struct perf_sample * sample = &in_profile->samples[i];
+            struct symbol_aggregation * symbols = sample_keys[i] ?
+                      thread_breakdown_symbols(breakdown, sample_keys[i]) :
+                      NULL;
+            if (!symbols)
+                continue;
+            const char * symbol;
+            const char * so_object;
+            struct symbol_location location;
+            symbol_resolver_locate(in_profile->resolver, sample->pid,
+                                   sample->ip, sample->is_kernel, &location);
+            symbol_resolver_symbolize(in_profile->resolver, &location,
+                                      &symbol, &so_object);
+            symbol_aggregation_add(symbols, symbol, so_object,
+                                   sample->samples, sample->period,
+                                   (double)sample->period);
+        }
+    } else
+        sample_keys = NULL;
+
+    symbolize_hottest_locations(in_profile, newrelic_transaction);
+    self_costs.symbolization_seconds += seconds_since(&stage_start);
+
+    upload_profile_totals_to_NewRelic(newrelic_transaction, aggregation,
+                                      in_profile->unresolved,
+                                      &in_profile->cost_model,
+                                      total_progr_duration);
+    if (in_profile->baseline)
+        upload_symbol_regressions_to_NewRelic(newrelic_transaction, in_profile,
+                                              group);
+    else
+        upload_symbols_to_NewRelic(newrelic_transaction, aggregation,
+                                   in_profile->unresolved, in_profile->options,
+                                   &in_profile->cost_model);
+    upload_top_aggregates_to_NewRelic(newrelic_transaction, threads,
+                                      "thread/",
+                                      in_profile->options->top_symbols,
+                                      &in_profile->cost_model);
+    if (sample_keys)
+        upload_thread_breakdown_to_NewRelic(newrelic_transaction, breakdown,
+                                            &in_profile->cost_model);
+    if (n_off_cpu_stacks > 0)
+        upload_off_cpu_to_NewRelic(newrelic_transaction, in_profile,
+                                   off_cpu_groups, group);
+    if (in_profile->stacks) {
+        upload_stacks_to_NewRelic(newrelic_transaction, in_profile->stacks,
+                                  in_profile->options, &in_profile->cost_model);
+        stack_trie_reset(in_profile->stacks);
+    }
+
+    symbol_aggregation_reset(aggregation);
+    symbol_aggregation_reset(in_profile->unresolved);
+    return 0;
+}
+
+
+void
+upload_native_window_to_NewRelic(struct native_profile * in_profile,
+                                 const struct timespec * window_duration,
+                                 unsigned long window_number)
+{
+    fprintf(stderr, "DEBUG: flushing window %lu: %llu samples\n",
+            window_number, in_profile->samples_count);
+
+    long newrelic_transxtion_id = begin_perf_counters_transaction(NULL);
+    if (newrelic_transxtion_id < 0)
+        return;   /* drop this window, to keep the memory bounded */
+
+    char attribute_value[32];
+    snprintf(attribute_value, sizeof attribute_value, "%lu", window_number);
+    int return_code;
+    newrelic_uploader_add_attribute(newrelic_uploader, newrelic_transxtion_id,
+                                    "ct_window_number", attribute_value);
+
+    /* the records that the uploader dropped so far, because its queue was
+     * full: ie., New Relic is slower than our sampling */
+    unsigned long long upload_dropped = newrelic_uploader_dropped(
+                                                         newrelic_uploader);
+    if (upload_dropped > 0) {
+        snprintf(attribute_value, sizeof attribute_value, "%llu",
+                 upload_dropped);
+        newrelic_uploader_add_attribute(newrelic_uploader,
+                                        newrelic_transxtion_id,
+                                        "ct_upload_dropped", attribute_value);
+    }
+
+    long newr_segm_window =
+            newrelic_segment_external_begin(newrelic_transxtion_id,
+                                            NEWRELIC_ROOT_SEGMENT,
+                                            "localhost", "symbolize samples");
+    if (newr_segm_window < 0)
+        fprintf(stderr, "ERROR: newrelic_segment_external_begin() "
+                        "returned %ld\n", newr_segm_window);
+
+    upload_native_profile_to_NewRelic(in_profile, window_duration, NULL, NULL,
+                                      NULL, newrelic_transxtion_id);
+
+    if (newr_segm_window >= 0) {
+        return_code = newrelic_segment_end(newrelic_transxtion_id,
+                                           newr_segm_window);
+        if (return_code < 0)
+            fprintf(stderr, "ERROR: newrelic_segment_end() returned %d\n",
+                    return_code);
+    }
+
+    /* the transaction of the window is ended by the uploader, after the
+     * attributes of its symbols: the sampler keeps on reading meanwhile */
+    newrelic_uploader_end_transaction(newrelic_uploader,
+                                      newrelic_transxtion_id);
+}
+
+
+/* The container of a cgroup, if it looks like the cgroup of a container
+ * engine, eg.:
+ *
+ *     /system.slice/docker-<64 hex digits>.scope    (docker, systemd driver)
+ *     /docker/<64 hex digits>                       (docker, cgroupfs driver)
+ *     /kubepods/burstable/pod<uid>/<64 hex digits>  (kubernetes)
+ *     /machine.slice/libpod-<64 hex digits>.scope   (podman)
+ *
+ * Writes its short id (as "docker ps" shows it) and returns 1, or returns 0 if
+ * it is not a container. */
+static int
+container_of_cgroup(const char * cgroup, char * out_id, size_t id_size)
+{
+    static const char * const container_engines[] = {
+        "docker", "containerd", "kubepods", "libpod", "lxc", "crio"
+    };
+    size_t i;
+    int is_container = 0;
+    for (i = 0; i < sizeof container_engines / sizeof container_engines[0];
+         i++)
+        if (strstr(cgroup, container_engines[i]))
+            is_container = 1;
+    if (!is_container)
+        return 0;
+
+    /* the last component, without its "<engine>-" prefix and ".scope" */
+    const char * id = strrchr(cgroup, '/');
+    id = id ? id + 1 : cgroup;
+    const char * dash = strrchr(id, '-');
+    if (dash)
+        id = dash + 1;
+    size_t len = strcspn(id, ".");
+    if (len == 0)
+        return 0;
+    if (len > 12)
+        len = 12;
+    snprintf(out_id, id_size, "%.*s", (int)len, id);
+    return 1;
+}
+
+
+/* The name of the group of a process in the daemon mode, eg.
+ * "container/3f4e5d6c7b8a", "process/nginx" or "process/nginx/1234" */
+static void
+process_group_name(struct symbol_resolver * resolver, pid_t pid,
+                   enum process_grouping group_by, char * out_name,
+                   size_t name_size)
+{
+    if (pid == 0) {
+        snprintf(out_name, name_size, "process/swapper");   /* idle */
+        return;
+    }
+
+    const char * cgroup = symbol_resolver_cgroup(resolver, pid);
+    char container_id[16];
+    if (container_of_cgroup(cgroup, container_id, sizeof container_id))
+        snprintf(out_name, name_size, "container/%s", container_id);
+    else if (group_by == GROUP_BY_CGROUP && cgroup[0] != '\0')
+        snprintf(out_name, name_size, "cgroup%s", cgroup);
+    else if (group_by == GROUP_BY_PID)
+        snprintf(out_name, name_size, "process/%s/%d",
+                 symbol_resolver_comm(resolver, pid), (int)pid);
+    else
+        snprintf(out_name, name_size, "process/%s",
+                 symbol_resolver_comm(resolver, pid));
+}
+
+
+/* Send one window of the daemon mode: the samples of the whole host, split
+ * into one New Relic transaction per process or container, for the top-N
+ * groups with most samples, and one "[other]" transaction for the rest, so
+ * that the number of transaction names stays bounded.
+ */
+void
+upload_native_groups_to_NewRelic(struct native_profile * in_profile,
+                                 const struct timespec * window_duration,
+                                 unsigned long window_number)
+{
+    static const char OTHER_GROUP[] = "[other]";
+
+    fprintf(stderr, "DEBUG: flushing window %lu: %llu samples\n",
+            window_number, in_profile->samples_count);
+    size_t n_off_cpu_stacks = 0;
+    const struct off_cpu_stack * off_cpu_stacks = NULL;
+    if (in_profile->off_cpu)
+        off_cpu_stacks = off_cpu_tracker_stacks(in_profile->off_cpu,
+                                                &n_off_cpu_stacks);
+    if (in_profile->n_samples == 0 && n_off_cpu_stacks == 0)
+        return;
+
+    /* the group of each sample, interned in the aggregation of groups */
+    const char ** sample_groups = arena_alloc(&window_arena,
+                                              in_profile->n_samples *
+                                              sizeof *sample_groups);
+    struct symbol_aggregation * groups =
+                   symbol_aggregation_new_in_arena(&window_arena);
+    struct symbol_aggregation * top_set =
+                   symbol_aggregation_new_in_arena(&window_arena);
+    unsigned int top_groups = in_profile->options->top_groups;
+    struct symbol_aggregate * top = arena_calloc(&window_arena, top_groups,
+                                                 sizeof *top);
+    if (!sample_groups || !groups || !top_set || !top) {
+        fprintf(stderr, "ERROR: upload_native_groups: malloc() failed\n");
+        return;
+    }
+
+    size_t i;
+    for (i = 0; i < in_profile->n_samples; i++) {
+        const struct perf_sample * sample = &in_profile->samples[i];
+        char group_name[128];
+        process_group_name(in_profile->resolver, sample->pid,
+                           in_profile->options->group_by, group_name,
+                           sizeof group_name);
+        sample_groups[i] = symbol_aggregation_intern(groups, group_name,
+                                                     strlen(group_name));
+        if (sample_groups[i])
+            symbol_aggregation_add(groups, sample_groups[i], NO_SO_OBJECT,
+                                   sample->samples, sample->period,
+                                   (double)sample->period);
+    }
+
+    size_t n_top = symbol_aggregation_top(groups, top_groups, top);
+    for (i = 0; i < n_top; i++)
+        symbol_aggregation_add(top_set, top[i].symbol, NO_SO_OBJECT, 0, 0, 0);
+    int has_others = 0;
+    for (i = 0; i < in_profile->n_samples; i++)
+        if (!sample_groups[i] ||
+            !symbol_aggregation_find(top_set, sample_groups[i], NO_SO_OBJECT)) {
+            sample_groups[i] = OTHER_GROUP;
+            has_others = 1;
+        }
+
+    /* the threads off the CPUs go to the transactions of their processes or
+     * containers, which are ranked by their on-CPU samples only */
+    const char ** off_cpu_groups = arena_alloc(&window_arena,
+                                               n_off_cpu_stacks *
+                                               sizeof *off_cpu_groups);
+    if (!off_cpu_groups) {
+        fprintf(stderr, "ERROR: upload_native_groups: malloc() failed\n");
+        return;
+    }
+    for (i = 0; i < n_off_cpu_stacks; i++) {
+        char group_name[128];
+        process_group_name(in_profile->resolver, off_cpu_stacks[i].pid,
+                           in_profile->options->group_by, group_name,
+                           sizeof group_name);
+        off_cpu_groups[i] = symbol_aggregation_intern(groups, group_name,
+                                                      strlen(group_name));
+        if (!off_cpu_groups[i] ||
+            !symbol_aggregation_find(top_set, off_cpu_groups[i],
+                                     NO_SO_OBJECT)) {
+            off_cpu_groups[i] = OTHER_GROUP;
+            has_others = 1;
+        }
+    }
+    fprintf(stderr, "DEBUG: window %lu: %zu processes or containers, the top "
+                    "%zu in transactions of their own\n", window_number,
+                    symbol_aggregation_count(groups), n_top);
+
+    size_t g;
+    for (g = 0; g < n_top + (size_t)has_others && interrupt_execution == 0;
+         g++) {
+        const char * group = g < n_top ? top[g].symbol : OTHER_GROUP;
+
+        long newrelic_transxtion_id = begin_perf_counters_transaction(group);
+        if (newrelic_transxtion_id < 0)
+            continue;
+
+        char attribute_value[32];
+        snprintf(attribute_value, sizeof attribute_value, "%lu",
+                 window_number);
+        newrelic_uploader_add_attribute(newrelic_uploader,
+                                        newrelic_transxtion_id,
+                                        "ct_window_number", attribute_value);
+        newrelic_uploader_add_attribute(newrelic_uploader,
+                                        newrelic_transxtion_id,
+                                        "ct_group", group);
+
+        upload_native_profile_to_NewRelic(in_profile, window_duration,
+                                          sample_groups, off_cpu_groups,
+                                          group, newrelic_transxtion_id);
+
+        newrelic_uploader_end_transaction(newrelic_uploader,
+                                          newrelic_transxtion_id);
+    }
+}
+
+
+
+int
+execute_counters_and_program(int in_program_argc, char * in_program_argv[],
+                             struct timespec * out_duration,
+                             struct perf_counter_totals * out_totals)
+{
+    /* the same options as the native sampler: only "-a" matters here */
+    struct perf_sampler_options options;
+    int program_idx = parse_native_sampler_options(in_program_argc,
+                                                   in_program_argv,
+                                                   &options, 1);
+    if (program_idx < 0)
+        return -1;
+
+    if (interrupt_execution != 0)
+        return -3;
+
+    int start_fd;
+    pid_t child_pid = perf_sampler_launch_program(in_program_argv + program_idx,
+                                                  &start_fd);
+    if (child_pid < 0)
+        return -4;
+
+    struct perf_counters * counters;
+    counters = perf_counters_open(child_pid, options.system_wide);
+    if (!counters) {
+        int status;
+        close(start_fd);
+        waitpid(child_pid, &status, 0);
+        return -5;
+    }
+    if (options.system_wide)
+        perf_counters_enable(counters);
+
+    struct timespec start_time, end_time;
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+    perf_sampler_start_program(start_fd);
+
+    /* the counters need no reading till the end: just wait */
+    int status = 0;
+    while (waitpid(child_pid, &status, 0) < 0 && errno == EINTR)
+        ;
+
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+    timespec_difference(&start_time, &end_time, out_duration);
+
+    perf_counters_disable(counters);
+    int read_result = perf_counters_read(counters, out_totals);
+    perf_counters_close(counters);
+
+    if (interrupt_execution != 0)
+        return -3;
+    if (read_result != 0)
+        return -5;
+
+    return WEXITSTATUS(status);
+}
+
+
+int
+upload_perf_counters_to_NewRelic(const struct perf_counter_totals * totals,
+                                 const struct timespec * prog_exec_duration,
+                                 long newrelic_transaction)
+{
+    if (interrupt_execution != 0) return -1;
+
+    char metric_name[MAX_LENGTH_NEW_RELIC_IDENT+1];
+    int id;
+    for (id = 0; id < PERF_N_COUNTERS; id++) {
+        const struct perf_counter_value * counter = &totals->counters[id];
+        if (!counter->supported)
+            continue;
+        if (counter->running < 1.0)
+            fprintf(stderr, "DEBUG: counter %s was multiplexed: counted "
+                            "%.02f%% of the time\n", perf_counter_name(id),
+                            100 * counter->running);
+
+        if (id == PERF_COUNTER_TASK_CLOCK) {
+            /* nanoseconds of CPU time */
+            record_metric_to_NewRelic("Custom/ct_counters/cpu_time",
+                                      counter->value / 1e9);
+            continue;
+        }
+        snprintf(metric_name, sizeof metric_name, "Custom/ct_counters/%s",
+                 perf_counter_name(id));
+        record_metric_to_NewRelic(metric_name, (double)counter->value);
+    }
+
+    record_metric_to_NewRelic("Custom/ct_counters/wall_clock_time",
+                              prog_exec_duration->tv_sec +
+                              prog_exec_duration->tv_nsec / 1e9);
+
+    /* the derived metrics, if their counters are supported */
+    if (totals->ipc >= 0)
+        record_metric_to_NewRelic("Custom/ct_counters/ipc", totals->ipc);
+    if (totals->cache_mpki >= 0)
+        record_metric_to_NewRelic("Custom/ct_counters/cache_mpki",
+                                  totals->cache_mpki);
+    if (totals->branch_miss_rate >= 0)
+        record_metric_to_NewRelic("Custom/ct_counters/branch_miss_rate",
+                                  totals->branch_miss_rate);
+
+    if (!totals->counters[PERF_COUNTER_CYCLES].supported)
+        send_error_notice_to_NewRelic(newrelic_transaction, "perf_counters",
+                                      "no hardware counters: only the CPU "
+                                      "time was counted");
+    return 0;
+}
+
 
 int
 usage_and_exit(void)
 {
     printf("Usage:\n"
            "\n"
-           "  perf_record_newrelic  newrelic_license_key "
-                             " [options-to-perf-record] <program> <args> ...\n"
+           "  perf_record_newrelic  newrelic_license_key  [--native] "
+                             "[--interval=N] [--top=K]\n"
+           "                        [--counters] [--metrics] "
+                             "[--rollup=dso]\n"
+           "                        [--daemon [--group-by=comm|pid|cgroup]"
+                             " [--top-groups=N]]\n"
+           "                        [--stacks=inclusive|folded] "
+                             "[--report-fields=F1,F2,...]\n"
+           "                        [--symbol-cache=DIR|off] [--pipe]\n"
+           "                        [--pid=PID,...|--tid=TID,...|--cgroup="
+                             "PATH]\n"
+           "                        [--duration=S] [--signal-control] "
+                             "[--cpu-budget=PCT]\n"
+           "                        [--readers=node|cpu] "
+                             "[--spool=FILE [--spool-size=MB]]\n"
+           "                        [--differential [--diff-threshold=PCT]] "
+                             "[--off-cpu]\n"
+           "                        [--breakdown[=pool|comm|thread] "
+                             "[--max-breakdown=N]]\n"
+           "                        [--preset=prod-light|prod-stacks|"
+                             "detailed] [--bpf]\n"
+           "                        [options-to-perf-record] <program> <args>"
+                             " ...\n"
            "                           Run and record performance of <program>"
                                      " under this NewRelic license key\n"
+           "                           --native: use perf_event_open() "
+                                     "directly, instead of 'perf record'\n"
+           "                                     and 'perf report' (only the"
+                                     " options -a, -e, -F, -c, -m, -g and\n"
+           "                                     --call-graph=fp|lbr; -e EVENT:p"
+                                     " for the precise sampling)\n"
+           "                           --interval=N: streaming mode, send "
+                                     "the samples to NewRelic every N\n"
+           "                                     seconds, each window in its"
+                                     " own transaction (implies --native)\n"
+           "                           --counters: count cycles, "
+                                     "instructions, cache and branch misses,\n"
+           "                                     as 'perf stat', and send them"
+                                     " and IPC, MPKI, etc., as metrics\n"
+           "                           --top=K: upload only the K symbols "
+                                     "with most samples (default 100)\n"
+           "                           --daemon: sample the whole host, "
+                                     "without a program, till a SIGTERM,\n"
+           "                                     with a transaction per "
+                                     "process or container per window\n"
+           "                                     (--interval, 60 by default;"
+                                     " --top-groups=N, 20 by default)\n"
+           "                           --metrics: send the top-K symbols "
+                                     "as numeric metrics, and the rest\n"
+           "                                     folded per DSO into "
+                                     "Custom/ct_other@<dso>\n"
+           "                           --rollup=dso: send only one metric "
+                                     "per DSO (top-K DSOs)\n"
+           "                           --stacks=inclusive: record the call-"
+                                     "graphs (-g), and send the top-K\n"
+           "                                     frames by inclusive time "
+                                     "(the default with a -g)\n"
+           "                           --stacks=folded: send the folded "
+                                     "stacks, for a flame-graph\n"
+           "                           --report-fields=F1,F2,...: the "
+                                     "--fields to 'perf report' (default\n"
+           "                                     overhead,period,sample,pid,"
+                                     "dso,sym)\n"
+           "                           --symbol-cache=DIR: the cache of the "
+                                     "symbol tables, by build-id,\n"
+           "                                     for --native (default "
+                                     "~/.cache/perf_record_newrelic)\n"
+           "                           --pid=PID,...: attach to processes "
+                                     "already running, without a program\n"
+           "                                     (--tid=TID,...: only those "
+                                     "threads; --cgroup=PATH: all the\n"
+           "                                     processes of a cgroup, "
+                                     "relative to /sys/fs/cgroup; implies\n"
+           "                                     --native), till they exit or "
+                                     "a SIGUSR2\n"
+           "                           --duration=S: stop the --daemon or "
+                                     "the attach after S seconds\n"
+           "                           --signal-control: start the --daemon "
+                                     "or the attach at a SIGUSR1\n"
+           "                           --cpu-budget=PCT: adapt the -F of "
+                                     "each CPU to keep the CPU use of\n"
+           "                                     the profiler within PCT%% of a "
+                                     "CPU (implies --native)\n"
+           "                           --readers=node|cpu: read the "
+                                     "ring-buffers in threads pinned to\n"
+           "                                     each NUMA node or CPU, for "
+                                     "large hosts (implies --native)\n"
+           "                           --pipe: stream 'perf record' into "
+                                     "'perf report' through a pipe,\n"
+           "                                     without a perf.data file\n"
+           "                           --spool=FILE: keep the metrics in "
+                                     "FILE while NewRelic is not\n"
+           "                                     reachable, and replay them "
+                                     "when it is again (--spool-size=MB:\n"
+           "                                     its hard cap, 64 by "
+                                     "default; the oldest windows are dropped)\n"
+           "                           --differential: with --interval or "
+                                     "--daemon, send instead of the\n"
+           "                                     top-K only the symbols whose "
+                                     "share grew against a rolling\n"
+           "                                     baseline by --diff-threshold="
+                                     "PCT points (1 by default)\n"
+           "                           --off-cpu: send also the time that the "
+                                     "threads spent blocked and in\n"
+           "                                     the run-queue, by function "
+                                     "and thread, from the sched_switch\n"
+           "                                     and sched_wakeup tracepoints "
+                                     "(implies --native; needs tracefs)\n"
+           "                           --bpf: count the samples in the "
+                                     "kernel, by a BPF program, per\n"
+           "                                     thread and call-graph, and "
+                                     "read them every second\n"
+           "                                     (implies --native; needs "
+                                     "root or CAP_BPF and CAP_PERFMON)\n"
+           "                           --breakdown[=pool|comm|thread]: send "
+                                     "also the top symbols of each pool\n"
+           "                                     of threads (the name without "
+                                     "its number; the default), thread\n"
+           "                                     name, or thread as metrics, "
+                                     "for the top --max-breakdown=N of\n"
+           "                                     them (16) per window. The "
+                                     "names of the threads \"<comm>/<tid>\"\n"
+           "                                     change as they come and go, "
+                                     "so those of their metrics have no\n"
+           "                                     bound over time\n"
+           "                           --preset=prod-light: -F 49 -m 16, "
+                                     "and no call-graphs (the -g and\n"
+           "                                     --stacks given are ignored);"
+                                     " prod-stacks: -F 49 -m 64 -g;\n"
+           "                                     detailed: -F 999 -m 256 -g."
+                                     " The options given after it\n"
+           "                                     change those of the preset\n"
            "  perf_record_newrelic  [-h|--help]\n"
            "                           Show this usage help\n");
     exit(1);
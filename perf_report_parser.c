@@ -0,0 +1,442 @@
+
+/* A zero-allocation parser of the output of "perf report": see
+ * "perf_report_parser.h".
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "perf_report_parser.h"
+
+
+static inline int
+is_blank(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+
+static inline const char *
+skip_blanks(const char * p, const char * end)
+{
+    while (p < end && is_blank(*p))
+        p++;
+    return p;
+}
+
+
+static inline const char *
+next_token(const char * p, const char * end, struct string_view * out_token)
+{
+    p = skip_blanks(p, end);
+    const char * token_start = p;
+    while (p < end && !is_blank(*p))
+        p++;
+    out_token->ptr = token_start;
+    out_token->len = (size_t)(p - token_start);
+    return p;
+}
+
+
+/* Parse a percentage "ddd.dd%": strtod() is not used because it needs a
+ * NUL-terminated string and depends on the locale */
+static const char *
+parse_percent(const char * p, const char * end, double * out_percent)
+{
+    double value = 0;
+    int digits = 0;
+
+    while (p < end && *p >= '0' && *p <= '9') {
+        value = 10 * value + (*p - '0');
+        p++;
+        digits++;
+    }
+    if (p < end && *p == '.') {
+        double scale = 0.1;
+        p++;
+        while (p < end && *p >= '0' && *p <= '9') {
+            value += scale * (*p - '0');
+            scale *= 0.1;
+            p++;
+            digits++;
+        }
+    }
+    if (digits == 0 || p >= end || *p != '%')
+        return NULL;
+
+    *out_percent = value;
+    return p + 1;
+}
+
+
+enum perf_report_parse_result
+perf_report_parse_line(const char * line, size_t len,
+                       struct perf_report_line * out)
+{
+    const char * end = line + len;
+    const char * p = skip_blanks(line, end);
+
+    if (p == end || *p == '#')
+        return PERF_REPORT_LINE_SKIPPED;
+
+    out->period = 0;
+    out->samples = 0;
+    out->tid = -1;
+    p = parse_percent(p, end, &out->percent);
+    if (!p || (p < end && !is_blank(*p)))
+        return PERF_REPORT_LINE_MALFORMED;
+
+    p = next_token(p, end, &out->comm);
+    p = next_token(p, end, &out->so_object);
+    if (out->comm.len == 0 || out->so_object.len == 0)
+        return PERF_REPORT_LINE_MALFORMED;
+
+    /* the cpu-mode marker: "[k]", "[.]", ... */
+    struct string_view marker;
+    p = next_token(p, end, &marker);
+    if (marker.len != 3 || marker.ptr[0] != '[' || marker.ptr[2] != ']')
+        return PERF_REPORT_LINE_MALFORMED;
+    out->cpu_mode = marker.ptr[1];
+
+    /* the symbol is the rest of the line, for it can have blanks (eg., C++
+     * symbols with their arguments, or "func (inlined)") */
+    p = skip_blanks(p, end);
+    const char * symbol_end = end;
+    while (symbol_end > p && is_blank(symbol_end[-1]))
+        symbol_end--;
+    if (symbol_end == p)
+        return PERF_REPORT_LINE_MALFORMED;
+    out->symbol.ptr = p;
+    out->symbol.len = (size_t)(symbol_end - p);
+
+    return PERF_REPORT_LINE_OK;
+}
+
+
+static const struct {
+    const char *            name;
+    enum perf_report_column column;
+} known_perf_report_columns[] = {
+    { "Overhead",      PERF_REPORT_COLUMN_OVERHEAD },
+    { "Self",          PERF_REPORT_COLUMN_OVERHEAD },
+    { "Period",        PERF_REPORT_COLUMN_PERIOD },
+    { "Samples",       PERF_REPORT_COLUMN_SAMPLES },
+    { "Command",       PERF_REPORT_COLUMN_COMM },
+    { "Pid:Command",   PERF_REPORT_COLUMN_THREAD },
+    { "Shared Object", PERF_REPORT_COLUMN_SO_OBJECT },
+    { "Symbol",        PERF_REPORT_COLUMN_SYMBOL },
+};
+
+
+/* The next field until "separator", without its surrounding blanks */
+static inline const char *
+next_field(const char * p, const char * end, char separator,
+           struct string_view * out_field)
+{
+    const char * field_end = memchr(p, separator, (size_t)(end - p));
+    if (!field_end)
+        field_end = end;
+
+    const char * next = field_end < end ? field_end + 1 : end;
+    p = skip_blanks(p, field_end);
+    while (field_end > p && is_blank(field_end[-1]))
+        field_end--;
+    out_field->ptr = p;
+    out_field->len = (size_t)(field_end - p);
+    return next;
+}
+
+
+int
+perf_report_parse_lost_samples(const char * line, size_t len,
+                               unsigned long long * out_lost_samples)
+{
+    static const char prefix[] = "Total Lost Samples:";
+    const char * end = line + len;
+    const char * p = skip_blanks(line, end);
+    if (p == end || *p != '#')
+        return -1;
+    p = skip_blanks(p + 1, end);
+    if ((size_t)(end - p) < sizeof prefix - 1 ||
+        memcmp(p, prefix, sizeof prefix - 1) != 0)
+        return -1;
+    p = skip_blanks(p + sizeof prefix - 1, end);
+
+    unsigned long long lost_samples = 0;
+    const char * digits = p;
+    while (p < end && *p >= '0' && *p <= '9')
+        lost_samples = 10 * lost_samples + (unsigned long long)(*p++ - '0');
+    if (p == digits)
+        return -1;
+    *out_lost_samples = lost_samples;
+    return 0;
+}
+
+
+int
+perf_report_symbol_is_unresolved(const struct string_view * symbol)
+{
+    return (symbol->len > 2 && symbol->ptr[0] == '0' &&
+            symbol->ptr[1] == 'x') ||
+           (symbol->len == 9 && memcmp(symbol->ptr, "[unknown]", 9) == 0);
+}
+
+
+int
+perf_report_schema_parse_header(struct perf_report_schema * out_schema,
+                                char separator, const char * line,
+                                size_t len)
+{
+    const char * end = line + len;
+    const char * p = skip_blanks(line, end);
+    if (p == end || *p != '#')
+        return -1;
+    p++;
+
+    memset(out_schema, 0, sizeof *out_schema);
+    out_schema->separator = separator;
+
+    int has_symbol = 0, has_so_object = 0, has_weight = 0;
+    while (p < end && out_schema->n_columns < PERF_REPORT_MAX_COLUMNS) {
+        struct string_view name;
+        p = next_field(p, end, separator, &name);
+
+        enum perf_report_column column = PERF_REPORT_COLUMN_IGNORED;
+        size_t i;
+        for (i = 0; i < sizeof known_perf_report_columns /
+                                   sizeof known_perf_report_columns[0]; i++)
+            if (strlen(known_perf_report_columns[i].name) == name.len &&
+                memcmp(known_perf_report_columns[i].name, name.ptr,
+                       name.len) == 0) {
+                column = known_perf_report_columns[i].column;
+                break;
+            }
+
+        out_schema->columns[out_schema->n_columns++] = column;
+        has_symbol |= column == PERF_REPORT_COLUMN_SYMBOL;
+        has_so_object |= column == PERF_REPORT_COLUMN_SO_OBJECT;
+        has_weight |= column == PERF_REPORT_COLUMN_OVERHEAD ||
+                      column == PERF_REPORT_COLUMN_PERIOD ||
+                      column == PERF_REPORT_COLUMN_SAMPLES;
+    }
+
+    return (has_symbol && has_so_object && has_weight) ? 0 : -1;
+}
+
+
+/* Parse an unsigned decimal integer, which must be the whole field */
+static int
+parse_unsigned(const struct string_view * field, unsigned long long * out)
+{
+    unsigned long long value = 0;
+    size_t i;
+    if (field->len == 0)
+        return -1;
+    for (i = 0; i < field->len; i++) {
+        char c = field->ptr[i];
+        if (c < '0' || c > '9')
+            return -1;
+        value = 10 * value + (unsigned long long)(c - '0');
+    }
+    *out = value;
+    return 0;
+}
+
+
+enum perf_report_parse_result
+perf_report_parse_fields(const struct perf_report_schema * schema,
+                         const char * line, size_t len,
+                         struct perf_report_line * out)
+{
+    const char * end = line + len;
+    const char * p = skip_blanks(line, end);
+
+    if (p == end || *p == '#')
+        return PERF_REPORT_LINE_SKIPPED;
+
+    memset(out, 0, sizeof *out);
+    out->cpu_mode = '.';
+    out->tid = -1;
+
+    unsigned int i;
+    for (i = 0; i < schema->n_columns; i++) {
+        if (p >= end && i > 0)
+            return PERF_REPORT_LINE_MALFORMED;   /* missing columns */
+
+        struct string_view field;
+        if (schema->columns[i] == PERF_REPORT_COLUMN_SYMBOL &&
+            i == schema->n_columns - 1) {
+            /* the last column takes the rest of the line */
+            field.ptr = skip_blanks(p, end);
+            const char * field_end = end;
+            while (field_end > field.ptr && is_blank(field_end[-1]))
+                field_end--;
+            field.len = (size_t)(field_end - field.ptr);
+            p = end;
+        } else {
+            p = next_field(p, end, schema->separator, &field);
+        }
+
+        switch (schema->columns[i]) {
+        case PERF_REPORT_COLUMN_OVERHEAD: {
+            const char * after = parse_percent(field.ptr, field.ptr + field.len,
+                                               &out->percent);
+            if (!after || after != field.ptr + field.len)
+                return PERF_REPORT_LINE_MALFORMED;
+            break;
+        }
+        case PERF_REPORT_COLUMN_PERIOD:
+            if (parse_unsigned(&field, &out->period) != 0)
+                return PERF_REPORT_LINE_MALFORMED;
+            break;
+        case PERF_REPORT_COLUMN_SAMPLES:
+            if (parse_unsigned(&field, &out->samples) != 0)
+                return PERF_REPORT_LINE_MALFORMED;
+            break;
+        case PERF_REPORT_COLUMN_COMM:
+            out->comm = field;
+            break;
+        case PERF_REPORT_COLUMN_THREAD: {
+            /* "1234:comm" */
+            const char * colon = memchr(field.ptr, ':', field.len);
+            struct string_view tid_field = { field.ptr, 0 };
+            unsigned long long tid;
+            if (colon)
+                tid_field.len = (size_t)(colon - field.ptr);
+            if (!colon || parse_unsigned(&tid_field, &tid) != 0)
+                return PERF_REPORT_LINE_MALFORMED;
+            out->tid = (int)tid;
+            out->comm.ptr = colon + 1;
+            out->comm.len = field.len - tid_field.len - 1;
+            break;
+        }
+        case PERF_REPORT_COLUMN_SO_OBJECT:
+            out->so_object = field;
+            break;
+        case PERF_REPORT_COLUMN_SYMBOL:
+            /* "[k] vm_normal_page": the cpu-mode marker comes first */
+            if (field.len >= 4 && field.ptr[0] == '[' && field.ptr[2] == ']' &&
+                is_blank(field.ptr[3])) {
+                out->cpu_mode = field.ptr[1];
+                field.ptr += 4;
+                field.len -= 4;
+                while (field.len > 0 && is_blank(field.ptr[0])) {
+                    field.ptr++;
+                    field.len--;
+                }
+            }
+            out->symbol = field;
+            break;
+        case PERF_REPORT_COLUMN_IGNORED:
+            break;
+        }
+    }
+
+    if (out->symbol.len == 0 || out->so_object.len == 0)
+        return PERF_REPORT_LINE_MALFORMED;
+    return PERF_REPORT_LINE_OK;
+}
+
+
+enum perf_report_parse_result
+perf_report_parse_folded_callchain(const char * line, size_t len,
+                                   unsigned long long * out_samples,
+                                   struct string_view * out_frames)
+{
+    const char * end = line + len;
+    const char * p = skip_blanks(line, end);
+
+    if (p == end || *p == '#')
+        return PERF_REPORT_LINE_SKIPPED;
+
+    struct string_view count;
+    p = next_token(p, end, &count);
+    if (parse_unsigned(&count, out_samples) != 0)
+        return PERF_REPORT_LINE_MALFORMED;
+
+    /* the frames take the rest of the line: symbols can have blanks */
+    out_frames->ptr = skip_blanks(p, end);
+    while (end > out_frames->ptr && is_blank(end[-1]))
+        end--;
+    out_frames->len = (size_t)(end - out_frames->ptr);
+    if (out_frames->len == 0)
+        return PERF_REPORT_LINE_MALFORMED;
+    return PERF_REPORT_LINE_OK;
+}
+
+
+void
+perf_report_reader_init(struct perf_report_reader * reader, int fd)
+{
+    reader->fd = fd;
+    reader->eof = 0;
+    reader->start = 0;
+    reader->end = 0;
+    reader->truncated_lines = 0;
+    reader->bytes_read = 0;
+}
+
+
+int
+perf_report_reader_next_line(struct perf_report_reader * reader,
+                             char ** out_line, size_t * out_len)
+{
+    int discarding = 0;   /* of a line longer than the buffer */
+
+    for (;;) {
+        char * line = reader->buffer + reader->start;
+        size_t available = reader->end - reader->start;
+        char * newline = memchr(line, '\n', available);
+
+        if (newline) {
+            reader->start += (size_t)(newline - line) + 1;
+            if (discarding) {
+                discarding = 0;
+                continue;
+            }
+            *newline = '\0';
+            *out_line = line;
+            *out_len = (size_t)(newline - line);
+            return 1;
+        }
+
+        if (reader->eof) {
+            if (available == 0 || discarding)
+                return 0;
+            /* the last line, without a '\n': there is always room for its
+             * '\0', since the buffer is not full when eof was seen */
+            line[available] = '\0';
+            reader->start = reader->end;
+            *out_line = line;
+            *out_len = available;
+            return 1;
+        }
+
+        /* move the partial line to the beginning of the buffer, and read
+         * more */
+        if (reader->start > 0) {
+            memmove(reader->buffer, line, available);
+            reader->start = 0;
+            reader->end = available;
+        }
+        if (reader->end == sizeof reader->buffer - 1) {
+            /* a line longer than the buffer: drop it */
+            reader->truncated_lines++;
+            reader->start = reader->end = 0;
+            discarding = 1;
+        }
+
+        ssize_t n_read = read(reader->fd, reader->buffer + reader->end,
+                              sizeof reader->buffer - 1 - reader->end);
+        if (n_read < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (n_read == 0)
+            reader->eof = 1;
+        reader->end += (size_t)n_read;
+        reader->bytes_read += (size_t)n_read;
+    }
+}
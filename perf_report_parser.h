@@ -0,0 +1,171 @@
+
+/* A zero-allocation parser of the output of "perf report".
+ *
+ * The lines are read by a perf_report_reader into its fixed buffer, which is
+ * reused for all the lines, and each line is tokenized by
+ * perf_report_parse_line() into string views pointing inside that buffer: so
+ * no malloc() nor free() per line, unlike the previous getline() followed by
+ * a sscanf() with two "%ms" conversions.
+ *
+ * The string views are valid till the next call to
+ * perf_report_reader_next_line().
+ */
+
+#ifndef PERF_REPORT_PARSER_H_
+#define PERF_REPORT_PARSER_H_
+
+#include <stddef.h>
+
+
+struct string_view {
+    const char * ptr;
+    size_t       len;
+};
+
+
+/* One line of "perf report", in its default format (sort by comm, dso,
+ * symbol):
+ *
+ *     16.67%       <prog>  [kernel.kallsyms]  [k] vm_normal_page
+ *     16.67%       <prog>  libc-2.17.so       [.] __fxstat64
+ *
+ * or in the machine-readable format of "perf report --field-separator=<c>
+ * --fields=<columns>" (see perf_report_parse_fields()), which can also give
+ * the period and the number of samples.
+ */
+struct perf_report_line {
+    double             percent;
+    struct string_view comm;
+    struct string_view so_object;
+    char               cpu_mode;     /* 'k' kernel, '.' user, 'g', 'u', ... */
+    struct string_view symbol;
+    unsigned long long period;       /* 0 if there is no "Period" column */
+    unsigned long long samples;      /* 0 if there is no "Samples" column */
+    int                tid;          /* -1 if there is no "Pid:Command" */
+};
+
+
+enum perf_report_parse_result {
+    PERF_REPORT_LINE_MALFORMED = -1,
+    PERF_REPORT_LINE_OK = 0,
+    PERF_REPORT_LINE_SKIPPED = 1      /* empty line, or a '#' comment */
+};
+
+
+/* Tokenize the "len" chars of "line" (without its '\n'). Returns
+ * PERF_REPORT_LINE_OK and fills "out", or PERF_REPORT_LINE_SKIPPED, or
+ * PERF_REPORT_LINE_MALFORMED if the line is not in the format above (and then
+ * "out" must not be used). */
+enum perf_report_parse_result
+perf_report_parse_line(const char * line, size_t len,
+                       struct perf_report_line * out);
+
+
+/* The columns of "perf report --fields=<columns>" that we understand, by
+ * the names that "perf report" gives them in its header line */
+enum perf_report_column {
+    PERF_REPORT_COLUMN_IGNORED = 0,
+    PERF_REPORT_COLUMN_OVERHEAD,      /* "Overhead", or "Self" with -g */
+    PERF_REPORT_COLUMN_PERIOD,        /* "Period" */
+    PERF_REPORT_COLUMN_SAMPLES,       /* "Samples" */
+    PERF_REPORT_COLUMN_COMM,          /* "Command" */
+    PERF_REPORT_COLUMN_THREAD,        /* "Pid:Command": the "pid" sort key,
+                                       * which is really per thread */
+    PERF_REPORT_COLUMN_SO_OBJECT,     /* "Shared Object" */
+    PERF_REPORT_COLUMN_SYMBOL         /* "Symbol" */
+};
+
+#define PERF_REPORT_MAX_COLUMNS  32
+
+/* The layout of the machine-readable lines: the columns, in the order
+ * given by the header line of "perf report" */
+struct perf_report_schema {
+    char                    separator;
+    unsigned int            n_columns;
+    enum perf_report_column columns[PERF_REPORT_MAX_COLUMNS];
+};
+
+
+/* Try to take the schema from a header line of "perf report --field-
+ * separator=<separator>", like:
+ *
+ *     # Overhead<sep>Period<sep>Samples<sep>Command<sep>Shared Object<sep>Symbol
+ *
+ * Returns 0 if it is a header line with at least the symbol and shared-
+ * object columns, and one of the overhead, period or samples columns, or -1
+ * otherwise (eg., the other '#' comments of "perf report"). */
+int
+perf_report_schema_parse_header(struct perf_report_schema * out_schema,
+                                char separator, const char * line,
+                                size_t len);
+
+
+/* The number of samples that "perf record" lost, from the comment of the
+ * header of "perf report":
+ *
+ *     # Total Lost Samples: 42
+ *
+ * Returns 0 if it is that line, or -1 otherwise. */
+int
+perf_report_parse_lost_samples(const char * line, size_t len,
+                               unsigned long long * out_lost_samples);
+
+
+/* Whether a symbol of "perf report" is one that it couldn't resolve: it
+ * prints then its address, as "0x00007f3c1b2a4e5d", or "[unknown]" */
+int
+perf_report_symbol_is_unresolved(const struct string_view * symbol);
+
+
+/* Tokenize a machine-readable line of "perf report", with the columns in
+ * the order given by "schema". The fields which are not in the schema are
+ * zero (or empty). Returns as perf_report_parse_line(). */
+enum perf_report_parse_result
+perf_report_parse_fields(const struct perf_report_schema * schema,
+                         const char * line, size_t len,
+                         struct perf_report_line * out);
+
+
+/* Tokenize a line of the call-graph of an entry, as printed after the line
+ * of the entry by "perf report -g folded,0,caller,count --no-children":
+ *
+ *     12 _start;__libc_start_main;main;compute
+ *
+ * the number of samples of that stack, and its frames, from the outermost
+ * caller to the symbol of the entry, separated by ';'. Returns as
+ * perf_report_parse_line(). */
+enum perf_report_parse_result
+perf_report_parse_folded_callchain(const char * line, size_t len,
+                                   unsigned long long * out_samples,
+                                   struct string_view * out_frames);
+
+
+#define PERF_REPORT_READER_BUFFER_SIZE  (64 * 1024)
+
+/* A line reader over a file descriptor (eg., the pipe from "perf report"),
+ * with a fixed buffer. Lines longer than the buffer are dropped (and
+ * counted in "truncated_lines"). */
+struct perf_report_reader {
+    int           fd;
+    int           eof;
+    size_t        start;      /* beginning of the next line in buffer[] */
+    size_t        end;        /* end of the data read in buffer[] */
+    unsigned long truncated_lines;
+    unsigned long long bytes_read;
+    char          buffer[PERF_REPORT_READER_BUFFER_SIZE];
+};
+
+
+void
+perf_report_reader_init(struct perf_report_reader * reader, int fd);
+
+
+/* Return in *out_line (NUL-terminated, without its '\n') and *out_len the
+ * next line. Returns 1 if a line was returned, 0 at the end of the input, or
+ * -1 on a read error. */
+int
+perf_report_reader_next_line(struct perf_report_reader * reader,
+                             char ** out_line, size_t * out_len);
+
+
+#endif  /* PERF_REPORT_PARSER_H_ */
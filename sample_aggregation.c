@@ -0,0 +1,53 @@
+/* The aggregations of the samples per thread and per folded stack: see
+ * "sample_aggregation.h".
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "sample_aggregation.h"
+
+
+void
+sample_aggregation_add_thread(struct symbol_aggregation * threads,
+                              const char * comm, size_t comm_len, int tid,
+                              unsigned long long samples,
+                              unsigned long long period, double weight)
+{
+    char thread_name[64];
+    int len = snprintf(thread_name, sizeof thread_name, "%.*s/%d",
+                       (int)(comm_len < 32 ? comm_len : 32), comm, tid);
+    const char * interned = symbol_aggregation_intern(threads, thread_name,
+                                                      (size_t)len);
+    const char * no_so_object = symbol_aggregation_intern(threads, "", 0);
+    if (interned && no_so_object)
+        symbol_aggregation_add(threads, interned, no_so_object, samples,
+                               period, weight);
+}
+
+
+void
+sample_aggregation_add_folded_stack(struct stack_trie * stacks,
+                                    struct symbol_aggregation * aggregation,
+                                    const struct string_view * folded_frames,
+                                    unsigned long long samples)
+{
+    struct stack_frame frames[STACK_TRIE_MAX_DEPTH];
+    size_t depth = 0;
+    const char * no_so_object = symbol_aggregation_intern(aggregation, "", 0);
+    const char * p = folded_frames->ptr;
+    const char * end = p + folded_frames->len;
+    while (p < end && depth < STACK_TRIE_MAX_DEPTH) {
+        const char * frame_end = memchr(p, ';', (size_t)(end - p));
+        if (!frame_end)
+            frame_end = end;
+        frames[depth].symbol = symbol_aggregation_intern(aggregation, p,
+                                                   (size_t)(frame_end - p));
+        frames[depth].so_object = no_so_object;
+        if (!frames[depth].symbol || !no_so_object)
+            return;
+        depth++;
+        p = frame_end + 1;
+    }
+    stack_trie_add(stacks, frames, depth, samples, 0, (double)samples);
+}
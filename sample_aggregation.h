@@ -0,0 +1,39 @@
+/* The aggregations into which the wrapper adds the samples of a flush window,
+ * besides the one per (symbol, DSO): per thread, and the call-graphs folded
+ * by "perf report -g" into the trie of the stacks. They are shared by the
+ * paths of "perf report" and of the native sampler, and by the benchmark of
+ * the pipeline of "perf report" (see "bench/bench_report_pipeline.c"), so
+ * that it measures the code of the wrapper itself.
+ */
+
+#ifndef SAMPLE_AGGREGATION_H_
+#define SAMPLE_AGGREGATION_H_
+
+#include <stddef.h>
+
+#include "perf_report_parser.h"
+#include "stack_trie.h"
+#include "symbol_aggregation.h"
+
+
+/* Add the samples of a thread to the aggregation of threads, by its name
+ * "<comm>/<tid>" (with the comm cut at 32 chars), interned in that
+ * aggregation, as its own DSO "" */
+void
+sample_aggregation_add_thread(struct symbol_aggregation * threads,
+                              const char * comm, size_t comm_len, int tid,
+                              unsigned long long samples,
+                              unsigned long long period, double weight);
+
+
+/* Add a folded stack of "perf report" ("outer;...;leaf") to the trie, with
+ * its frames interned in the aggregation (the DSOs of the frames are not
+ * given) */
+void
+sample_aggregation_add_folded_stack(struct stack_trie * stacks,
+                                    struct symbol_aggregation * aggregation,
+                                    const struct string_view * folded_frames,
+                                    unsigned long long samples);
+
+
+#endif  /* SAMPLE_AGGREGATION_H_ */
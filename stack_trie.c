@@ -0,0 +1,415 @@
+/* The aggregation of the call-graphs in a prefix trie: see "stack_trie.h".
+ *
+ * The nodes are in one array, where the parents always come before their
+ * children (the root is the node 0), and the children of a node are found
+ * by an open-addressing hash table (with linear probing) keyed by (parent,
+ * symbol, DSO), like the symbol_aggregation, and not by walking a list of
+ * siblings: the root and the dispatchers (eg., "start_thread", or the event
+ * loop of a daemon) can have thousands of children.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "stack_trie.h"
+
+
+#define INITIAL_TRIE_CAPACITY  1024
+
+struct stack_trie_node {
+    const char *       symbol;
+    const char *       so_object;
+    unsigned int       parent;
+    unsigned long long samples;         /* inclusive: the stacks through it */
+    unsigned long long period;
+    double             weight;
+    unsigned long long self_samples;    /* the stacks which end in it */
+    unsigned long long self_period;
+    double             self_weight;
+};
+
+struct stack_trie {
+    struct stack_trie_node * nodes;
+    size_t                   n_nodes;
+    size_t                   capacity;
+    unsigned int *           children;  /* node indexes; 0: empty slot */
+    size_t                   children_capacity;
+};
+
+
+static inline uint64_t
+hash_child(unsigned int parent, const char * symbol, const char * so_object)
+{
+    /* the finalizer of MurmurHash3, over the parent and the two pointers */
+    uint64_t h = (uint64_t)(uintptr_t)symbol * 0x9e3779b97f4a7c15ULL ^
+                 (uint64_t)(uintptr_t)so_object ^
+                 (uint64_t)parent * 0xc2b2ae3d27d4eb4fULL;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+
+struct stack_trie *
+stack_trie_new(void)
+{
+    struct stack_trie * trie = calloc(1, sizeof *trie);
+    if (!trie)
+        return NULL;
+
+    trie->nodes = malloc(INITIAL_TRIE_CAPACITY * sizeof *trie->nodes);
+    trie->children = calloc(2 * INITIAL_TRIE_CAPACITY, sizeof *trie->children);
+    if (!trie->nodes || !trie->children) {
+        stack_trie_free(trie);
+        return NULL;
+    }
+    trie->capacity = INITIAL_TRIE_CAPACITY;
+    trie->children_capacity = 2 * INITIAL_TRIE_CAPACITY;
+    stack_trie_reset(trie);
+    return trie;
+}
+
+
+void
+stack_trie_free(struct stack_trie * trie)
+{
+    if (!trie)
+        return;
+    free(trie->nodes);
+    free(trie->children);
+    free(trie);
+}
+
+
+/* Double the nodes and the hash table of the children, so that the table is
+ * never more than half full */
+static int
+grow_trie(struct stack_trie * trie)
+{
+    size_t new_capacity = 2 * trie->capacity;
+    struct stack_trie_node * new_nodes = realloc(trie->nodes,
+                                                 new_capacity *
+                                                 sizeof *new_nodes);
+    if (!new_nodes)
+        return -1;
+    trie->nodes = new_nodes;
+
+    size_t new_children_capacity = 2 * new_capacity;
+    unsigned int * new_children = calloc(new_children_capacity,
+                                         sizeof *new_children);
+    if (!new_children)
+        return -1;
+    size_t mask = new_children_capacity - 1;
+    size_t i;
+    for (i = 1; i < trie->n_nodes; i++) {
+        const struct stack_trie_node * node = &trie->nodes[i];
+        size_t slot = hash_child(node->parent, node->symbol,
+                                 node->so_object) & mask;
+        while (new_children[slot])
+            slot = (slot + 1) & mask;
+        new_children[slot] = (unsigned int)i;
+    }
+
+    free(trie->children);
+    trie->children = new_children;
+    trie->children_capacity = new_children_capacity;
+    trie->capacity = new_capacity;
+    return 0;
+}
+
+
+/* The child of "parent" for the frame, which is created if not there yet.
+ * Returns its index, or 0 if it couldn't allocate memory. */
+static unsigned int
+find_or_add_child(struct stack_trie * trie, unsigned int parent,
+                  const struct stack_frame * frame)
+{
+    size_t mask = trie->children_capacity - 1;
+    size_t slot = hash_child(parent, frame->symbol, frame->so_object) & mask;
+    unsigned int child;
+    while ((child = trie->children[slot]) != 0) {
+        const struct stack_trie_node * node = &trie->nodes[child];
+        if (node->parent == parent && node->symbol == frame->symbol &&
+            node->so_object == frame->so_object)
+            return child;
+        slot = (slot + 1) & mask;
+    }
+
+    if (trie->n_nodes == trie->capacity) {
+        if (grow_trie(trie) != 0)
+            return 0;
+        return find_or_add_child(trie, parent, frame);   /* new slot */
+    }
+
+    child = (unsigned int)trie->n_nodes++;
+    struct stack_trie_node * node = &trie->nodes[child];
+    memset(node, 0, sizeof *node);
+    node->symbol = frame->symbol;
+    node->so_object = frame->so_object;
+    node->parent = parent;
+    trie->children[slot] = child;
+    return child;
+}
+
+
+int
+stack_trie_add(struct stack_trie * trie, const struct stack_frame * frames,
+               size_t depth, unsigned long long samples,
+               unsigned long long period, double weight)
+{
+    if (depth > STACK_TRIE_MAX_DEPTH)
+        depth = STACK_TRIE_MAX_DEPTH;
+
+    unsigned int node = 0;
+    size_t i;
+    for (i = 0; ; i++) {
+        trie->nodes[node].samples += samples;
+        trie->nodes[node].period += period;
+        trie->nodes[node].weight += weight;
+        if (i == depth)
+            break;
+        unsigned int child = find_or_add_child(trie, node, &frames[i]);
+        if (child == 0)
+            return -1;
+        node = child;
+    }
+    trie->nodes[node].self_samples += samples;
+    trie->nodes[node].self_period += period;
+    trie->nodes[node].self_weight += weight;
+    return 0;
+}
+
+
+size_t
+stack_trie_node_count(const struct stack_trie * trie)
+{
+    return trie->n_nodes;
+}
+
+
+unsigned long long
+stack_trie_total_samples(const struct stack_trie * trie)
+{
+    return trie->nodes[0].samples;
+}
+
+
+double
+stack_trie_total_weight(const struct stack_trie * trie)
+{
+    return trie->nodes[0].weight;
+}
+
+
+int
+stack_trie_add_inclusive(const struct stack_trie * trie,
+                         struct symbol_aggregation * out)
+{
+    size_t i;
+    for (i = 1; i < trie->n_nodes; i++) {
+        const struct stack_trie_node * node = &trie->nodes[i];
+
+        /* a recursive frame is counted only at its outermost call, which
+         * already includes the stacks of the inner calls */
+        unsigned int ancestor = node->parent;
+        while (ancestor != 0 &&
+               (trie->nodes[ancestor].symbol != node->symbol ||
+                trie->nodes[ancestor].so_object != node->so_object))
+            ancestor = trie->nodes[ancestor].parent;
+        if (ancestor != 0)
+            continue;
+
+        if (symbol_aggregation_add(out, node->symbol, node->so_object,
+                                   node->samples, node->period,
+                                   node->weight) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+
+/* The state of stack_trie_write_folded() while it walks the trie */
+struct folded_writer {
+    const struct stack_trie * trie;
+    double                    min_weight;
+    unsigned int *            first_child;    /* the heaviest first */
+    unsigned int *            next_sibling;
+    unsigned long long *      folded_samples; /* of the children below
+                                               * min_weight */
+    unsigned int              path[STACK_TRIE_MAX_DEPTH + 1];
+    unsigned int              previous_path[STACK_TRIE_MAX_DEPTH + 1];
+    unsigned int              previous_depth;
+    char *                    buffer;
+    size_t                    buffer_size;
+    size_t                    length;
+    int                       full;
+    unsigned long long        omitted;
+};
+
+
+/* A node, to sort the children of every node by their weights */
+struct node_order {
+    unsigned int parent;
+    unsigned int node;
+    double       weight;
+};
+
+
+static int
+compare_by_parent_and_weight(const void * a, const void * b)
+{
+    const struct node_order * x = a;
+    const struct node_order * y = b;
+    if (x->parent != y->parent)
+        return x->parent < y->parent ? -1 : 1;
+    if (x->weight != y->weight)
+        return x->weight > y->weight ? -1 : 1;
+    return 0;
+}
+
+
+/* Write the line of the stack of "path[1..depth]", whose samples are
+ * "samples" */
+static void
+write_folded_line(struct folded_writer * writer, unsigned int depth,
+                  unsigned long long samples)
+{
+    if (writer->full) {
+        writer->omitted += samples;
+        return;
+    }
+
+    unsigned int shared = 0;
+    while (shared < depth && shared < writer->previous_depth &&
+           writer->path[shared + 1] == writer->previous_path[shared + 1])
+        shared++;
+
+    size_t room = writer->buffer_size - writer->length;
+    size_t start = writer->length;
+    int n = snprintf(writer->buffer + start, room, "%u ", shared);
+    size_t used = n > 0 ? (size_t)n : room;
+    unsigned int i;
+    for (i = shared + 1; i <= depth && used < room; i++) {
+        const char * symbol = writer->trie->nodes[writer->path[i]].symbol;
+        n = snprintf(writer->buffer + start + used, room - used, "%s%s",
+                     symbol, i < depth ? ";" : "");
+        used += n > 0 ? (size_t)n : room;
+    }
+    if (used < room) {
+        n = snprintf(writer->buffer + start + used, room - used, " %llu\n",
+                     samples);
+        used += n > 0 ? (size_t)n : room;
+    }
+
+    if (used >= room) {
+        /* it doesn't fit (with its NUL): this and the following stacks are
+         * omitted, for they are the lighter ones */
+        writer->buffer[start] = '\0';
+        writer->full = 1;
+        writer->omitted += samples;
+        return;
+    }
+    writer->length += used;
+    memcpy(writer->previous_path, writer->path,
+           (depth + 1) * sizeof writer->path[0]);
+    writer->previous_depth = depth;
+}
+
+
+static void
+write_folded_subtree(struct folded_writer * writer, unsigned int node,
+                     unsigned int depth)
+{
+    const struct stack_trie_node * nodes = writer->trie->nodes;
+    writer->path[depth] = node;
+
+    unsigned long long samples = nodes[node].self_samples +
+                                 writer->folded_samples[node];
+    if (depth > 0 && samples > 0)
+        write_folded_line(writer, depth, samples);
+
+    unsigned int child;
+    for (child = writer->first_child[node]; child != 0;
+         child = writer->next_sibling[child])
+        if (nodes[child].weight >= writer->min_weight)
+            write_folded_subtree(writer, child, depth + 1);
+}
+
+
+long
+stack_trie_write_folded(const struct stack_trie * trie, double min_weight,
+                        char * buffer, size_t buffer_size,
+                        unsigned long long * out_omitted,
+                        struct arena * scratch)
+{
+    *out_omitted = 0;
+    if (buffer_size == 0)
+        return 0;
+    buffer[0] = '\0';
+
+    struct folded_writer * writer = arena_calloc(scratch, 1, sizeof *writer);
+    struct node_order * order = arena_alloc(scratch,
+                                            trie->n_nodes * sizeof *order);
+    if (writer) {
+        writer->first_child = arena_calloc(scratch, trie->n_nodes,
+                                           sizeof *writer->first_child);
+        writer->next_sibling = arena_calloc(scratch, trie->n_nodes,
+                                            sizeof *writer->next_sibling);
+        writer->folded_samples = arena_calloc(scratch, trie->n_nodes,
+                                              sizeof *writer->folded_samples);
+    }
+    if (!writer || !order || !writer->first_child || !writer->next_sibling ||
+        !writer->folded_samples)
+        return -1;
+    writer->trie = trie;
+    writer->min_weight = min_weight;
+    writer->buffer = buffer;
+    writer->buffer_size = buffer_size;
+
+    /* link the children of each node from the heaviest to the lightest,
+     * and fold the light subtrees into their callers: as the weight of a
+     * node is at least that of its children, a light node under a heavy
+     * one is the root of a light subtree */
+    size_t i, n_order = 0;
+    for (i = 1; i < trie->n_nodes; i++) {
+        const struct stack_trie_node * node = &trie->nodes[i];
+        order[n_order].parent = node->parent;
+        order[n_order].node = (unsigned int)i;
+        order[n_order].weight = node->weight;
+        n_order++;
+        if (node->weight < min_weight &&
+            (node->parent == 0 ||
+             trie->nodes[node->parent].weight >= min_weight))
+            writer->folded_samples[node->parent] += node->samples;
+    }
+    qsort(order, n_order, sizeof *order, compare_by_parent_and_weight);
+    for (i = n_order; i > 0; i--) {
+        unsigned int node = order[i - 1].node;
+        unsigned int parent = order[i - 1].parent;
+        writer->next_sibling[node] = writer->first_child[parent];
+        writer->first_child[parent] = node;
+    }
+
+    write_folded_subtree(writer, 0, 0);
+
+    long length = (long)writer->length;
+    /* the light stacks without a caller to be folded into are omitted too */
+    *out_omitted = writer->omitted + writer->folded_samples[0];
+    return length;
+}
+
+
+void
+stack_trie_reset(struct stack_trie * trie)
+{
+    memset(trie->nodes, 0, sizeof *trie->nodes);   /* the root */
+    trie->n_nodes = 1;
+    memset(trie->children, 0, trie->children_capacity *
+                              sizeof *trie->children);
+}
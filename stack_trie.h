@@ -0,0 +1,113 @@
+
+/* The aggregation of the call-graphs (stacks) of the samples, for a flush
+ * window, as a prefix trie of frames: each node is a frame (symbol, DSO) and
+ * its path from the root is the stack of callers above it, so the frames
+ * shared by many stacks (eg., "main" and its callees near the root) are
+ * stored just once, instead of once per sample or per distinct stack.
+ *
+ * Every node has the samples, periods and weights of the stacks which pass
+ * through it (its inclusive cost, or "children" in "perf report"), and of
+ * the stacks which end in it (its self cost). From the trie come:
+ *
+ *   - the inclusive cost per frame, with stack_trie_add_inclusive(), to send
+ *     the top-K frames where the time goes (and not only the leaves), and
+ *
+ *   - the folded stacks, as the input of a flame-graph
+ *     (http://www.brendangregg.com/flamegraphs.html), with
+ *     stack_trie_write_folded().
+ *
+ * As in the symbol_aggregation, the (symbol, DSO) strings of the frames must
+ * be interned: the frames are compared by their pointers.
+ */
+
+#ifndef STACK_TRIE_H_
+#define STACK_TRIE_H_
+
+#include <stddef.h>
+
+#include "symbol_aggregation.h"
+
+
+/* The deepest stack kept: the frames beyond it are dropped, as "perf record"
+ * does with /proc/sys/kernel/perf_event_max_stack */
+#define STACK_TRIE_MAX_DEPTH  256
+
+
+struct stack_frame {
+    const char * symbol;
+    const char * so_object;
+};
+
+
+struct stack_trie;
+struct arena;
+
+
+struct stack_trie *
+stack_trie_new(void);
+
+
+void
+stack_trie_free(struct stack_trie * trie);
+
+
+/* Add a stack of "depth" frames, from the outermost caller (frames[0], eg.
+ * "_start") to the leaf, where the sample was taken. Returns 0, or -1 if it
+ * couldn't allocate memory (then the stack is only partially added). */
+int
+stack_trie_add(struct stack_trie * trie, const struct stack_frame * frames,
+               size_t depth, unsigned long long samples,
+               unsigned long long period, double weight);
+
+
+/* The number of nodes (distinct stack prefixes) in the trie, and the sums of
+ * the stacks added to it */
+size_t
+stack_trie_node_count(const struct stack_trie * trie);
+
+
+unsigned long long
+stack_trie_total_samples(const struct stack_trie * trie);
+
+
+double
+stack_trie_total_weight(const struct stack_trie * trie);
+
+
+/* Add to "out" the inclusive cost of each frame: the stacks in which it
+ * appears, counted once per stack even if the frame is recursive. Returns 0,
+ * or -1 if it couldn't allocate memory. */
+int
+stack_trie_add_inclusive(const struct stack_trie * trie,
+                         struct symbol_aggregation * out);
+
+
+/* Write the folded stacks, one per line, the heaviest subtrees first, in a
+ * prefix-compressed form of the folded format of "stackcollapse-perf.pl":
+ * each line is
+ *
+ *     <k> <frame>;<frame>;...;<frame> <samples>
+ *
+ * where the stack is the first <k> frames of the stack of the previous line
+ * followed by the frames in the line, so that the callers shared with the
+ * previous stack are not repeated. The stacks whose weight is less than
+ * "min_weight" are folded into their callers. The output stops (at the end
+ * of a line) before "buffer_size" is exceeded, and is NUL-terminated;
+ * *out_omitted is the number of samples of the stacks which didn't fit (or
+ * which were light and had no caller to be folded into).
+ * The working tables of the walk are allocated from "scratch" (eg., the
+ * arena of the flush window), and are released with it.
+ * Returns the length written, or -1 if it couldn't allocate memory. */
+long
+stack_trie_write_folded(const struct stack_trie * trie, double min_weight,
+                        char * buffer, size_t buffer_size,
+                        unsigned long long * out_omitted,
+                        struct arena * scratch);
+
+
+/* Empty the trie at the end of a flush window */
+void
+stack_trie_reset(struct stack_trie * trie);
+
+
+#endif  /* STACK_TRIE_H_ */
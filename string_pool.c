@@ -0,0 +1,22 @@
+/* A simple pool of strings: see "string_pool.h" */
+
+#include "string_pool.h"
+
+
+#define STRING_POOL_CHUNK_SIZE  (64 * 1024)
+
+
+const char *
+string_pool_add(struct string_pool * pool, const char * str, size_t len)
+{
+    if (pool->arena.chunk_size == 0)
+        pool->arena.chunk_size = STRING_POOL_CHUNK_SIZE;
+    return arena_strndup(&pool->arena, str, len);
+}
+
+
+void
+string_pool_free(struct string_pool * pool)
+{
+    arena_free(&pool->arena);
+}
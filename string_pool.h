@@ -0,0 +1,32 @@
+/* A simple pool of strings, so that the many small strings of the symbol
+ * tables (eg., the ~100K symbols in /proc/kallsyms) and of the aggregations
+ * are not allocated one by one: an arena (see "arena.h") of their own, which
+ * is never reset, so that these long-lived strings are packed together and
+ * don't fragment the heap of the per-window data. The strings are only
+ * released all together in string_pool_free().
+ */
+
+#ifndef STRING_POOL_H_
+#define STRING_POOL_H_
+
+#include <stddef.h>
+
+#include "arena.h"
+
+
+struct string_pool {
+    struct arena arena;
+};
+
+
+/* Copy the "len" chars of "str" into the pool, adding a '\0'. Returns the
+ * copy, or NULL if it couldn't allocate memory. */
+const char *
+string_pool_add(struct string_pool * pool, const char * str, size_t len);
+
+
+void
+string_pool_free(struct string_pool * pool);
+
+
+#endif  /* STRING_POOL_H_ */
@@ -0,0 +1,394 @@
+
+/* The in-process aggregation of the samples per (symbol, DSO): see
+ * "symbol_aggregation.h".
+ *
+ * Both the aggregation table and the table of interned strings are open-
+ * addressing hash tables with linear probing, whose capacities are powers of
+ * two, and which are grown (doubled) when they are half full.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "string_pool.h"
+#include "symbol_aggregation.h"
+
+
+#define INITIAL_AGGREGATION_CAPACITY  1024
+#define INITIAL_INTERN_CAPACITY       1024
+
+struct symbol_aggregation {
+    struct symbol_aggregate * slots;      /* symbol == NULL: empty slot */
+    size_t                    capacity;
+    size_t                    count;
+    unsigned long long        total_samples;
+    unsigned long long        total_period;
+    double                    total_weight;
+
+    /* the interned strings */
+    const char **             interned;   /* NULL: empty slot */
+    size_t                    intern_capacity;
+    size_t                    intern_count;
+    struct string_pool        strings;
+
+    struct arena *            arena;      /* NULL: on the heap */
+};
+
+
+static inline uint64_t
+mix_pointers(const void * a, const void * b)
+{
+    /* the finalizer of MurmurHash3, over the two pointers */
+    uint64_t h = (uint64_t)(uintptr_t)a * 0x9e3779b97f4a7c15ULL ^
+                 (uint64_t)(uintptr_t)b;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+
+static inline uint64_t
+hash_chars(const char * str, size_t len)
+{
+    /* FNV-1a */
+    uint64_t h = 14695981039346656037ULL;
+    size_t i;
+    for (i = 0; i < len; i++) {
+        h ^= (unsigned char)str[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+
+/* The tables come from the heap, or from the arena of the aggregation (where
+ * the tables which were outgrown are only released with the arena) */
+static void *
+table_calloc(struct symbol_aggregation * aggregation, size_t n, size_t size)
+{
+    return aggregation->arena ? arena_calloc(aggregation->arena, n, size)
+                              : calloc(n, size);
+}
+
+
+static void
+table_free(struct symbol_aggregation * aggregation, void * table)
+{
+    if (!aggregation->arena)
+        free(table);
+}
+
+
+static struct symbol_aggregation *
+new_aggregation(struct arena * arena)
+{
+    struct symbol_aggregation * aggregation =
+                   arena ? arena_calloc(arena, 1, sizeof *aggregation)
+                         : calloc(1, sizeof *aggregation);
+    if (!aggregation)
+        return NULL;
+    aggregation->arena = arena;
+
+    aggregation->slots = table_calloc(aggregation,
+                                      INITIAL_AGGREGATION_CAPACITY,
+                                      sizeof *aggregation->slots);
+    aggregation->interned = table_calloc(aggregation, INITIAL_INTERN_CAPACITY,
+                                         sizeof *aggregation->interned);
+    if (!aggregation->slots || !aggregation->interned) {
+        symbol_aggregation_free(aggregation);
+        return NULL;
+    }
+    aggregation->capacity = INITIAL_AGGREGATION_CAPACITY;
+    aggregation->intern_capacity = INITIAL_INTERN_CAPACITY;
+    return aggregation;
+}
+
+
+struct symbol_aggregation *
+symbol_aggregation_new(void)
+{
+    return new_aggregation(NULL);
+}
+
+
+struct symbol_aggregation *
+symbol_aggregation_new_in_arena(struct arena * arena)
+{
+    return new_aggregation(arena);
+}
+
+
+void
+symbol_aggregation_free(struct symbol_aggregation * aggregation)
+{
+    if (!aggregation || aggregation->arena)
+        return;
+    free(aggregation->slots);
+    free(aggregation->interned);
+    string_pool_free(&aggregation->strings);
+    free(aggregation);
+}
+
+
+static int
+grow_intern_table(struct symbol_aggregation * aggregation)
+{
+    size_t new_capacity = 2 * aggregation->intern_capacity;
+    const char ** new_table = table_calloc(aggregation, new_capacity,
+                                           sizeof *new_table);
+    if (!new_table)
+        return -1;
+
+    size_t i;
+    for (i = 0; i < aggregation->intern_capacity; i++) {
+        const char * str = aggregation->interned[i];
+        if (!str)
+            continue;
+        size_t slot = hash_chars(str, strlen(str)) & (new_capacity - 1);
+        while (new_table[slot])
+            slot = (slot + 1) & (new_capacity - 1);
+        new_table[slot] = str;
+    }
+
+    table_free(aggregation, aggregation->interned);
+    aggregation->interned = new_table;
+    aggregation->intern_capacity = new_capacity;
+    return 0;
+}
+
+
+const char *
+symbol_aggregation_intern(struct symbol_aggregation * aggregation,
+                          const char * str, size_t len)
+{
+    size_t mask = aggregation->intern_capacity - 1;
+    size_t slot = hash_chars(str, len) & mask;
+
+    const char * candidate;
+    while ((candidate = aggregation->interned[slot]) != NULL) {
+        if (strncmp(candidate, str, len) == 0 && candidate[len] == '\0')
+            return candidate;
+        slot = (slot + 1) & mask;
+    }
+    if (aggregation->intern_count + 1 >= aggregation->intern_capacity)
+        return NULL;   /* completely full (it couldn't grow): an empty slot
+                        * must be left, for the probing to end */
+
+    const char * copy = aggregation->arena ?
+                        arena_strndup(aggregation->arena, str, len) :
+                        string_pool_add(&aggregation->strings, str, len);
+    if (!copy)
+        return NULL;
+    aggregation->interned[slot] = copy;
+    aggregation->intern_count++;
+
+    if (2 * aggregation->intern_count > aggregation->intern_capacity)
+        grow_intern_table(aggregation);  /* if it fails, we keep on probing,
+                                          * till it is completely full */
+    return copy;
+}
+
+
+static int
+grow_aggregation_table(struct symbol_aggregation * aggregation)
+{
+    size_t new_capacity = 2 * aggregation->capacity;
+    struct symbol_aggregate * new_slots = table_calloc(aggregation,
+                                                       new_capacity,
+                                                       sizeof *new_slots);
+    if (!new_slots)
+        return -1;
+
+    size_t i;
+    for (i = 0; i < aggregation->capacity; i++) {
+        const struct symbol_aggregate * entry = &aggregation->slots[i];
+        if (!entry->symbol)
+            continue;
+        size_t slot = mix_pointers(entry->symbol, entry->so_object) &
+                                                          (new_capacity - 1);
+        while (new_slots[slot].symbol)
+            slot = (slot + 1) & (new_capacity - 1);
+        new_slots[slot] = *entry;
+    }
+
+    table_free(aggregation, aggregation->slots);
+    aggregation->slots = new_slots;
+    aggregation->capacity = new_capacity;
+    return 0;
+}
+
+
+int
+symbol_aggregation_add(struct symbol_aggregation * aggregation,
+                       const char * symbol, const char * so_object,
+                       unsigned long long samples, unsigned long long period,
+                       double weight)
+{
+    if (2 * (aggregation->count + 1) > aggregation->capacity &&
+        grow_aggregation_table(aggregation) != 0 &&
+        aggregation->count + 1 >= aggregation->capacity)
+        return -1;   /* completely full: can't grow it */
+
+    size_t mask = aggregation->capacity - 1;
+    size_t slot = mix_pointers(symbol, so_object) & mask;
+    struct symbol_aggregate * entry;
+    while ((entry = &aggregation->slots[slot])->symbol != NULL) {
+        if (entry->symbol == symbol && entry->so_object == so_object)
+            break;
+        slot = (slot + 1) & mask;
+    }
+
+    if (!entry->symbol) {
+        entry->symbol = symbol;
+        entry->so_object = so_object;
+        aggregation->count++;
+    }
+    entry->samples += samples;
+    entry->period += period;
+    entry->weight += weight;
+    aggregation->total_samples += samples;
+    aggregation->total_period += period;
+    aggregation->total_weight += weight;
+    return 0;
+}
+
+
+const struct symbol_aggregate *
+symbol_aggregation_find(const struct symbol_aggregation * aggregation,
+                        const char * symbol, const char * so_object)
+{
+    size_t mask = aggregation->capacity - 1;
+    size_t slot = mix_pointers(symbol, so_object) & mask;
+    const struct symbol_aggregate * entry;
+    while ((entry = &aggregation->slots[slot])->symbol != NULL) {
+        if (entry->symbol == symbol && entry->so_object == so_object)
+            return entry;
+        slot = (slot + 1) & mask;
+    }
+    return NULL;
+}
+
+
+void
+symbol_aggregation_for_each(const struct symbol_aggregation * aggregation,
+                            void (*callback)(void * callback_arg,
+                                             const struct symbol_aggregate *),
+                            void * callback_arg)
+{
+    size_t i;
+    for (i = 0; i < aggregation->capacity; i++)
+        if (aggregation->slots[i].symbol)
+            callback(callback_arg, &aggregation->slots[i]);
+}
+
+
+size_t
+symbol_aggregation_count(const struct symbol_aggregation * aggregation)
+{
+    return aggregation->count;
+}
+
+
+unsigned long long
+symbol_aggregation_total_samples(const struct symbol_aggregation * aggregation)
+{
+    return aggregation->total_samples;
+}
+
+
+unsigned long long
+symbol_aggregation_total_period(const struct symbol_aggregation * aggregation)
+{
+    return aggregation->total_period;
+}
+
+
+double
+symbol_aggregation_total_weight(const struct symbol_aggregation * aggregation)
+{
+    return aggregation->total_weight;
+}
+
+
+/* A min-heap of the "k" heaviest aggregates seen so far, so that the top-K
+ * costs O(n log k) and not a sort of the whole table */
+static void
+sift_down_min_heap(struct symbol_aggregate * heap, size_t n, size_t i)
+{
+    for (;;) {
+        size_t smallest = i;
+        size_t left = 2 * i + 1, right = 2 * i + 2;
+        if (left < n && heap[left].weight < heap[smallest].weight)
+            smallest = left;
+        if (right < n && heap[right].weight < heap[smallest].weight)
+            smallest = right;
+        if (smallest == i)
+            return;
+        struct symbol_aggregate tmp = heap[i];
+        heap[i] = heap[smallest];
+        heap[smallest] = tmp;
+        i = smallest;
+    }
+}
+
+
+static int
+compare_aggregates_by_weight(const void * a, const void * b)
+{
+    const struct symbol_aggregate * aa = a;
+    const struct symbol_aggregate * ab = b;
+    if (aa->weight != ab->weight)
+        return aa->weight > ab->weight ? -1 : 1;
+    return 0;
+}
+
+
+size_t
+symbol_aggregation_top(const struct symbol_aggregation * aggregation,
+                       size_t k, struct symbol_aggregate * out_top)
+{
+    size_t n = 0;
+    size_t i;
+
+    if (k == 0)
+        return 0;
+
+    for (i = 0; i < aggregation->capacity; i++) {
+        const struct symbol_aggregate * entry = &aggregation->slots[i];
+        if (!entry->symbol)
+            continue;
+
+        if (n < k) {
+            out_top[n++] = *entry;
+            if (n == k) {
+                /* heapify */
+                size_t j = k / 2;
+                while (j-- > 0)
+                    sift_down_min_heap(out_top, k, j);
+            }
+        } else if (entry->weight > out_top[0].weight) {
+            out_top[0] = *entry;
+            sift_down_min_heap(out_top, k, 0);
+        }
+    }
+
+    qsort(out_top, n, sizeof *out_top, compare_aggregates_by_weight);
+    return n;
+}
+
+
+void
+symbol_aggregation_reset(struct symbol_aggregation * aggregation)
+{
+    memset(aggregation->slots, 0,
+           aggregation->capacity * sizeof *aggregation->slots);
+    aggregation->count = 0;
+    aggregation->total_samples = 0;
+    aggregation->total_period = 0;
+    aggregation->total_weight = 0;
+}
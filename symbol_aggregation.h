@@ -0,0 +1,112 @@
+
+/* The in-process aggregation of the samples per (symbol, DSO), for a flush
+ * window, so that only the top-K symbols are sent to New Relic, sorted and in
+ * one batch at the end of the window, instead of one New Relic call per line
+ * of "perf report" or per sample.
+ *
+ * The table is an open-addressing hash table (with linear probing) keyed by
+ * the pointers of the (symbol, DSO) strings, which must be interned: either
+ * by the symbol_resolver of the native sampler, or by
+ * symbol_aggregation_intern() for the strings parsed from "perf report".
+ */
+
+#ifndef SYMBOL_AGGREGATION_H_
+#define SYMBOL_AGGREGATION_H_
+
+#include <stddef.h>
+
+
+/* The aggregate of one (symbol, DSO) */
+struct symbol_aggregate {
+    const char *       symbol;
+    const char *       so_object;
+    unsigned long long samples;    /* number of samples */
+    unsigned long long period;     /* sum of the periods of the samples */
+    double             weight;     /* the sort key: periods, or percentages */
+};
+
+
+struct symbol_aggregation;
+struct arena;
+
+
+struct symbol_aggregation *
+symbol_aggregation_new(void);
+
+
+/* A new aggregation whose tables and interned strings are all allocated
+ * from "arena", for the temporary aggregations of a flush window: it lives
+ * till the arena is reset (symbol_aggregation_free() does nothing to it) */
+struct symbol_aggregation *
+symbol_aggregation_new_in_arena(struct arena * arena);
+
+
+void
+symbol_aggregation_free(struct symbol_aggregation * aggregation);
+
+
+/* Return the interned copy of the "len" chars of "str", which lives till
+ * symbol_aggregation_free() (it survives symbol_aggregation_reset()), or
+ * till the reset of the arena of the aggregation.
+ * Returns NULL if it could't allocate memory. */
+const char *
+symbol_aggregation_intern(struct symbol_aggregation * aggregation,
+                          const char * str, size_t len);
+
+
+/* Add "samples", "period" and "weight" to the aggregate of the interned
+ * (symbol, so_object). Returns 0, or -1 if it couldn't allocate memory. */
+int
+symbol_aggregation_add(struct symbol_aggregation * aggregation,
+                       const char * symbol, const char * so_object,
+                       unsigned long long samples, unsigned long long period,
+                       double weight);
+
+
+/* The aggregate of the interned (symbol, so_object), or NULL if it is not in
+ * the table */
+const struct symbol_aggregate *
+symbol_aggregation_find(const struct symbol_aggregation * aggregation,
+                        const char * symbol, const char * so_object);
+
+
+/* Call "callback" for each aggregate in the table, in no particular order */
+void
+symbol_aggregation_for_each(const struct symbol_aggregation * aggregation,
+                            void (*callback)(void * callback_arg,
+                                             const struct symbol_aggregate *),
+                            void * callback_arg);
+
+
+/* The number of distinct (symbol, DSO) in the table, and the sums of the
+ * samples, periods and weights of all of them */
+size_t
+symbol_aggregation_count(const struct symbol_aggregation * aggregation);
+
+
+unsigned long long
+symbol_aggregation_total_samples(const struct symbol_aggregation * aggregation);
+
+
+unsigned long long
+symbol_aggregation_total_period(const struct symbol_aggregation * aggregation);
+
+
+double
+symbol_aggregation_total_weight(const struct symbol_aggregation * aggregation);
+
+
+/* Write into out_top[] the (at most) "k" aggregates of highest weight, sorted
+ * by decreasing weight. Returns how many were written. */
+size_t
+symbol_aggregation_top(const struct symbol_aggregation * aggregation,
+                       size_t k, struct symbol_aggregate * out_top);
+
+
+/* Empty the table at the end of a flush window (the interned strings are
+ * kept, for they are probably seen again in the next window) */
+void
+symbol_aggregation_reset(struct symbol_aggregation * aggregation);
+
+
+#endif  /* SYMBOL_AGGREGATION_H_ */
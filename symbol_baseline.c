@@ -0,0 +1,472 @@
+/* The rolling baseline of the profile: see "symbol_baseline.h".
+ *
+ * The names are interned in a symbol_aggregation of the baseline (used only
+ * for its table of interned strings), so that the entries are keyed by the
+ * pointers of their (symbol, DSO), and by the index of their group. The
+ * table of the entries is an open-addressing hash table with linear probing,
+ * as the aggregations are. When it is full, it is compacted: it is rebuilt,
+ * with the interned names, from the entries whose share is still worth
+ * comparing to.
+ *
+ * The EWMA of the variance is the one of "Incremental calculation of
+ * weighted mean and variance" (T. Finch, 2009):
+ *
+ *     diff = share - mean
+ *     mean = mean + alpha * diff
+ *     variance = (1 - alpha) * (variance + alpha * diff^2)
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "symbol_baseline.h"
+
+
+#define INITIAL_BASELINE_CAPACITY  1024
+#define MAX_BASELINE_GROUPS        1024
+
+/* the entries whose mean share fell below this are dropped by a compaction:
+ * they couldn't be a regression of more than a tiny "min_delta" anyway */
+#define PRUNED_SHARE               1e-4
+
+struct baseline_entry {
+    const char * symbol;          /* interned; NULL: empty slot */
+    const char * so_object;
+    unsigned int group;           /* the index in the groups */
+    unsigned int last_update;     /* the last update which saw the symbol */
+    double       mean;            /* the EWMA of the share */
+    double       variance;
+};
+
+struct baseline_group {
+    const char * name;            /* interned */
+    unsigned int windows;
+};
+
+struct symbol_baseline {
+    struct baseline_entry *     entries;
+    size_t                      capacity;
+    size_t                      count;
+    size_t                      max_entries;
+    struct baseline_group *     groups;        /* MAX_BASELINE_GROUPS */
+    unsigned int                n_groups;
+    struct symbol_aggregation * names;
+    double                      alpha;
+    unsigned int                warmup_windows;
+    unsigned int                updates;
+};
+
+
+static inline uint64_t
+mix_entry_key(const char * symbol, const char * so_object, unsigned int group)
+{
+    /* the finalizer of MurmurHash3, as in the aggregations */
+    uint64_t h = (uint64_t)(uintptr_t)symbol * 0x9e3779b97f4a7c15ULL ^
+                 (uint64_t)(uintptr_t)so_object ^
+                 (uint64_t)group * 0xc2b2ae3d27d4eb4fULL;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+
+struct symbol_baseline *
+symbol_baseline_new(double alpha, unsigned int warmup_windows,
+                    size_t max_entries)
+{
+    if (alpha <= 0 || alpha > 1 || max_entries == 0)
+        return NULL;
+
+    struct symbol_baseline * baseline = calloc(1, sizeof *baseline);
+    if (!baseline)
+        return NULL;
+    baseline->entries = calloc(INITIAL_BASELINE_CAPACITY,
+                               sizeof *baseline->entries);
+    baseline->groups = calloc(MAX_BASELINE_GROUPS, sizeof *baseline->groups);
+    baseline->names = symbol_aggregation_new();
+    if (!baseline->entries || !baseline->groups || !baseline->names) {
+        symbol_baseline_free(baseline);
+        return NULL;
+    }
+    baseline->capacity = INITIAL_BASELINE_CAPACITY;
+    baseline->max_entries = max_entries;
+    baseline->alpha = alpha;
+    baseline->warmup_windows = warmup_windows;
+    return baseline;
+}
+
+
+void
+symbol_baseline_free(struct symbol_baseline * baseline)
+{
+    if (!baseline)
+        return;
+    free(baseline->entries);
+    free(baseline->groups);
+    symbol_aggregation_free(baseline->names);
+    free(baseline);
+}
+
+
+static void
+insert_entry(struct baseline_entry * table, size_t capacity,
+             const struct baseline_entry * entry)
+{
+    size_t mask = capacity - 1;
+    size_t slot = mix_entry_key(entry->symbol, entry->so_object,
+                                entry->group) & mask;
+    while (table[slot].symbol)
+        slot = (slot + 1) & mask;
+    table[slot] = *entry;
+}
+
+
+static int
+grow_entry_table(struct symbol_baseline * baseline)
+{
+    size_t new_capacity = 2 * baseline->capacity;
+    struct baseline_entry * new_table = calloc(new_capacity,
+                                               sizeof *new_table);
+    if (!new_table)
+        return -1;
+
+    size_t i;
+    for (i = 0; i < baseline->capacity; i++)
+        if (baseline->entries[i].symbol)
+            insert_entry(new_table, new_capacity, &baseline->entries[i]);
+
+    free(baseline->entries);
+    baseline->entries = new_table;
+    baseline->capacity = new_capacity;
+    return 0;
+}
+
+
+/* Rebuild the baseline from the entries whose share didn't decay below
+ * PRUNED_SHARE, re-interning their names (and only the groups which still
+ * have entries) so that the strings of the dropped ones are released too */
+static int
+compact_baseline(struct symbol_baseline * baseline)
+{
+    struct symbol_aggregation * names = symbol_aggregation_new();
+    struct baseline_entry * entries = calloc(baseline->capacity,
+                                             sizeof *entries);
+    struct baseline_group * groups = calloc(MAX_BASELINE_GROUPS,
+                                            sizeof *groups);
+    unsigned int * group_map = malloc(MAX_BASELINE_GROUPS *
+                                      sizeof *group_map);
+    if (!names || !entries || !groups || !group_map)
+        goto failed;
+
+    unsigned int g, n_groups = 0;
+    for (g = 0; g < MAX_BASELINE_GROUPS; g++)
+        group_map[g] = MAX_BASELINE_GROUPS;   /* no entry kept */
+
+    size_t i, count = 0;
+    for (i = 0; i < baseline->capacity; i++) {
+        struct baseline_entry entry = baseline->entries[i];
+        if (!entry.symbol || entry.mean < PRUNED_SHARE)
+            continue;
+
+        if (group_map[entry.group] == MAX_BASELINE_GROUPS) {
+            const struct baseline_group * old_group =
+                                           &baseline->groups[entry.group];
+            groups[n_groups].name = symbol_aggregation_intern(names,
+                                                   old_group->name,
+                                                   strlen(old_group->name));
+            groups[n_groups].windows = old_group->windows;
+            if (!groups[n_groups].name)
+                goto failed;
+            group_map[entry.group] = n_groups++;
+        }
+        entry.group = group_map[entry.group];
+        entry.symbol = symbol_aggregation_intern(names, entry.symbol,
+                                                 strlen(entry.symbol));
+        entry.so_object = symbol_aggregation_intern(names, entry.so_object,
+                                                    strlen(entry.so_object));
+        if (!entry.symbol || !entry.so_object)
+            goto failed;
+        insert_entry(entries, baseline->capacity, &entry);
+        count++;
+    }
+
+    symbol_aggregation_free(baseline->names);
+    free(baseline->entries);
+    free(baseline->groups);
+    free(group_map);
+    baseline->names = names;
+    baseline->entries = entries;
+    baseline->groups = groups;
+    baseline->n_groups = n_groups;
+    baseline->count = count;
+    return 0;
+
+failed:
+    symbol_aggregation_free(names);
+    free(entries);
+    free(groups);
+    free(group_map);
+    return -1;
+}
+
+
+static struct baseline_group *
+find_group(const struct symbol_baseline * baseline, const char * interned)
+{
+    unsigned int g;
+    for (g = 0; g < baseline->n_groups; g++)
+        if (baseline->groups[g].name == interned)
+            return &baseline->groups[g];
+    return NULL;
+}
+
+
+/* The entry of the interned (symbol, so_object) of the group, added with a
+ * zero share if it is new (*out_is_new), or NULL if it is new and the table
+ * is full: then only the symbols already in it are compared */
+static struct baseline_entry *
+find_or_add_entry(struct symbol_baseline * baseline, const char * symbol,
+                  const char * so_object, unsigned int group,
+                  int * out_is_new)
+{
+    *out_is_new = 0;
+    size_t mask = baseline->capacity - 1;
+    size_t slot = mix_entry_key(symbol, so_object, group) & mask;
+    struct baseline_entry * entry;
+    while ((entry = &baseline->entries[slot])->symbol) {
+        if (entry->symbol == symbol && entry->so_object == so_object &&
+            entry->group == group)
+            return entry;
+        slot = (slot + 1) & mask;
+    }
+
+    if (baseline->count >= baseline->max_entries)
+        return NULL;
+    if (2 * (baseline->count + 1) > baseline->capacity) {
+        if (grow_entry_table(baseline) == 0) {
+            mask = baseline->capacity - 1;
+            slot = mix_entry_key(symbol, so_object, group) & mask;
+            while ((entry = &baseline->entries[slot])->symbol)
+                slot = (slot + 1) & mask;
+        } else if (baseline->count + 1 >= baseline->capacity) {
+            return NULL;   /* completely full: can't grow it */
+        }
+    }
+    entry->symbol = symbol;
+    entry->so_object = so_object;
+    entry->group = group;
+    baseline->count++;
+    *out_is_new = 1;
+    return entry;
+}
+
+
+static inline void
+fold_share(struct baseline_entry * entry, double share, double alpha)
+{
+    double diff = share - entry->mean;
+    entry->mean += alpha * diff;
+    entry->variance = (1 - alpha) * (entry->variance + alpha * diff * diff);
+}
+
+
+/* A min-heap of the "max" largest deltas seen so far, as in the top-K of the
+ * aggregations */
+static void
+sift_down_regressions(struct symbol_regression * heap, size_t n, size_t i)
+{
+    for (;;) {
+        size_t smallest = i;
+        size_t left = 2 * i + 1, right = 2 * i + 2;
+        if (left < n && heap[left].delta < heap[smallest].delta)
+            smallest = left;
+        if (right < n && heap[right].delta < heap[smallest].delta)
+            smallest = right;
+        if (smallest == i)
+            return;
+        struct symbol_regression tmp = heap[i];
+        heap[i] = heap[smallest];
+        heap[smallest] = tmp;
+        i = smallest;
+    }
+}
+
+
+static void
+add_regression(struct symbol_regression * heap, size_t max, size_t * n,
+               const struct symbol_regression * regression)
+{
+    if (*n < max) {
+        /* sift up */
+        size_t i = (*n)++;
+        heap[i] = *regression;
+        while (i > 0 && heap[(i - 1) / 2].delta > heap[i].delta) {
+            struct symbol_regression tmp = heap[i];
+            heap[i] = heap[(i - 1) / 2];
+            heap[(i - 1) / 2] = tmp;
+            i = (i - 1) / 2;
+        }
+    } else if (max > 0 && regression->delta > heap[0].delta) {
+        heap[0] = *regression;
+        sift_down_regressions(heap, max, 0);
+    }
+}
+
+
+static int
+compare_regressions_by_delta(const void * a, const void * b)
+{
+    const struct symbol_regression * ra = a;
+    const struct symbol_regression * rb = b;
+    if (ra->delta != rb->delta)
+        return ra->delta > rb->delta ? -1 : 1;
+    return 0;
+}
+
+
+/* The state of symbol_baseline_update() over the aggregates of a window */
+struct update_state {
+    struct symbol_baseline *   baseline;
+    unsigned int               group;
+    int                        first_window;
+    int                        compare;
+    double                     total_weight;
+    double                     min_delta;
+    double                     min_z_squared;
+    struct symbol_regression * regressions;
+    size_t                     max_regressions;
+    size_t                     n_regressions;
+    int                        failed;
+};
+
+
+static void
+update_entry(void * callback_arg, const struct symbol_aggregate * aggregate)
+{
+    struct update_state * state = callback_arg;
+    struct symbol_baseline * baseline = state->baseline;
+    double share = aggregate->weight / state->total_weight;
+
+    const char * symbol = symbol_aggregation_intern(baseline->names,
+                                                    aggregate->symbol,
+                                                    strlen(aggregate->symbol));
+    const char * so_object = symbol_aggregation_intern(baseline->names,
+                                                 aggregate->so_object,
+                                                 strlen(aggregate->so_object));
+    if (!symbol || !so_object) {
+        state->failed = 1;
+        return;
+    }
+    int is_new;
+    struct baseline_entry * entry = find_or_add_entry(baseline, symbol,
+                                                      so_object, state->group,
+                                                      &is_new);
+    if (!entry)
+        return;
+    entry->last_update = baseline->updates;
+    if (is_new && state->first_window) {
+        entry->mean = share;   /* the baseline starts from the first window */
+        return;
+    }
+
+    double delta = share - entry->mean;
+    if (state->compare && delta >= state->min_delta &&
+        delta * delta >= state->min_z_squared * entry->variance) {
+        struct symbol_regression regression;
+        regression.symbol = symbol;
+        regression.so_object = so_object;
+        regression.share = share;
+        regression.baseline_share = entry->mean;
+        regression.delta = delta;
+        regression.z_score_squared = entry->variance > 0 ?
+                                     delta * delta / entry->variance : 0;
+        add_regression(state->regressions, state->max_regressions,
+                       &state->n_regressions, &regression);
+    }
+    fold_share(entry, share, baseline->alpha);
+}
+
+
+int
+symbol_baseline_update(struct symbol_baseline * baseline, const char * group,
+                       const struct symbol_aggregation * window,
+                       double total_weight, double min_delta, double min_z,
+                       struct symbol_regression * out_regressions,
+                       size_t max_regressions)
+{
+    if (total_weight <= 0)
+        return 0;
+
+    /* make room before the window, so that the names of the regressions
+     * stay valid till the next update */
+    if ((baseline->count + symbol_aggregation_count(window) >
+                                                   baseline->max_entries ||
+         baseline->n_groups == MAX_BASELINE_GROUPS) &&
+        compact_baseline(baseline) != 0)
+        return -1;
+
+    const char * group_name = symbol_aggregation_intern(baseline->names, group,
+                                                        strlen(group));
+    if (!group_name)
+        return -1;
+    struct baseline_group * baseline_group = find_group(baseline, group_name);
+    if (!baseline_group) {
+        if (baseline->n_groups == MAX_BASELINE_GROUPS)
+            return 0;   /* too many groups: this one is not compared */
+        baseline_group = &baseline->groups[baseline->n_groups++];
+        baseline_group->name = group_name;
+        baseline_group->windows = 0;
+    }
+
+    struct update_state state;
+    memset(&state, 0, sizeof state);
+    state.baseline = baseline;
+    state.group = (unsigned int)(baseline_group - baseline->groups);
+    state.first_window = baseline_group->windows == 0;
+    state.compare = baseline_group->windows >= baseline->warmup_windows;
+    state.total_weight = total_weight;
+    state.min_delta = min_delta;
+    state.min_z_squared = min_z * min_z;
+    state.regressions = out_regressions;
+    state.max_regressions = max_regressions;
+
+    baseline->updates++;
+    symbol_aggregation_for_each(window, update_entry, &state);
+
+    /* the symbols of the group which were not in the window decay */
+    size_t i;
+    for (i = 0; i < baseline->capacity; i++) {
+        struct baseline_entry * entry = &baseline->entries[i];
+        if (entry->symbol && entry->group == state.group &&
+            entry->last_update != baseline->updates)
+            fold_share(entry, 0, baseline->alpha);
+    }
+    baseline_group->windows++;
+
+    qsort(out_regressions, state.n_regressions, sizeof *out_regressions,
+          compare_regressions_by_delta);
+    return state.failed ? -1 : (int)state.n_regressions;
+}
+
+
+unsigned int
+symbol_baseline_windows(const struct symbol_baseline * baseline,
+                        const char * group)
+{
+    unsigned int g;
+    for (g = 0; g < baseline->n_groups; g++)
+        if (strcmp(baseline->groups[g].name, group) == 0)
+            return baseline->groups[g].windows;
+    return 0;
+}
+
+
+size_t
+symbol_baseline_count(const struct symbol_baseline * baseline)
+{
+    return baseline->count;
+}
@@ -0,0 +1,94 @@
+
+/* The rolling baseline of the profile, for the differential profiling: the
+ * share of the samples of each (symbol, DSO) in the windows so far, decayed
+ * with an exponentially weighted moving average (EWMA), with its variance,
+ * so that a window is compared to the baseline and only the symbols whose
+ * share grew significantly are reported ("regressed"): eg., after a deploy,
+ * the functions which got slower, and not the steady ones.
+ *
+ * The shares (the weight of a symbol over the total weight of the window)
+ * and not the samples are compared, so that a window which is busier or
+ * idler than the baseline doesn't look like a regression of all of its
+ * symbols. A baseline is kept per group (the "process/<comm>" or the
+ * "container/<id>" of the daemon mode, or "" for the program profiled), and
+ * it is not compared to before it has seen a few windows ("warm-up").
+ *
+ * The baseline keeps its own copies of the names, and is keyed by them, not
+ * by the pointers of the aggregation of the window, so that the symbols of a
+ * DSO which was unloaded and loaded again are the same. Its size is bound:
+ * when the table is full, the entries whose share decayed to almost nothing
+ * are dropped.
+ */
+
+#ifndef SYMBOL_BASELINE_H_
+#define SYMBOL_BASELINE_H_
+
+#include <stddef.h>
+
+#include "symbol_aggregation.h"
+
+
+#define SYMBOL_BASELINE_DEFAULT_ALPHA         0.1   /* EWMA, per window */
+#define SYMBOL_BASELINE_DEFAULT_WARMUP        5     /* windows */
+#define SYMBOL_BASELINE_DEFAULT_MAX_ENTRIES   65536
+
+
+struct symbol_baseline;
+
+
+/* A regressed symbol of a window: its names are the copies of the baseline,
+ * which live till the next symbol_baseline_update() */
+struct symbol_regression {
+    const char * symbol;
+    const char * so_object;
+    double       share;            /* in the window, in [0, 1] */
+    double       baseline_share;   /* the EWMA before the window */
+    double       delta;            /* share - baseline_share */
+    double       z_score_squared;  /* delta^2 / the EWMA of the variance */
+};
+
+
+/* A new baseline, with the EWMA factor "alpha" in ]0, 1] (the weight of a
+ * new window), compared to only after "warmup_windows", and of at most
+ * "max_entries" (group, symbol, DSO). Returns NULL if it couldn't allocate
+ * memory. */
+struct symbol_baseline *
+symbol_baseline_new(double alpha, unsigned int warmup_windows,
+                    size_t max_entries);
+
+
+void
+symbol_baseline_free(struct symbol_baseline * baseline);
+
+
+/* Compare the aggregation of a window of "group" to the baseline of the
+ * group, as shares of "total_weight" (the weight of the whole window, which
+ * can be more than the one of the aggregation: eg., with the samples which
+ * were not symbolized), and write into out_regressions[] the (at most)
+ * "max_regressions" symbols whose share grew by at least "min_delta" (eg.,
+ * 0.01: by one point of percentage) and by at least "min_z" standard
+ * deviations of the baseline, sorted by decreasing delta; then fold the
+ * window into the baseline. The symbols which are new since the warm-up are regressions too
+ * if their share is at least "min_delta".
+ * Returns the number of regressions written (0 during the warm-up, or for
+ * an empty window), or -1 if it couldn't allocate memory. */
+int
+symbol_baseline_update(struct symbol_baseline * baseline, const char * group,
+                       const struct symbol_aggregation * window,
+                       double total_weight, double min_delta, double min_z,
+                       struct symbol_regression * out_regressions,
+                       size_t max_regressions);
+
+
+/* The number of windows of "group" folded into the baseline so far */
+unsigned int
+symbol_baseline_windows(const struct symbol_baseline * baseline,
+                        const char * group);
+
+
+/* The number of (group, symbol, DSO) in the baseline */
+size_t
+symbol_baseline_count(const struct symbol_baseline * baseline);
+
+
+#endif  /* SYMBOL_BASELINE_H_ */
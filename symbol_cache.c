@@ -0,0 +1,415 @@
+/* The on-disk cache of the symbol tables: see "symbol_cache.h".
+ *
+ * The layout of a cache file, whose sections are 8-byte aligned:
+ *
+ *     struct symbol_cache_header
+ *     uint64_t                   keys[n_symbols + 1]    (64-byte aligned)
+ *     struct symbol_cache_entry  symbols[n_symbols + 1]
+ *     uint32_t                   owners[n_owners]       (string offsets)
+ *     char                       strings[strings_size]  (NUL-terminated)
+ *
+ * Both keys[] (the start addresses, alone, so that a cache line has 8 of
+ * them) and symbols[] are in the Eytzinger order: they start at 1 (the root
+ * of the tree), and the children of the slot k are the slots 2k and 2k+1.
+ * The search descends keys[], and reads only the one symbol it finds.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "symbol_cache.h"
+
+
+#define SYMBOL_CACHE_VERSION  1
+
+static const char SYMBOL_CACHE_MAGIC[8] = { 'P', 'R', 'N', 'R', 'S', 'Y',
+                                            'M', '\0' };
+
+struct symbol_cache_header {
+    char     magic[8];
+    uint32_t version;
+    uint32_t word_size;          /* sizeof(void *) of the writer */
+    uint64_t n_symbols;
+    uint64_t n_owners;
+    uint64_t keys_offset;
+    uint64_t symbols_offset;
+    uint64_t owners_offset;
+    uint64_t strings_offset;
+    uint64_t strings_size;
+};
+
+struct symbol_cache_entry {
+    uint64_t start;
+    uint64_t end;
+    uint32_t name;               /* offset in strings[] */
+    uint32_t owner;
+};
+
+struct symbol_cache {
+    const unsigned char *             image;      /* the mmap'ed file */
+    size_t                            image_size;
+    const struct symbol_cache_header * header;
+    const struct symbol_cache_entry * symbols;
+    const uint64_t *                  keys;
+    const uint32_t *                  owners;
+    const char *                      strings;
+};
+
+
+static inline uint64_t
+align8(uint64_t offset)
+{
+    return (offset + 7) & ~(uint64_t)7;
+}
+
+
+static inline uint64_t
+align64(uint64_t offset)
+{
+    return (offset + 63) & ~(uint64_t)63;
+}
+
+
+/* The string table being written, with the names deduplicated (the aliases
+ * of a symbol, and the many symbols of a kernel module, share their names) */
+struct string_table_writer {
+    char *     data;
+    size_t     size;
+    size_t     capacity;
+    uint32_t * slots;            /* offset + 1; 0: empty slot */
+    size_t     n_slots;
+};
+
+
+static uint64_t
+hash_name(const char * str)
+{
+    /* FNV-1a */
+    uint64_t h = 14695981039346656037ULL;
+    while (*str) {
+        h ^= (unsigned char)*str++;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+
+/* The offset of "str" in the string table, which is added if not there yet.
+ * Returns -1 if it couldn't allocate memory. */
+static long long
+add_string(struct string_table_writer * table, const char * str)
+{
+    size_t mask = table->n_slots - 1;
+    size_t slot = hash_name(str) & mask;
+    while (table->slots[slot] != 0) {
+        uint32_t offset = table->slots[slot] - 1;
+        if (strcmp(table->data + offset, str) == 0)
+            return offset;
+        slot = (slot + 1) & mask;
+    }
+
+    size_t len = strlen(str) + 1;
+    if (table->size + len > UINT32_MAX - 1)
+        return -1;
+    if (table->size + len > table->capacity) {
+        size_t new_capacity = table->capacity ? 2 * table->capacity : 65536;
+        while (new_capacity < table->size + len)
+            new_capacity *= 2;
+        char * new_data = realloc(table->data, new_capacity);
+        if (!new_data)
+            return -1;
+        table->data = new_data;
+        table->capacity = new_capacity;
+    }
+    uint32_t offset = (uint32_t)table->size;
+    memcpy(table->data + offset, str, len);
+    table->size += len;
+    table->slots[slot] = offset + 1;
+    return offset;
+}
+
+
+/* Fill the Eytzinger arrays with an in-order walk of the implicit tree,
+ * which visits the slots in the order of the sorted symbols */
+static size_t
+build_eytzinger(const struct symbol_cache_entry * sorted, size_t n_symbols,
+                uint64_t * keys, struct symbol_cache_entry * symbols,
+                size_t next_symbol, size_t slot)
+{
+    if (slot > n_symbols)
+        return next_symbol;
+    next_symbol = build_eytzinger(sorted, n_symbols, keys, symbols,
+                                  next_symbol, 2 * slot);
+    keys[slot] = sorted[next_symbol].start;
+    symbols[slot] = sorted[next_symbol];
+    next_symbol++;
+    return build_eytzinger(sorted, n_symbols, keys, symbols, next_symbol,
+                           2 * slot + 1);
+}
+
+
+static int
+write_all(int fd, const void * data, size_t size)
+{
+    const char * p = data;
+    while (size > 0) {
+        ssize_t written = write(fd, p, size);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return -1;
+        p += written;
+        size -= (size_t)written;
+    }
+    return 0;
+}
+
+
+/* Write zeros from *offset up to the start of the next section */
+static int
+write_padding(int fd, uint64_t * offset, uint64_t section_offset)
+{
+    static const char zeros[64];
+    int ret = write_all(fd, zeros, (size_t)(section_offset - *offset));
+    *offset = section_offset;
+    return ret;
+}
+
+
+int
+symbol_cache_write(const char * fname,
+                   const struct symbol_cache_symbol * symbols,
+                   size_t n_symbols, const char * const * owners,
+                   unsigned int n_owners)
+{
+    if (n_symbols >= UINT32_MAX)
+        return -1;
+
+    int ret = -1;
+    int fd = -1;
+    char tmp_fname[4096];
+    snprintf(tmp_fname, sizeof tmp_fname, "%s.%d.tmp", fname, (int)getpid());
+
+    struct string_table_writer table;
+    memset(&table, 0, sizeof table);
+    table.n_slots = 1024;
+    while (table.n_slots < 2 * (n_symbols + n_owners))
+        table.n_slots *= 2;
+    table.slots = calloc(table.n_slots, sizeof *table.slots);
+    struct symbol_cache_entry * entries = malloc((n_symbols ? n_symbols : 1) *
+                                                 sizeof *entries);
+    uint64_t * keys = calloc(n_symbols + 1, sizeof *keys);
+    struct symbol_cache_entry * eytzinger = calloc(n_symbols + 1,
+                                                   sizeof *eytzinger);
+    uint32_t * owner_names = calloc(n_owners ? n_owners : 1,
+                                    sizeof *owner_names);
+    if (!table.slots || !entries || !keys || !eytzinger || !owner_names ||
+        add_string(&table, "") < 0)   /* never an empty string table */
+        goto end_symbol_cache_write;
+
+    size_t i;
+    for (i = 0; i < n_symbols; i++) {
+        long long name = add_string(&table, symbols[i].name);
+        if (name < 0)
+            goto end_symbol_cache_write;
+        entries[i].start = symbols[i].start;
+        entries[i].end = symbols[i].end;
+        entries[i].name = (uint32_t)name;
+        entries[i].owner = symbols[i].owner;
+    }
+    for (i = 1; i < n_owners; i++) {
+        long long name = add_string(&table, owners[i]);
+        if (name < 0)
+            goto end_symbol_cache_write;
+        owner_names[i] = (uint32_t)name;
+    }
+    build_eytzinger(entries, n_symbols, keys, eytzinger, 0, 1);
+
+    struct symbol_cache_header header;
+    memset(&header, 0, sizeof header);
+    memcpy(header.magic, SYMBOL_CACHE_MAGIC, sizeof header.magic);
+    header.version = SYMBOL_CACHE_VERSION;
+    header.word_size = sizeof(void *);
+    header.n_symbols = n_symbols;
+    header.n_owners = n_owners;
+    /* the children of the slot k 3 levels down, 8k to 8k+7, in one line */
+    header.keys_offset = align64(sizeof header);
+    header.symbols_offset = align8(header.keys_offset +
+                                   (n_symbols + 1) * sizeof *keys);
+    header.owners_offset = align8(header.symbols_offset +
+                                  (n_symbols + 1) * sizeof *eytzinger);
+    header.strings_offset = align8(header.owners_offset +
+                                   n_owners * sizeof *owner_names);
+    header.strings_size = table.size;
+
+    fd = open(tmp_fname, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0)
+        goto end_symbol_cache_write;
+
+    uint64_t offset = sizeof header;
+    if (write_all(fd, &header, sizeof header) != 0 ||
+        write_padding(fd, &offset, header.keys_offset) != 0 ||
+        write_all(fd, keys, (n_symbols + 1) * sizeof *keys) != 0)
+        goto end_symbol_cache_write;
+    offset += (n_symbols + 1) * sizeof *keys;
+    if (write_padding(fd, &offset, header.symbols_offset) != 0 ||
+        write_all(fd, eytzinger, (n_symbols + 1) * sizeof *eytzinger) != 0)
+        goto end_symbol_cache_write;
+    offset += (n_symbols + 1) * sizeof *eytzinger;
+    if (write_padding(fd, &offset, header.owners_offset) != 0 ||
+        write_all(fd, owner_names, n_owners * sizeof *owner_names) != 0)
+        goto end_symbol_cache_write;
+    offset += n_owners * sizeof *owner_names;
+    if (write_padding(fd, &offset, header.strings_offset) != 0 ||
+        write_all(fd, table.data, table.size) != 0)
+        goto end_symbol_cache_write;
+
+    if (close(fd) == 0 && rename(tmp_fname, fname) == 0)
+        ret = 0;
+    fd = -1;
+
+end_symbol_cache_write:
+    if (fd >= 0)
+        close(fd);
+    if (ret != 0)
+        unlink(tmp_fname);
+    free(table.slots);
+    free(table.data);
+    free(entries);
+    free(keys);
+    free(eytzinger);
+    free(owner_names);
+    return ret;
+}
+
+
+struct symbol_cache *
+symbol_cache_open(const char * fname)
+{
+    int fd = open(fname, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 ||
+        st.st_size < (off_t)sizeof(struct symbol_cache_header)) {
+        close(fd);
+        return NULL;
+    }
+    size_t image_size = (size_t)st.st_size;
+    const unsigned char * image = mmap(NULL, image_size, PROT_READ,
+                                       MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED)
+        return NULL;
+
+    /* check that all the sections are inside the file, so that a corrupted
+     * (or truncated) file is rejected here and not at a lookup */
+    const struct symbol_cache_header * header =
+                                  (const struct symbol_cache_header *)image;
+    uint64_t n = header->n_symbols;
+    if (memcmp(header->magic, SYMBOL_CACHE_MAGIC, sizeof header->magic) != 0 ||
+        header->version != SYMBOL_CACHE_VERSION ||
+        header->word_size != sizeof(void *) ||
+        n >= UINT32_MAX || header->n_owners >= UINT32_MAX ||
+        header->keys_offset < sizeof *header ||
+        header->keys_offset + (n + 1) * sizeof(uint64_t) >
+                                                     header->symbols_offset ||
+        header->symbols_offset + (n + 1) * sizeof(struct symbol_cache_entry) >
+                                                     header->owners_offset ||
+        header->owners_offset + header->n_owners * sizeof(uint32_t) >
+                                                     header->strings_offset ||
+        header->strings_offset + header->strings_size != image_size ||
+        header->strings_size == 0 || image[image_size - 1] != '\0' ||
+        header->keys_offset % 64 != 0 ||
+        (header->symbols_offset | header->owners_offset) % 8 != 0) {
+        munmap((void *)image, image_size);
+        return NULL;
+    }
+
+    struct symbol_cache * cache = calloc(1, sizeof *cache);
+    if (!cache) {
+        munmap((void *)image, image_size);
+        return NULL;
+    }
+    cache->image = image;
+    cache->image_size = image_size;
+    cache->header = header;
+    cache->symbols = (const struct symbol_cache_entry *)
+                                           (image + header->symbols_offset);
+    cache->keys = (const uint64_t *)(image + header->keys_offset);
+    cache->owners = (const uint32_t *)(image + header->owners_offset);
+    cache->strings = (const char *)(image + header->strings_offset);
+    return cache;
+}
+
+
+void
+symbol_cache_close(struct symbol_cache * cache)
+{
+    if (!cache)
+        return;
+    munmap((void *)cache->image, cache->image_size);
+    free(cache);
+}
+
+
+size_t
+symbol_cache_count(const struct symbol_cache * cache)
+{
+    return (size_t)cache->header->n_symbols;
+}
+
+
+unsigned int
+symbol_cache_owner_count(const struct symbol_cache * cache)
+{
+    return (unsigned int)cache->header->n_owners;
+}
+
+
+const char *
+symbol_cache_owner_name(const struct symbol_cache * cache, unsigned int owner)
+{
+    if (owner == 0 || owner >= cache->header->n_owners ||
+        cache->owners[owner] >= cache->header->strings_size)
+        return NULL;
+    return cache->strings + cache->owners[owner];
+}
+
+
+int
+symbol_cache_lookup(const struct symbol_cache * cache, unsigned long long addr,
+                    const char ** out_name, unsigned int * out_owner)
+{
+    size_t n = (size_t)cache->header->n_symbols;
+
+    /* descend the tree, going right whenever the key is <= addr, till
+     * below a leaf, while prefetching the line of the descendants of k
+     * 3 levels below. The bits of k are the turns taken: removing its
+     * trailing zeros (the left turns after the last right turn) and that
+     * last right turn leaves the slot of the last start <= addr, or 0 if
+     * there is none */
+    size_t k = 1;
+    while (k <= n) {
+        __builtin_prefetch(cache->keys + 8 * k);
+        k = 2 * k + (cache->keys[k] <= addr);
+    }
+    k >>= __builtin_ffsll((long long)k);
+    if (k == 0)
+        return 0;
+    const struct symbol_cache_entry * entry = &cache->symbols[k];
+    if (addr >= entry->end || entry->name >= cache->header->strings_size)
+        return 0;
+
+    *out_name = cache->strings + entry->name;
+    *out_owner = entry->owner;
+    return 1;
+}
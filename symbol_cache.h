@@ -0,0 +1,85 @@
+
+/* A persistent, on-disk cache of the symbol tables of the resolver, so that
+ * the same binaries (libc, the kernel, the programs profiled again and
+ * again) are not symbolized from scratch in every run: without it, every
+ * run parses the ".symtab" of each DSO, or the ~100K lines of
+ * /proc/kallsyms, and interns and sorts all their symbols.
+ *
+ * A cache file has the symbol table of one DSO, and it is named by the
+ * build-id of that DSO (see symbol_resolver_set_cache_dir()), so that it is
+ * never used for another build of a binary with the same path. The file is
+ * used in place, mmap'ed: it has the symbols, and apart their start
+ * addresses, in an Eytzinger layout (the breadth-first order of a complete
+ * binary search tree), and their names in a string table. A search in it
+ * touches a few cache lines at the top of the tree, always the same ones,
+ * and prefetches the next ones, instead of the log2(N) scattered ones of a
+ * binary search on a sorted array.
+ *
+ * The files are written for the native byte order and word size only: the
+ * magic and the version in their header reject any other.
+ */
+
+#ifndef SYMBOL_CACHE_H_
+#define SYMBOL_CACHE_H_
+
+#include <stddef.h>
+
+
+/* A symbol to write into a cache file: the symbols must be sorted by start
+ * address, and "owner" is an index into the names of the owners (eg., the
+ * kernel modules, for kallsyms), or 0 for the DSO itself */
+struct symbol_cache_symbol {
+    unsigned long long start;
+    unsigned long long end;
+    const char *       name;
+    unsigned int       owner;
+};
+
+
+struct symbol_cache;
+
+
+/* Write the symbols into a cache file, atomically (into a temporary file
+ * which is renamed), so that another run which is reading it never sees it
+ * half written. "owners[0]" is not written (the DSO itself). Returns 0, or
+ * -1 on error. */
+int
+symbol_cache_write(const char * fname,
+                   const struct symbol_cache_symbol * symbols,
+                   size_t n_symbols, const char * const * owners,
+                   unsigned int n_owners);
+
+
+/* mmap a cache file, and check its header. Returns NULL if it doesn't exist
+ * or if it is not a valid cache file. */
+struct symbol_cache *
+symbol_cache_open(const char * fname);
+
+
+void
+symbol_cache_close(struct symbol_cache * cache);
+
+
+size_t
+symbol_cache_count(const struct symbol_cache * cache);
+
+
+/* The number of the owners in the file, and their names (the name of the
+ * owner 0 is NULL: the DSO itself) */
+unsigned int
+symbol_cache_owner_count(const struct symbol_cache * cache);
+
+
+const char *
+symbol_cache_owner_name(const struct symbol_cache * cache, unsigned int owner);
+
+
+/* Find the symbol which contains "addr". Returns 1 and sets *out_name
+ * (which points into the mmap'ed file, valid till symbol_cache_close()) and
+ * *out_owner, or returns 0 if no symbol contains it. */
+int
+symbol_cache_lookup(const struct symbol_cache * cache, unsigned long long addr,
+                    const char ** out_name, unsigned int * out_owner);
+
+
+#endif  /* SYMBOL_CACHE_H_ */
@@ -0,0 +1,1269 @@
+
+/* Resolution of instruction addresses into (symbol, DSO) pairs for the
+ * native perf_event_open() sampling engine.
+ *
+ * See "symbol_resolver.h" for the interface. The implementation is simple on
+ * purpose, and it is a small subset of what "perf report" does:
+ *
+ *    - user-space addresses are translated to an offset in the file mapped
+ *      at that address, and from the file offset to the virtual address
+ *      inside that ELF file using its PT_LOAD program headers; then this
+ *      virtual address is searched in the sorted table of the STT_FUNC
+ *      symbols of the ELF file (its ".symtab" if it wasn't stripped, or its
+ *      ".dynsym" otherwise). Only 64-bit ELF files are understood.
+ *
+ *    - kernel addresses are searched in the sorted table of /proc/kallsyms,
+ *      which also tells us the kernel module, if any, where it is.
+ *
+ * No DWARF, no debuginfo files and no C++ demangling.
+ *
+ * With a cache directory, the sorted tables are also written to an on-disk
+ * symbol_cache, and the next runs use the cached table in place (mmap'ed)
+ * instead of parsing the ELF file or /proc/kallsyms again.
+ */
+
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "string_pool.h"
+#include "symbol_cache.h"
+#include "symbol_resolver.h"
+
+
+static const char UNKNOWN_SYMBOL[] = "[unknown]";
+static const char KERNEL_DSO_NAME[] = "[kernel.kallsyms]";
+
+
+struct dso;
+
+struct symbol_entry {
+    unsigned long long start;
+    unsigned long long end;
+    const char *       name;
+    struct dso *       owner;    /* the kernel module for kallsyms entries */
+};
+
+struct elf_load_segment {
+    unsigned long long offset;
+    unsigned long long vaddr;
+    unsigned long long filesz;
+};
+
+struct dso {
+    const char *              path;         /* as given in the mmap record */
+    const char *              short_name;   /* basename, as "perf report" */
+    int                       symbols_loaded;
+    struct symbol_entry *     symbols;
+    size_t                    n_symbols;
+    struct elf_load_segment * segments;
+    size_t                    n_segments;
+    struct symbol_cache *     cache;        /* instead of symbols[] */
+    unsigned int              cache_owner;  /* while writing the cache */
+    struct dso *              next;         /* hash-chain */
+};
+
+struct mapping {
+    unsigned long long start;
+    unsigned long long end;
+    unsigned long long pgoff;
+    struct dso *       dso;
+};
+
+struct process_maps {
+    pid_t                 pid;
+    struct mapping *      maps;      /* sorted by start address */
+    size_t                n_maps;
+    size_t                capacity;
+    int                   exited;
+    char                  comm[16];  /* TASK_COMM_LEN, "" if not known */
+    const char *          cgroup;    /* interned, NULL if not read yet */
+    struct process_maps * next;      /* hash-chain */
+};
+
+
+/* The name of a thread, which can be another one than the name of its
+ * process (eg., after a prctl(PR_SET_NAME) or a pthread_setname_np()) */
+struct thread_comm {
+    pid_t                tid;
+    pid_t                pid;
+    int                  exited;
+    char                 comm[16];  /* "": the name of its process */
+    struct thread_comm * next;      /* hash-chain */
+};
+
+
+/* The paths of the cgroups, interned: there are few of them, but many
+ * processes in each one */
+struct cgroup_path {
+    const char *         path;
+    struct cgroup_path * next;       /* hash-chain */
+};
+
+
+#define DSO_HASH_BUCKETS      1024
+#define PROCESS_HASH_BUCKETS  4096
+#define CGROUP_HASH_BUCKETS   256
+#define THREAD_HASH_BUCKETS   4096
+
+struct symbol_resolver {
+    struct string_pool    strings;
+    struct dso *          dsos[DSO_HASH_BUCKETS];
+    struct process_maps * processes[PROCESS_HASH_BUCKETS];
+    struct cgroup_path *  cgroups[CGROUP_HASH_BUCKETS];
+    struct thread_comm *  threads[THREAD_HASH_BUCKETS];
+
+    /* the kernel: /proc/kallsyms */
+    int                   kallsyms_loaded;
+    struct symbol_entry * kernel_symbols;
+    size_t                n_kernel_symbols;
+    struct dso *          kernel_dso;
+
+    /* the on-disk cache of the symbol tables, if cache_dir is not NULL */
+    char *                cache_dir;
+    struct symbol_cache * kernel_cache;
+    struct dso **         kernel_cache_owners;   /* the modules, by index */
+    unsigned int          cache_hits;
+    unsigned int          cache_misses;
+};
+
+
+static unsigned long
+hash_string(const char * str)
+{
+    /* FNV-1a */
+    unsigned long h = 2166136261UL;
+    while (*str) {
+        h ^= (unsigned char)*str++;
+        h *= 16777619UL;
+    }
+    return h;
+}
+
+
+struct symbol_resolver *
+symbol_resolver_new(void)
+{
+    struct symbol_resolver * resolver = calloc(1, sizeof *resolver);
+    return resolver;
+}
+
+
+static void
+free_process_maps(struct process_maps * process)
+{
+    free(process->maps);
+    free(process);
+}
+
+
+void
+symbol_resolver_free(struct symbol_resolver * resolver)
+{
+    if (!resolver)
+        return;
+
+    int i;
+    for (i = 0; i < DSO_HASH_BUCKETS; i++) {
+        struct dso * dso = resolver->dsos[i];
+        while (dso) {
+            struct dso * next = dso->next;
+            free(dso->symbols);
+            free(dso->segments);
+            symbol_cache_close(dso->cache);
+            free(dso);
+            dso = next;
+        }
+    }
+    for (i = 0; i < PROCESS_HASH_BUCKETS; i++) {
+        struct process_maps * process = resolver->processes[i];
+        while (process) {
+            struct process_maps * next = process->next;
+            free_process_maps(process);
+            process = next;
+        }
+    }
+    for (i = 0; i < CGROUP_HASH_BUCKETS; i++) {
+        struct cgroup_path * cgroup = resolver->cgroups[i];
+        while (cgroup) {
+            struct cgroup_path * next = cgroup->next;
+            free(cgroup);
+            cgroup = next;
+        }
+    }
+    for (i = 0; i < THREAD_HASH_BUCKETS; i++) {
+        struct thread_comm * thread = resolver->threads[i];
+        while (thread) {
+            struct thread_comm * next = thread->next;
+            free(thread);
+            thread = next;
+        }
+    }
+    free(resolver->kernel_symbols);
+    symbol_cache_close(resolver->kernel_cache);
+    free(resolver->kernel_cache_owners);
+    free(resolver->cache_dir);
+    string_pool_free(&resolver->strings);
+    free(resolver);
+}
+
+
+static struct dso *
+find_or_add_dso(struct symbol_resolver * resolver, const char * path)
+{
+    unsigned long bucket = hash_string(path) % DSO_HASH_BUCKETS;
+    struct dso * dso;
+    for (dso = resolver->dsos[bucket]; dso; dso = dso->next)
+        if (strcmp(dso->path, path) == 0)
+            return dso;
+
+    dso = calloc(1, sizeof *dso);
+    if (!dso)
+        return NULL;
+    dso->path = string_pool_add(&resolver->strings, path, strlen(path));
+    if (!dso->path) {
+        free(dso);
+        return NULL;
+    }
+    const char * slash = strrchr(dso->path, '/');
+    dso->short_name = (slash && path[0] == '/') ? slash + 1 : dso->path;
+    dso->next = resolver->dsos[bucket];
+    resolver->dsos[bucket] = dso;
+    return dso;
+}
+
+
+static struct process_maps *
+find_process(struct symbol_resolver * resolver, pid_t pid, int create)
+{
+    unsigned long bucket = (unsigned long)pid % PROCESS_HASH_BUCKETS;
+    struct process_maps * process;
+    for (process = resolver->processes[bucket]; process;
+         process = process->next)
+        if (process->pid == pid) {
+            if (create && process->exited) {
+                /* the pid was reused by a new process */
+                process->exited = 0;
+                process->n_maps = 0;
+                process->comm[0] = '\0';
+                process->cgroup = NULL;
+            }
+            return process;
+        }
+
+    if (!create)
+        return NULL;
+
+    process = calloc(1, sizeof *process);
+    if (!process)
+        return NULL;
+    process->pid = pid;
+    process->next = resolver->processes[bucket];
+    resolver->processes[bucket] = process;
+    return process;
+}
+
+
+static int
+insert_mapping(struct process_maps * process, const struct mapping * new_map)
+{
+    /* Find the insertion point, keeping the array sorted by start address.
+     * A new mapping at the same start address replaces the previous one
+     * (eg., a munmap() + mmap() of another file at the same place) */
+    size_t lo = 0, hi = process->n_maps;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (process->maps[mid].start < new_map->start)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (lo < process->n_maps && process->maps[lo].start == new_map->start) {
+        process->maps[lo] = *new_map;
+        return 0;
+    }
+
+    if (process->n_maps == process->capacity) {
+        size_t new_capacity = process->capacity ? 2 * process->capacity : 32;
+        struct mapping * new_maps = realloc(process->maps,
+                                            new_capacity * sizeof *new_maps);
+        if (!new_maps)
+            return -1;
+        process->maps = new_maps;
+        process->capacity = new_capacity;
+    }
+
+    memmove(&process->maps[lo + 1], &process->maps[lo],
+            (process->n_maps - lo) * sizeof *process->maps);
+    process->maps[lo] = *new_map;
+    process->n_maps++;
+    return 0;
+}
+
+
+int
+symbol_resolver_add_mmap(struct symbol_resolver * resolver, pid_t pid,
+                         unsigned long long start, unsigned long long len,
+                         unsigned long long pgoff, const char * filename)
+{
+    struct process_maps * process = find_process(resolver, pid, 1);
+    if (!process)
+        return -1;
+
+    struct mapping new_map;
+    new_map.start = start;
+    new_map.end = start + len;
+    new_map.pgoff = pgoff;
+    new_map.dso = find_or_add_dso(resolver, filename);
+    if (!new_map.dso)
+        return -1;
+
+    return insert_mapping(process, &new_map);
+}
+
+
+int
+symbol_resolver_load_proc_maps(struct symbol_resolver * resolver, pid_t pid)
+{
+    char maps_fname[64];
+    snprintf(maps_fname, sizeof maps_fname, "/proc/%d/maps", (int)pid);
+
+    FILE * maps_file = fopen(maps_fname, "r");
+    if (!maps_file)
+        return -1;
+
+    /* Each line is in the format:
+     *   7f6e1c3b1000-7f6e1c3d3000 r-xp 00000000 fd:01 1234   /usr/lib/libc.so.6
+     */
+    char line[PATH_MAX + 128];
+    int count = 0;
+    while (fgets(line, sizeof line, maps_file)) {
+        unsigned long long start, end, pgoff;
+        char perms[8];
+        int name_offset = 0;
+        if (sscanf(line, "%llx-%llx %7s %llx %*s %*s %n",
+                   &start, &end, perms, &pgoff, &name_offset) < 4)
+            continue;
+        if (perms[2] != 'x' || name_offset == 0)
+            continue;   /* only executable mappings can have samples */
+
+        char * name = line + name_offset;
+        name[strcspn(name, "\n")] = '\0';
+        if (name[0] == '\0')
+            name = "//anon";
+
+        if (symbol_resolver_add_mmap(resolver, pid, start, end - start,
+                                     pgoff, name) == 0)
+            count++;
+    }
+
+    fclose(maps_file);
+
+    /* and its name, which would have come in a PERF_RECORD_COMM */
+    char comm_fname[64];
+    snprintf(comm_fname, sizeof comm_fname, "/proc/%d/comm", (int)pid);
+    FILE * comm_file = fopen(comm_fname, "r");
+    if (comm_file) {
+        char comm[32];
+        if (fgets(comm, sizeof comm, comm_file)) {
+            comm[strcspn(comm, "\n")] = '\0';
+            symbol_resolver_set_comm(resolver, pid, comm);
+        }
+        fclose(comm_file);
+    }
+    return count;
+}
+
+
+int
+symbol_resolver_fork(struct symbol_resolver * resolver, pid_t parent_pid,
+                     pid_t child_pid)
+{
+    if (parent_pid == child_pid)
+        return 0;   /* a new thread, which shares the address space */
+
+    struct process_maps * parent = find_process(resolver, parent_pid, 0);
+    if (!parent || parent->n_maps == 0)
+        return 0;
+
+    struct process_maps * child = find_process(resolver, child_pid, 1);
+    if (!child)
+        return -1;
+    memcpy(child->comm, parent->comm, sizeof child->comm);
+    child->cgroup = parent->cgroup;
+
+    struct mapping * maps = malloc(parent->n_maps * sizeof *maps);
+    if (!maps)
+        return -1;
+    memcpy(maps, parent->maps, parent->n_maps * sizeof *maps);
+    free(child->maps);
+    child->maps = maps;
+    child->n_maps = child->capacity = parent->n_maps;
+    return 0;
+}
+
+
+void
+symbol_resolver_exec(struct symbol_resolver * resolver, pid_t pid)
+{
+    struct process_maps * process = find_process(resolver, pid, 0);
+    if (process)
+        process->n_maps = 0;
+}
+
+
+int
+symbol_resolver_set_comm(struct symbol_resolver * resolver, pid_t pid,
+                         const char * comm)
+{
+    struct process_maps * process = find_process(resolver, pid, 1);
+    if (!process)
+        return -1;
+    strncpy(process->comm, comm, sizeof process->comm - 1);
+    process->comm[sizeof process->comm - 1] = '\0';
+    return 0;
+}
+
+
+int
+symbol_resolver_has_process(struct symbol_resolver * resolver, pid_t pid)
+{
+    return find_process(resolver, pid, 0) != NULL;
+}
+
+
+const char *
+symbol_resolver_comm(struct symbol_resolver * resolver, pid_t pid)
+{
+    struct process_maps * process = find_process(resolver, pid, 0);
+    if (!process || process->comm[0] == '\0')
+        return UNKNOWN_SYMBOL;
+    return process->comm;
+}
+
+
+static struct thread_comm *
+find_thread(struct symbol_resolver * resolver, pid_t tid, int create)
+{
+    unsigned long bucket = (unsigned long)tid % THREAD_HASH_BUCKETS;
+    struct thread_comm * thread;
+    for (thread = resolver->threads[bucket]; thread; thread = thread->next)
+        if (thread->tid == tid) {
+            if (create && thread->exited) {
+                /* the tid was reused by a new thread */
+                thread->exited = 0;
+                thread->comm[0] = '\0';
+            }
+            return thread;
+        }
+
+    if (!create)
+        return NULL;
+
+    thread = calloc(1, sizeof *thread);
+    if (!thread)
+        return NULL;
+    thread->tid = tid;
+    thread->next = resolver->threads[bucket];
+    resolver->threads[bucket] = thread;
+    return thread;
+}
+
+
+int
+symbol_resolver_set_thread_comm(struct symbol_resolver * resolver, pid_t pid,
+                                pid_t tid, const char * comm)
+{
+    if (tid == pid)
+        return symbol_resolver_set_comm(resolver, pid, comm);
+
+    struct thread_comm * thread = find_thread(resolver, tid, 1);
+    if (!thread)
+        return -1;
+    thread->pid = pid;
+    strncpy(thread->comm, comm, sizeof thread->comm - 1);
+    thread->comm[sizeof thread->comm - 1] = '\0';
+    return 0;
+}
+
+
+const char *
+symbol_resolver_thread_comm(struct symbol_resolver * resolver, pid_t pid,
+                            pid_t tid)
+{
+    if (tid == pid || tid <= 0)
+        return symbol_resolver_comm(resolver, pid);
+
+    struct thread_comm * thread = find_thread(resolver, tid, 0);
+    if (!thread || thread->pid != pid) {
+        /* a thread which was named before the sampling started: its name
+         * is read once, or left to the one of its process */
+        thread = find_thread(resolver, tid, 1);
+        if (!thread)
+            return symbol_resolver_comm(resolver, pid);
+        thread->pid = pid;
+        thread->comm[0] = '\0';
+
+        char comm_fname[64];
+        snprintf(comm_fname, sizeof comm_fname, "/proc/%d/task/%d/comm",
+                 (int)pid, (int)tid);
+        FILE * comm_file = fopen(comm_fname, "r");
+        if (comm_file) {
+            char comm[32];
+            if (fgets(comm, sizeof comm, comm_file)) {
+                comm[strcspn(comm, "\n")] = '\0';
+                strncpy(thread->comm, comm, sizeof thread->comm - 1);
+                thread->comm[sizeof thread->comm - 1] = '\0';
+            }
+            fclose(comm_file);
+        }
+    }
+    if (thread->comm[0] == '\0')
+        return symbol_resolver_comm(resolver, pid);
+    return thread->comm;
+}
+
+
+void
+symbol_resolver_thread_exit(struct symbol_resolver * resolver, pid_t tid)
+{
+    struct thread_comm * thread = find_thread(resolver, tid, 0);
+    if (thread)
+        thread->exited = 1;
+}
+
+
+static const char *
+intern_cgroup_path(struct symbol_resolver * resolver, const char * path)
+{
+    unsigned long bucket = hash_string(path) % CGROUP_HASH_BUCKETS;
+    struct cgroup_path * cgroup;
+    for (cgroup = resolver->cgroups[bucket]; cgroup; cgroup = cgroup->next)
+        if (strcmp(cgroup->path, path) == 0)
+            return cgroup->path;
+
+    cgroup = malloc(sizeof *cgroup);
+    if (!cgroup)
+        return NULL;
+    cgroup->path = string_pool_add(&resolver->strings, path, strlen(path));
+    if (!cgroup->path) {
+        free(cgroup);
+        return NULL;
+    }
+    cgroup->next = resolver->cgroups[bucket];
+    resolver->cgroups[bucket] = cgroup;
+    return cgroup->path;
+}
+
+
+/* The cgroup of a process, from /proc/<pid>/cgroup: the line "0::<path>" of
+ * the cgroups v2, or else the line of the "cpu" controller of the cgroups v1
+ * ("<id>:cpu,cpuacct:<path>") */
+static const char *
+read_proc_cgroup(struct symbol_resolver * resolver, pid_t pid)
+{
+    char cgroup_fname[64];
+    snprintf(cgroup_fname, sizeof cgroup_fname, "/proc/%d/cgroup", (int)pid);
+    FILE * cgroup_file = fopen(cgroup_fname, "r");
+    if (!cgroup_file)
+        return NULL;
+
+    char line[PATH_MAX + 64];
+    char path[PATH_MAX];
+    path[0] = '\0';
+    while (fgets(line, sizeof line, cgroup_file)) {
+        line[strcspn(line, "\n")] = '\0';
+        char * controllers = strchr(line, ':');
+        char * line_path = controllers ? strchr(controllers + 1, ':') : NULL;
+        if (!line_path)
+            continue;
+        *line_path++ = '\0';
+        controllers++;
+
+        int is_v2 = strcmp(line, "0") == 0 && controllers[0] == '\0';
+        int is_cpu = strstr(controllers, "cpu") != NULL;
+        if (is_v2 || is_cpu || path[0] == '\0') {
+            snprintf(path, sizeof path, "%s", line_path);
+            if (is_v2 || is_cpu)
+                break;
+        }
+    }
+    fclose(cgroup_file);
+
+    return path[0] ? intern_cgroup_path(resolver, path) : NULL;
+}
+
+
+const char *
+symbol_resolver_cgroup(struct symbol_resolver * resolver, pid_t pid)
+{
+    struct process_maps * process = find_process(resolver, pid, 0);
+    if (!process)
+        return "";
+    if (!process->cgroup && !process->exited)
+        process->cgroup = read_proc_cgroup(resolver, pid);
+    return process->cgroup ? process->cgroup : "";
+}
+
+
+void
+symbol_resolver_exit(struct symbol_resolver * resolver, pid_t pid)
+{
+    struct process_maps * process = find_process(resolver, pid, 0);
+    if (process)
+        process->exited = 1;
+}
+
+
+int
+symbol_resolver_forget_exited(struct symbol_resolver * resolver)
+{
+    int count = 0;
+    int i;
+    for (i = 0; i < PROCESS_HASH_BUCKETS; i++) {
+        struct process_maps ** link = &resolver->processes[i];
+        while (*link) {
+            struct process_maps * process = *link;
+            if (process->exited) {
+                *link = process->next;
+                free_process_maps(process);
+                count++;
+            } else {
+                link = &process->next;
+            }
+        }
+    }
+    for (i = 0; i < THREAD_HASH_BUCKETS; i++) {
+        struct thread_comm ** link = &resolver->threads[i];
+        while (*link) {
+            struct thread_comm * thread = *link;
+            if (thread->exited) {
+                *link = thread->next;
+                free(thread);
+            } else {
+                link = &thread->next;
+            }
+        }
+    }
+    return count;
+}
+
+
+static int
+compare_symbol_entries(const void * a, const void * b)
+{
+    const struct symbol_entry * sa = a;
+    const struct symbol_entry * sb = b;
+    if (sa->start < sb->start)
+        return -1;
+    return sa->start > sb->start;
+}
+
+
+/* Sort the symbols by address and set the end of the symbols whose size is
+ * unknown (st_size == 0, or kallsyms, which doesn't give sizes) to the start
+ * of the next symbol */
+static void
+sort_symbol_table(struct symbol_entry * symbols, size_t n_symbols,
+                  unsigned long long last_end)
+{
+    qsort(symbols, n_symbols, sizeof *symbols, compare_symbol_entries);
+
+    size_t i;
+    for (i = 0; i < n_symbols; i++) {
+        if (symbols[i].end > symbols[i].start)
+            continue;
+        if (i + 1 < n_symbols)
+            symbols[i].end = symbols[i + 1].start;
+        else
+            symbols[i].end = last_end;
+    }
+}
+
+
+static const struct symbol_entry *
+search_symbol_table(const struct symbol_entry * symbols, size_t n_symbols,
+                    unsigned long long addr)
+{
+    /* the last symbol whose start is <= addr */
+    size_t lo = 0, hi = n_symbols;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (symbols[mid].start <= addr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == 0)
+        return NULL;
+
+    const struct symbol_entry * candidate = &symbols[lo - 1];
+    if (addr >= candidate->end)
+        return NULL;
+    return candidate;
+}
+
+
+int
+symbol_resolver_set_cache_dir(struct symbol_resolver * resolver,
+                              const char * cache_dir)
+{
+    /* "mkdir -p" */
+    char path[PATH_MAX];
+    snprintf(path, sizeof path, "%s", cache_dir);
+    char * slash;
+    for (slash = strchr(path + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        if (mkdir(path, 0755) != 0 && errno != EEXIST)
+            return -1;
+        *slash = '/';
+    }
+    if (mkdir(path, 0755) != 0 && errno != EEXIST)
+        return -1;
+
+    free(resolver->cache_dir);
+    resolver->cache_dir = strdup(cache_dir);
+    return resolver->cache_dir ? 0 : -1;
+}
+
+
+void
+symbol_resolver_cache_stats(const struct symbol_resolver * resolver,
+                            unsigned int * out_hits, unsigned int * out_misses)
+{
+    *out_hits = resolver->cache_hits;
+    *out_misses = resolver->cache_misses;
+}
+
+
+/* Find the NT_GNU_BUILD_ID in a sequence of ELF notes, and write it in hex
+ * (as "perf buildid-list" shows it). Returns 1 if found, or 0. */
+static int
+find_build_id_note(const unsigned char * notes, size_t size, char * out_hex,
+                   size_t hex_size)
+{
+    size_t offset = 0;
+    while (offset + sizeof(Elf64_Nhdr) <= size) {
+        const Elf64_Nhdr * note = (const Elf64_Nhdr *)(notes + offset);
+        size_t name_offset = offset + sizeof *note;
+        size_t desc_offset = name_offset + ((note->n_namesz + 3) & ~3U);
+        size_t next_offset = desc_offset + ((note->n_descsz + 3) & ~3U);
+        if (next_offset > size || next_offset <= offset)
+            return 0;
+
+        if (note->n_type == NT_GNU_BUILD_ID && note->n_namesz == 4 &&
+            memcmp(notes + name_offset, "GNU", 4) == 0 &&
+            note->n_descsz > 0 && 2 * note->n_descsz < hex_size) {
+            Elf64_Word i;
+            for (i = 0; i < note->n_descsz; i++)
+                snprintf(out_hex + 2 * i, 3, "%02x",
+                         notes[desc_offset + i]);
+            return 1;
+        }
+        offset = next_offset;
+    }
+    return 0;
+}
+
+
+/* The name of the cache file of a mmap'ed ELF file: its build-id, from its
+ * PT_NOTE segments. Returns 1, or 0 if the cache can't be used for it. */
+static int
+elf_cache_fname(const struct symbol_resolver * resolver,
+                const unsigned char * image, size_t file_size,
+                char * out_fname, size_t fname_size)
+{
+    const Elf64_Ehdr * ehdr = (const Elf64_Ehdr *)image;
+    if (!resolver->cache_dir || ehdr->e_phoff == 0 ||
+        ehdr->e_phentsize != sizeof(Elf64_Phdr) ||
+        ehdr->e_phoff + (unsigned long long)ehdr->e_phnum *
+                                               sizeof(Elf64_Phdr) > file_size)
+        return 0;
+
+    const Elf64_Phdr * phdrs = (const Elf64_Phdr *)(image + ehdr->e_phoff);
+    char build_id[2 * 64 + 1];
+    int i;
+    for (i = 0; i < ehdr->e_phnum; i++) {
+        if (phdrs[i].p_type != PT_NOTE ||
+            phdrs[i].p_offset + phdrs[i].p_filesz > file_size)
+            continue;
+        if (find_build_id_note(image + phdrs[i].p_offset, phdrs[i].p_filesz,
+                               build_id, sizeof build_id)) {
+            snprintf(out_fname, fname_size, "%s/%s.sym", resolver->cache_dir,
+                     build_id);
+            return 1;
+        }
+    }
+    return 0;   /* no build-id: the file can't be told from another build */
+}
+
+
+/* Write a sorted symbol table into its cache file. The owners of the
+ * entries which are not "self" (the kernel modules) are numbered from 1. */
+static void
+write_symbol_cache(const char * cache_fname,
+                   const struct symbol_entry * symbols, size_t n_symbols,
+                   struct dso * self)
+{
+    struct symbol_cache_symbol * cached = malloc((n_symbols ? n_symbols : 1) *
+                                                 sizeof *cached);
+    const char ** owners = malloc(sizeof *owners);
+    unsigned int n_owners = 1;
+    if (!cached || !owners)
+        goto end_write_symbol_cache;
+    owners[0] = NULL;
+
+    size_t i;
+    for (i = 0; i < n_symbols; i++)
+        symbols[i].owner->cache_owner = 0;
+    for (i = 0; i < n_symbols; i++) {
+        struct dso * owner = symbols[i].owner;
+        if (owner != self && owner->cache_owner == 0) {
+            const char ** new_owners = realloc(owners, (n_owners + 1) *
+                                                       sizeof *owners);
+            if (!new_owners)
+                goto end_write_symbol_cache;
+            owners = new_owners;
+            owners[n_owners] = owner->path;
+            owner->cache_owner = n_owners++;
+        }
+        cached[i].start = symbols[i].start;
+        cached[i].end = symbols[i].end;
+        cached[i].name = symbols[i].name;
+        cached[i].owner = owner == self ? 0 : owner->cache_owner;
+    }
+    symbol_cache_write(cache_fname, cached, n_symbols, owners, n_owners);
+
+end_write_symbol_cache:
+    free(cached);
+    free(owners);
+}
+
+
+static void
+load_elf_symbols(struct symbol_resolver * resolver, struct dso * dso)
+{
+    dso->symbols_loaded = 1;
+
+    if (dso->path[0] != '/')
+        return;   /* "[vdso]", "[heap]", "//anon", etc */
+
+    int fd = open(dso->path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(Elf64_Ehdr)) {
+        close(fd);
+        return;
+    }
+
+    size_t file_size = (size_t)st.st_size;
+    const unsigned char * image = mmap(NULL, file_size, PROT_READ,
+                                       MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED)
+        return;
+
+    const Elf64_Ehdr * ehdr = (const Elf64_Ehdr *)image;
+    if (memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0 ||
+        ehdr->e_ident[EI_CLASS] != ELFCLASS64 ||
+        ehdr->e_shoff == 0 || ehdr->e_shentsize != sizeof(Elf64_Shdr) ||
+        ehdr->e_shoff + (unsigned long long)ehdr->e_shnum *
+                                                 sizeof(Elf64_Shdr) > file_size)
+        goto unmap_elf_image;
+
+    /* the PT_LOAD segments, to translate file offsets to virtual addresses */
+    if (ehdr->e_phoff != 0 && ehdr->e_phentsize == sizeof(Elf64_Phdr) &&
+        ehdr->e_phoff + (unsigned long long)ehdr->e_phnum *
+                                               sizeof(Elf64_Phdr) <= file_size) {
+        const Elf64_Phdr * phdrs = (const Elf64_Phdr *)(image + ehdr->e_phoff);
+        dso->segments = calloc(ehdr->e_phnum ? ehdr->e_phnum : 1,
+                               sizeof *dso->segments);
+        int i;
+        for (i = 0; dso->segments && i < ehdr->e_phnum; i++) {
+            if (phdrs[i].p_type != PT_LOAD)
+                continue;
+            struct elf_load_segment * seg = &dso->segments[dso->n_segments++];
+            seg->offset = phdrs[i].p_offset;
+            seg->vaddr = phdrs[i].p_vaddr;
+            seg->filesz = phdrs[i].p_filesz;
+        }
+    }
+
+    /* the table of this build of the file may be in the cache already */
+    char cache_fname[PATH_MAX];
+    int cacheable = elf_cache_fname(resolver, image, file_size, cache_fname,
+                                    sizeof cache_fname);
+    if (cacheable) {
+        dso->cache = symbol_cache_open(cache_fname);
+        if (dso->cache) {
+            resolver->cache_hits++;
+            goto unmap_elf_image;
+        }
+        resolver->cache_misses++;
+    }
+
+    /* prefer the full ".symtab", if the file wasn't stripped */
+    const Elf64_Shdr * shdrs = (const Elf64_Shdr *)(image + ehdr->e_shoff);
+    const Elf64_Shdr * symtab = NULL;
+    int i;
+    for (i = 0; i < ehdr->e_shnum; i++) {
+        if (shdrs[i].sh_type == SHT_SYMTAB) {
+            symtab = &shdrs[i];
+            break;
+        }
+        if (shdrs[i].sh_type == SHT_DYNSYM && !symtab)
+            symtab = &shdrs[i];
+    }
+    if (!symtab || symtab->sh_link >= ehdr->e_shnum ||
+        symtab->sh_offset + symtab->sh_size > file_size)
+        goto unmap_elf_image;
+
+    const Elf64_Shdr * strtab = &shdrs[symtab->sh_link];
+    if (strtab->sh_offset + strtab->sh_size > file_size)
+        goto unmap_elf_image;
+
+    const Elf64_Sym * syms = (const Elf64_Sym *)(image + symtab->sh_offset);
+    size_t n_syms = symtab->sh_size / sizeof(Elf64_Sym);
+    const char * strs = (const char *)(image + strtab->sh_offset);
+
+    dso->symbols = calloc(n_syms ? n_syms : 1, sizeof *dso->symbols);
+    if (!dso->symbols)
+        goto unmap_elf_image;
+
+    size_t j;
+    for (j = 0; j < n_syms; j++) {
+        int type = ELF64_ST_TYPE(syms[j].st_info);
+        if ((type != STT_FUNC && type != STT_GNU_IFUNC) ||
+            syms[j].st_shndx == SHN_UNDEF || syms[j].st_value == 0 ||
+            syms[j].st_name >= strtab->sh_size)
+            continue;
+
+        const char * name = strs + syms[j].st_name;
+        size_t name_len = strnlen(name, strtab->sh_size - syms[j].st_name);
+        struct symbol_entry * entry = &dso->symbols[dso->n_symbols];
+        entry->name = string_pool_add(&resolver->strings, name, name_len);
+        if (!entry->name)
+            break;
+        entry->start = syms[j].st_value;
+        entry->end = syms[j].st_value + syms[j].st_size;
+        entry->owner = dso;
+        dso->n_symbols++;
+    }
+
+    sort_symbol_table(dso->symbols, dso->n_symbols,
+                      dso->n_symbols ?
+                          dso->symbols[dso->n_symbols - 1].start + 1 : 0);
+    if (cacheable)
+        write_symbol_cache(cache_fname, dso->symbols, dso->n_symbols, dso);
+
+unmap_elf_image:
+    munmap((void *)image, file_size);
+}
+
+
+/* Read a small file of /proc or /sys whole (their sizes are not known
+ * before reading them). Returns its length, or -1. */
+static long
+read_small_file(const char * fname, unsigned char * buffer, size_t size)
+{
+    int fd = open(fname, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    size_t length = 0;
+    ssize_t n;
+    while (length < size &&
+           (n = read(fd, buffer + length, size - length)) > 0)
+        length += (size_t)n;
+    close(fd);
+    return (long)length;
+}
+
+
+/* The name of the cache file of the kernel symbols: the addresses in
+ * /proc/kallsyms are those of this kernel (its build-id, in
+ * /sys/kernel/notes), of this boot (it is relocated at every boot, with
+ * KASLR), and of the modules loaded now, so they are all in its name */
+static int
+kallsyms_cache_fname(const struct symbol_resolver * resolver,
+                     char * out_fname, size_t fname_size)
+{
+    if (!resolver->cache_dir)
+        return 0;
+
+    static unsigned char buffer[64 * 1024];
+    char build_id[2 * 64 + 1] = "none";
+    long length = read_small_file("/sys/kernel/notes", buffer, sizeof buffer);
+    if (length > 0)
+        find_build_id_note(buffer, (size_t)length, build_id, sizeof build_id);
+
+    /* FNV-1a of the boot id and of the list of modules */
+    unsigned long long h = 14695981039346656037ULL;
+    const char * const boot_files[] = { "/proc/sys/kernel/random/boot_id",
+                                        "/proc/modules" };
+    size_t f;
+    for (f = 0; f < sizeof boot_files / sizeof boot_files[0]; f++) {
+        length = read_small_file(boot_files[f], buffer, sizeof buffer);
+        if (f == 0 && length <= 0)
+            return 0;   /* which boot is this? */
+        long i;
+        for (i = 0; i < length; i++) {
+            h ^= buffer[i];
+            h *= 1099511628211ULL;
+        }
+    }
+    snprintf(out_fname, fname_size, "%s/kernel-%s-%016llx.sym",
+             resolver->cache_dir, build_id, h);
+    return 1;
+}
+
+
+/* Use the cached table of the kernel symbols, with the DSOs of its
+ * modules. Returns 0, or -1 if it is not in the cache. */
+static int
+load_kallsyms_cache(struct symbol_resolver * resolver, const char * cache_fname)
+{
+    struct symbol_cache * cache = symbol_cache_open(cache_fname);
+    if (!cache)
+        return -1;
+
+    unsigned int n_owners = symbol_cache_owner_count(cache);
+    struct dso ** owners = calloc(n_owners ? n_owners : 1, sizeof *owners);
+    if (!owners) {
+        symbol_cache_close(cache);
+        return -1;
+    }
+    owners[0] = resolver->kernel_dso;
+    unsigned int i;
+    for (i = 1; i < n_owners; i++) {
+        const char * module = symbol_cache_owner_name(cache, i);
+        owners[i] = module ? find_or_add_dso(resolver, module) : NULL;
+        if (!owners[i])
+            owners[i] = resolver->kernel_dso;
+        owners[i]->symbols_loaded = 1;
+    }
+    resolver->kernel_cache = cache;
+    resolver->kernel_cache_owners = owners;
+    return 0;
+}
+
+
+static void
+load_kallsyms(struct symbol_resolver * resolver)
+{
+    resolver->kallsyms_loaded = 1;
+    resolver->kernel_dso = find_or_add_dso(resolver, KERNEL_DSO_NAME);
+    if (!resolver->kernel_dso)
+        return;
+    resolver->kernel_dso->symbols_loaded = 1;
+
+    char cache_fname[PATH_MAX];
+    int cacheable = kallsyms_cache_fname(resolver, cache_fname,
+                                         sizeof cache_fname);
+    if (cacheable) {
+        if (load_kallsyms_cache(resolver, cache_fname) == 0) {
+            resolver->cache_hits++;
+            return;
+        }
+        resolver->cache_misses++;
+    }
+
+    FILE * kallsyms = fopen("/proc/kallsyms", "r");
+    if (!kallsyms)
+        return;
+
+    size_t capacity = 0;
+    char line[512];
+    /* Each line is in the format:
+     *     ffffffff81000000 T _stext
+     *     ffffffffc0a01000 t ext4_fill_super   [ext4]
+     */
+    while (fgets(line, sizeof line, kallsyms)) {
+        unsigned long long addr;
+        char type;
+        char name[256];
+        char module[128];
+        int fields = sscanf(line, "%llx %c %255s [%127[^]]]",
+                            &addr, &type, name, module);
+        if (fields < 3 || addr == 0)
+            continue;  /* addr == 0: /proc/sys/kernel/kptr_restrict */
+        if (type != 't' && type != 'T' && type != 'w' && type != 'W')
+            continue;
+
+        if (resolver->n_kernel_symbols == capacity) {
+            size_t new_capacity = capacity ? 2 * capacity : 65536;
+            struct symbol_entry * new_symbols =
+                  realloc(resolver->kernel_symbols,
+                          new_capacity * sizeof *new_symbols);
+            if (!new_symbols)
+                break;
+            resolver->kernel_symbols = new_symbols;
+            capacity = new_capacity;
+        }
+
+        struct symbol_entry * entry =
+                              &resolver->kernel_symbols[resolver->n_kernel_symbols];
+        entry->name = string_pool_add(&resolver->strings, name, strlen(name));
+        if (!entry->name)
+            break;
+        entry->start = addr;
+        entry->end = 0;
+        entry->owner = resolver->kernel_dso;
+        if (fields == 4) {
+            char module_dso_name[132];
+            snprintf(module_dso_name, sizeof module_dso_name, "[%s]", module);
+            struct dso * module_dso = find_or_add_dso(resolver,
+                                                      module_dso_name);
+            if (module_dso) {
+                module_dso->symbols_loaded = 1;
+                entry->owner = module_dso;
+            }
+        }
+        resolver->n_kernel_symbols++;
+    }
+    fclose(kallsyms);
+
+    sort_symbol_table(resolver->kernel_symbols, resolver->n_kernel_symbols,
+                      ~0ULL);
+    /* not if kptr_restrict hid the addresses from us */
+    if (cacheable && resolver->n_kernel_symbols > 0)
+        write_symbol_cache(cache_fname, resolver->kernel_symbols,
+                           resolver->n_kernel_symbols, resolver->kernel_dso);
+}
+
+
+static int
+file_offset_to_vaddr(const struct dso * dso, unsigned long long offset,
+                     unsigned long long * out_vaddr)
+{
+    size_t i;
+    for (i = 0; i < dso->n_segments; i++) {
+        const struct elf_load_segment * seg = &dso->segments[i];
+        if (offset >= seg->offset && offset < seg->offset + seg->filesz) {
+            *out_vaddr = offset - seg->offset + seg->vaddr;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+int
+symbol_resolver_locate(struct symbol_resolver * resolver, pid_t pid,
+                       unsigned long long ip, int is_kernel,
+                       struct symbol_location * out_location)
+{
+    out_location->dso = NULL;
+    out_location->offset = ip;
+
+    if (is_kernel) {
+        /* the DSO only, without loading /proc/kallsyms yet */
+        if (!resolver->kernel_dso)
+            resolver->kernel_dso = find_or_add_dso(resolver, KERNEL_DSO_NAME);
+        out_location->dso = resolver->kernel_dso;
+        return out_location->dso != NULL;
+    }
+
+    struct process_maps * process = find_process(resolver, pid, 0);
+    if (!process)
+        return 0;
+
+    size_t lo = 0, hi = process->n_maps;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (process->maps[mid].start <= ip)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == 0 || ip >= process->maps[lo - 1].end)
+        return 0;
+
+    const struct mapping * map = &process->maps[lo - 1];
+    out_location->dso = map->dso;
+    out_location->offset = ip - map->start + map->pgoff;
+    return 1;
+}
+
+
+const char *
+symbol_resolver_location_dso(const struct symbol_location * location)
+{
+    const struct dso * dso = location->dso;
+    return dso ? dso->short_name : UNKNOWN_SYMBOL;
+}
+
+
+int
+symbol_resolver_symbolize(struct symbol_resolver * resolver,
+                          const struct symbol_location * location,
+                          const char ** out_symbol, const char ** out_dso)
+{
+    struct dso * dso = (struct dso *)location->dso;
+    *out_symbol = UNKNOWN_SYMBOL;
+    *out_dso = symbol_resolver_location_dso(location);
+    if (!dso)
+        return 0;
+
+    if (dso == resolver->kernel_dso) {
+        unsigned long long ip = location->offset;
+        if (!resolver->kallsyms_loaded)
+            load_kallsyms(resolver);
+        if (resolver->kernel_cache) {
+            unsigned int owner;
+            if (!symbol_cache_lookup(resolver->kernel_cache, ip, out_symbol,
+                                     &owner))
+                return 0;
+            if (owner < symbol_cache_owner_count(resolver->kernel_cache))
+                *out_dso = resolver->kernel_cache_owners[owner]->short_name;
+            return 1;
+        }
+        const struct symbol_entry * entry =
+                         search_symbol_table(resolver->kernel_symbols,
+                                             resolver->n_kernel_symbols, ip);
+        if (!entry)
+            return 0;
+        *out_symbol = entry->name;
+        *out_dso = entry->owner->short_name;
+        return 1;
+    }
+
+    if (!dso->symbols_loaded)
+        load_elf_symbols(resolver, dso);
+
+    unsigned long long vaddr;
+    if (!file_offset_to_vaddr(dso, location->offset, &vaddr))
+        return 0;
+
+    if (dso->cache) {
+        unsigned int owner;
+        return symbol_cache_lookup(dso->cache, vaddr, out_symbol, &owner);
+    }
+    const struct symbol_entry * entry = search_symbol_table(dso->symbols,
+                                                            dso->n_symbols,
+                                                            vaddr);
+    if (!entry)
+        return 0;
+    *out_symbol = entry->name;
+    return 1;
+}
+
+
+int
+symbol_resolver_lookup(struct symbol_resolver * resolver, pid_t pid,
+                       unsigned long long ip, int is_kernel,
+                       const char ** out_symbol, const char ** out_dso)
+{
+    struct symbol_location location;
+    symbol_resolver_locate(resolver, pid, ip, is_kernel, &location);
+    return symbol_resolver_symbolize(resolver, &location, out_symbol, out_dso);
+}
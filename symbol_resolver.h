@@ -0,0 +1,193 @@
+
+/* Resolution of instruction addresses into (symbol, DSO) pairs, for the
+ * native perf_event_open() sampling engine, which has no "perf report" to
+ * symbolize the samples for us.
+ *
+ * The resolver keeps, for each process it has seen, the list of the memory
+ * mappings of that process (taken from the PERF_RECORD_MMAP2 records in the
+ * ring-buffers, or from /proc/<pid>/maps for the processes which already
+ * existed before the sampling started), and for each DSO (ELF shared-object
+ * or executable) the sorted table of its function symbols, which is loaded
+ * lazily the first time an address falls inside that DSO. Kernel addresses
+ * are resolved with /proc/kallsyms.
+ *
+ * All the strings returned by symbol_resolver_lookup() are owned by the
+ * resolver and stay valid until symbol_resolver_free(), so the caller can
+ * compare them by pointer (they are interned).
+ */
+
+#ifndef SYMBOL_RESOLVER_H_
+#define SYMBOL_RESOLVER_H_
+
+#include <sys/types.h>
+
+
+struct symbol_resolver;
+
+
+struct symbol_resolver *
+symbol_resolver_new(void);
+
+
+void
+symbol_resolver_free(struct symbol_resolver * resolver);
+
+
+/* Register a new memory mapping [start, start+len) of the file "filename",
+ * at the file offset "pgoff", in the process "pid". Returns 0 on success, or
+ * a negative value if it couldn't allocate memory. */
+int
+symbol_resolver_add_mmap(struct symbol_resolver * resolver, pid_t pid,
+                         unsigned long long start, unsigned long long len,
+                         unsigned long long pgoff, const char * filename);
+
+
+/* Read /proc/<pid>/maps to register the mappings of a process that already
+ * existed before its perf-events were opened. Returns the number of mappings
+ * registered, or a negative value on error. */
+int
+symbol_resolver_load_proc_maps(struct symbol_resolver * resolver, pid_t pid);
+
+
+/* A process "child_pid" was forked from "parent_pid": it inherits a copy of
+ * the mappings of its parent. */
+int
+symbol_resolver_fork(struct symbol_resolver * resolver, pid_t parent_pid,
+                     pid_t child_pid);
+
+
+/* The process "pid" did an exec(): forget its previous mappings. */
+void
+symbol_resolver_exec(struct symbol_resolver * resolver, pid_t pid);
+
+
+/* The name (comm) of the process "pid" is "comm", from a PERF_RECORD_COMM or
+ * from /proc/<pid>/comm. Returns 0, or -1 if it couldn't allocate memory. */
+int
+symbol_resolver_set_comm(struct symbol_resolver * resolver, pid_t pid,
+                         const char * comm);
+
+
+/* Whether the process "pid" is known: it was loaded from /proc, or it came
+ * in the records of the sampler (even if it exited since) */
+int
+symbol_resolver_has_process(struct symbol_resolver * resolver, pid_t pid);
+
+
+/* The name of the process "pid", or "[unknown]". Unlike the strings of
+ * symbol_resolver_lookup(), it is not interned: it is valid only till the
+ * next call to the resolver. */
+const char *
+symbol_resolver_comm(struct symbol_resolver * resolver, pid_t pid);
+
+
+/* The name of the thread "tid" of the process "pid" is "comm" (the name of
+ * the process, if it is its main thread), from a PERF_RECORD_COMM. Returns
+ * 0, or -1 if it couldn't allocate memory. */
+int
+symbol_resolver_set_thread_comm(struct symbol_resolver * resolver, pid_t pid,
+                                pid_t tid, const char * comm);
+
+
+/* The name of the thread "tid" of the process "pid": from its
+ * PERF_RECORD_COMM, or read the first time from /proc/<pid>/task/<tid>/comm
+ * (for a thread named before it was sampled), or else the name of its
+ * process. As symbol_resolver_comm(), valid only till the next call to the
+ * resolver. */
+const char *
+symbol_resolver_thread_comm(struct symbol_resolver * resolver, pid_t pid,
+                            pid_t tid);
+
+
+/* The thread "tid" exited: its name is kept till the next
+ * symbol_resolver_forget_exited(), as the mappings of a process */
+void
+symbol_resolver_thread_exit(struct symbol_resolver * resolver, pid_t tid);
+
+
+/* The path of the cgroup of the process "pid" (eg.,
+ * "/system.slice/docker-<id>.scope"), read from /proc/<pid>/cgroup the first
+ * time, or "" if it is not known. It is interned, as the symbols. */
+const char *
+symbol_resolver_cgroup(struct symbol_resolver * resolver, pid_t pid);
+
+
+/* The process "pid" exited. Its mappings are kept till the next call to
+ * symbol_resolver_forget_exited(), because there can still be samples of it
+ * waiting to be symbolized. */
+void
+symbol_resolver_exit(struct symbol_resolver * resolver, pid_t pid);
+
+
+/* Release the mappings of all the processes that exited, and the names of
+ * the threads that exited, so that the memory of a long-running sampling of
+ * the whole system stays bounded. Returns the number of processes
+ * released. */
+int
+symbol_resolver_forget_exited(struct symbol_resolver * resolver);
+
+
+/* Keep the symbol tables in an on-disk cache (see "symbol_cache.h") in the
+ * directory "cache_dir", which is created if it doesn't exist: the table of
+ * an ELF file under its build-id, and the table of the kernel under its
+ * build-id, the boot and the modules loaded, so that the next runs
+ * symbolize without parsing the ELF files nor /proc/kallsyms again.
+ * Returns 0, or -1 if the directory couldn't be created. */
+int
+symbol_resolver_set_cache_dir(struct symbol_resolver * resolver,
+                              const char * cache_dir);
+
+
+/* The number of symbol tables that were found in the on-disk cache, and of
+ * those which weren't (and were written to it) */
+void
+symbol_resolver_cache_stats(const struct symbol_resolver * resolver,
+                            unsigned int * out_hits, unsigned int * out_misses);
+
+
+/* Where an instruction address is, independently of the process: the DSO
+ * mapped at it and the offset in its file (or the address itself, in the
+ * kernel). The samples can be aggregated by their locations, which are
+ * cheap to find, and only the hottest locations symbolized. */
+struct symbol_location {
+    const void *       dso;      /* opaque; NULL if it is not known */
+    unsigned long long offset;
+};
+
+
+/* Find the location of "ip" in the process "pid", without symbolizing it (nor
+ * loading the symbols of its DSO). Returns 1, or 0 if it is not in a known
+ * mapping (then its DSO is NULL). */
+int
+symbol_resolver_locate(struct symbol_resolver * resolver, pid_t pid,
+                       unsigned long long ip, int is_kernel,
+                       struct symbol_location * out_location);
+
+
+/* The name of the DSO of a location (interned, as symbol_resolver_lookup()
+ * returns it), without symbolizing it */
+const char *
+symbol_resolver_location_dso(const struct symbol_location * location);
+
+
+/* Symbolize a location, as symbol_resolver_lookup() does an address. The
+ * locations stay valid after the process exits (they point to its DSOs,
+ * which the resolver keeps). */
+int
+symbol_resolver_symbolize(struct symbol_resolver * resolver,
+                          const struct symbol_location * location,
+                          const char ** out_symbol, const char ** out_dso);
+
+
+/* Resolve the instruction address "ip" in the process "pid". "is_kernel" is
+ * non-zero if the sample was taken in kernel mode. On return, *out_symbol and
+ * *out_dso point to interned strings owned by the resolver (the symbol is
+ * "[unknown]" if it couldn't be resolved). Returns 1 if the symbol was
+ * resolved, 0 if it wasn't. */
+int
+symbol_resolver_lookup(struct symbol_resolver * resolver, pid_t pid,
+                       unsigned long long ip, int is_kernel,
+                       const char ** out_symbol, const char ** out_dso);
+
+
+#endif  /* SYMBOL_RESOLVER_H_ */